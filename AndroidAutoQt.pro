@@ -19,9 +19,20 @@ SOURCES += \
     modules/android-auto/headunit/hu/hu_aap.cpp \
     modules/android-auto/headunit/hu/hu_ssl.cpp \
     modules/android-auto/headunit/hu/hu_tcp.cpp \
+    modules/android-auto/headunit/hu/hu_sockopt.cpp \
+    modules/android-auto/headunit/hu/hu_uring.cpp \
+    modules/android-auto/headunit/hu/hu_tcp_uring.cpp \
+    modules/android-auto/headunit/hu/hu_loopback.cpp \
+    modules/android-auto/headunit/hu/hu_capture.cpp \
+    modules/android-auto/headunit/hu/hu_frame.cpp \
+    modules/android-auto/headunit/hu/hu_pool.cpp \
+    modules/android-auto/headunit/hu/hu_cipher.cpp \
     modules/android-auto/headunit/hu/hu_usb.cpp \
+    modules/android-auto/headunit/hu/hu_aoa.cpp \
+    modules/android-auto/headunit/hu/hu_hotplug.cpp \
     modules/android-auto/headunit/hu/hu_uti.cpp \
     modules/android-auto/headunit/common/glib_utils.cpp \
+    modules/android-auto/headunit/common/media_queue.cpp \
     modules/android-auto/qgstvideobuffer.cpp \
     modules/android-auto/headunit/hu/generated.x64/hu.pb.cc
 
@@ -34,9 +45,21 @@ HEADERS += \
     modules/android-auto/headunit/hu/hu_aap.h \
     modules/android-auto/headunit/hu/hu_ssl.h \
     modules/android-auto/headunit/hu/hu_tcp.h \
+    modules/android-auto/headunit/hu/hu_sockopt.h \
+    modules/android-auto/headunit/hu/hu_uring.h \
+    modules/android-auto/headunit/hu/hu_tcp_uring.h \
+    modules/android-auto/headunit/hu/hu_loopback.h \
+    modules/android-auto/headunit/hu/hu_capture.h \
+    modules/android-auto/headunit/hu/hu_frame.h \
+    modules/android-auto/headunit/hu/hu_pool.h \
+    modules/android-auto/headunit/hu/hu_cipher.h \
     modules/android-auto/headunit/hu/hu_usb.h \
+    modules/android-auto/headunit/hu/hu_aoa.h \
+    modules/android-auto/headunit/hu/hu_hotplug.h \
+    modules/android-auto/headunit/hu/hu_ring.h \
     modules/android-auto/headunit/hu/hu_uti.h \
     modules/android-auto/headunit/common/glib_utils.h \
+    modules/android-auto/headunit/common/media_queue.h \
     modules/android-auto/qgstvideobuffer.h \
     modules/android-auto/headunit/hu/generated.x64/hu.pb.h \
     src/aasettings.h
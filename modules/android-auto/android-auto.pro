@@ -17,9 +17,20 @@ SOURCES += \
     headunit/hu/hu_aap.cpp \
     headunit/hu/hu_ssl.cpp \
     headunit/hu/hu_tcp.cpp \
+    headunit/hu/hu_sockopt.cpp \
+    headunit/hu/hu_uring.cpp \
+    headunit/hu/hu_tcp_uring.cpp \
+    headunit/hu/hu_loopback.cpp \
+    headunit/hu/hu_capture.cpp \
+    headunit/hu/hu_frame.cpp \
+    headunit/hu/hu_pool.cpp \
+    headunit/hu/hu_cipher.cpp \
     headunit/hu/hu_usb.cpp \
+    headunit/hu/hu_aoa.cpp \
+    headunit/hu/hu_hotplug.cpp \
     headunit/hu/hu_uti.cpp \
     headunit/common/glib_utils.cpp \
+    headunit/common/media_queue.cpp \
     headunit/hu/generated.x64/hu.pb.cc \
     qgstvideobuffer.cpp
 
@@ -43,10 +54,22 @@ HEADERS += \
     headunit/hu/hu_aap.h \
     headunit/hu/hu_ssl.h \
     headunit/hu/hu_tcp.h \
+    headunit/hu/hu_sockopt.h \
+    headunit/hu/hu_uring.h \
+    headunit/hu/hu_tcp_uring.h \
+    headunit/hu/hu_loopback.h \
+    headunit/hu/hu_capture.h \
+    headunit/hu/hu_frame.h \
+    headunit/hu/hu_pool.h \
+    headunit/hu/hu_cipher.h \
     headunit/hu/hu_usb.h \
+    headunit/hu/hu_aoa.h \
+    headunit/hu/hu_hotplug.h \
+    headunit/hu/hu_ring.h \
     headunit/hu/hu_uti.h \
     headunit/hu/generated.x64/hu.pb.h \
     headunit/common/glib_utils.h \
+    headunit/common/media_queue.h \
     qgstvideobuffer.h
 
 DISTFILES += \
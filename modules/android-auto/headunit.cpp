@@ -13,8 +13,29 @@
 #include <gst/video/video.h>
 #include "hu_uti.h"
 #include "hu_aap.h"
+#include "media_queue.h"
 #include "../../src/aasettings.h"
 
+// Queue depths in packets. Video drops its oldest frames, a late frame is
+// worth nothing. Audio waits a little for the sink before dropping.
+#define VIDEO_QUEUE_PACKETS 8
+#define AUDIO_QUEUE_PACKETS 16
+#define AUDIO_QUEUE_BLOCK_MS 20
+
+static void push_to_src(GstAppSrc *gst_src, uint64_t timestamp, const byte *buf, int len) {
+    GstBuffer * buffer = gst_buffer_new_and_alloc(len);
+
+    GstCaps *reference = gst_caps_from_string("timestamp/x-metavision-stream");
+    gst_buffer_add_reference_timestamp_meta(buffer, reference, timestamp * 1000, GST_CLOCK_TIME_NONE);
+    gst_caps_unref(reference);
+
+    gst_buffer_fill(buffer, 0, buf, len);
+    int ret = gst_app_src_push_buffer(gst_src, buffer);
+    if (ret != GST_FLOW_OK) {
+        qDebug("push buffer returned %d for %d bytes ", ret, len);
+    }
+}
+
 Headunit::Headunit(QObject *parent) : QObject(parent),
     callbacks(this)
 {
@@ -22,6 +43,8 @@ Headunit::Headunit(QObject *parent) : QObject(parent),
 }
 
 Headunit::~Headunit() {
+    // The queue workers push into the srcs, finish them before those go
+    stopMediaQueues();
     stopPipelines();
 
     gst_object_unref(vid_pipeline);
@@ -88,6 +111,12 @@ int Headunit::startHU(){
     aa_settings["ts_height"] = std::to_string(m_videoHeight);
     aa_settings["ts_width"] = std::to_string(m_videoWidth);
 
+    // Left over from a previous attempt or session
+    if (headunit) {
+        huStarted = false;
+        g_hu = nullptr;
+        delete headunit;
+    }
     headunit = new AndroidAuto::HUServer(callbacks, aa_settings);
 
     int ret = headunit->start();
@@ -101,6 +130,11 @@ int Headunit::startHU(){
 
 int Headunit::init()
 {
+    if (vid_pipeline) {
+        // Pipelines are reused across sessions
+        return 0;
+    }
+
     // Get settings from our configuration system
     std::map<std::string, std::string> aa_settings;
     aa_settings = AASettings::instance()->getStdStringMap();
@@ -238,6 +272,13 @@ int Headunit::init()
     m_aud_src = GST_APP_SRC(gst_bin_get_by_name(GST_BIN(aud_pipeline), "audsrc"));
     m_au1_src = GST_APP_SRC(gst_bin_get_by_name(GST_BIN(au1_pipeline), "au1src"));
 
+    m_vidQueue.reset(new MediaQueue("hu_video", VIDEO_QUEUE_PACKETS, MediaQueue::DROP_OLDEST, 0,
+        [this](uint64_t timestamp, const byte *buf, int len) { push_to_src(m_vid_src, timestamp, buf, len); }));
+    m_audQueue.reset(new MediaQueue("hu_audio", AUDIO_QUEUE_PACKETS, MediaQueue::BLOCK_BRIEFLY, AUDIO_QUEUE_BLOCK_MS,
+        [this](uint64_t timestamp, const byte *buf, int len) { push_to_src(m_aud_src, timestamp, buf, len); }));
+    m_au1Queue.reset(new MediaQueue("hu_voice", AUDIO_QUEUE_PACKETS, MediaQueue::BLOCK_BRIEFLY, AUDIO_QUEUE_BLOCK_MS,
+        [this](uint64_t timestamp, const byte *buf, int len) { push_to_src(m_au1_src, timestamp, buf, len); }));
+
     gst_element_set_state(mic_pipeline, GST_STATE_PAUSED);
     gst_element_set_state(vid_pipeline, GST_STATE_PAUSED);
     gst_element_set_state(aud_pipeline, GST_STATE_PAUSED);
@@ -319,15 +360,19 @@ GstFlowReturn Headunit::read_mic_data(GstElement *appsink, Headunit *_this) {
     uint64_t bufTimestamp = GST_BUFFER_TIMESTAMP(gstbuf);
     uint64_t timestamp = GST_CLOCK_TIME_IS_VALID(bufTimestamp) ? (bufTimestamp / 1000) : get_cur_timestamp();
 
-    _this->g_hu->queueCommand([timestamp, mapInfo](AndroidAuto::IHUConnectionThreadInterface & s) {
-      int ret = s.sendEncodedMediaPacket(1, AndroidAuto::MicrophoneChannel, AndroidAuto::HU_PROTOCOL_MESSAGE::MediaDataWithTimestamp, timestamp, mapInfo.data, mapInfo.size);
+    // The samples are copied out once, while still mapped, into a buffer
+    // with room for the message header in front
+    auto buffer = std::make_shared<AndroidAuto::HUSendBuffer>();
+    memcpy(buffer->Reserve(mapInfo.size), mapInfo.data, mapInfo.size);
+    gst_buffer_unmap(gstbuf, const_cast<GstMapInfo*> (&mapInfo));
+
+    _this->g_hu->queueCommand([timestamp, buffer](AndroidAuto::IHUConnectionThreadInterface & s) {
+      int ret = s.sendEncodedMediaBuffer(1, AndroidAuto::MicrophoneChannel, AndroidAuto::HU_PROTOCOL_MESSAGE::MediaDataWithTimestamp, timestamp, *buffer);
         if (ret < 0) {
             qDebug("read_mic_data(): hu_aap_enc_send() failed with (%d)", ret);
         }
     });
 
-    gst_buffer_unmap(gstbuf, const_cast<GstMapInfo*> (&mapInfo));
-
     gst_sample_unref(gstsample);
     return GST_FLOW_OK;
 }
@@ -381,6 +426,35 @@ void Headunit::stopPipelines(){
     gst_element_set_state(au1_pipeline, GST_STATE_NULL);
 }
 
+MediaQueue *Headunit::mediaQueue(AndroidAuto::ServiceChannels chan){
+    switch(chan){
+    case AndroidAuto::VideoChannel:
+        return m_vidQueue.get();
+    case AndroidAuto::MediaAudioChannel:
+        return m_audQueue.get();
+    case AndroidAuto::Audio1Channel:
+        return m_au1Queue.get();
+    default:
+        return nullptr;
+    }
+}
+
+void Headunit::logMediaQueue(AndroidAuto::ServiceChannels chan){
+    MediaQueue *queue = mediaQueue(chan);
+    if (queue) {
+        qDebug("%s", queue->Describe().c_str());
+    }
+}
+
+void Headunit::stopMediaQueues(){
+    for (MediaQueue *queue : {m_vidQueue.get(), m_audQueue.get(), m_au1Queue.get()}) {
+        if (queue) {
+            queue->Stop();
+            qDebug("%s", queue->Describe().c_str());
+        }
+    }
+}
+
 bool Headunit::mouseDown(QPoint point){
     lastAction = HU::TouchInfo::TOUCH_ACTION_PRESS;
     touchEvent(HU::TouchInfo::TOUCH_ACTION_PRESS, &point);
@@ -587,30 +661,13 @@ void Headunit::setNigthmode(bool night) {
 }
 
 int DesktopEventCallbacks::MediaPacket(AndroidAuto::ServiceChannels chan, uint64_t timestamp, const byte * buf, int len) {
-    GstAppSrc* gst_src = nullptr;
-
-    if (chan == AndroidAuto::VideoChannel) {
-        gst_src = headunit->m_vid_src;
-    } else if (chan == AndroidAuto::MediaAudioChannel) {
-        gst_src = headunit->m_aud_src;
-    } else if (chan == AndroidAuto::Audio1Channel) {
-        gst_src = headunit->m_au1_src;
+    // Copied into the channel's queue, the ack goes out without waiting on gstreamer
+    MediaQueue* queue = headunit->mediaQueue(chan);
+    if (queue) {
+        queue->Push(timestamp, buf, len);
     } else {
         qDebug () << "Unknown channel : " << chan;
     }
-
-    if (gst_src) {
-        GstBuffer * buffer = gst_buffer_new_and_alloc(len);
-
-        GstCaps *reference = gst_caps_from_string("timestamp/x-metavision-stream");
-        gst_buffer_add_reference_timestamp_meta(buffer, reference, timestamp * 1000, GST_CLOCK_TIME_NONE);
-
-        gst_buffer_fill(buffer, 0, buf, len);
-        int ret = gst_app_src_push_buffer((GstAppSrc *) gst_src, buffer);
-        if (ret != GST_FLOW_OK) {
-            qDebug("push buffer returned %d for %d bytes ", ret, len);
-        }
-    }
     return 0;
 }
 
@@ -640,13 +697,16 @@ int DesktopEventCallbacks::MediaStart(AndroidAuto::ServiceChannels chan) {
 int DesktopEventCallbacks::MediaStop(AndroidAuto::ServiceChannels chan) {
     switch(chan){
     case AndroidAuto::VideoChannel:
+        headunit->logMediaQueue(chan);
         gst_element_set_state(headunit->vid_pipeline, GST_STATE_PAUSED);
         headunit->setStatus(Headunit::VIDEO_WAITING);
         break;
     case AndroidAuto::MediaAudioChannel:
+        headunit->logMediaQueue(chan);
         gst_element_set_state(headunit->aud_pipeline, GST_STATE_PAUSED);
         break;
     case AndroidAuto::Audio1Channel:
+        headunit->logMediaQueue(chan);
         gst_element_set_state(headunit->au1_pipeline, GST_STATE_PAUSED);
         break;
     case AndroidAuto::MicrophoneChannel:
@@ -12,6 +12,7 @@
 #include <QString>
 #include <QVariant>
 #include <atomic>
+#include <memory>
 
 #include <QAbstractVideoBuffer>
 #include <QAbstractVideoSurface>
@@ -22,6 +23,7 @@
 #include "glib_utils.h"
 #include "hu_aap.h"
 #include "hu_uti.h"
+#include "media_queue.h"
 
 class Headunit;
 
@@ -104,6 +106,11 @@ public:
     GstAppSrc *m_aud_src = nullptr;
     GstAppSrc *m_au1_src = nullptr;
 
+    // Per channel hand-off to gstreamer, null for channels without one
+    MediaQueue *mediaQueue(AndroidAuto::ServiceChannels chan);
+    void logMediaQueue(AndroidAuto::ServiceChannels chan);
+    void stopMediaQueues();
+
     uint8_t m_mediaPipelineVolume = 100;
     uint8_t m_voicePipelineVolume = 100;
 
@@ -151,7 +158,7 @@ public slots:
     void videoFrameHandler(const QVideoFrame &frame);
 
 private:
-    AndroidAuto::HUServer *headunit;
+    AndroidAuto::HUServer *headunit = nullptr;
     DesktopEventCallbacks callbacks;
     HU::TouchInfo::TOUCH_ACTION lastAction =
         HU::TouchInfo::TOUCH_ACTION_RELEASE;
@@ -172,6 +179,10 @@ private:
     QVideoSurfaceFormat m_format;
     bool m_videoStarted = false;
 
+    std::unique_ptr<MediaQueue> m_vidQueue;
+    std::unique_ptr<MediaQueue> m_audQueue;
+    std::unique_ptr<MediaQueue> m_au1Queue;
+
     int m_inputMode = INPUT_MODE_TOUCH;
     void sendInputEvent(HU::TouchInfo::TOUCH_ACTION action, QPoint *point);
     void sendButtonEvent(int scanCode, bool isPressed, bool longPress = false);
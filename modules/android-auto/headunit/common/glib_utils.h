@@ -3,7 +3,9 @@
 #include <glib.h>
 #include <functional>
 
-extern GMainContext* run_on_thread_main_context;
-
-void run_on_main_thread(std::function<bool()>&& f);
-void run_on_main_thread_delay(guint milliseconds, std::function<bool()>&& f);
+// Runs f on the thread iterating context, the default main context unless
+// one is given
+void run_on_main_thread(std::function<bool()>&& f,
+                        GMainContext* context = nullptr);
+void run_on_main_thread_delay(guint milliseconds, std::function<bool()>&& f,
+                              GMainContext* context = nullptr);
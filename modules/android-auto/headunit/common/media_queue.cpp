@@ -0,0 +1,132 @@
+#include "media_queue.h"
+
+#include <pthread.h>
+#include <algorithm>
+#include <chrono>
+
+MediaQueue::MediaQueue(const std::string& name, size_t maxPackets, Overflow overflow, int blockMs,
+                       Consumer consumer)
+    : name(name), maxPackets(std::max<size_t>(maxPackets, 1)), overflow(overflow),
+      blockMs(blockMs), consumer(std::move(consumer))
+{
+    worker = std::thread([this] { WorkerMain(); });
+}
+
+MediaQueue::~MediaQueue()
+{
+    Stop();
+}
+
+bool MediaQueue::Push(uint64_t timestamp, const byte* buf, int len)
+{
+    std::unique_lock<std::mutex> guard(lock);
+    if (stopping) {
+        stats.dropped++;
+        return false;
+    }
+    bool kept = true;
+    if (packets.size() >= maxPackets && overflow == BLOCK_BRIEFLY) {
+        stats.blocked++;
+        notFull.wait_for(guard, std::chrono::milliseconds(blockMs),
+                         [this] { return packets.size() < maxPackets || stopping; });
+        if (stopping) {
+            stats.dropped++;
+            return false;
+        }
+    }
+    while (packets.size() >= maxPackets) {
+        spare.push_back(std::move(packets.front()));
+        packets.pop_front();
+        stats.dropped++;
+        kept = false;
+    }
+
+    Packet packet;
+    if (!spare.empty()) {
+        packet = std::move(spare.back());
+        spare.pop_back();
+    }
+    packet.timestamp = timestamp;
+    packet.data.assign(buf, buf + len);
+    packets.push_back(std::move(packet));
+    stats.pushed++;
+    stats.maxDepth = std::max(stats.maxDepth, packets.size());
+    guard.unlock();
+    notEmpty.notify_one();
+    return kept;
+}
+
+void MediaQueue::Flush()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    stats.dropped += packets.size();
+    while (!packets.empty()) {
+        spare.push_back(std::move(packets.front()));
+        packets.pop_front();
+    }
+    notFull.notify_all();
+}
+
+void MediaQueue::Stop()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    notEmpty.notify_all();
+    notFull.notify_all();
+    if (worker.joinable()) {
+        worker.join();
+    }
+}
+
+MediaQueue::Stats MediaQueue::GetStats()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    Stats ret = stats;
+    ret.depth = packets.size();
+    return ret;
+}
+
+size_t MediaQueue::Depth()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return packets.size();
+}
+
+std::string MediaQueue::Describe()
+{
+    Stats st = GetStats();
+    char line[256];
+    snprintf(line, sizeof(line),
+             "%s: %llu pushed, %llu consumed, %llu dropped, %llu blocked, depth %zu, max %zu of %zu",
+             name.c_str(), (unsigned long long)st.pushed, (unsigned long long)st.consumed,
+             (unsigned long long)st.dropped, (unsigned long long)st.blocked, st.depth,
+             st.maxDepth, maxPackets);
+    return line;
+}
+
+void MediaQueue::WorkerMain()
+{
+    pthread_setname_np(pthread_self(), name.substr(0, 15).c_str());
+
+    Packet packet;
+    std::unique_lock<std::mutex> guard(lock);
+    while (true) {
+        notEmpty.wait(guard, [this] { return !packets.empty() || stopping; });
+        if (packets.empty()) {
+            break;  // stopping and drained
+        }
+        packet = std::move(packets.front());
+        packets.pop_front();
+        guard.unlock();
+        notFull.notify_one();
+
+        // The sink may take its time here, the HU thread keeps going
+        consumer(packet.timestamp, packet.data.data(), (int)packet.data.size());
+
+        guard.lock();
+        stats.consumed++;
+        spare.push_back(std::move(packet));
+    }
+}
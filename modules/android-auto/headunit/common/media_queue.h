@@ -0,0 +1,73 @@
+#pragma once
+
+#include <stdint.h>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "hu_uti.h"
+
+// Hands media packets from the HU thread to a consumer thread of their own,
+// so a slow sink never holds up acks, pings and input on the other channels.
+// Bounded, what happens when it's full depends on the overflow policy.
+class MediaQueue
+{
+public:
+    enum Overflow {
+        DROP_OLDEST,    // never wait, throw the oldest packet away (video)
+        BLOCK_BRIEFLY,  // wait up to blockMs for room, then drop the oldest (audio)
+    };
+    typedef std::function<void(uint64_t timestamp, const byte* buf, int len)> Consumer;
+
+    MediaQueue(const std::string& name, size_t maxPackets, Overflow overflow, int blockMs,
+               Consumer consumer);
+    ~MediaQueue();
+
+    // Copies the packet. False if it or an older one was dropped to make room.
+    bool Push(uint64_t timestamp, const byte* buf, int len);
+    // Drops whatever hasn't been consumed yet
+    void Flush();
+    // Consumes what is queued, then ends the consumer thread. Later pushes are dropped.
+    void Stop();
+
+    struct Stats {
+        uint64_t pushed = 0;
+        uint64_t consumed = 0;
+        uint64_t dropped = 0;
+        uint64_t blocked = 0;  // pushes that had to wait for room
+        size_t depth = 0;      // packets waiting right now
+        size_t maxDepth = 0;
+    };
+    Stats GetStats();
+    size_t Depth();
+    // "<name>: pushed .. dropped .. depth now/max" for the log
+    std::string Describe();
+
+private:
+    struct Packet {
+        uint64_t timestamp = 0;
+        std::vector<byte> data;
+    };
+
+    std::string name;
+    size_t maxPackets;
+    Overflow overflow;
+    int blockMs;
+    Consumer consumer;
+
+    std::mutex lock;
+    std::condition_variable notEmpty;
+    std::condition_variable notFull;
+    std::deque<Packet> packets;
+    // Consumed packets, their buffers are reused by the next pushes
+    std::vector<Packet> spare;
+    bool stopping = false;
+    Stats stats;
+    std::thread worker;
+
+    void WorkerMain();
+};
@@ -2,8 +2,11 @@
 #include <pthread.h>
 #define LOGTAG "hu_aap"
 #include <endian.h>
+#include <poll.h>
 #include <google/protobuf/descriptor.h>
 
+#include <algorithm>
+#include <chrono>
 #include <fstream>
 #include <iostream>
 #include <memory>
@@ -13,14 +16,18 @@
 #include "hu_ssl.h"
 #include "hu_uti.h"
 
+#include "hu_capture.h"
+#include "hu_loopback.h"
 #include "hu_tcp.h"
+#include "hu_tcp_uring.h"
 #include "hu_usb.h"
 
 using namespace AndroidAuto;
 
 HUServer::HUServer(IHUConnectionThreadEventCallbacks& callbacks,
                    std::map<std::string, std::string> _settings)
-    : callbacks(callbacks) {
+    : callbacks(callbacks),
+      m_messageCounters(new MessageCounters[s_dispatchEntryCount + 1]) {
     settings = _settings;
 
     // Defaults
@@ -46,45 +53,161 @@ HUServer::HUServer(IHUConnectionThreadEventCallbacks& callbacks,
     default_settings["margin_height"] = "0";
     default_settings["dpi"] = "140";
     default_settings["available_while_in_call"] = "0";  // bool
-    default_settings["transport_type"] = "usb";         // "usb" or "network"
+    // "usb", "network", "loopback" or "replay"
+    default_settings["transport_type"] = "usb";
     default_settings["network_address"] = "127.0.0.1";
     default_settings["wifi_direct"] = "0";
+    // ms a connect may stay in progress, nothing waits for it
+    default_settings["tcp_connect_timeout"] = "2000";
+    // "default", "wireless" or "lowlatency", see hu_sockopt.h
+    default_settings["tcp_socket_profile"] = "default";
+    default_settings["tcp_io_uring"] = "0";  // bool, needs kernel 6.0
+    default_settings["tcp_uring_buffers"] = "64";  // 16 KB receive buffers
+    default_settings["usb_rx_transfers"] = "4";  // bulk-IN transfers in flight
+    default_settings["usb_rx_transfer_size"] = "16384";
+    default_settings["usb_rx_ring_size"] = "1048576";  // USB -> HU thread
+    default_settings["usb_tx_transfers"] = "16";  // bulk-OUT pool size
+    default_settings["usb_zero_copy"] = "1";  // libusb_dev_mem_alloc buffers
+    default_settings["loopback_name"] = "default";  // see HULoopbackLink
+    default_settings["loopback_ring_size"] = "1048576";  // per direction
+    default_settings["capture_file"] = "";  // records the session if set
+    default_settings["replay_file"] = "";   // capture for transport_type=replay
+    default_settings["replay_pacing"] = "original";  // or "fast"
+    default_settings["log_packets"] = "1";  // dump sent frames, debug builds
+    default_settings["log_sends"] = "0";    // trace every send
+    default_settings["media_fast_path"] = "1";  // media data skips dispatch
+    default_settings["tls_resume"] = "1";  // offer the last TLS session
+    // "auto" puts suites with the cipher this CPU decrypts fastest first,
+    // otherwise an OpenSSL cipher list, "" for OpenSSL's default
+    default_settings["ssl_cipher_list"] = "auto";
 
     settings.insert(default_settings.begin(), default_settings.end());
+    m_logPackets = settings["log_packets"] == "1";
+    m_logSends = settings["log_sends"] == "1";
+    m_mediaFastPath = settings["media_fast_path"] == "1";
+    // A capture has to be replayed with the very same handshake
+    bool replayable = !settings["capture_file"].empty() ||
+                      settings["transport_type"] == "replay";
+    m_tlsResume = settings["tls_resume"] == "1" && !replayable;
+    m_cipherList = settings["ssl_cipher_list"];
+    if (m_cipherList == "auto" && replayable) {
+        m_cipherList = "";  // Another benchmark run may order it differently
+    }
 }
 
 int HUServer::startTransport() {
+    // Nothing of the last session's stream may leak into this one
+    m_frameParser.Reset();
+    for (AssemblySlot& slot : m_assembly) {
+        releaseAssembly(slot);
+    }
+    for (PreparedAck& ack : m_mediaAck) {
+        ack.len = 0;
+    }
+
     std::map<std::string, std::string> conf;
     if (settings["transport_type"] == "network") {
         conf["network_address"] = settings["network_address"];
+        conf["wifi_direct"] = settings["wifi_direct"];
+        // tcp_connect_timeout, tcp_socket_profile and its overrides
+        for (const auto& setting : settings) {
+            if (setting.first.compare(0, 4, "tcp_") == 0) {
+                conf.insert(setting);
+            }
+        }
         logd("AA over Wifi");
-        transport =
-            std::unique_ptr<HUTransportStream>(new HUTransportStreamTCP(conf));
+#ifdef HU_HAVE_IO_URING
+        if (settings["tcp_io_uring"] == "1" && HUUring::Supported()) {
+            logd("Using io_uring");
+            transport = std::unique_ptr<HUTransportStream>(
+                new HUTransportStreamTCPUring(conf));
+        }
+#endif
+        if (!transport) {
+            if (settings["tcp_io_uring"] == "1") {
+                logw("io_uring not available, falling back to poll");
+            }
+            transport = std::unique_ptr<HUTransportStream>(
+                new HUTransportStreamTCP(conf));
+        }
         iaap_tra_recv_tmo = 1000;
         iaap_tra_send_tmo = 2000;
     } else if (settings["transport_type"] == "usb") {
+        conf["usb_rx_transfers"] = settings["usb_rx_transfers"];
+        conf["usb_rx_transfer_size"] = settings["usb_rx_transfer_size"];
+        conf["usb_rx_ring_size"] = settings["usb_rx_ring_size"];
+        conf["usb_tx_transfers"] = settings["usb_tx_transfers"];
+        conf["usb_zero_copy"] = settings["usb_zero_copy"];
         transport =
             std::unique_ptr<HUTransportStream>(new HUTransportStreamUSB(conf));
         logd("AA over USB");
         iaap_tra_recv_tmo = 0;  // 100;
         iaap_tra_send_tmo = 2500;
+    } else if (settings["transport_type"] == "loopback") {
+        conf["loopback_name"] = settings["loopback_name"];
+        conf["loopback_ring_size"] = settings["loopback_ring_size"];
+        transport = std::unique_ptr<HUTransportStream>(
+            new HUTransportStreamLoopback(conf));
+        logd("AA over in-process loopback");
+        iaap_tra_recv_tmo = 0;
+        iaap_tra_send_tmo = 2500;
+    } else if (settings["transport_type"] == "replay") {
+        conf["replay_file"] = settings["replay_file"];
+        conf["replay_pacing"] = settings["replay_pacing"];
+        transport = std::unique_ptr<HUTransportStream>(
+            new HUTransportStreamReplay(conf));
+        logd("AA replayed from %s", settings["replay_file"].c_str());
+        iaap_tra_recv_tmo = 0;
+        iaap_tra_send_tmo = 2500;
     } else {
         loge("Unknown transport type");
         return -1;
     }
-    return transport->Start();
+    if (!settings["capture_file"].empty() &&
+        settings["transport_type"] != "replay") {
+        conf["capture_file"] = settings["capture_file"];
+        transport = std::unique_ptr<HUTransportStream>(
+            new HUTransportStreamCapture(std::move(transport), conf));
+    }
+
+    // A capture or replay changes OpenSSL's random numbers for the whole
+    // process
+    bool seeded = settings["transport_type"] == "replay" ||
+                  !settings["capture_file"].empty();
+    if (m_sessionRegistered) {
+        // The last start failed after the transport was up
+        hu_capture_session_end(m_sessionSeeded);
+        m_sessionRegistered = false;
+    }
+    if (!hu_capture_session_begin(seeded)) {
+        return -1;
+    }
+    int ret = transport->Start();
+    if (ret < 0) {
+        hu_capture_session_end(seeded);
+        return ret;
+    }
+    m_sessionRegistered = true;
+    m_sessionSeeded = seeded;
+    return ret;
 }
 
 int HUServer::stopTransport() {
     int ret = 0;
+    // Chunks go back to the transport, so they can't outlive it
+    m_receiveChunks.clear();
     if (transport) {
         ret = transport->Stop();
         transport.reset();
     }
+    if (m_sessionRegistered) {
+        hu_capture_session_end(m_sessionSeeded);
+        m_sessionRegistered = false;
+    }
     return ret;
 }
 
-int HUServer::receiveTransportPacket(byte* buf, int len, int tmo) {
+int HUServer::receiveTransportChunks(int tmo) {
     int ret = 0;
     if (iaap_state != hu_STATE_STARTED &&
         iaap_state != hu_STATE_STARTIN) {  // Need to recv when starting
@@ -94,7 +217,7 @@ int HUServer::receiveTransportPacket(byte* buf, int len, int tmo) {
 
     int readfd = transport->GetReadFD();
     int errorfd = transport->GetErrorFD();
-    if (tmo > 0 || errorfd >= 0) {
+    if (m_receiveChunks.empty() && (tmo > 0 || errorfd >= 0)) {
         fd_set sock_set;
         FD_ZERO(&sock_set);
         FD_SET(readfd, &sock_set);
@@ -120,26 +243,62 @@ int HUServer::receiveTransportPacket(byte* buf, int len, int tmo) {
         }
     }
 
-    ret = read(readfd, buf, len);
-    if (ret < 0) {
-        loge("ihu_tra_recv() error so stop Transport & AAP  ret: %d", ret);
-        stop();
+    if (m_receiveChunks.empty()) {
+        ret = transport->Poll([this](HUTransportChunkPtr chunk) {
+            m_receiveChunks.push_back(std::move(chunk));
+        });
+        if (ret < 0) {
+            loge("ihu_tra_recv() error so stop Transport & AAP  ret: %d", ret);
+            stop();
+            return (ret);
+        }
     }
-    return (ret);
-}
 
-int log_packet_info = 1;
+    return m_receiveChunks.size();  // 0 if woken up without data
+}
 
 int HUServer::sendTransportPacket(
-    int retry, byte* buf, int len,
-    int tmo) {  // Send Transport data: chan,flags,len,type,...
+    int retry, const iovec* iov, int iovcnt, int tmo,
+    int frames) {  // Send Transport data: chan,flags,len,type,...
     // Need to send when starting
     if (iaap_state != hu_STATE_STARTED && iaap_state != hu_STATE_STARTIN) {
         loge("CHECK: iaap_state: %d (%s)", iaap_state, state_get(iaap_state));
         return (-1);
     }
 
-    int ret = transport->Write(buf, len, tmo);
+    int len = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        len += iov[i].iov_len;
+    }
+
+    if (m_batchSends && len > MAX_FRAME_SIZE) {
+        // A whole multi-frame message, too big to batch. What's batched
+        // goes first to keep the order, then it goes out on its own.
+        if (flushSendBatch() < 0) {
+            return (-1);
+        }
+    } else if (m_batchSends) {
+        if (m_sendBatchLen + len > MAX_FRAME_SIZE && flushSendBatch() < 0) {
+            return (-1);
+        }
+        for (int i = 0; i < iovcnt; i++) {
+            memcpy(&m_sendBatch[m_sendBatchLen], iov[i].iov_base,
+                   iov[i].iov_len);
+            m_sendBatchLen += iov[i].iov_len;
+        }
+        m_sendBatchStats.copiedBytes += len;
+        m_sendBatchFrames++;
+        m_sendBatchTimeout = std::max(m_sendBatchTimeout, tmo);
+        return (len);
+    }
+
+    int ret = transport->SubmitWrite(iov, iovcnt, tmo);
+    if (ret >= 0) ret = len;
+    m_sendBatchStats.bytes += len;
+    m_sendBatchStats.frames += frames;
+    m_sendBatchStats.writes++;
+    m_sendBatchStats.maxFramesPerWrite =
+        std::max(m_sendBatchStats.maxFramesPerWrite, frames);
     if (ret < 0 || ret != len) {
         if (retry == 0) {
             loge(
@@ -152,34 +311,80 @@ int HUServer::sendTransportPacket(
         return (-1);
     }
 
-    if (ena_log_verbo && ena_log_aap_send)
+    if (m_logSends)
         logd("OK ihu_tra_send() ret: %d  len: %d", ret, len);
     return (ret);
 }
 
-int HUServer::sendEncodedMessage(int retry, ServiceChannels chan, uint16_t messageCode,
-    const google::protobuf::MessageLite& message, int overrideTimeout) {
-    const int messageSize = message.ByteSizeLong();
-    const int requiredSize = messageSize + 2;
-    if (temp_assembly_buffer->size() <
-        static_cast<unsigned int>(requiredSize)) {
-        temp_assembly_buffer->resize(static_cast<unsigned int>(requiredSize));
+// The batch is capped at MAX_FRAME_SIZE so it always fits a single USB
+// pool transfer; a lone frame is never bigger than that.
+int HUServer::flushSendBatch() {
+    if (m_sendBatchLen == 0) {
+        return (0);
+    }
+    const int len = m_sendBatchLen;
+    iovec iov = {m_sendBatch, (size_t)len};
+    int ret = transport->SubmitWrite(&iov, 1, m_sendBatchTimeout);
+    if (ret >= 0) ret = len;
+
+    m_sendBatchStats.bytes += len;
+    m_sendBatchStats.frames += m_sendBatchFrames;
+    m_sendBatchStats.writes++;
+    m_sendBatchStats.maxFramesPerWrite =
+        std::max(m_sendBatchStats.maxFramesPerWrite, m_sendBatchFrames);
+    m_sendBatchLen = 0;
+    m_sendBatchFrames = 0;
+    m_sendBatchTimeout = 0;
+
+    if (ret != len) {
+        loge("Error flushing %d bytes ret: %d, stop Transport & AAP", len,
+             ret);
+        m_batchSends = false;
+        stop();
+        return (-1);
     }
+    return (ret);
+}
 
-    uint16_t* destMessageCode =
-        reinterpret_cast<uint16_t*>(temp_assembly_buffer->data());
-    *destMessageCode++ = htobe16(messageCode);
+void HUServer::logSendBatchStats() {
+    const SendBatchStats& st = m_sendBatchStats;
+    if (st.writes == 0) {
+        return;
+    }
+    logi("Send: %llu frames in %llu writes, %.2f frames per write, max %d",
+         (unsigned long long)st.frames, (unsigned long long)st.writes,
+         (double)st.frames / st.writes, st.maxFramesPerWrite);
+    if (st.messages > 0) {
+        const HUBufferPool::Stats& ps = m_sendPool.GetStats();
+        logi("Send: %llu messages of several frames, %.2f frames each, "
+             "%llu of %llu buffers reused",
+             (unsigned long long)st.messages,
+             (double)st.messageFrames / st.messages,
+             (unsigned long long)ps.reused, (unsigned long long)ps.acquired);
+    }
+    logi("Send: %llu bytes, each copied %.2f times on the way to the "
+         "transport",
+         (unsigned long long)st.bytes,
+         st.bytes ? (double)st.copiedBytes / st.bytes : 0.0);
+}
 
-    if (!message.SerializeToArray(destMessageCode, messageSize)) {
+int HUServer::sendEncodedMessage(int retry, ServiceChannels chan, uint16_t messageCode,
+    const google::protobuf::MessageLite& message, int overrideTimeout) {
+    // Serialized right where it gets encrypted from, behind the code
+    const int messageSize = message.ByteSizeLong();
+    byte* dest = m_sendMessage.Reserve(messageSize);
+    if (!message.SerializeToArray(dest, messageSize)) {
         loge("AppendToString failed for %s", message.GetTypeName().c_str());
         return -1;
     }
+    *reinterpret_cast<uint16_t*>(m_sendMessage.Prepend(2)) =
+        htobe16(messageCode);
 
     logd("Send %s on channel %i %s", message.GetTypeName().c_str(), chan,
          getChannel(chan));
-    // hex_dump("PB:", 80, temp_assembly_buffer->data(), requiredSize);
-    return sendEncoded(retry, chan, temp_assembly_buffer->data(),
-                           requiredSize, overrideTimeout);
+    // hex_dump("PB:", 80, m_sendMessage.Data(), m_sendMessage.Len());
+    return sendEncoded(retry, chan, m_sendMessage.Data(),
+                       m_sendMessage.Len(), overrideTimeout);
 }
 
 int HUServer::sendEncodedMediaPacket(int retry, ServiceChannels chan,
@@ -187,26 +392,31 @@ int HUServer::sendEncodedMediaPacket(int retry, ServiceChannels chan,
                                            uint64_t timeStamp,
                                            const byte* buffer, int bufferLen,
                                            int overrideTimeout) {
-    const int requiredSize = bufferLen + 2 + 8;
-    if (temp_assembly_buffer->size() <
-        static_cast<unsigned int>(requiredSize)) {
-        temp_assembly_buffer->resize(static_cast<unsigned int>(requiredSize));
-    }
-
-    uint16_t* destMessageCode =
-        reinterpret_cast<uint16_t*>(temp_assembly_buffer->data());
-    *destMessageCode++ = htobe16(messageCode);
-
-    uint64_t* destTimestamp = reinterpret_cast<uint64_t*>(destMessageCode);
-    *destTimestamp++ = htobe64(timeStamp);
+    // The caller's memory may not outlive this, so it's copied once
+    memcpy(m_sendMessage.Reserve(bufferLen), buffer, bufferLen);
+    m_sendBatchStats.copiedBytes += bufferLen;
+    return sendEncodedMediaBuffer(retry, chan, messageCode, timeStamp,
+                                  m_sendMessage, overrideTimeout);
+}
 
-    memcpy(destTimestamp, buffer, bufferLen);
+int HUServer::sendEncodedMediaBuffer(int retry, ServiceChannels chan,
+                                     uint16_t messageCode, uint64_t timeStamp,
+                                     HUSendBuffer& buffer,
+                                     int overrideTimeout) {
+    const uint64_t beTimeStamp = htobe64(timeStamp);
+    byte* destTimestamp = buffer.Prepend(sizeof(beTimeStamp));
+    byte* destMessageCode = destTimestamp ? buffer.Prepend(2) : nullptr;
+    if (destMessageCode == nullptr) {
+        loge("No headroom left in the send buffer, was it sent already?");
+        return (-1);
+    }
+    memcpy(destTimestamp, &beTimeStamp, sizeof(beTimeStamp));
+    *reinterpret_cast<uint16_t*>(destMessageCode) = htobe16(messageCode);
 
     // logd ("Send %s on channel %i %s", message.GetTypeName().c_str(), chan,
-    // chan_get(chan)); hex_dump("PB:", 80, temp_assembly_buffer->data(),
-    // requiredSize);
-    return sendEncoded(retry, chan, temp_assembly_buffer->data(),
-                           requiredSize, overrideTimeout);
+    // chan_get(chan)); hex_dump("PB:", 80, buffer.Data(), buffer.Len());
+    return sendEncoded(retry, chan, buffer.Data(), buffer.Len(),
+                       overrideTimeout);
 }
 
 int HUServer::sendEncoded(int retry, ServiceChannels chan, byte* buf, int len,
@@ -232,6 +442,40 @@ int HUServer::sendEncoded(int retry, ServiceChannels chan, byte* buf, int len,
                                        // control");
     }
 
+    // A single frame is encrypted into enc_buf, or when batching straight
+    // onto the end of the batch. A longer message has all of its frames
+    // encrypted back to back into one pooled buffer, each record right
+    // behind its header, and goes to the transport as one write with an
+    // entry per frame.
+    const int frames =
+        std::max((len + MAX_FRAME_PAYLOAD_SIZE - 1) / MAX_FRAME_PAYLOAD_SIZE, 1);
+    const int tmo = overrideTimeout < 0 ? iaap_tra_send_tmo : overrideTimeout;
+    HUBuffer pooled;
+    byte* out = enc_buf;
+    size_t room = sizeof(enc_buf);
+    bool batched = false;
+    if (frames == 1 && m_batchSends) {
+        // Header and record overhead fit in what MAX_FRAME_SIZE has on top of
+        // the payload
+        const int overhead = MAX_FRAME_SIZE - MAX_FRAME_PAYLOAD_SIZE;
+        if (MAX_FRAME_SIZE - m_sendBatchLen < len + overhead &&
+            flushSendBatch() < 0) {
+            return (-1);
+        }
+        out = &m_sendBatch[m_sendBatchLen];
+        room = MAX_FRAME_SIZE - m_sendBatchLen;
+        batched = true;
+    } else if (frames > 1) {
+        // Header and record overhead fit in MAX_FRAME_SIZE with the payload
+        room = (size_t)frames * MAX_FRAME_SIZE;
+        pooled = m_sendPool.Acquire(room);
+        out = pooled.data.get();
+        m_sendFrames.clear();
+        m_sendBatchStats.messages++;
+        m_sendBatchStats.messageFrames += frames;
+    }
+
+    size_t used = 0;
     for (int frag_start = 0; frag_start < len;
          frag_start += MAX_FRAME_PAYLOAD_SIZE) {
         byte flags = base_flags;
@@ -245,8 +489,7 @@ int HUServer::sendEncoded(int retry, ServiceChannels chan, byte* buf, int len,
             cur_len = len - frag_start;
         }
 #ifndef NDEBUG
-        //    if (ena_log_verbo && ena_log_aap_send) {
-        if (log_packet_info) {  // && ena_log_aap_send)
+        if (m_logPackets) {
             char prefix[MAX_FRAME_SIZE] = {0};
             snprintf(prefix, sizeof(prefix), "S %d %s %1.1x", chan,
                      getChannel(chan),
@@ -255,56 +498,54 @@ int HUServer::sendEncoded(int retry, ServiceChannels chan, byte* buf, int len,
         }
 #endif
 
-        int bytes_written = SSL_write(m_ssl, &buf[frag_start],
-                                      cur_len);  // Write plaintext to SSL
-        if (bytes_written <= 0) {
-            loge("SSL_write() bytes_written: %d", bytes_written);
-            logSSLReturnCode(bytes_written);
-            logSSLInfo();
-            stop();
-            return (-1);
-        }
-        if (bytes_written != cur_len)
-            loge("SSL_write() cur_len: %d  bytes_written: %d  chan: %d %s",
-                 cur_len, bytes_written, chan, getChannel(chan));
-        else if (ena_log_verbo && ena_log_aap_send)
-            logd("SSL_write() cur_len: %d  bytes_written: %d  chan: %d %s",
-                 cur_len, bytes_written, chan, getChannel(chan));
-
-        enc_buf[0] = (byte)chan;  // Encode channel and flags
-        enc_buf[1] = flags;
-
+        // Everything but the record length is known before encrypting
+        byte* header = &out[used];
+        header[0] = (byte)chan;  // Encode channel and flags
+        header[1] = flags;
         int header_size = 4;
-        if ((flags & HU_FRAME_FIRST_FRAME) & !(flags & HU_FRAME_LAST_FRAME)) {
+        if ((flags & HU_FRAME_FIRST_FRAME) && !(flags & HU_FRAME_LAST_FRAME)) {
             // write total len
-            *((uint32_t*)&enc_buf[header_size]) = htobe32(len);
+            *((uint32_t*)&header[header_size]) = htobe32(len);
             header_size += 4;
         }
 
-        int bytes_read = BIO_read(
-            m_sslReadBio, &enc_buf[header_size],
-            sizeof(enc_buf) -
-                header_size);  // Read encrypted from SSL BIO to enc_buf +
-
-        if (bytes_read <= 0) {
-            loge("BIO_read() bytes_read: %d", bytes_read);
+        // The record goes right behind the header
+        int record_len =
+            encryptRecord(&buf[frag_start], cur_len, &header[header_size],
+                          room - used - header_size);
+        if (record_len < 0) {
+            loge("Couldn't encrypt %d bytes on chan: %d %s", cur_len, chan,
+                 getChannel(chan));
+            m_sendPool.Release(std::move(pooled));
             stop();
             return (-1);
         }
-        if (ena_log_verbo && ena_log_aap_send)
-            logd("BIO_read() bytes_read: %d", bytes_read);
 
-        *((uint16_t*)&enc_buf[2]) = htobe16(bytes_read);
+        *((uint16_t*)&header[2]) = htobe16(record_len);
+        used += header_size + record_len;
+        if (frames > 1) {
+            m_sendFrames.push_back(
+                {header, (size_t)(header_size + record_len)});
+        }
+    }
 
-        int ret = 0;
-        ret = sendTransportPacket(
-            retry, enc_buf, bytes_read + header_size,
-            overrideTimeout < 0
-                ? iaap_tra_send_tmo
-                : overrideTimeout);  // Send encrypted data to AA Server
-        if (retry) return (ret);
+    if (batched) {
+        m_sendBatchLen += used;
+        m_sendBatchFrames++;
+        m_sendBatchTimeout = std::max(m_sendBatchTimeout, tmo);
+        if (retry) return ((int)used);
+        return (0);
     }
 
+    iovec iov = {out, used};
+    int ret = frames > 1
+                  ? sendTransportPacket(retry, m_sendFrames.data(),
+                                        (int)m_sendFrames.size(), tmo, frames)
+                  : sendTransportPacket(retry, &iov, 1, tmo,
+                                        frames);  // Send encrypted data to AA Server
+    m_sendPool.Release(std::move(pooled));  // The transport is done with it
+    if (retry) return (ret);
+
     return (0);
 }
 
@@ -348,8 +589,7 @@ int HUServer::sendUnencoded(int retry, ServiceChannels chan, byte* buf, int len,
 
         logd("Frame %i : %i bytes", (int)flags, cur_len);
 #ifndef NDEBUG
-        //    if (ena_log_verbo && ena_log_aap_send) {
-        if (log_packet_info) {  // && ena_log_aap_send)
+        if (m_logPackets) {
             char prefix[MAX_FRAME_SIZE] = {0};
             snprintf(prefix, sizeof(prefix), "S %d %s %1.1x", chan,
                      getChannel(chan),
@@ -368,10 +608,10 @@ int HUServer::sendUnencoded(int retry, ServiceChannels chan, byte* buf, int len,
             header_size += 4;
         }
 
-        memcpy(&enc_buf[header_size], &buf[frag_start], cur_len);
-
+        iovec iov[2] = {{enc_buf, (size_t)header_size},
+                        {&buf[frag_start], (size_t)cur_len}};
         return sendTransportPacket(
-            retry, enc_buf, cur_len + header_size,
+            retry, iov, 2,
             overrideTimeout < 0
                 ? iaap_tra_send_tmo
                 : overrideTimeout);  // Send encrypted data to AA Server
@@ -384,21 +624,21 @@ int HUServer::sendUnencodedBlob(int retry, ServiceChannels chan, uint16_t messag
                                      const byte* buffer, int bufferLen,
                                      int overrideTimeout) {
     const int requiredSize = bufferLen + 2;
-    if (temp_assembly_buffer->size() <
+    if (send_buffer.size() <
         static_cast<unsigned int>(requiredSize)) {
-        temp_assembly_buffer->resize(static_cast<unsigned int>(requiredSize));
+        send_buffer.resize(static_cast<unsigned int>(requiredSize));
     }
 
     uint16_t* destMessageCode =
-        reinterpret_cast<uint16_t*>(temp_assembly_buffer->data());
+        reinterpret_cast<uint16_t*>(send_buffer.data());
     *destMessageCode++ = htobe16(messageCode);
 
     memcpy(destMessageCode, buffer, bufferLen);
 
     // logd ("Send %s on channel %i %s", message.GetTypeName().c_str(), chan,
-    // chan_get(chan)); hex_dump("PB:", 80, temp_assembly_buffer->data(),
+    // chan_get(chan)); hex_dump("PB:", 80, send_buffer.data(),
     // requiredSize);
-    return sendUnencoded(retry, chan, temp_assembly_buffer->data(),
+    return sendUnencoded(retry, chan, send_buffer.data(),
                              requiredSize, overrideTimeout);
 }
 
@@ -406,13 +646,13 @@ int HUServer::sendUnencodedMessage(int retry, ServiceChannels chan, uint16_t mes
     const google::protobuf::MessageLite& message, int overrideTimeout) {
     const int messageSize = message.ByteSizeLong();
     const int requiredSize = messageSize + 2;
-    if (temp_assembly_buffer->size() <
+    if (send_buffer.size() <
         static_cast<unsigned int>(requiredSize)) {
-        temp_assembly_buffer->resize(static_cast<unsigned int>(requiredSize));
+        send_buffer.resize(static_cast<unsigned int>(requiredSize));
     }
 
     uint16_t* destMessageCode =
-        reinterpret_cast<uint16_t*>(temp_assembly_buffer->data());
+        reinterpret_cast<uint16_t*>(send_buffer.data());
     *destMessageCode++ = htobe16(messageCode);
 
     if (!message.SerializeToArray(destMessageCode, messageSize)) {
@@ -422,8 +662,8 @@ int HUServer::sendUnencodedMessage(int retry, ServiceChannels chan, uint16_t mes
 
     logd("Send %s on channel %i %s", message.GetTypeName().c_str(), chan,
          getChannel(chan));
-    // hex_dump("PB:", 80, temp_assembly_buffer->data(), requiredSize);
-    return sendUnencoded(retry, chan, temp_assembly_buffer->data(),
+    // hex_dump("PB:", 80, send_buffer.data(), requiredSize);
+    return sendUnencoded(retry, chan, send_buffer.data(),
                              requiredSize, overrideTimeout);
 }
 
@@ -439,12 +679,16 @@ int HUServer::handle_VersionResponse(ServiceChannels chan, byte* buf, int len) {
     return (ret);
 }
 
+int HUServer::handle_SSLHandshake(ServiceChannels chan, byte* buf, int len) {
+    return handleSSLHandshake(buf, len);
+}
+
 //  extern int wifi_direct;// = 0;//1;//0;
 int HUServer::handle_ServiceDiscoveryRequest(ServiceChannels chan, byte* buf,
     int len) {  // Service Discovery Request
 
     HU::ServiceDiscoveryRequest request;
-    if (!request.ParseFromArray(buf, len))
+    if (!parseMessage(request, buf, len))
         loge("Service Discovery Request: %x", buf[2]);
     else
         logd("Service Discovery Request: %s",
@@ -642,7 +886,7 @@ int HUServer::handle_ServiceDiscoveryRequest(ServiceChannels chan, byte* buf,
 int HUServer::handle_PingRequest(ServiceChannels chan, byte* buf,
                                     int len) {  // Ping Request
     HU::PingRequest request;
-    if (!request.ParseFromArray(buf, len))
+    if (!parseMessage(request, buf, len))
         loge("Ping Request");
     else
         logd("Ping Request: %d", buf[3]);
@@ -657,7 +901,7 @@ int HUServer::handle_NavigationFocusRequest(
     ServiceChannels chan, byte* buf,
     int len) {  // Navigation Focus Request
     HU::NavigationFocusRequest request;
-    if (!request.ParseFromArray(buf, len))
+    if (!parseMessage(request, buf, len))
         loge("Navigation Focus Request");
     else
         logd("Navigation Focus Request: %d", request.focus_type());
@@ -672,7 +916,7 @@ int HUServer::handle_ShutdownRequest(ServiceChannels chan, byte* buf,
                                         int len) {  // Byebye Request
 
     HU::ShutdownRequest request;
-    if (!request.ParseFromArray(buf, len))
+    if (!parseMessage(request, buf, len))
         loge("Byebye Request");
     else if (request.reason() == 1)
         logd("Byebye Request reason: 1 AA Exit Car Mode");
@@ -696,7 +940,7 @@ int HUServer::handle_VoiceSessionRequest(
     // sr:  00000000 00 11 08 02
 
     HU::VoiceSessionRequest request;
-    if (!request.ParseFromArray(buf, len))
+    if (!parseMessage(request, buf, len))
         loge("Voice Session Notification");
     else if (request.voice_status() ==
              HU::VoiceSessionRequest::VOICE_STATUS_START)
@@ -713,7 +957,7 @@ int HUServer::handle_AudioFocusRequest(
     ServiceChannels chan, byte* buf,
     int len) {  // Navigation Focus Request
     HU::AudioFocusRequest request;
-    if (!request.ParseFromArray(buf, len))
+    if (!parseMessage(request, buf, len))
         loge("AudioFocusRequest Focus Request");
     else
         logd("AudioFocusRequest Focus Request %s: %d", getChannel(chan),
@@ -727,7 +971,7 @@ int HUServer::handle_ChannelOpenRequest(ServiceChannels chan, byte* buf,
                                            int len) {  // Channel Open Request
 
     HU::ChannelOpenRequest request;
-    if (!request.ParseFromArray(buf, len))
+    if (!parseMessage(request, buf, len))
         loge("Channel Open Request");
     else
         logd("Channel Open Request: %d  priority: %d", request.id(),
@@ -755,7 +999,7 @@ int HUServer::handle_ChannelOpenRequest(ServiceChannels chan, byte* buf,
 
 int HUServer::handle_MediaSetupRequest(ServiceChannels chan, byte* buf, int len) {
     HU::MediaSetupRequest request;
-    if (!request.ParseFromArray(buf, len))
+    if (!parseMessage(request, buf, len))
         loge("MediaSetupRequest");
     else
         logd("MediaSetupRequest: %d", request.type());
@@ -777,7 +1021,7 @@ int HUServer::handle_MediaSetupRequest(ServiceChannels chan, byte* buf, int len)
 
 int HUServer::handle_VideoFocusRequest(ServiceChannels chan, byte* buf, int len) {
     HU::VideoFocusRequest request;
-    if (!request.ParseFromArray(buf, len))
+    if (!parseMessage(request, buf, len))
         loge("VideoFocusRequest");
     else
         logd("VideoFocusRequest: %d", request.disp_index());
@@ -793,12 +1037,15 @@ int HUServer::handle_MediaStartRequest(
     // sr:  00000000 00 11 08 02
 
     HU::MediaStartRequest request;
-    if (!request.ParseFromArray(buf, len))
+    if (!parseMessage(request, buf, len))
         loge("MediaStartRequest");
     else
         logd("MediaStartRequest: %d", request.session());
 
     channel_session_id[chan] = request.session();
+    if (isMediaSinkChannel(chan)) {
+        m_mediaAck[chan].len = 0;
+    }
     return callbacks.MediaStart(chan);
 }
 
@@ -808,12 +1055,15 @@ int HUServer::handle_MediaStopRequest(
     // sr:  00000000 00 11 08 02
 
     HU::MediaStopRequest request;
-    if (!request.ParseFromArray(buf, len))
+    if (!parseMessage(request, buf, len))
         loge("MediaStopRequest");
     else
         logd("MediaStopRequest");
 
     channel_session_id[chan] = 0;
+    if (isMediaSinkChannel(chan)) {
+        m_mediaAck[chan].len = 0;
+    }
     return callbacks.MediaStop(chan);
 }
 
@@ -821,7 +1071,7 @@ int HUServer::handle_SensorStartRequest(
     ServiceChannels chan, byte* buf,
     int len) {  // Navigation Focus Request
     HU::SensorStartRequest request;
-    if (!request.ParseFromArray(buf, len))
+    if (!parseMessage(request, buf, len))
         loge("SensorStartRequest Focus Request");
     else
         logd("SensorStartRequest Focus Request: %d", request.type());
@@ -836,7 +1086,7 @@ int HUServer::handle_SensorStartRequest(
 int HUServer::handle_BindingRequest(ServiceChannels chan, byte* buf,
                                        int len) {  // Navigation Focus Request
     HU::BindingRequest request;
-    if (!request.ParseFromArray(buf, len))
+    if (!parseMessage(request, buf, len))
         loge("BindingRequest Focus Request");
     else
         logd("BindingRequest Focus Request: %d", request.scan_codes_size());
@@ -850,7 +1100,7 @@ int HUServer::handle_BindingRequest(ServiceChannels chan, byte* buf,
 
 int HUServer::handle_MediaAck(ServiceChannels chan, byte* buf, int len) {
     HU::MediaAck request;
-    if (!request.ParseFromArray(buf, len))
+    if (!parseMessage(request, buf, len))
         loge("MediaAck");
     else
         logd("MediaAck");
@@ -859,7 +1109,7 @@ int HUServer::handle_MediaAck(ServiceChannels chan, byte* buf, int len) {
 
 int HUServer::handle_MicRequest(ServiceChannels chan, byte* buf, int len) {
     HU::MicRequest request;
-    if (!request.ParseFromArray(buf, len))
+    if (!parseMessage(request, buf, len))
         loge("MicRequest");
     else
         logd("MicRequest");
@@ -882,13 +1132,7 @@ int HUServer::handle_MediaDataWithTimestamp(ServiceChannels chan, byte* buf, int
     if (ret < 0) {
         return ret;
     }
-
-    HU::MediaAck mediaAck;
-    mediaAck.set_session(channel_session_id[chan]);
-    mediaAck.set_value(1);
-
-    return sendEncodedMessage(0, chan, HU_MEDIA_CHANNEL_MESSAGE::MediaAck,
-                                   mediaAck);
+    return sendMediaAck(chan);
 }
 
 int HUServer::handle_MediaData(ServiceChannels chan, byte* buf, int len) {
@@ -896,18 +1140,67 @@ int HUServer::handle_MediaData(ServiceChannels chan, byte* buf, int len) {
     if (ret < 0) {
         return ret;
     }
+    return sendMediaAck(chan);
+}
 
-    HU::MediaAck mediaAck;
-    mediaAck.set_session(channel_session_id[chan]);
-    mediaAck.set_value(1);
+int HUServer::fastMediaDataWithTimestamp(ServiceChannels chan, byte* buf,
+                                         int len) {
+    if (len < 8) {
+        loge("Media data with timestamp too short: %d", len);
+        return (-1);
+    }
+    return fastMediaPacket(chan, be64toh(*((uint64_t*)buf)), &buf[8], len - 8);
+}
+
+int HUServer::fastMediaData(ServiceChannels chan, byte* buf, int len) {
+    return fastMediaPacket(chan, 0, buf, len);
+}
+
+int HUServer::fastMediaPacket(ServiceChannels chan, uint64_t timestamp,
+                              byte* buf, int len) {
+    int ret = callbacks.MediaPacket(chan, timestamp, buf, len);
+    if (ret < 0) {
+        return ret;
+    }
+    return sendMediaAck(chan);
+}
+
+int HUServer::sendMediaAck(ServiceChannels chan) {
+    if (!isMediaSinkChannel(chan)) {
+        HU::MediaAck mediaAck;
+        mediaAck.set_session(channel_session_id[chan]);
+        mediaAck.set_value(1);
+        return sendEncodedMessage(0, chan, HU_MEDIA_CHANNEL_MESSAGE::MediaAck,
+                                  mediaAck);
+    }
 
-    return sendEncodedMessage(0, chan, HU_MEDIA_CHANNEL_MESSAGE::MediaAck,
-                                   mediaAck);
+    // The same bytes for every packet of a session, encode them once
+    PreparedAck& ack = m_mediaAck[chan];
+    if (ack.len == 0) {
+        HU::MediaAck mediaAck;
+        mediaAck.set_session(channel_session_id[chan]);
+        mediaAck.set_value(1);
+        const int messageSize = mediaAck.ByteSizeLong();
+        if (messageSize + 2 > (int)sizeof(ack.data)) {
+            loge("MediaAck too long: %d", messageSize);
+            return (-1);
+        }
+        *reinterpret_cast<uint16_t*>(ack.data) =
+            htobe16((uint16_t)HU_MEDIA_CHANNEL_MESSAGE::MediaAck);
+        if (!mediaAck.SerializeToArray(&ack.data[2], messageSize)) {
+            loge("SerializeToArray failed for MediaAck");
+            return (-1);
+        }
+        ack.len = messageSize + 2;
+        logd("MediaAck prepared for %s session %d", getChannel(chan),
+             channel_session_id[chan]);
+    }
+    return sendEncoded(0, chan, ack.data, ack.len);
 }
 
 int HUServer::handle_PhoneStatus(ServiceChannels chan, byte* buf, int len) {
     HU::PhoneStatus request;
-    if (!request.ParseFromArray(buf, len)) {
+    if (!parseMessage(request, buf, len)) {
         loge("PhoneStatus Focus Request");
         return -1;
     } else {
@@ -920,7 +1213,7 @@ int HUServer::handle_PhoneStatus(ServiceChannels chan, byte* buf, int len) {
 int HUServer::handle_GenericNotificationResponse(ServiceChannels chan, byte* buf,
                                                     int len) {
     HU::GenericNotificationResponse request;
-    if (!request.ParseFromArray(buf, len)) {
+    if (!parseMessage(request, buf, len)) {
         loge("GenericNotificationResponse Focus Request");
         return -1;
     } else {
@@ -933,7 +1226,7 @@ int HUServer::handle_GenericNotificationResponse(ServiceChannels chan, byte* buf
 int HUServer::handle_StartGenericNotifications(ServiceChannels chan, byte* buf,
                                                   int len) {
     HU::StartGenericNotifications request;
-    if (!request.ParseFromArray(buf, len)) {
+    if (!parseMessage(request, buf, len)) {
         loge("StartGenericNotifications Focus Request");
         return -1;
     } else {
@@ -945,7 +1238,7 @@ int HUServer::handle_StartGenericNotifications(ServiceChannels chan, byte* buf,
 
 int HUServer::handle_StopGenericNotifications(ServiceChannels chan, byte* buf, int len) {
     HU::StopGenericNotifications request;
-    if (!request.ParseFromArray(buf, len)) {
+    if (!parseMessage(request, buf, len)) {
         loge("StopGenericNotifications Focus Request");
         return -1;
     } else {
@@ -957,7 +1250,7 @@ int HUServer::handle_StopGenericNotifications(ServiceChannels chan, byte* buf, i
 
 int HUServer::handle_BluetoothPairingRequest(ServiceChannels chan, byte* buf, int len) {
     HU::BluetoothPairingRequest request;
-    if (!request.ParseFromArray(buf, len)) {
+    if (!parseMessage(request, buf, len)) {
         loge("BluetoothPairingRequest Focus Request");
         return -1;
     } else {
@@ -976,7 +1269,7 @@ int HUServer::handle_BluetoothPairingRequest(ServiceChannels chan, byte* buf, in
 
 int HUServer::handle_BluetoothAuthData(ServiceChannels chan, byte* buf, int len) {
     HU::BluetoothAuthData request;
-    if (!request.ParseFromArray(buf, len)) {
+    if (!parseMessage(request, buf, len)) {
         loge("BluetoothAuthData Focus Request");
         return -1;
     } else {
@@ -988,7 +1281,7 @@ int HUServer::handle_BluetoothAuthData(ServiceChannels chan, byte* buf, int len)
 
 int HUServer::handle_NaviStatus(ServiceChannels chan, byte* buf, int len) {
     HU::NAVMessagesStatus request;
-    if (!request.ParseFromArray(buf, len)) {
+    if (!parseMessage(request, buf, len)) {
         logv("NaviStatus Request");
         logv(request.DebugString().c_str());
         return -1;
@@ -1001,7 +1294,7 @@ int HUServer::handle_NaviStatus(ServiceChannels chan, byte* buf, int len) {
 
 int HUServer::handle_NaviTurn(ServiceChannels chan, byte* buf, int len) {
     HU::NAVTurnMessage request;
-    if (!request.ParseFromArray(buf, len)) {
+    if (!parseMessage(request, buf, len)) {
         logv("NaviTurn Request");
         logv(request.DebugString().c_str());
         return -1;
@@ -1014,7 +1307,7 @@ int HUServer::handle_NaviTurn(ServiceChannels chan, byte* buf, int len) {
 
 int HUServer::handle_NaviTurnDistance(ServiceChannels chan, byte* buf, int len) {
     HU::NAVDistanceMessage request;
-    if (!request.ParseFromArray(buf, len)) {
+    if (!parseMessage(request, buf, len)) {
         logv("NaviTurnDistance Request");
         logv(request.DebugString().c_str());
         return -1;
@@ -1025,6 +1318,157 @@ int HUServer::handle_NaviTurnDistance(ServiceChannels chan, byte* buf, int len)
     return 0;
 }
 
+// Every message with a handler. DISPATCH_AS(kind, type, code, name) sends
+// type::code to handle_<name>(), DISPATCH() when code and name are the
+// same. Expanded into the table and into the checks findHandler() makes
+// on it at compile time.
+#define HU_DISPATCH_ENTRIES(DISPATCH, DISPATCH_AS) \
+    DISPATCH(InitMessages, HU_INIT_MESSAGE, VersionResponse) \
+    DISPATCH(InitMessages, HU_INIT_MESSAGE, SSLHandshake) \
+    DISPATCH(ControlMessages, HU_PROTOCOL_MESSAGE, MediaDataWithTimestamp) \
+    DISPATCH(ControlMessages, HU_PROTOCOL_MESSAGE, MediaData) \
+    DISPATCH(ControlMessages, HU_PROTOCOL_MESSAGE, ServiceDiscoveryRequest) \
+    DISPATCH(ControlMessages, HU_PROTOCOL_MESSAGE, ChannelOpenRequest) \
+    DISPATCH(ControlMessages, HU_PROTOCOL_MESSAGE, PingRequest) \
+    DISPATCH(ControlMessages, HU_PROTOCOL_MESSAGE, NavigationFocusRequest) \
+    DISPATCH(ControlMessages, HU_PROTOCOL_MESSAGE, ShutdownRequest) \
+    DISPATCH(ControlMessages, HU_PROTOCOL_MESSAGE, VoiceSessionRequest) \
+    DISPATCH(ControlMessages, HU_PROTOCOL_MESSAGE, AudioFocusRequest) \
+    DISPATCH(SensorMessages, HU_SENSOR_CHANNEL_MESSAGE, SensorStartRequest) \
+    DISPATCH(InputMessages, HU_INPUT_CHANNEL_MESSAGE, BindingRequest) \
+    DISPATCH(BluetoothMessages, HU_BLUETOOTH_CHANNEL_MESSAGE, BluetoothPairingRequest) \
+    DISPATCH(BluetoothMessages, HU_BLUETOOTH_CHANNEL_MESSAGE, BluetoothAuthData) \
+    DISPATCH(PhoneStatusMessages, HU_PHONE_STATUS_CHANNEL_MESSAGE, PhoneStatus) \
+    DISPATCH(NotificationMessages, HU_GENERIC_NOTIFICATIONS_CHANNEL_MESSAGE, StartGenericNotifications) \
+    DISPATCH(NotificationMessages, HU_GENERIC_NOTIFICATIONS_CHANNEL_MESSAGE, StopGenericNotifications) \
+    DISPATCH(NotificationMessages, HU_GENERIC_NOTIFICATIONS_CHANNEL_MESSAGE, GenericNotificationResponse) \
+    DISPATCH(MediaMessages, HU_MEDIA_CHANNEL_MESSAGE, MediaSetupRequest) \
+    DISPATCH(MediaMessages, HU_MEDIA_CHANNEL_MESSAGE, MediaStartRequest) \
+    DISPATCH(MediaMessages, HU_MEDIA_CHANNEL_MESSAGE, MediaStopRequest) \
+    DISPATCH(MediaMessages, HU_MEDIA_CHANNEL_MESSAGE, MediaAck) \
+    DISPATCH(MediaMessages, HU_MEDIA_CHANNEL_MESSAGE, MicRequest) \
+    DISPATCH(MediaMessages, HU_MEDIA_CHANNEL_MESSAGE, VideoFocusRequest) \
+    DISPATCH_AS(NavigationMessages, HU_NAVI_CHANNEL_MESSAGE, Status, NaviStatus) \
+    DISPATCH_AS(NavigationMessages, HU_NAVI_CHANNEL_MESSAGE, Turn, NaviTurn) \
+    DISPATCH_AS(NavigationMessages, HU_NAVI_CHANNEL_MESSAGE, TurnDistance, NaviTurnDistance)
+
+#define DISPATCH_ENTRY_AS(kind, type, code, name) \
+    { kind, (uint16_t)type::code, #name, &HUServer::handle_##name },
+#define DISPATCH_ENTRY(kind, type, name) \
+    DISPATCH_ENTRY_AS(kind, type, name, name)
+
+const HUServer::DispatchEntry HUServer::s_dispatchTable[] = {
+    HU_DISPATCH_ENTRIES(DISPATCH_ENTRY, DISPATCH_ENTRY_AS)
+};
+
+const int HUServer::s_dispatchEntryCount =
+    sizeof(s_dispatchTable) / sizeof(s_dispatchTable[0]);
+
+#undef DISPATCH_ENTRY
+#undef DISPATCH_ENTRY_AS
+
+static const char* message_kind_name(int kind) {
+    static const char* const names[] = {
+        "init",         "control",      "sensor", "input",      "bluetooth",
+        "phone status", "notification", "media",  "navigation", "unknown"};
+    return names[kind];
+}
+
+// Channel specific codes start at 0x8000, slot 0 of their kind
+static constexpr int message_slot(int msg_type) {
+    return msg_type < 0x8000 ? msg_type : msg_type - 0x8000;
+}
+
+struct DispatchKey {
+    int kind;
+    int code;
+};
+
+static constexpr bool dispatch_codes_fit(const DispatchKey* keys, int count,
+                                         int slots) {
+    return count == 0 || (message_slot(keys[0].code) < slots &&
+                          dispatch_codes_fit(keys + 1, count - 1, slots));
+}
+
+// Whether key shares its kind and slot with any of keys[0, count)
+static constexpr bool dispatch_code_taken(const DispatchKey& key,
+                                          const DispatchKey* keys, int count) {
+    return count > 0 &&
+           ((keys[0].kind == key.kind &&
+             message_slot(keys[0].code) == message_slot(key.code)) ||
+            dispatch_code_taken(key, keys + 1, count - 1));
+}
+
+static constexpr bool dispatch_codes_unique(const DispatchKey* keys,
+                                            int count) {
+    return count == 0 || (!dispatch_code_taken(keys[0], keys + 1, count - 1) &&
+                          dispatch_codes_unique(keys + 1, count - 1));
+}
+
+int HUServer::findHandler(MessageKind kind, uint16_t msg_type) {
+#define DISPATCH_KEY_AS(kind, type, code, name) { kind, (int)type::code },
+#define DISPATCH_KEY(kind, type, name) DISPATCH_KEY_AS(kind, type, name, name)
+    static constexpr DispatchKey keys[] = {
+        HU_DISPATCH_ENTRIES(DISPATCH_KEY, DISPATCH_KEY_AS)};
+#undef DISPATCH_KEY
+#undef DISPATCH_KEY_AS
+    static constexpr int key_count = sizeof(keys) / sizeof(keys[0]);
+    static_assert(key_count < 255, "The index holds entries as uint8_t");
+    static_assert(dispatch_codes_fit(keys, key_count, MESSAGE_SLOTS),
+                  "A dispatch entry's code is past the last message slot");
+    static_assert(dispatch_codes_unique(keys, key_count),
+                  "Two dispatch entries share a kind and message slot");
+    // Built from s_dispatchTable once, kind x slot -> entry
+    static const std::vector<uint8_t> index = [] {
+        std::vector<uint8_t> ret(MessageKindCount * MESSAGE_SLOTS,
+                                 s_dispatchEntryCount);
+        for (int i = 0; i < s_dispatchEntryCount; i++) {
+            const DispatchEntry& entry = s_dispatchTable[i];
+            ret[entry.kind * MESSAGE_SLOTS + message_slot(entry.code)] = i;
+        }
+        return ret;
+    }();
+    int slot = message_slot(msg_type);
+    if (slot >= MESSAGE_SLOTS) {
+        return s_dispatchEntryCount;
+    }
+    return index[kind * MESSAGE_SLOTS + slot];
+}
+
+#undef HU_DISPATCH_ENTRIES
+
+int HUServer::dispatchMessage(int entry, ServiceChannels chan, byte* buf,
+                              int len, MessageHandler handler) {
+    MessageCounters& counters = m_messageCounters[entry];
+    counters.calls.fetch_add(1, std::memory_order_relaxed);
+    counters.bytes.fetch_add(len, std::memory_order_relaxed);
+
+    m_dispatching = &counters;
+    auto begin = std::chrono::steady_clock::now();
+    if (!handler) {
+        handler = s_dispatchTable[entry].handler;
+    }
+    int ret = (this->*handler)(chan, buf, len);
+    auto elapsed = std::chrono::steady_clock::now() - begin;
+    m_dispatching = nullptr;
+
+    counters.nanoseconds.fetch_add(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count(),
+        std::memory_order_relaxed);
+    return ret;
+}
+
+bool HUServer::parseMessage(google::protobuf::MessageLite& message,
+                            const byte* buf, int len) {
+    if (message.ParseFromArray(buf, len)) {
+        return true;
+    }
+    if (m_dispatching) {
+        m_dispatching->parseFailures.fetch_add(1, std::memory_order_relaxed);
+    }
+    return false;
+}
+
 int HUServer::processMessage(ServiceChannels chan, uint16_t msg_type, byte* buf,
                                int len) {
     if (ena_log_verbo)
@@ -1039,141 +1483,112 @@ int HUServer::processMessage(ServiceChannels chan, uint16_t msg_type, byte* buf,
         return 0;  // handled
     }
 
+    MessageKind kind;
     if (iaap_state == hu_STATE_STARTIN) {
-        switch ((HU_INIT_MESSAGE)msg_type) {
-            case HU_INIT_MESSAGE::VersionResponse:
-                return handle_VersionResponse(chan, buf, len);
-            case HU_INIT_MESSAGE::SSLHandshake:
-                return handleSSLHandshake(buf, len);
+        kind = InitMessages;
+    } else if (msg_type < 0x8000) {
+        kind = ControlMessages;
+    } else {
+        switch (chan) {
+            case SensorChannel: kind = SensorMessages; break;
+            case TouchChannel: kind = InputMessages; break;
+            case BluetoothChannel: kind = BluetoothMessages; break;
+            case PhoneStatusChannel: kind = PhoneStatusMessages; break;
+            case NotificationChannel: kind = NotificationMessages; break;
+            case VideoChannel:
+            case MediaAudioChannel:
+            case Audio1Channel:
+            case Audio2Channel:
+            case MicrophoneChannel: kind = MediaMessages; break;
+            case NavigationChannel: kind = NavigationMessages; break;
             default:
-                logw("Unknown msg_type: %d", msg_type);
+                m_messageCounters[s_dispatchEntryCount].calls++;
+                logw("Unknown chan: %d", chan);
                 return (0);
         }
-    } else {
-        const bool isControlMessage = msg_type < 0x8000;
-
-        if (isControlMessage) {
-            switch ((HU_PROTOCOL_MESSAGE)msg_type) {
-                case HU_PROTOCOL_MESSAGE::MediaDataWithTimestamp:
-                    return handle_MediaDataWithTimestamp(chan, buf, len);
-                case HU_PROTOCOL_MESSAGE::MediaData:
-                    return handle_MediaData(chan, buf, len);
-                case HU_PROTOCOL_MESSAGE::ServiceDiscoveryRequest:
-                    return handle_ServiceDiscoveryRequest(chan, buf, len);
-                case HU_PROTOCOL_MESSAGE::ChannelOpenRequest:
-                    return handle_ChannelOpenRequest(chan, buf, len);
-                case HU_PROTOCOL_MESSAGE::PingRequest:
-                    return handle_PingRequest(chan, buf, len);
-                case HU_PROTOCOL_MESSAGE::NavigationFocusRequest:
-                    return handle_NavigationFocusRequest(chan, buf, len);
-                case HU_PROTOCOL_MESSAGE::ShutdownRequest:
-                    return handle_ShutdownRequest(chan, buf, len);
-                case HU_PROTOCOL_MESSAGE::VoiceSessionRequest:
-                    return handle_VoiceSessionRequest(chan, buf, len);
-                case HU_PROTOCOL_MESSAGE::AudioFocusRequest:
-                    return handle_AudioFocusRequest(chan, buf, len);
-                default:
-                    logw("Unknown msg_type: %d", msg_type);
-                    return (0);
-            }
-        } else if (chan == SensorChannel) {
-            switch ((HU_SENSOR_CHANNEL_MESSAGE)msg_type) {
-                case HU_SENSOR_CHANNEL_MESSAGE::SensorStartRequest:
-                    return handle_SensorStartRequest(chan, buf, len);
-                default:
-                    logw("Unknown msg_type: %d", msg_type);
-                    return (0);
-            }
-        } else if (chan == TouchChannel) {
-            switch ((HU_INPUT_CHANNEL_MESSAGE)msg_type) {
-                case HU_INPUT_CHANNEL_MESSAGE::BindingRequest:
-                    return handle_BindingRequest(chan, buf, len);
-                default:
-                    logw("Unknown msg_type: %d", msg_type);
-                    return (0);
-            }
-        } else if (chan == BluetoothChannel) {
-            switch ((HU_BLUETOOTH_CHANNEL_MESSAGE)msg_type) {
-                case HU_BLUETOOTH_CHANNEL_MESSAGE::BluetoothPairingRequest:
-                    return handle_BluetoothPairingRequest(chan, buf, len);
-                case HU_BLUETOOTH_CHANNEL_MESSAGE::BluetoothAuthData:
-                    return handle_BluetoothAuthData(chan, buf, len);
-                default:
-                    logw("BLUETOOTH CHANNEL MESSAGE = chan %d - msg_type: %d",
-                         chan, msg_type);
-                    return (0);
-            }
-        } else if (chan == PhoneStatusChannel) {
-            switch ((HU_PHONE_STATUS_CHANNEL_MESSAGE)msg_type) {
-                case HU_PHONE_STATUS_CHANNEL_MESSAGE::PhoneStatus:
-                    return handle_PhoneStatus(chan, buf, len);
-                default:
-                    logw("Unknown msg_type: %d", msg_type);
-                    return (0);
-            }
-        } else if (chan == NotificationChannel) {
-            switch ((HU_GENERIC_NOTIFICATIONS_CHANNEL_MESSAGE)msg_type) {
-                case HU_GENERIC_NOTIFICATIONS_CHANNEL_MESSAGE::
-                    StartGenericNotifications:
-                    return handle_StartGenericNotifications(chan, buf, len);
-                case HU_GENERIC_NOTIFICATIONS_CHANNEL_MESSAGE::
-                    StopGenericNotifications:
-                    return handle_StopGenericNotifications(chan, buf, len);
-                case HU_GENERIC_NOTIFICATIONS_CHANNEL_MESSAGE::
-                    GenericNotificationResponse:
-                    return handle_GenericNotificationResponse(chan, buf,
-                                                                 len);
-                default:
-                    logw("Unknown msg_type: %d", msg_type);
-                    return (0);
-            }
-        } else if (chan == MediaAudioChannel || chan == Audio1Channel ||
-                   chan == Audio2Channel || chan == VideoChannel ||
-                   chan == MicrophoneChannel) {
-            switch ((HU_MEDIA_CHANNEL_MESSAGE)msg_type) {
-                case HU_MEDIA_CHANNEL_MESSAGE::MediaSetupRequest:
-                    return handle_MediaSetupRequest(chan, buf, len);
-                case HU_MEDIA_CHANNEL_MESSAGE::MediaStartRequest:
-                    return handle_MediaStartRequest(chan, buf, len);
-                case HU_MEDIA_CHANNEL_MESSAGE::MediaStopRequest:
-                    return handle_MediaStopRequest(chan, buf, len);
-                case HU_MEDIA_CHANNEL_MESSAGE::MediaAck:
-                    return handle_MediaAck(chan, buf, len);
-                case HU_MEDIA_CHANNEL_MESSAGE::MicRequest:
-                    return handle_MicRequest(chan, buf, len);
-                case HU_MEDIA_CHANNEL_MESSAGE::VideoFocusRequest:
-                    return handle_VideoFocusRequest(chan, buf, len);
-                default:
-                    logw("Unknown msg_type: %d", msg_type);
-                    return (0);
-            }
-        } else if (chan == NavigationChannel) {
-            logv("AA_CH_NAVI");
-            logv("AA_CH_NAVI msg_type: %04x  len: %d  buf: %p", msg_type, len,
-                 buf);
-            hex_dump("AA_CH_NAVI", 80, buf, len);
-            switch ((HU_NAVI_CHANNEL_MESSAGE)msg_type) {
-                case HU_NAVI_CHANNEL_MESSAGE::Status:
-                    logv("AA_CH_NAVI: HU_NAVI_CHANNEL_MESSAGE::Status");
-                    handle_NaviStatus(chan, buf, len);
-                    return (0);
-                case HU_NAVI_CHANNEL_MESSAGE::Turn:
-                    logv("AA_CH_NAVI: HU_NAVI_CHANNEL_MESSAGE::Turn");
-                    handle_NaviTurn(chan, buf, len);
-                    return (0);
-                case HU_NAVI_CHANNEL_MESSAGE::TurnDistance:
-                    logv("AA_CH_NAVI: HU_NAVI_CHANNEL_MESSAGE::TurnDistance");
-                    handle_NaviTurnDistance(chan, buf, len);
-                    return (0);
-                default:
-                    logw("Unknown msg_type: %d", msg_type);
-                    return (0);
-            }
+    }
+
+    int entry = findHandler(kind, msg_type);
+    if (entry == s_dispatchEntryCount) {
+        m_messageCounters[s_dispatchEntryCount].calls++;
+        logw("Unknown msg_type: %d on %s channel %d", msg_type,
+             message_kind_name(kind), chan);
+        return (0);
+    }
+
+    if (kind == NavigationMessages) {
+        logv("AA_CH_NAVI msg_type: %04x  len: %d  buf: %p", msg_type, len,
+             buf);
+        hex_dump("AA_CH_NAVI", 80, buf, len);
+        // Trouble with these never ends the session
+        dispatchMessage(entry, chan, buf, len);
+        return (0);
+    }
+    return dispatchMessage(entry, chan, buf, len);
+}
+
+std::vector<HUServer::MessageStats> HUServer::GetMessageStats() const {
+    std::vector<MessageStats> ret;
+    for (int i = 0; i <= s_dispatchEntryCount; i++) {
+        const MessageCounters& counters = m_messageCounters[i];
+        MessageStats st;
+        if (i < s_dispatchEntryCount) {
+            st.kind = message_kind_name(s_dispatchTable[i].kind);
+            st.name = s_dispatchTable[i].name;
+            st.code = s_dispatchTable[i].code;
+        } else {
+            st.kind = message_kind_name(MessageKindCount);
+            st.name = "unknown";
+            st.code = 0;
         }
+        st.calls = counters.calls.load(std::memory_order_relaxed);
+        st.bytes = counters.bytes.load(std::memory_order_relaxed);
+        st.nanoseconds = counters.nanoseconds.load(std::memory_order_relaxed);
+        st.parseFailures =
+            counters.parseFailures.load(std::memory_order_relaxed);
+        ret.push_back(st);
     }
+    return ret;
+}
 
-    logw("Unknown chan: %d", chan);
-    return (0);
+void HUServer::logMessageStats() {
+    std::vector<MessageStats> stats = GetMessageStats();
+    // Most time spent first
+    std::sort(stats.begin(), stats.end(),
+              [](const MessageStats& a, const MessageStats& b) {
+                  return a.nanoseconds > b.nanoseconds;
+              });
+    for (const MessageStats& st : stats) {
+        if (st.calls == 0) {
+            continue;
+        }
+        logi("Messages: %-12s %-28s %8llu calls %10llu bytes %9.3f ms "
+             "%8.2f us/call %llu parse failures",
+             st.kind, st.name, (unsigned long long)st.calls,
+             (unsigned long long)st.bytes, st.nanoseconds / 1e6,
+             st.nanoseconds / 1e3 / st.calls,
+             (unsigned long long)st.parseFailures);
+    }
+}
+
+HUServer::TLSStats HUServer::GetTLSStats() const {
+    TLSStats st;
+    st.cipher = m_tlsCounters.cipher.load(std::memory_order_relaxed);
+    st.records = m_tlsCounters.records.load(std::memory_order_relaxed);
+    st.bytes = m_tlsCounters.bytes.load(std::memory_order_relaxed);
+    st.nanoseconds = m_tlsCounters.nanoseconds.load(std::memory_order_relaxed);
+    return st;
+}
+
+void HUServer::logTLSStats() {
+    TLSStats st = GetTLSStats();
+    if (!st.cipher) {
+        return;
+    }
+    logi("TLS: %s, %llu records, %llu bytes decrypted in %.3f ms, %.1f MB/s",
+         st.cipher, (unsigned long long)st.records,
+         (unsigned long long)st.bytes, st.nanoseconds / 1e6,
+         st.nanoseconds ? st.bytes * 1e3 / st.nanoseconds : 0.0);
 }
 
 int HUServer::queueCommand(
@@ -1197,6 +1612,7 @@ int HUServer::shutdown() {
                 byebye.set_reason(HU::ShutdownRequest::REASON_QUIT);
                 s.sendEncodedMessage(
                     0, ControlChannel, HU_PROTOCOL_MESSAGE::ShutdownRequest, byebye);
+                flushSendBatch();
                 ms_sleep(500);
             }
             s.stop();
@@ -1207,6 +1623,10 @@ int HUServer::shutdown() {
         }
         hu_thread.join();
     }
+    logSendBatchStats();
+    logReceiveStats();
+    logMessageStats();
+    logTLSStats();
 
     if (command_write_fd >= 0) close(command_write_fd);
     command_write_fd = -1;
@@ -1234,6 +1654,11 @@ int HUServer::stop() {  // Sends Byebye, then stops Transport/USBACC/OAP
     // Continue only if started or starting...
     if (iaap_state != hu_STATE_STARTED) return (0);
 
+    // Whatever was batched goes out before the ShutdownRequest, which is
+    // sent directly
+    flushSendBatch();
+    m_batchSends = false;
+
     HU::ShutdownRequest shutdownReq;
     shutdownReq.set_reason(HU::ShutdownRequest::REASON_QUIT);
     sendEncodedMessage(0, ControlChannel, HU_PROTOCOL_MESSAGE::ShutdownRequest,
@@ -1261,7 +1686,11 @@ void HUServer::mainThread() {
 
     int transportFD = transport->GetReadFD();
     int errorfd = transport->GetErrorFD();
+    timeval zero_tv = {0, 0};
     while (!hu_thread_quit_flag) {
+        // Data may already be buffered without the fd being signalled, don't
+        // sleep in that case
+        const bool pending = !m_receiveChunks.empty();
         fd_set sock_set;
         FD_ZERO(&sock_set);
         FD_SET(command_read_fd, &sock_set);
@@ -1272,8 +1701,9 @@ void HUServer::mainThread() {
             FD_SET(errorfd, &sock_set);
         }
 
-        int ret = select(maxfd + 1, &sock_set, NULL, NULL, NULL);
-        if (ret <= 0) {
+        int ret = select(maxfd + 1, &sock_set, NULL, NULL,
+                         pending ? &zero_tv : NULL);
+        if (ret < 0 || (ret == 0 && !pending)) {
             loge("Select failed %d", ret);
             return;
         }
@@ -1282,24 +1712,36 @@ void HUServer::mainThread() {
             hu_thread_quit_flag = true;
             callbacks.DisconnectionOrError();
         } else {
+            // Everything sent from here on goes out in one write at the end
+            m_batchSends = true;
             if (FD_ISSET(command_read_fd, &sock_set)) {
                 logd("Got command_read_fd");
-                IHUAnyThreadInterface::HUThreadCommand* ptr = nullptr;
-                if (ptr = popCommand()) {
-                    logd("Running %p", ptr);
-                    (*ptr)(*this);
-                    delete ptr;
-                }
+                // Run what has been queued up meanwhile too, bounded so
+                // received data isn't starved
+                pollfd command_poll = {command_read_fd, POLLIN, 0};
+                int commands = 0;
+                do {
+                    IHUAnyThreadInterface::HUThreadCommand* ptr = nullptr;
+                    if (ptr = popCommand()) {
+                        logd("Running %p", ptr);
+                        (*ptr)(*this);
+                        delete ptr;
+                    }
+                } while (++commands < 16 && !hu_thread_quit_flag &&
+                         poll(&command_poll, 1, 0) > 0);
             }
-            if (FD_ISSET(transportFD, &sock_set)) {
+            if (pending || FD_ISSET(transportFD, &sock_set)) {
                 // data ready
                 logd("Got transportFD");
                 ret = processReceived(iaap_tra_recv_tmo);
-                if (ret < 0) {
+                // Unless a handler already stopped the session
+                if (ret < 0 && !hu_thread_quit_flag) {
                     loge("hu_aap_recv_process failed %d", ret);
                     stop();
                 }
             }
+            flushSendBatch();
+            m_batchSends = false;
         }
     }
     logd("hu_thread_main exit");
@@ -1319,9 +1761,18 @@ int HUServer::start() {  // Starts Transport/USBACC/OAP, then AA
     }
 
     pthread_setname_np(pthread_self(), "aa_main_thread");
+    m_startUs = hu_time_us();
+
+    // Before the transport, so a capture's seeded random numbers are
+    // never used for the shared context
+    if (prepareSSL() < 0) {
+        return (-1);
+    }
 
     iaap_state = hu_STATE_STARTIN;
     logd("  SET: iaap_state: %d (%s)", iaap_state, state_get(iaap_state));
+    // Left set by the last session, frames would be dropped
+    hu_thread_quit_flag = false;
 
     int ret =
         startTransport();  // Start Transport/USBACC/OAP
@@ -1364,7 +1815,7 @@ int HUServer::start() {  // Starts Transport/USBACC/OAP, then AA
     return (0);
 }
 
-int HUServer::processReceived(int tmo) {  //
+int HUServer::processReceived(int tmo) {
     // Terminate unless started or starting (we need to process when
     // starting)
     if (iaap_state != hu_STATE_STARTED && iaap_state != hu_STATE_STARTIN) {
@@ -1372,172 +1823,197 @@ int HUServer::processReceived(int tmo) {  //
         return (-1);
     }
 
-    int ret = 0;
-    errno = 0;
-    int min_size_hdr = 4;
-    int have_len = 0;  // Length remaining to process for all sub-packets plus
-                       // 4/8 byte headers
-
-    bool has_last = false;
-    bool has_first = false;
-    int chan = -1;
-    while (!has_last) {  // While length remaining to process,... Process Rx
-                         // packet:
-        have_len = receiveTransportPacket(enc_buf, min_size_hdr, tmo);
-        if (have_len == 0 && !has_first) {
-            return 0;
-        }
+    int ret = receiveTransportChunks(tmo);
+    if (ret <= 0) {
+        return (ret);
+    }
 
-        if (have_len < min_size_hdr) {  // If we don't have a full 6 byte header
-                                        // at least...
-            loge("Recv have_len: %d", have_len);
+    int frames = 0;
+    while (!m_receiveChunks.empty()) {
+        // The chunk stays queued while it is parsed. A handler that stops
+        // the session may take the transport and the chunk with it, so
+        // handleFrame() fails then and nothing touches the chunk again.
+        const HUTransportChunk& chunk = *m_receiveChunks.front();
+        ret = m_frameParser.Feed(
+            chunk.data, chunk.len,
+            [this](const HUFrame& frame) { return handleFrame(frame); });
+        if (ret < 0) {
             return (-1);
         }
+        frames += ret;
+        m_receiveChunks.pop_front();
+    }
 
-        if (ena_log_verbo) {
-            logd("Recv while (have_len > 0): %d", have_len);
-            hex_dump("LR: ", 16, enc_buf, have_len);
-        }
-        int cur_chan = (int)enc_buf[0];  // Channel
-        if (cur_chan != chan && chan >= 0) {
-            logd(
-                "Interleaved channels, preserving incomplete packet for chan "
-                "%s",
-                getChannel((ServiceChannels)chan));
-            channel_assembly_buffers[chan] = temp_assembly_buffer;
-            temp_assembly_buffer = NULL;
-            has_first = has_last = false;
-            // return (-1);
-        }
-        chan = cur_chan;
-
-        int flags = enc_buf[1];  // Flags
-        int frame_len = be16toh(*((uint16_t*)&enc_buf[2]));
-
-        logd("Frame flags %i len %i", flags, frame_len);
+    m_receiveStats.wakeups++;
+    m_receiveStats.maxFramesPerWakeup =
+        std::max(m_receiveStats.maxFramesPerWakeup, frames);
+    return frames;
+}
 
-        if (frame_len > MAX_FRAME_PAYLOAD_SIZE) {
-            loge("Too big");
-            return (-1);
-        }
+// Largest total length taken from a first frame's header as it is
+static const size_t MAX_ASSEMBLY_PREALLOC = 4 << 20;
 
-        int header_size = 4;
-        bool has_total_size_header = false;
-        if ((flags & HU_FRAME_FIRST_FRAME) & !(flags & HU_FRAME_LAST_FRAME)) {
-            // if first but not last, next 4 is total size
-            has_total_size_header = true;
-            header_size += 4;
-        }
+int HUServer::handleFrame(const HUFrame& frame) {
+    if (hu_thread_quit_flag ||
+        (iaap_state != hu_STATE_STARTED && iaap_state != hu_STATE_STARTIN)) {
+        // Stopped by an earlier message, drop the rest
+        return (-1);
+    }
+    if (ena_log_verbo) {
+        logd("Frame chan %d flags %d len %d", frame.chan, frame.flags,
+             frame.len);
+    }
 
-        int remaining_bytes_in_frame = (frame_len + header_size) - have_len;
-        while (remaining_bytes_in_frame > 0) {
-            logd("Getting more %i", remaining_bytes_in_frame);
-            int got_bytes =
-                receiveTransportPacket(&enc_buf[have_len], remaining_bytes_in_frame,
-                                tmo);  // Get Rx packet from Transport
-            if (got_bytes <
-                0) {  // If we don't have a full 6 byte header at least...
-                loge("Recv got_bytes: %d", got_bytes);
-                return (-1);
-            }
-            have_len += got_bytes;
-            remaining_bytes_in_frame -= got_bytes;
+    AssemblySlot& slot = m_assembly[frame.chan];
+    if (m_assemblingChannels > (slot.active ? 1 : 0)) {
+        m_assemblyStats.interleaved++;
+    }
+    if (frame.flags & HU_FRAME_FIRST_FRAME) {
+        if (slot.active) {
+            // The last message never got its last frame
+            m_assemblyStats.abandoned++;
+            releaseAssembly(slot);
         }
-
-        auto buffer = channel_assembly_buffers.find(chan);
-        if (buffer !=
-            channel_assembly_buffers
-                .end())  // Have old buffer with incomplete data for channel
-        {
-            logd("Found existing buffer for chan %s", getChannel((ServiceChannels)chan));
-            temp_assembly_buffer = buffer->second;
-        } else if (temp_assembly_buffer ==
-                   NULL)  // Old buffer had incomplete data and was preserved,
-                          // need
-        // to create new one
-        {
-            logd("Created new buffer for chan %s", getChannel((ServiceChannels)chan));
-            temp_assembly_buffer = new std::vector<uint8_t>();
+        // Encrypted, the total counts TLS overhead too, so it's enough for
+        // the plaintext. It's only trusted that far, past that the slot
+        // grows as frames come in.
+        size_t expected =
+            std::min<size_t>(frame.totalLen, MAX_ASSEMBLY_PREALLOC);
+        reserveAssembly(slot, std::max<size_t>(expected, frame.len));
+        if (!(frame.flags & HU_FRAME_LAST_FRAME)) {
+            slot.active = true;
+            m_assemblingChannels++;
+            m_assemblyStats.fragmented++;
         }
+    } else if (!slot.active) {
+        loge("No HU_FRAME_FIRST_FRAME, and no incomplete buffer for chan %s",
+             getChannel((ServiceChannels)frame.chan));
+        return (-1);
+    } else if (slot.len + frame.len > slot.buffer.capacity) {
+        m_assemblyStats.grown++;
+        // Doubling, so a message without a usable total isn't copied over
+        // and over
+        reserveAssembly(slot, std::max(slot.len + frame.len,
+                                       slot.buffer.capacity * 2));
+    }
 
-        if (flags & HU_FRAME_FIRST_FRAME) {
-            temp_assembly_buffer->clear();  // It's the first frame and old data
-                                            // may still be there, so clear
-        } else if (!has_first &&
-                   temp_assembly_buffer->size() ==
-                       0)  // No first frame yet and buffer is empty
-        {
-            loge(
-                "No HU_FRAME_FIRST_FRAME, and no incomplete buffer for chan %s",
-                getChannel((ServiceChannels)chan));
+    byte* dest = &slot.buffer.data[slot.len];
+    if (frame.flags & HU_FRAME_ENCRYPTED) {
+        int bytes_written = BIO_write(m_sslWriteBio, frame.payload,
+                                      frame.len);  // Write encrypted to SSL input BIO
+        if (bytes_written <= 0) {
+            loge("BIO_write() bytes_written: %d", bytes_written);
             return (-1);
         }
-
-        has_first = true;
-        has_last = (flags & HU_FRAME_LAST_FRAME) != 0;
-
-        if (has_total_size_header) {
-            uint32_t total_size = be32toh(*((uint32_t*)&enc_buf[4]));
-            logd("First only, total len %u", total_size);
-            temp_assembly_buffer->reserve(total_size);
-        } else {
-            temp_assembly_buffer->reserve(frame_len);
+        if (bytes_written != frame.len)
+            loge("BIO_write() len: %d  bytes_written: %d  chan: %d %s",
+                 frame.len, bytes_written, frame.chan,
+                 getChannel((ServiceChannels)frame.chan));
+
+        auto begin = std::chrono::steady_clock::now();
+        int bytes_read = SSL_read(m_ssl, dest,
+                                  frame.len);  // Read decrypted to decrypted rx buf
+        auto elapsed = std::chrono::steady_clock::now() - begin;
+        if (bytes_read <= 0 || bytes_read > frame.len) {
+            loge("SSL_read() bytes_read: %d  errno: %d", bytes_read, errno);
+            logSSLReturnCode(bytes_read);
+            return (-1);  // Fatal so return error and de-initialize; Should
+                          // we be able to recover, if Transport data got
+                          // corrupted ??
         }
+        slot.len += bytes_read;
+        m_tlsCounters.records.fetch_add(1, std::memory_order_relaxed);
+        m_tlsCounters.bytes.fetch_add(bytes_read, std::memory_order_relaxed);
+        m_tlsCounters.nanoseconds.fetch_add(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed)
+                .count(),
+            std::memory_order_relaxed);
+    } else {
+        memcpy(dest, frame.payload, frame.len);
+        slot.len += frame.len;
+    }
 
-        if (flags & HU_FRAME_ENCRYPTED) {
-            size_t cur_vec = temp_assembly_buffer->size();
-            temp_assembly_buffer->resize(cur_vec + frame_len);  // just incase
-
-            int bytes_written =
-                BIO_write(m_sslWriteBio, &enc_buf[header_size],
-                          frame_len);  // Write encrypted to SSL input BIO
-            if (bytes_written <= 0) {
-                loge("BIO_write() bytes_written: %d", bytes_written);
-                return (-1);
-            }
-            if (bytes_written != frame_len)
-                loge("BIO_write() len: %d  bytes_written: %d  chan: %d %s",
-                     frame_len, bytes_written, chan, getChannel((ServiceChannels)chan));
-            else if (ena_log_verbo)
-                logd("BIO_write() len: %d  bytes_written: %d  chan: %d %s",
-                     frame_len, bytes_written, chan, getChannel((ServiceChannels)chan));
-
-            int bytes_read =
-                SSL_read(m_ssl, &(*temp_assembly_buffer)[cur_vec],
-                         frame_len);  // Read decrypted to decrypted rx buf
-            if (bytes_read <= 0 || bytes_read > frame_len) {
-                loge("SSL_read() bytes_read: %d  errno: %d", bytes_read, errno);
-                logSSLReturnCode(bytes_read);
-                return (-1);  // Fatal so return error and de-initialize; Should
-                              // we be able to recover, if Transport data got
-                              // corrupted ??
-            }
-            if (ena_log_verbo) logd("SSL_read() bytes_read: %d", bytes_read);
+    if (!(frame.flags & HU_FRAME_LAST_FRAME)) {
+        return (0);
+    }
 
-            temp_assembly_buffer->resize(cur_vec + bytes_read);
+    m_assemblyStats.messages++;
+    m_assemblyStats.peakMessage =
+        std::max(m_assemblyStats.peakMessage, slot.len);
+    int ret = 0;
+    if (slot.len >= 2) {
+        byte* message = slot.buffer.data.get();
+        uint16_t msg_type = be16toh(*reinterpret_cast<uint16_t*>(message));
+        if (m_mediaFastPath && iaap_state == hu_STATE_STARTED &&
+            msg_type <= (uint16_t)HU_PROTOCOL_MESSAGE::MediaData &&
+            isMediaSinkChannel(frame.chan)) {
+            // Counted with the MediaData handlers it stands in for
+            ret = dispatchMessage(
+                findHandler(ControlMessages, msg_type),
+                (ServiceChannels)frame.chan, &message[2], slot.len - 2,
+                msg_type == (uint16_t)HU_PROTOCOL_MESSAGE::MediaData
+                    ? &HUServer::fastMediaData
+                    : &HUServer::fastMediaDataWithTimestamp);
         } else {
-            temp_assembly_buffer->insert(temp_assembly_buffer->end(),
-                                         &enc_buf[header_size],
-                                         &enc_buf[frame_len + header_size]);
+            ret = processMessage((ServiceChannels)frame.chan, msg_type,
+                                 &message[2], slot.len - 2);
         }
     }
+    releaseAssembly(slot);
+    if (hu_thread_quit_flag ||
+        (iaap_state != hu_STATE_STARTED && iaap_state != hu_STATE_STARTIN)) {
+        // The handler stopped the session, the frame's data may be gone
+        return (-1);
+    }
+    if (ret < 0) {  // If error...
+        loge("Error iaap_msg_process() ret: %d  ", ret);
+        return (ret);
+    }
+    return (0);
+}
 
-    const int buf_len = temp_assembly_buffer->size();
-    if (buf_len >= 2) {
-        uint16_t msg_type =
-            be16toh(*reinterpret_cast<uint16_t*>(temp_assembly_buffer->data()));
+void HUServer::reserveAssembly(AssemblySlot& slot, size_t size) {
+    if (slot.buffer.capacity >= size) {
+        return;
+    }
+    HUBuffer buffer = m_assemblyPool.Acquire(size);
+    if (slot.len > 0) {
+        memcpy(buffer.data.get(), slot.buffer.data.get(), slot.len);
+    }
+    m_assemblyPool.Release(std::move(slot.buffer));
+    slot.buffer = std::move(buffer);
+}
 
-        ret = processMessage(
-            (ServiceChannels)chan, msg_type, &(*temp_assembly_buffer)[2],
-            buf_len - 2);  // Decrypt & Process 1 received encrypted message
-        if (ret < 0 && iaap_state != hu_STATE_STOPPED) {  // If error...
-            loge("Error iaap_msg_process() ret: %d  ", ret);
-            return (ret);
-        }
+void HUServer::releaseAssembly(AssemblySlot& slot) {
+    if (slot.active) {
+        slot.active = false;
+        m_assemblingChannels--;
     }
+    slot.len = 0;
+    m_assemblyPool.Release(std::move(slot.buffer));
+}
 
-    return (ret);  // Return value from the last iaap_recv_dec_process() call;
-                   // should be 0
+void HUServer::logReceiveStats() {
+    const HUFrameParser::Stats& st = m_frameParser.GetStats();
+    if (m_receiveStats.wakeups == 0) {
+        return;
+    }
+    logi("Receive: %llu frames in %llu wakeups, %.2f frames per wakeup, "
+         "max %d, %llu carried over",
+         (unsigned long long)st.frames,
+         (unsigned long long)m_receiveStats.wakeups,
+         (double)st.frames / m_receiveStats.wakeups,
+         m_receiveStats.maxFramesPerWakeup, (unsigned long long)st.carried);
+
+    const AssemblyStats& as = m_assemblyStats;
+    const HUBufferPool::Stats& ps = m_assemblyPool.GetStats();
+    logi("Reassembly: %llu messages, %llu in several frames, %llu frames "
+         "interleaved with another channel, %llu grown, %llu abandoned, "
+         "peak %zu bytes, %llu of %llu buffers reused",
+         (unsigned long long)as.messages, (unsigned long long)as.fragmented,
+         (unsigned long long)as.interleaved, (unsigned long long)as.grown,
+         (unsigned long long)as.abandoned, as.peakMessage,
+         (unsigned long long)ps.reused, (unsigned long long)ps.acquired);
 }
 
 std::map<std::string, int> HUServer::getResolutions() {
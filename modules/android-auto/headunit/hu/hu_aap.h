@@ -1,9 +1,16 @@
 #pragma once
 #include <functional>
+#include <sys/uio.h>
+#include <atomic>
+#include <deque>
 #include <map>
+#include <memory>
 #include <string>
 #include <thread>
+#include <vector>
 #include "hu.pb.h"
+#include "hu_frame.h"
+#include "hu_pool.h"
 #include "hu_ssl.h"
 #include "hu_uti.h"
 
@@ -82,29 +89,115 @@
         }
     }
 
-        enum HU_FRAME_FLAGS {
-            HU_FRAME_FIRST_FRAME = 1 << 0,
-            HU_FRAME_LAST_FRAME = 1 << 1,
-            HU_FRAME_CONTROL_MESSAGE = 1 << 2,
-            HU_FRAME_ENCRYPTED = 1 << 3,
-            };
+    class HUTransportChunk;
 
-#define MAX_FRAME_PAYLOAD_SIZE 0x4000
-// At 16 bytes for header
-#define MAX_FRAME_SIZE 0x4100
+    // Takes back chunks once their consumer is done with them
+    class HUTransportChunkPool {
+    public:
+        virtual ~HUTransportChunkPool() {}
+        virtual void Recycle(HUTransportChunk* chunk) = 0;
+    };
+
+    // A piece of the received byte stream, handed over by the transport.
+    // Owned by whoever holds the pointer; releasing it returns the buffer to
+    // the transport, so all chunks must be released before the transport
+    // is stopped.
+    class HUTransportChunk {
+    public:
+        byte* data = nullptr;
+        int len = 0;       // bytes received
+        int capacity = 0;  // size of data
+        HUTransportChunkPool* pool = nullptr;
+    };
+
+    struct HUTransportChunkRelease {
+        inline void operator()(HUTransportChunk* chunk) const {
+            chunk->pool->Recycle(chunk);
+        }
+    };
+    typedef std::unique_ptr<HUTransportChunk, HUTransportChunkRelease>
+        HUTransportChunkPtr;
+
+    // The payload of a message to send, written in place by whoever has the
+    // data, with headroom in front for the message code and a media
+    // timestamp. The send path only prepends those, the payload itself
+    // isn't copied again before it is encrypted. Sending uses up the
+    // headroom, Reserve() it again for the next message.
+    class HUSendBuffer {
+    public:
+        enum { HEADROOM = 2 + 8 };  // message code, timestamp
+
+        explicit HUSendBuffer(size_t capacity = 0) { Reserve(capacity); }
+
+        // Room for len payload bytes, contents undefined. Drops what was
+        // prepended.
+        inline byte* Reserve(size_t len) {
+            if (HEADROOM + len > m_capacity) {
+                m_capacity = HEADROOM + len;
+                m_data.reset(new byte[m_capacity]);
+            }
+            m_start = HEADROOM;
+            m_len = len;
+            return &m_data[HEADROOM];
+        }
+        // len bytes in front of what is there, nullptr once the headroom
+        // is used up
+        inline byte* Prepend(size_t len) {
+            if (len > m_start) {
+                return nullptr;
+            }
+            m_start -= len;
+            m_len += len;
+            return &m_data[m_start];
+        }
+        inline byte* Data() { return &m_data[m_start]; }
+        inline size_t Len() const { return m_len; }
+
+    private:
+        std::unique_ptr<byte[]> m_data;
+        size_t m_capacity = 0;
+        size_t m_start = HEADROOM;
+        size_t m_len = 0;  // from m_start
+    };
+
+    // Where SSL_write puts the record it makes once a connection is up, see
+    // HUServer::encryptRecord()
+    struct HURecordSink {
+        bool active = false;  // the SSL writes into it
+        byte* out = nullptr;
+        size_t room = 0;
+        size_t len = 0;
+    };
 
     class HUTransportStream {
     protected:
+        // Signalled when Poll() has something to hand over
         int readfd = -1;
         // optional if required for pipe, etc
         int errorfd = -1;
 
     public:
+        typedef std::function<void(int result)> WriteCompletion;
+        typedef std::function<void(HUTransportChunkPtr chunk)>
+            ReceiveCallback;
+
         virtual ~HUTransportStream() {}
         inline HUTransportStream(std::map<std::string, std::string>) {}
         virtual int Start() = 0;
         virtual int Stop() = 0;
-        virtual int Write(const byte* buf, int len, int tmo) = 0;
+
+        // Queues iov as one write and returns once the transport no longer
+        // needs the iovecs. A transport with a size limit per write may
+        // send the entries separately, none is bigger than MAX_FRAME_SIZE.
+        // Waits at most tmo ms if the transport is backed up. done, if
+        // given, is called exactly once with the byte count or -1, from any
+        // thread and possibly before SubmitWrite returns. Returns -1 if the
+        // write couldn't be queued, done gets -1 then too.
+        virtual int SubmitWrite(const iovec* iov, int iovcnt, int tmo,
+                                WriteCompletion done = nullptr) = 0;
+        // Hands every chunk received so far to callback, on the calling
+        // thread. Returns the number of chunks, -1 on error or end of stream.
+        virtual int Poll(const ReceiveCallback& callback) = 0;
 
         inline int GetReadFD() { return readfd; }
         inline int GetErrorFD() { return errorfd; }
@@ -136,6 +229,12 @@
                                            uint16_t messageCode, uint64_t timeStamp,
                                            const byte* buffer, int bufferLen,
                                            int overrideTimeout = -1) = 0;
+        // Like sendEncodedMediaPacket without copying the payload, code and
+        // timestamp go in the buffer's headroom
+        virtual int sendEncodedMediaBuffer(int retry, ServiceChannels chan,
+                                           uint16_t messageCode, uint64_t timeStamp,
+                                           HUSendBuffer& buffer,
+                                           int overrideTimeout = -1) = 0;
         virtual int sendUnencodedBlob(int retry, ServiceChannels chan, uint16_t messageCode,
                                       const byte* buffer, int bufferLen,
                                       int overrideTimeout = -1) = 0;
@@ -162,6 +261,15 @@
                 bufferLen, overrideTimeout);
         }
 
+        template <typename EnumType>
+        inline int sendEncodedMediaBuffer(int retry, ServiceChannels chan, EnumType messageCode,
+                                          uint64_t timeStamp, HUSendBuffer& buffer,
+                                          int overrideTimeout = -1) {
+            return sendEncodedMediaBuffer(
+                retry, chan, static_cast<uint16_t>(messageCode), timeStamp, buffer,
+                overrideTimeout);
+        }
+
         template <typename EnumType>
         inline int sendUnencodedBlob(int retry, ServiceChannels chan, EnumType messageCode,
                                      const byte* buffer, int bufferLen,
@@ -253,12 +361,38 @@
 
         HUServer(IHUConnectionThreadEventCallbacks& callbacks,
                  std::map<std::string, std::string>);
-        virtual ~HUServer() { shutdown(); }
+        virtual ~HUServer() {
+            shutdown();
+            freeSSL();
+        }
 
         inline IHUAnyThreadInterface& GetAnyThreadInterface() { return *this; }
         static std::map<std::string, int> getResolutions();
         static std::map<std::string, int> getFPS();
 
+        // Handled messages so far, one entry per message type the HU
+        // knows plus one for the rest. Can be called from any thread.
+        struct MessageStats {
+            const char* kind;  // "control", "media", ...
+            const char* name;
+            uint16_t code;
+            uint64_t calls;
+            uint64_t bytes;
+            uint64_t nanoseconds;  // in the handler, callbacks included
+            uint64_t parseFailures;
+        };
+        std::vector<MessageStats> GetMessageStats() const;
+
+        // The cipher the phone picked and what was decrypted with it so far,
+        // received frames only. Can be called from any thread.
+        struct TLSStats {
+            const char* cipher;  // OpenSSL name, nullptr before a handshake
+            uint64_t records;
+            uint64_t bytes;        // plaintext
+            uint64_t nanoseconds;  // in SSL_read
+        };
+        TLSStats GetTLSStats() const;
+
     protected:
         IHUConnectionThreadEventCallbacks& callbacks;
         std::unique_ptr<HUTransportStream> transport;
@@ -267,9 +401,16 @@
             150;  // 100;//1;//10;//100;//250;//100;//250;//100;//25;
             // // 10 doesn't work ? 100 does
         int iaap_tra_send_tmo = 500;  // 2;//25;//250;//500;//100;//500;//250;
-        std::vector<uint8_t>* temp_assembly_buffer = new std::vector<uint8_t>();
-        std::map<int, std::vector<uint8_t>*> channel_assembly_buffers;
+        bool m_logPackets = true;  // log_packets setting
+        bool m_logSends = false;   // log_sends setting
+        // Scratch space for encoding outgoing messages, send path only
+        std::vector<uint8_t> send_buffer;  // unencrypted ones
+        HUSendBuffer m_sendMessage;
         byte enc_buf[MAX_FRAME_SIZE] = {0};
+        // Encrypted messages of several frames and where each frame is in
+        // them, send path only
+        HUBufferPool m_sendPool;
+        std::vector<iovec> m_sendFrames;
         int32_t channel_session_id[MaximumChannel] = {0};
 
         std::thread hu_thread;
@@ -285,35 +426,198 @@
         void mainThread();
 
         SSL* m_ssl = nullptr;
-        SSL_CTX* m_sslContext = nullptr;
-        SSL_METHOD* m_sslMethod = nullptr;
         BIO* m_sslWriteBio = nullptr;
-        BIO* m_sslReadBio = nullptr;
+        BIO* m_sslReadBio = nullptr;  // a record sink once connected
+        HURecordSink m_recordSink;
+        // Swaps the memory BIO the handshake used for a record sink, which
+        // saves a copy of every record. Keeps the memory BIO if it can't.
+        void useRecordSink();
+        // Encrypts len bytes into one record at out. Returns its length,
+        // -1 if it doesn't fit in room or SSL fails.
+        int encryptRecord(const byte* buf, int len, byte* out, size_t room);
 
         void logSSLReturnCode(int ret);
         void logSSLInfo();
 
+        // Sets up what all sessions share, the first call in the process
+        // does the work. Resolves m_cipherList too.
+        int prepareSSL();
+        void freeSSL();
+        uint64_t m_startUs = 0;     // start() was called, hu_time_us
+        uint64_t m_sslSetupUs = 0;  // making this session's SSL
+        // tls_resume setting, off while capturing or replaying since a
+        // capture has to hold a whole handshake
+        bool m_tlsResume = true;
+        // ssl_cipher_list setting, "" for OpenSSL's default list
+        std::string m_cipherList;
+        // Written by the HU thread only, read from anywhere
+        struct TLSCounters {
+            std::atomic<const char*> cipher{nullptr};
+            std::atomic<uint64_t> records{0};
+            std::atomic<uint64_t> bytes{0};
+            std::atomic<uint64_t> nanoseconds{0};
+        };
+        TLSCounters m_tlsCounters;
+        void logTLSStats();
+        bool m_sessionOffered = false;  // a cached session went in the hello
+        uint64_t m_handshakeBeginUs = 0;
+        void forgetSSLSession();
+        // Counts the handshake and keeps its session for the next one
+        void handshakeDone();
         int beginSSLHandshake();
         int sendSSLHandshakePacket();
         int handleSSLHandshake(byte* buf, int len);
 
+        // Frames produced while the HU thread handles one wakeup are gathered
+        // here and handed to the transport in a single write
+        struct SendBatchStats {
+            uint64_t frames = 0;
+            uint64_t writes = 0;
+            int maxFramesPerWrite = 0;
+            uint64_t messages = 0;  // sent in several frames
+            uint64_t messageFrames = 0;
+            uint64_t bytes = 0;  // handed to the transport
+            // Bytes memcpy'd on the way from the caller to the transport,
+            // what OpenSSL and the transport copy themselves not included
+            uint64_t copiedBytes = 0;
+        };
+        bool m_batchSends = false;
+        // Frames are encrypted straight into it
+        byte m_sendBatch[MAX_FRAME_SIZE];
+        int m_sendBatchLen = 0;
+        int m_sendBatchFrames = 0;
+        int m_sendBatchTimeout = 0;
+        SendBatchStats m_sendBatchStats;
+        int flushSendBatch();
+        void logSendBatchStats();
+
         int startTransport();
         int stopTransport();
-        int receiveTransportPacket(byte* buf, int len,
-                                   int tmo);  // Used by intern, hu_ssl
-        int sendTransportPacket(int retry, byte* buf, int len,
-                                int tmo);  // Used by intern, hu_ssl
+        // Counted with hu_capture_session_begin() while the transport runs
+        bool m_sessionRegistered = false;
+        bool m_sessionSeeded = false;
+        // Received chunks not parsed yet
+        std::deque<HUTransportChunkPtr> m_receiveChunks;
+        HUFrameParser m_frameParser;
+        struct ReceiveStats {
+            uint64_t wakeups = 0;
+            int maxFramesPerWakeup = 0;
+        };
+        ReceiveStats m_receiveStats;
+        void logReceiveStats();
+
+        // A message being put together from frames, one slot per channel.
+        // The buffer comes from m_assemblyPool, sized by the total length in
+        // the first frame.
+        struct AssemblySlot {
+            HUBuffer buffer;
+            size_t len = 0;
+            bool active = false;  // between the first and last of several
+        };
+        struct AssemblyStats {
+            uint64_t messages = 0;
+            uint64_t fragmented = 0;   // messages in several frames
+            uint64_t interleaved = 0;  // frames arriving while another
+                                       // channel's message was incomplete
+            uint64_t grown = 0;        // longer than the first frame said
+            uint64_t abandoned = 0;    // restarted before the last frame
+            size_t peakMessage = 0;
+        };
+        AssemblySlot m_assembly[MaximumChannel];
+        int m_assemblingChannels = 0;  // slots active across frames
+        HUBufferPool m_assemblyPool;
+        AssemblyStats m_assemblyStats;
+        void reserveAssembly(AssemblySlot& slot, size_t size);
+        void releaseAssembly(AssemblySlot& slot);
+
+        // Waits up to tmo ms if nothing is buffered yet, then hands over
+        // what the transport has
+        int receiveTransportChunks(int tmo);
+        int handleFrame(const HUFrame& frame);
+
+        // MediaData and MediaDataWithTimestamp on the sink channels skip
+        // MessageFilter and processMessage, and are acked with an encoding
+        // prepared once per media session
+        struct PreparedAck {
+            byte data[16];
+            int len = 0;  // 0 until prepared for the current session
+        };
+        bool m_mediaFastPath = true;  // media_fast_path setting
+        PreparedAck m_mediaAck[Audio2Channel + 1];
+        static inline bool isMediaSinkChannel(int chan) {
+            return chan >= VideoChannel && chan <= Audio2Channel;
+        }
+        int fastMediaDataWithTimestamp(ServiceChannels chan, byte* buf, int len);
+        int fastMediaData(ServiceChannels chan, byte* buf, int len);
+        int fastMediaPacket(ServiceChannels chan, uint64_t timestamp, byte* buf,
+                            int len);
+        int sendMediaAck(ServiceChannels chan);
+        // frames is how many frames iov holds, for the stats
+        int sendTransportPacket(int retry, const iovec* iov, int iovcnt,
+                                int tmo, int frames = 1);
+        inline int sendTransportPacket(int retry, byte* buf, int len,
+                                       int tmo) {  // Used by intern, hu_ssl
+            iovec iov = {buf, (size_t)len};
+            return sendTransportPacket(retry, &iov, 1, tmo);
+        }
 
         int processMessage(ServiceChannels chan, uint16_t msg_type, byte* buf, int len);
+
+        // processMessage looks handlers up by the kind of channel a message
+        // came on and its code. Codes below 0x8000 are the same on every
+        // channel, the others mean something per kind.
+        enum MessageKind {
+            InitMessages,  // before the TLS handshake is done
+            ControlMessages,
+            SensorMessages,
+            InputMessages,
+            BluetoothMessages,
+            PhoneStatusMessages,
+            NotificationMessages,
+            MediaMessages,
+            NavigationMessages,
+            MessageKindCount
+        };
+        enum { MESSAGE_SLOTS = 32 };
+        typedef int (HUServer::*MessageHandler)(ServiceChannels chan, byte* buf,
+                                                int len);
+        struct DispatchEntry {
+            MessageKind kind;
+            uint16_t code;
+            const char* name;
+            MessageHandler handler;
+        };
+        static const DispatchEntry s_dispatchTable[];
+        static const int s_dispatchEntryCount;  // taken from the table
+        // Written by the HU thread only, read from anywhere
+        struct MessageCounters {
+            std::atomic<uint64_t> calls{0};
+            std::atomic<uint64_t> bytes{0};
+            std::atomic<uint64_t> nanoseconds{0};
+            std::atomic<uint64_t> parseFailures{0};
+        };
+        // One per table entry, the last one counts messages without a handler
+        std::unique_ptr<MessageCounters[]> m_messageCounters;
+        MessageCounters* m_dispatching = nullptr;  // while a handler runs
+        // s_dispatchTable index, s_dispatchEntryCount if there is no handler
+        static int findHandler(MessageKind kind, uint16_t msg_type);
+        // Runs the entry's handler, or the one given, and counts it there
+        int dispatchMessage(int entry, ServiceChannels chan, byte* buf, int len,
+                            MessageHandler handler = nullptr);
+        // ParseFromArray, failures are counted against the running handler
+        bool parseMessage(google::protobuf::MessageLite& message,
+                          const byte* buf, int len);
+        void logMessageStats();
         int sendEncoded(int retry, ServiceChannels chan, byte* buf, int len,
                         int overrideTimeout = -1);  // Used by intern, hu_jni     //
             // Encrypted Send
         int sendUnencoded(int retry, ServiceChannels chan, byte* buf, int len,
                           int overrideTimeout = -1);
 
-        int processReceived(int tmo);  // Used by          hu_mai,  hu_jni     //
-            // Process 1 encrypted receive message set:
-            // Respond to decrypted message
+        // Decrypts and handles every complete message received so far,
+        // waiting up to tmo ms if there is nothing. Returns the number of
+        // frames, -1 on error.
+        int processReceived(int tmo);
         virtual int sendEncodedMessage(int retry, ServiceChannels chan, uint16_t messageCode,
                                        const google::protobuf::MessageLite& message,
                                        int overrideTimeout = -1) override;
@@ -321,6 +625,10 @@
                                            uint16_t messageCode, uint64_t timeStamp,
                                            const byte* buffer, int bufferLen,
                                            int overrideTimeout = -1) override;
+        virtual int sendEncodedMediaBuffer(int retry, ServiceChannels chan,
+                                           uint16_t messageCode, uint64_t timeStamp,
+                                           HUSendBuffer& buffer,
+                                           int overrideTimeout = -1) override;
         virtual int sendUnencodedBlob(int retry, ServiceChannels chan, uint16_t messageCode,
                                       const byte* buffer, int bufferLen,
                                       int overrideTimeout = -1) override;
@@ -330,12 +638,14 @@
             int overrideTimeout = -1) override;
         virtual int stop() override;
 
+        using IHUConnectionThreadInterface::sendEncodedMediaBuffer;
         using IHUConnectionThreadInterface::sendEncodedMediaPacket;
         using IHUConnectionThreadInterface::sendEncodedMessage;
         using IHUConnectionThreadInterface::sendUnencodedBlob;
         using IHUConnectionThreadInterface::sendUnencodedMessage;
 
         int handle_VersionResponse(ServiceChannels chan, byte* buf, int len);
+        int handle_SSLHandshake(ServiceChannels chan, byte* buf, int len);
         int handle_ServiceDiscoveryRequest(ServiceChannels chan, byte* buf, int len);
         int handle_PingRequest(ServiceChannels chan, byte* buf, int len);
         int handle_NavigationFocusRequest(ServiceChannels chan, byte* buf, int len);
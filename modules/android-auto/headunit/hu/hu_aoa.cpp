@@ -0,0 +1,348 @@
+#define LOGTAG "hu_aoa"
+#include "hu_aoa.h"
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <set>
+#include <thread>
+
+using namespace AndroidAuto;
+
+static unsigned char AAP_VAL_MAN[] = "Android";
+static unsigned char AAP_VAL_MOD[] = "Android Auto";
+static unsigned char AAP_VAL_DESC[] = "Android Auto";
+static unsigned char AAP_VAL_VER[] = "2.0.1";
+static unsigned char AAP_VAL_URI[] =
+    "https://github.com/viktorgino/libheadunit";
+static unsigned char AAP_VAL_SERIAL[] = "HU-AAAAAA001";
+
+#define ACC_IDX_MAN 0     // Manufacturer
+#define ACC_IDX_MOD 1     // Model
+#define ACC_IDX_DESC 2    // Model
+#define ACC_IDX_VER 3     // Model
+#define ACC_IDX_URI 4     // Model
+#define ACC_IDX_SERIAL 5  // Model
+
+#define ACC_REQ_GET_PROTOCOL 51
+#define ACC_REQ_SEND_STRING 52
+#define ACC_REQ_START 53
+
+#define VEN_ID_GOOGLE 0x18D1
+#define DEV_ID_OAP 0x2D00
+#define DEV_ID_OAP_WITH_ADB 0x2D01
+
+#define USB_DIR_IN 0x80
+#define USB_DIR_OUT 0x00
+#define USB_TYPE_VENDOR 0x40
+
+#define AOA_STEP_TIMEOUT 1000
+
+// based on http://source.android.com/devices/accessories/aoa.html
+struct AOAStep {
+    const char* name;
+    uint8_t req_type;
+    uint8_t req_val;
+    uint16_t idx;
+    unsigned char* data;
+    uint16_t len;
+};
+
+static const AOAStep aoa_steps[] = {
+    {"GET_PROTOCOL", USB_DIR_IN | USB_TYPE_VENDOR, ACC_REQ_GET_PROTOCOL, 0,
+     nullptr, sizeof(uint16_t)},
+    {"ACC_IDX_MAN", USB_DIR_OUT | USB_TYPE_VENDOR, ACC_REQ_SEND_STRING,
+     ACC_IDX_MAN, AAP_VAL_MAN, sizeof(AAP_VAL_MAN)},
+    {"ACC_IDX_MOD", USB_DIR_OUT | USB_TYPE_VENDOR, ACC_REQ_SEND_STRING,
+     ACC_IDX_MOD, AAP_VAL_MOD, sizeof(AAP_VAL_MOD)},
+    {"ACC_IDX_DESC", USB_DIR_OUT | USB_TYPE_VENDOR, ACC_REQ_SEND_STRING,
+     ACC_IDX_DESC, AAP_VAL_DESC, sizeof(AAP_VAL_DESC)},
+    {"ACC_IDX_VER", USB_DIR_OUT | USB_TYPE_VENDOR, ACC_REQ_SEND_STRING,
+     ACC_IDX_VER, AAP_VAL_VER, sizeof(AAP_VAL_VER)},
+    {"ACC_IDX_URI", USB_DIR_OUT | USB_TYPE_VENDOR, ACC_REQ_SEND_STRING,
+     ACC_IDX_URI, AAP_VAL_URI, sizeof(AAP_VAL_URI)},
+    {"ACC_IDX_SERIAL", USB_DIR_OUT | USB_TYPE_VENDOR, ACC_REQ_SEND_STRING,
+     ACC_IDX_SERIAL, AAP_VAL_SERIAL, sizeof(AAP_VAL_SERIAL)},
+    {"ACC_REQ_START", USB_DIR_OUT | USB_TYPE_VENDOR, ACC_REQ_START, 0, nullptr,
+     0},
+};
+static const int aoa_step_count = sizeof(aoa_steps) / sizeof(aoa_steps[0]);
+
+// vendor << 16 | product of devices that don't speak AOA, shared by every
+// switcher so the transport's fallback path benefits from the watcher's
+static std::mutex non_accessory_lock;
+static std::set<uint32_t> non_accessory_devices;
+
+static inline uint32_t device_key(uint16_t vendor, uint16_t product) {
+    return (uint32_t)vendor << 16 | product;
+}
+
+struct HUAccessorySwitcher::DeviceProbe {
+    HUAccessorySwitcher* owner = nullptr;
+    libusb_device* device = nullptr;
+    libusb_device_handle* handle = nullptr;
+    libusb_transfer* transfer = nullptr;
+    std::vector<byte> buffer;
+    uint16_t vendor = 0;
+    uint16_t product = 0;
+    int step = 0;
+    bool inFlight = false;
+    uint64_t startTime = 0;
+    uint64_t stepStartTime = 0;
+    uint64_t stepTimeUs[aoa_step_count] = {0};
+};
+
+HUAccessorySwitcher::HUAccessorySwitcher(libusb_context* usbContext)
+    : m_usbContext(usbContext) {}
+
+HUAccessorySwitcher::~HUAccessorySwitcher() {
+    for (auto& probe : m_probes) {
+        if (probe->inFlight) {
+            libusb_cancel_transfer(probe->transfer);
+        }
+    }
+    Wait(1000);
+    for (auto& probe : m_probes) {
+        if (probe->inFlight) {
+            // libusb still owns the transfer, leaking is the only safe option
+            loge("AOA transfer still pending after cancel, leaking it");
+            probe.release();
+        }
+    }
+}
+
+bool HUAccessorySwitcher::IsAccessory(uint16_t vendor, uint16_t product) {
+    return vendor == VEN_ID_GOOGLE &&
+           (product == DEV_ID_OAP || product == DEV_ID_OAP_WITH_ADB);
+}
+
+int HUAccessorySwitcher::Probe(libusb_device* device) {
+    libusb_device_descriptor desc;
+    int usb_err = libusb_get_device_descriptor(device, &desc);
+    if (usb_err < 0) {
+        loge("Error getting descriptor");
+        return -1;
+    }
+    if (desc.bDeviceClass == LIBUSB_CLASS_HUB ||
+        IsAccessory(desc.idVendor, desc.idProduct)) {
+        return -1;
+    }
+    {
+        std::lock_guard<std::mutex> lock(non_accessory_lock);
+        if (non_accessory_devices.count(device_key(desc.idVendor, desc.idProduct))) {
+            logv("Skipping non-AOA device 0x%04x : 0x%04x", desc.idVendor,
+                 desc.idProduct);
+            return -1;
+        }
+    }
+    for (auto& probe : m_probes) {
+        if (probe->device == device) {
+            return 0;  // Already on it
+        }
+    }
+
+    logd("Opening device 0x%04x : 0x%04x", desc.idVendor, desc.idProduct);
+    std::unique_ptr<HUAccessorySwitcher::DeviceProbe> probe(
+        new HUAccessorySwitcher::DeviceProbe());
+    usb_err = libusb_open(device, &probe->handle);
+    if (usb_err < 0) {
+        loge("Error opening device 0x%04x : 0x%04x", desc.idVendor,
+             desc.idProduct);
+        return -1;
+    }
+    probe->owner = this;
+    probe->device = device;
+    probe->vendor = desc.idVendor;
+    probe->product = desc.idProduct;
+    probe->transfer = libusb_alloc_transfer(0);
+    if (probe->transfer == nullptr) {
+        loge("Error allocating a transfer for device 0x%04x : 0x%04x",
+             desc.idVendor, desc.idProduct);
+        libusb_close(probe->handle);
+        return -1;
+    }
+    probe->startTime = hu_time_us();
+
+    DeviceProbe& started = *probe;
+    m_probes.push_back(std::move(probe));
+    if (submit_step(started) < 0) {
+        finish(started, "submit failed");
+        return -1;
+    }
+    return 0;
+}
+
+int HUAccessorySwitcher::ProbeAll() {
+    libusb_device** devices = nullptr;
+    ssize_t dev_count = libusb_get_device_list(m_usbContext, &devices);
+    if (dev_count < 0) {
+        loge("Error libusb_get_device_list usb_err: %d (%s)", dev_count,
+             libusb_strerror((libusb_error)dev_count));
+        return -1;
+    }
+    for (ssize_t i = 0; i < dev_count; i++) {
+        Probe(devices[i]);
+    }
+    // Probes keep the handles open, which keeps the devices alive
+    libusb_free_device_list(devices, 1);
+    return 0;
+}
+
+// The one background run, joined when the next one starts or at exit
+namespace {
+struct BackgroundProbe {
+    std::mutex lock;
+    std::thread thread;
+    std::atomic<bool> running{false};
+    ~BackgroundProbe() {
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+};
+BackgroundProbe background_probe;
+}
+
+void HUAccessorySwitcher::ProbeAllInBackground(int tmo) {
+    std::lock_guard<std::mutex> lock(background_probe.lock);
+    if (background_probe.running) {
+        return;
+    }
+    if (background_probe.thread.joinable()) {
+        background_probe.thread.join();  // Finished already
+    }
+    background_probe.running = true;
+    background_probe.thread = std::thread([tmo] {
+        pthread_setname_np(pthread_self(), "usb_aoa_probe");
+        libusb_context* usbContext = nullptr;
+        if (libusb_init(&usbContext) < 0) {
+            loge("Error libusb_init failed");
+        } else {
+            {
+                HUAccessorySwitcher switcher(usbContext);
+                if (switcher.ProbeAll() == 0) {
+                    switcher.Wait(tmo);
+                }
+            }
+            libusb_exit(usbContext);
+        }
+        background_probe.running = false;
+    });
+}
+
+void HUAccessorySwitcher::Wait(int tmo) {
+    uint64_t deadline = hu_time_us() + tmo * 1000ULL;
+    timeval tv = {0, 100000};
+    while (!m_probes.empty() && hu_time_us() < deadline) {
+        bool inFlight = false;
+        for (auto& probe : m_probes) {
+            inFlight |= probe->inFlight;
+        }
+        if (!inFlight) break;
+        libusb_handle_events_timeout_completed(m_usbContext, &tv, nullptr);
+    }
+}
+
+int HUAccessorySwitcher::submit_step(DeviceProbe& probe) {
+    const AOAStep& step = aoa_steps[probe.step];
+    probe.buffer.assign(LIBUSB_CONTROL_SETUP_SIZE + step.len, 0);
+    libusb_fill_control_setup(probe.buffer.data(), step.req_type, step.req_val,
+                              0, step.idx, step.len);
+    if (step.data) {
+        memcpy(probe.buffer.data() + LIBUSB_CONTROL_SETUP_SIZE, step.data,
+               step.len);
+    }
+    libusb_fill_control_transfer(probe.transfer, probe.handle,
+                                 probe.buffer.data(), &transfer_callback_tramp,
+                                 &probe, AOA_STEP_TIMEOUT);
+    probe.stepStartTime = hu_time_us();
+    int usb_err = libusb_submit_transfer(probe.transfer);
+    if (usb_err < 0) {
+        loge("Error submitting %s to device 0x%04x : 0x%04x: %d (%s)",
+             step.name, probe.vendor, probe.product, usb_err,
+             libusb_strerror((libusb_error)usb_err));
+        return usb_err;
+    }
+    probe.inFlight = true;
+    return 0;
+}
+
+void HUAccessorySwitcher::finish(DeviceProbe& probe, const char* result) {
+    logi("AOA 0x%04x : 0x%04x %s after %llu us", probe.vendor, probe.product,
+         result, (unsigned long long)(hu_time_us() - probe.startTime));
+    for (int i = 0; i <= probe.step && i < aoa_step_count; i++) {
+        logd("  %-14s %llu us", aoa_steps[i].name,
+             (unsigned long long)probe.stepTimeUs[i]);
+    }
+
+    libusb_free_transfer(probe.transfer);
+    libusb_close(probe.handle);
+    m_probes.erase(std::remove_if(m_probes.begin(), m_probes.end(),
+                                  [&probe](std::unique_ptr<DeviceProbe>& p) {
+                                      return p.get() == &probe;
+                                  }),
+                   m_probes.end());
+}
+
+void HUAccessorySwitcher::transfer_callback(libusb_transfer* transfer) {
+    DeviceProbe& probe = *reinterpret_cast<DeviceProbe*>(transfer->user_data);
+    probe.inFlight = false;
+    probe.stepTimeUs[probe.step] = hu_time_us() - probe.stepStartTime;
+    const AOAStep& step = aoa_steps[probe.step];
+
+    if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+        if (probe.step == 0 && transfer->status == LIBUSB_TRANSFER_STALL) {
+            // Doesn't understand GET_PROTOCOL, not a phone. Anything else,
+            // like a timeout from a phone that isn't ready yet right after
+            // plug-in, is tried again on the next arrival.
+            std::lock_guard<std::mutex> lock(non_accessory_lock);
+            non_accessory_devices.insert(
+                device_key(probe.vendor, probe.product));
+            finish(probe, "is not AOA capable");
+        } else if (probe.step == aoa_step_count - 1 &&
+                   transfer->status == LIBUSB_TRANSFER_NO_DEVICE) {
+            // Some phones drop off the bus before acknowledging START
+            finish(probe, "switched");
+        } else {
+            logd("Error sending %s to device 0x%04x : 0x%04x: %d", step.name,
+                 probe.vendor, probe.product, transfer->status);
+            finish(probe, "failed");
+        }
+        return;
+    }
+
+    if (probe.step == 0) {
+        uint16_t oap_proto_ver;
+        if (transfer->actual_length < (int)sizeof(oap_proto_ver)) {
+            logd("Short GET_PROTOCOL answer from device 0x%04x : 0x%04x: %d",
+                 probe.vendor, probe.product, transfer->actual_length);
+            finish(probe, "failed");
+            return;
+        }
+        memcpy(&oap_proto_ver, libusb_control_transfer_get_data(transfer),
+               sizeof(oap_proto_ver));
+        oap_proto_ver = le16toh(oap_proto_ver);
+        if (oap_proto_ver < 1) {
+            std::lock_guard<std::mutex> lock(non_accessory_lock);
+            non_accessory_devices.insert(
+                device_key(probe.vendor, probe.product));
+            finish(probe, "is not AOA capable");
+            return;
+        }
+        logd("Device 0x%04x : 0x%04x responded with protocol ver %u",
+             probe.vendor, probe.product, oap_proto_ver);
+    }
+
+    if (++probe.step == aoa_step_count) {
+        // The phone re-enumerates as an accessory now
+        probe.step--;
+        finish(probe, "switched");
+    } else if (submit_step(probe) < 0) {
+        finish(probe, "failed");
+    }
+}
+
+void HUAccessorySwitcher::transfer_callback_tramp(libusb_transfer* transfer) {
+    DeviceProbe* probe = reinterpret_cast<DeviceProbe*>(transfer->user_data);
+    probe->owner->transfer_callback(transfer);
+}
@@ -0,0 +1,44 @@
+#pragma once
+#include <libusb.h>
+#include <memory>
+#include <vector>
+#include "hu_uti.h"
+
+namespace AndroidAuto {
+
+// Switches phones into Android Open Accessory mode without blocking. Every
+// candidate device gets its own chain of async control transfers
+// (GET_PROTOCOL, the identification strings, START), so a slow or silent
+// device doesn't hold up the others. Completions run from whatever thread
+// handles events on the context passed in. Devices that refused
+// GET_PROTOCOL are remembered and not probed again.
+class HUAccessorySwitcher {
+   public:
+    HUAccessorySwitcher(libusb_context* usbContext);
+    ~HUAccessorySwitcher();
+
+    static bool IsAccessory(uint16_t vendor, uint16_t product);
+
+    // Starts the handshake, returns -1 if the device is skipped
+    int Probe(libusb_device* device);
+    // Probes every device on the bus
+    int ProbeAll();
+    inline int Pending() const { return m_probes.size(); }
+    // Handles events until every probe has finished or tmo ms have passed
+    void Wait(int tmo);
+    // Probes every device on the bus on a thread of its own, with its own
+    // libusb context, for at most tmo ms. Returns right away, and does
+    // nothing while the last run is still going.
+    static void ProbeAllInBackground(int tmo);
+
+   private:
+    struct DeviceProbe;
+    libusb_context* m_usbContext;
+    std::vector<std::unique_ptr<DeviceProbe>> m_probes;
+
+    int submit_step(DeviceProbe& probe);
+    void finish(DeviceProbe& probe, const char* result);
+    void transfer_callback(libusb_transfer* transfer);
+    static void LIBUSB_CALL transfer_callback_tramp(libusb_transfer* transfer);
+};
+}
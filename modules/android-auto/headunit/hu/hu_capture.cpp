@@ -0,0 +1,546 @@
+#define LOGTAG "hu_capture"
+#include "hu_capture.h"
+#include "hu_uti.h"  // Utilities
+
+#include <fcntl.h>
+#include <openssl/rand.h>
+#include <openssl/sha.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <algorithm>
+
+using namespace AndroidAuto;
+
+// The file grows by this much at a time, a 1080p60 session writes a few
+// MB/s, so remapping stays rare
+#define CAPTURE_GROW_STEP (64u << 20)
+
+static inline size_t capture_align(size_t size) { return (size + 7) & ~7; }
+
+int HUCaptureWriter::Open(const std::string& path,
+                          const byte seed[HU_CAPTURE_SEED_SIZE]) {
+    std::lock_guard<std::mutex> lock(m_lock);
+    // Holds what's needed to decrypt the session, owner only
+    m_fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (m_fd < 0) {
+        loge("Can't create %s errno: %d (%s)", path.c_str(), errno,
+             strerror(errno));
+        return (-1);
+    }
+    m_used = 0;
+    if (!grow(capture_align(sizeof(HUCaptureHeader)))) {
+        close(m_fd);
+        m_fd = -1;
+        return (-1);
+    }
+
+    HUCaptureHeader* header = (HUCaptureHeader*)m_map;
+    memcpy(header->magic, HU_CAPTURE_MAGIC, sizeof(header->magic));
+    header->version = 1;
+    header->headerSize = sizeof(HUCaptureHeader);
+    timeval now;
+    gettimeofday(&now, nullptr);
+    header->startRealtimeUs = (uint64_t)now.tv_sec * 1000000 + now.tv_usec;
+    memcpy(header->randSeed, seed, HU_CAPTURE_SEED_SIZE);
+    m_used = capture_align(sizeof(HUCaptureHeader));
+    m_startUs = hu_time_us();
+    m_records = 0;
+    return (0);
+}
+
+bool HUCaptureWriter::grow(size_t needed) {
+    if (m_used + needed <= m_mapSize) {
+        return true;
+    }
+    size_t size = (m_used + needed + CAPTURE_GROW_STEP - 1) /
+                  CAPTURE_GROW_STEP * CAPTURE_GROW_STEP;
+    if (ftruncate(m_fd, size) < 0) {
+        loge("ftruncate errno: %d (%s)", errno, strerror(errno));
+        return false;
+    }
+    void* map = m_map ? mremap(m_map, m_mapSize, size, MREMAP_MAYMOVE)
+                      : mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED, m_fd, 0);
+    if (map == MAP_FAILED) {
+        loge("mmap errno: %d (%s)", errno, strerror(errno));
+        return false;
+    }
+    m_map = (byte*)map;
+    m_mapSize = size;
+    return true;
+}
+
+void HUCaptureWriter::Append(HU_CAPTURE_DIRECTION direction, const iovec* iov,
+                             int iovcnt) {
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        len += iov[i].iov_len;
+    }
+    if (len == 0) {
+        return;
+    }
+    const size_t size = capture_align(sizeof(HUCaptureRecord) + len);
+
+    std::lock_guard<std::mutex> lock(m_lock);
+    if (!m_map) {
+        return;
+    }
+    if (!grow(size)) {
+        // Keep what was captured so far rather than a file with holes
+        loge("Capture stopped after %llu records",
+             (unsigned long long)m_records);
+        munmap(m_map, m_mapSize);
+        m_map = nullptr;
+        return;
+    }
+
+    HUCaptureRecord* record = (HUCaptureRecord*)(m_map + m_used);
+    byte* dest = (byte*)(record + 1);
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(dest, iov[i].iov_base, iov[i].iov_len);
+        dest += iov[i].iov_len;
+    }
+    record->timeUs = hu_time_us() - m_startUs;
+    record->direction = direction;
+    // Last, a record with a length is complete
+    record->len = len;
+    m_used += size;
+    m_records++;
+}
+
+void HUCaptureWriter::Close() {
+    std::lock_guard<std::mutex> lock(m_lock);
+    if (m_map) {
+        munmap(m_map, m_mapSize);
+        m_map = nullptr;
+    }
+    m_mapSize = 0;
+    if (m_fd >= 0) {
+        if (ftruncate(m_fd, m_used) < 0) {
+            loge("ftruncate errno: %d (%s)", errno, strerror(errno));
+        }
+        close(m_fd);
+        m_fd = -1;
+        logd("Captured %llu records, %zu bytes", (unsigned long long)m_records,
+             m_used);
+    }
+}
+
+int HUCaptureReader::Open(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        loge("Can't open %s errno: %d (%s)", path.c_str(), errno,
+             strerror(errno));
+        return (-1);
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(HUCaptureHeader)) {
+        loge("%s is not a capture", path.c_str());
+        close(fd);
+        return (-1);
+    }
+    void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        loge("mmap errno: %d (%s)", errno, strerror(errno));
+        return (-1);
+    }
+    m_map = (byte*)map;
+    m_size = st.st_size;
+
+    const HUCaptureHeader* header = Header();
+    if (memcmp(header->magic, HU_CAPTURE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != 1 || header->headerSize < sizeof(HUCaptureHeader) ||
+        header->headerSize > m_size) {
+        loge("%s is not a capture", path.c_str());
+        Close();
+        return (-1);
+    }
+    return (0);
+}
+
+void HUCaptureReader::Close() {
+    if (m_map) {
+        munmap(m_map, m_size);
+        m_map = nullptr;
+    }
+    m_size = 0;
+}
+
+const HUCaptureRecord* HUCaptureReader::check(size_t offset) const {
+    if (offset + sizeof(HUCaptureRecord) > m_size) {
+        return nullptr;
+    }
+    const HUCaptureRecord* record = (const HUCaptureRecord*)(m_map + offset);
+    // Zeroed space after an unclean stop, or a torn last record
+    if (record->len == 0 ||
+        record->len > m_size - offset - sizeof(HUCaptureRecord)) {
+        return nullptr;
+    }
+    return record;
+}
+
+const HUCaptureRecord* HUCaptureReader::First() const {
+    return m_map ? check(capture_align(Header()->headerSize)) : nullptr;
+}
+
+const HUCaptureRecord* HUCaptureReader::Next(
+    const HUCaptureRecord* record) const {
+    size_t offset = (const byte*)record - m_map;
+    return check(offset +
+                 capture_align(sizeof(HUCaptureRecord) + record->len));
+}
+
+// SHA-256 over seed and a counter. Only has to be repeatable, the seed is in
+// the capture file anyway.
+static std::mutex capture_rand_lock;
+static byte capture_rand_seed[HU_CAPTURE_SEED_SIZE + sizeof(uint64_t)];
+static uint64_t capture_rand_counter = 0;
+static byte capture_rand_block[SHA256_DIGEST_LENGTH];
+static size_t capture_rand_used = sizeof(capture_rand_block);
+
+static int capture_rand_bytes(unsigned char* buf, int num) {
+    std::lock_guard<std::mutex> lock(capture_rand_lock);
+    while (num > 0) {
+        if (capture_rand_used == sizeof(capture_rand_block)) {
+            memcpy(&capture_rand_seed[HU_CAPTURE_SEED_SIZE],
+                   &capture_rand_counter, sizeof(capture_rand_counter));
+            SHA256(capture_rand_seed, sizeof(capture_rand_seed),
+                   capture_rand_block);
+            capture_rand_counter++;
+            capture_rand_used = 0;
+        }
+        size_t count = std::min((size_t)num,
+                                sizeof(capture_rand_block) - capture_rand_used);
+        memcpy(buf, &capture_rand_block[capture_rand_used], count);
+        capture_rand_used += count;
+        buf += count;
+        num -= count;
+    }
+    return 1;
+}
+
+static int capture_rand_status() { return 1; }
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+// Seeding from outside would break repeatability, ignore it
+static int capture_rand_seed_ignored(const void*, int) { return 1; }
+static int capture_rand_add_ignored(const void*, int, double) { return 1; }
+#else
+static void capture_rand_seed_ignored(const void*, int) {}
+static void capture_rand_add_ignored(const void*, int, double) {}
+#endif
+
+static RAND_METHOD capture_rand_method = {
+    capture_rand_seed_ignored, capture_rand_bytes, nullptr,
+    capture_rand_add_ignored,  capture_rand_bytes, capture_rand_status};
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+// OpenSSL 3 deprecates RAND_METHOD, but RAND_bytes_ex() still uses one set
+// here in place of the default provider. Replacing it the OpenSSL 3 way
+// takes a provider of our own, for a debugging aid that's not worth it.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wdeprecated-declarations"
+#endif
+
+void AndroidAuto::hu_capture_rand_install(
+    const byte seed[HU_CAPTURE_SEED_SIZE]) {
+    {
+        std::lock_guard<std::mutex> lock(capture_rand_lock);
+        memcpy(capture_rand_seed, seed, HU_CAPTURE_SEED_SIZE);
+        capture_rand_counter = 0;
+        capture_rand_used = sizeof(capture_rand_block);
+    }
+    RAND_set_rand_method(&capture_rand_method);
+    logw("Seeded random numbers, this session is not secure");
+}
+
+void AndroidAuto::hu_capture_rand_remove() {
+    if (RAND_get_rand_method() == &capture_rand_method) {
+        RAND_set_rand_method(nullptr);  // Back to the default
+    }
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#pragma GCC diagnostic pop
+#endif
+
+static std::mutex capture_session_lock;
+static int capture_sessions = 0;
+static bool capture_seeded_session = false;
+
+bool AndroidAuto::hu_capture_session_begin(bool seeded) {
+    std::lock_guard<std::mutex> lock(capture_session_lock);
+    if (capture_seeded_session) {
+        loge("A capture or replay session is running, can't start another");
+        return false;
+    }
+    if (seeded && capture_sessions > 0) {
+        loge("%d other session(s) running, can't capture or replay",
+             capture_sessions);
+        return false;
+    }
+    capture_sessions++;
+    capture_seeded_session = seeded;
+    return true;
+}
+
+void AndroidAuto::hu_capture_session_end(bool seeded) {
+    std::lock_guard<std::mutex> lock(capture_session_lock);
+    capture_sessions--;
+    if (seeded) {
+        capture_seeded_session = false;
+    }
+}
+
+HUTransportStreamCapture::HUTransportStreamCapture(
+    std::unique_ptr<HUTransportStream> inner,
+    std::map<std::string, std::string> _settings)
+    : HUTransportStream(_settings), m_inner(std::move(inner)) {
+    m_path = _settings["capture_file"];
+}
+
+HUTransportStreamCapture::~HUTransportStreamCapture() {
+    if (m_capturing) {
+        hu_capture_rand_remove();
+        m_writer.Close();
+    }
+}
+
+int HUTransportStreamCapture::Start() {
+    int ret = m_inner->Start();
+    if (ret < 0) {
+        return ret;
+    }
+    readfd = m_inner->GetReadFD();
+    errorfd = m_inner->GetErrorFD();
+    if (m_capturing) {
+        return ret;
+    }
+
+    // The seed itself comes from the real generator
+    byte seed[HU_CAPTURE_SEED_SIZE];
+    if (RAND_bytes(seed, sizeof(seed)) != 1 || m_writer.Open(m_path, seed) < 0) {
+        logw("Not capturing this session");
+        return ret;
+    }
+    hu_capture_rand_install(seed);
+    m_capturing = true;
+    logi("Capturing to %s", m_path.c_str());
+    return ret;
+}
+
+int HUTransportStreamCapture::Stop() {
+    if (m_capturing) {
+        hu_capture_rand_remove();
+        m_writer.Close();
+        m_capturing = false;
+    }
+    return m_inner->Stop();
+}
+
+int HUTransportStreamCapture::SubmitWrite(const iovec* iov, int iovcnt,
+                                          int tmo, WriteCompletion done) {
+    if (m_capturing) {
+        m_writer.Append(HU_CAPTURE_SENT, iov, iovcnt);
+    }
+    return m_inner->SubmitWrite(iov, iovcnt, tmo, std::move(done));
+}
+
+int HUTransportStreamCapture::Poll(const ReceiveCallback& callback) {
+    if (!m_capturing) {
+        return m_inner->Poll(callback);
+    }
+    return m_inner->Poll([this, &callback](HUTransportChunkPtr chunk) {
+        iovec iov = {chunk->data, (size_t)chunk->len};
+        m_writer.Append(HU_CAPTURE_RECEIVED, &iov, 1);
+        callback(std::move(chunk));
+    });
+}
+
+HUTransportStreamReplay::HUTransportStreamReplay(
+    std::map<std::string, std::string> _settings)
+    : HUTransportStream(_settings) {
+    m_path = _settings["replay_file"];
+    m_fast = _settings["replay_pacing"] == "fast";
+}
+
+HUTransportStreamReplay::~HUTransportStreamReplay() {
+    Stop();
+    for (HUTransportChunk* chunk : m_freeChunks) {
+        delete chunk;
+    }
+}
+
+int HUTransportStreamReplay::Start() {
+    if (m_started) {
+        return (0);
+    }
+    if (m_reader.Open(m_path) < 0) {
+        return (-1);
+    }
+    // Fast replay stays readable until the end, otherwise a timer fires for
+    // the next record
+    readfd = m_fast ? eventfd(1, EFD_NONBLOCK | EFD_CLOEXEC)
+                    : timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (readfd < 0) {
+        loge("Can't create replay fd errno: %d (%s)", errno, strerror(errno));
+        m_reader.Close();
+        return (-1);
+    }
+    hu_capture_rand_install(m_reader.Header()->randSeed);
+
+    m_next = m_reader.First();
+    skip_sent();
+    m_sentRecord = m_reader.First();
+    m_sentOffset = 0;
+    m_sentMatched = 0;
+    m_diverged = false;
+    m_records = 0;
+    m_bytes = 0;
+    m_startUs = hu_time_us();
+    m_started = true;
+    if (!m_fast) {
+        arm_timer();
+    }
+    logi("Replaying %s, %s pacing", m_path.c_str(),
+         m_fast ? "fast" : "original");
+    return (0);
+}
+
+int HUTransportStreamReplay::Stop() {
+    if (!m_started) {
+        return (0);
+    }
+    uint64_t elapsed = std::max<uint64_t>(hu_time_us() - m_startUs, 1);
+    logi("Replayed %llu records  %llu bytes in %llu ms  %.1f MB/s",
+         (unsigned long long)m_records, (unsigned long long)m_bytes,
+         (unsigned long long)(elapsed / 1000), (double)m_bytes / elapsed);
+    logi("HU output matched the capture for %llu bytes%s",
+         (unsigned long long)m_sentMatched, m_diverged ? "" : ", all of it");
+
+    hu_capture_rand_remove();
+    close(readfd);
+    readfd = -1;
+    m_next = nullptr;
+    m_sentRecord = nullptr;
+    m_reader.Close();
+    m_started = false;
+    return (0);
+}
+
+void HUTransportStreamReplay::skip_sent() {
+    while (m_next && m_next->direction != HU_CAPTURE_RECEIVED) {
+        m_next = m_reader.Next(m_next);
+    }
+}
+
+void HUTransportStreamReplay::arm_timer() {
+    // Right away at the end, so Poll() reports it
+    uint64_t due = m_next ? m_startUs + m_next->timeUs : 0;
+    due = std::max<uint64_t>(due, 1);
+    itimerspec spec = {};
+    spec.it_value.tv_sec = due / 1000000;
+    spec.it_value.tv_nsec = (due % 1000000) * 1000;
+    timerfd_settime(readfd, TFD_TIMER_ABSTIME, &spec, nullptr);
+}
+
+int HUTransportStreamReplay::SubmitWrite(const iovec* iov, int iovcnt,
+                                         int tmo, WriteCompletion done) {
+    int len = 0;
+    std::lock_guard<std::mutex> lock(m_sentLock);
+    for (int i = 0; i < iovcnt; i++) {
+        const byte* buf = (const byte*)iov[i].iov_base;
+        size_t left = iov[i].iov_len;
+        len += left;
+        // Differences after the handshake are expected, timestamps and the
+        // like. Before it, decryption of the replay fails.
+        while (left > 0 && !m_diverged) {
+            while (m_sentRecord &&
+                   (m_sentRecord->direction != HU_CAPTURE_SENT ||
+                    m_sentOffset == m_sentRecord->len)) {
+                m_sentRecord = m_reader.Next(m_sentRecord);
+                m_sentOffset = 0;
+            }
+            if (!m_sentRecord) {
+                m_diverged = true;
+                break;
+            }
+            size_t count =
+                std::min<size_t>(left, m_sentRecord->len - m_sentOffset);
+            if (memcmp(buf,
+                       HUCaptureReader::Payload(m_sentRecord) + m_sentOffset,
+                       count) != 0) {
+                logw("HU output differs from the capture after %llu bytes",
+                     (unsigned long long)m_sentMatched);
+                m_diverged = true;
+                break;
+            }
+            buf += count;
+            left -= count;
+            m_sentOffset += count;
+            m_sentMatched += count;
+        }
+    }
+    if (done) done(len);
+    return len;
+}
+
+int HUTransportStreamReplay::Poll(const ReceiveCallback& callback) {
+    if (!m_started) return (-1);
+
+    if (!m_fast) {
+        uint64_t expirations = 0;
+        if (read(readfd, &expirations, sizeof(expirations)) < 0 &&
+            errno != EAGAIN) {
+            return (-1);
+        }
+    }
+    if (!m_next) {
+        logd("End of capture");
+        return (-1);
+    }
+
+    const uint64_t now = hu_time_us() - m_startUs;
+    int count = 0;
+    size_t bytes = 0;
+    // Bounded so commands get their turn during a fast replay
+    while (m_next && count < 64 && bytes < 1048576) {
+        if (!m_fast && m_next->timeUs > now) {
+            break;
+        }
+        HUTransportChunk* chunk = nullptr;
+        if (m_freeChunks.empty()) {
+            chunk = new HUTransportChunk();
+            chunk->pool = this;
+        } else {
+            chunk = m_freeChunks.back();
+            m_freeChunks.pop_back();
+        }
+        // Consumers only copy out of chunks, the mapping is read-only
+        chunk->data = (byte*)HUCaptureReader::Payload(m_next);
+        chunk->len = chunk->capacity = m_next->len;
+        m_records++;
+        m_bytes += chunk->len;
+        bytes += chunk->len;
+        count++;
+        callback(HUTransportChunkPtr(chunk));
+
+        m_next = m_reader.Next(m_next);
+        skip_sent();
+    }
+    if (!m_fast) {
+        arm_timer();
+    }
+    return count;
+}
+
+void HUTransportStreamReplay::Recycle(HUTransportChunk* chunk) {
+    chunk->data = nullptr;
+    chunk->len = 0;
+    m_freeChunks.push_back(chunk);
+}
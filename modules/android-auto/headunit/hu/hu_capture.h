@@ -0,0 +1,154 @@
+#pragma once
+#include <stdint.h>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "hu_aap.h"
+
+namespace AndroidAuto {
+
+// Capture file layout, host byte order. A header, then records back to back,
+// each 8 byte aligned. A zeroed record marks the end of a file that wasn't
+// closed cleanly.
+#define HU_CAPTURE_MAGIC "HUCAP01"
+#define HU_CAPTURE_SEED_SIZE 32
+
+struct HUCaptureHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t headerSize;
+    uint64_t startRealtimeUs;  // wall clock at Start(), for reference only
+    // The session's random numbers come from this seed, see
+    // hu_capture_rand_install(). Anyone holding the file can decrypt it.
+    byte randSeed[HU_CAPTURE_SEED_SIZE];
+};
+
+enum HU_CAPTURE_DIRECTION : uint8_t {
+    HU_CAPTURE_RECEIVED = 1,  // phone to HU
+    HU_CAPTURE_SENT = 2,      // HU to phone
+};
+
+struct HUCaptureRecord {
+    uint64_t timeUs;  // since Start()
+    uint32_t len;     // payload bytes following the record
+    uint8_t direction;
+    uint8_t pad[3];
+};
+
+// Appends records to a memory-mapped file, which grows in large steps and is
+// trimmed on Close(). Thread safe.
+class HUCaptureWriter {
+   public:
+    ~HUCaptureWriter() { Close(); }
+    int Open(const std::string& path, const byte seed[HU_CAPTURE_SEED_SIZE]);
+    void Append(HU_CAPTURE_DIRECTION direction, const iovec* iov, int iovcnt);
+    void Close();
+
+   private:
+    std::mutex m_lock;
+    int m_fd = -1;
+    byte* m_map = nullptr;
+    size_t m_mapSize = 0;
+    size_t m_used = 0;
+    uint64_t m_startUs = 0;
+    uint64_t m_records = 0;
+    bool grow(size_t needed);
+};
+
+// Read-only view of a capture file
+class HUCaptureReader {
+   public:
+    ~HUCaptureReader() { Close(); }
+    int Open(const std::string& path);
+    void Close();
+    const HUCaptureHeader* Header() const {
+        return (const HUCaptureHeader*)m_map;
+    }
+    // Records in file order, nullptr at the end
+    const HUCaptureRecord* First() const;
+    const HUCaptureRecord* Next(const HUCaptureRecord* record) const;
+    static const byte* Payload(const HUCaptureRecord* record) {
+        return (const byte*)(record + 1);
+    }
+
+   private:
+    byte* m_map = nullptr;
+    size_t m_size = 0;
+    const HUCaptureRecord* check(size_t offset) const;
+};
+
+// Replaces OpenSSL's random numbers with a stream derived from seed, so a
+// replay can repeat the TLS handshake of the capture byte for byte and
+// decrypt what the phone sent. Only for capture and replay sessions.
+void hu_capture_rand_install(const byte seed[HU_CAPTURE_SEED_SIZE]);
+void hu_capture_rand_remove();
+
+// Seeded random numbers are process-wide, so a capture or replay session
+// has to be the only one in the process. Registers a session with the
+// transport being started, false and logged if it can't run alongside
+// those already registered.
+bool hu_capture_session_begin(bool seeded);
+void hu_capture_session_end(bool seeded);
+
+// Records everything another transport sends and receives, with
+// capture_file set. Also switches the session to seeded random numbers.
+class HUTransportStreamCapture : public HUTransportStream {
+   public:
+    HUTransportStreamCapture(std::unique_ptr<HUTransportStream> inner,
+                             std::map<std::string, std::string> _settings);
+    ~HUTransportStreamCapture();
+    virtual int Start() override;
+    virtual int Stop() override;
+    virtual int SubmitWrite(const iovec* iov, int iovcnt, int tmo,
+                            WriteCompletion done = nullptr) override;
+    virtual int Poll(const ReceiveCallback& callback) override;
+
+   private:
+    std::unique_ptr<HUTransportStream> m_inner;
+    std::string m_path;
+    HUCaptureWriter m_writer;
+    bool m_capturing = false;
+};
+
+// transport_type=replay, plays replay_file back as the phone. With
+// replay_pacing=original data arrives at the captured times, with "fast" as
+// fast as the HU thread takes it. What the HU sends is compared with the
+// capture and otherwise dropped.
+class HUTransportStreamReplay : public HUTransportStream,
+                                private HUTransportChunkPool {
+   public:
+    HUTransportStreamReplay(std::map<std::string, std::string> _settings);
+    ~HUTransportStreamReplay();
+    virtual int Start() override;
+    virtual int Stop() override;
+    virtual int SubmitWrite(const iovec* iov, int iovcnt, int tmo,
+                            WriteCompletion done = nullptr) override;
+    virtual int Poll(const ReceiveCallback& callback) override;
+
+   private:
+    std::string m_path;
+    bool m_fast = false;
+    HUCaptureReader m_reader;
+    bool m_started = false;
+    uint64_t m_startUs = 0;
+
+    // Next record to hand over
+    const HUCaptureRecord* m_next = nullptr;
+    // Captured HU output, to find where the replay diverges
+    const HUCaptureRecord* m_sentRecord = nullptr;
+    uint32_t m_sentOffset = 0;
+    uint64_t m_sentMatched = 0;
+    bool m_diverged = false;
+    std::mutex m_sentLock;
+
+    // Chunks point into the mapped file
+    std::vector<HUTransportChunk*> m_freeChunks;
+    virtual void Recycle(HUTransportChunk* chunk) override;
+
+    uint64_t m_records = 0;
+    uint64_t m_bytes = 0;
+    void skip_sent();
+    void arm_timer();
+};
+}
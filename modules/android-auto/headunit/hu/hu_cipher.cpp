@@ -0,0 +1,191 @@
+#define LOGTAG "hu_cipher"
+#include "hu_cipher.h"
+#include "hu_uti.h"  // Utilities
+
+#include <openssl/evp.h>
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+using namespace AndroidAuto;
+
+namespace {
+struct BenchCipher {
+    const char* name;
+    const char* suite;
+    const EVP_CIPHER* (*cipher)();
+};
+
+const BenchCipher bench_ciphers[] = {
+    {"AES-128-GCM", "AES128-GCM", EVP_aes_128_gcm},
+    {"AES-256-GCM", "AES256-GCM", EVP_aes_256_gcm},
+    {"ChaCha20-Poly1305", "CHACHA20-POLY1305", EVP_chacha20_poly1305},
+};
+
+enum { IV_BYTES = 12, TAG_BYTES = 16, AAD_BYTES = 13 };  // as in a record
+
+struct CipherCtxFree {
+    void operator()(EVP_CIPHER_CTX* ctx) const { EVP_CIPHER_CTX_free(ctx); }
+};
+typedef std::unique_ptr<EVP_CIPHER_CTX, CipherCtxFree> CipherCtx;
+}
+
+// Seals one record of plain into sealed and tag, so there's something
+// valid to open
+static bool seal(const EVP_CIPHER* cipher, const byte* key, const byte* iv,
+                 const byte* aad, const std::vector<byte>& plain,
+                 std::vector<byte>& sealed, byte* tag) {
+    CipherCtx ctx(EVP_CIPHER_CTX_new());
+    int len = 0;
+    int final_len = 0;
+    sealed.resize(plain.size());
+    return ctx && EVP_EncryptInit_ex(ctx.get(), cipher, NULL, key, iv) == 1 &&
+           EVP_EncryptUpdate(ctx.get(), NULL, &len, aad, AAD_BYTES) == 1 &&
+           EVP_EncryptUpdate(ctx.get(), sealed.data(), &len, plain.data(),
+                             (int)plain.size()) == 1 &&
+           EVP_EncryptFinal_ex(ctx.get(), sealed.data() + len, &final_len) ==
+               1 &&
+           EVP_CIPHER_CTX_ctrl(ctx.get(), EVP_CTRL_AEAD_GET_TAG, TAG_BYTES,
+                               tag) == 1;
+}
+
+namespace {
+// One cipher set up like a connection, with a sealed record to open over
+// and over
+class CipherRun {
+   public:
+    HUCipherResult result;
+    uint64_t us = 0;
+
+    CipherRun(const BenchCipher& bc, size_t recordBytes) {
+        result.name = bc.name;
+        result.suite = bc.suite;
+        result.recordBytes = recordBytes;
+
+        const EVP_CIPHER* cipher = bc.cipher();
+        if (!cipher) {
+            return;  // Not built into this libcrypto
+        }
+        byte key[32];
+        for (size_t i = 0; i < sizeof(key); i++) key[i] = (byte)(i * 7 + 1);
+        for (size_t i = 0; i < sizeof(m_iv); i++) m_iv[i] = (byte)(i * 3);
+        for (size_t i = 0; i < sizeof(m_aad); i++) m_aad[i] = (byte)i;
+        m_plain.resize(recordBytes);
+        for (size_t i = 0; i < recordBytes; i++) m_plain[i] = (byte)(i * 31);
+        if (!seal(cipher, key, m_iv, m_aad, m_plain, m_sealed, m_tag)) {
+            loge("Couldn't seal a %s record", bc.name);
+            return;
+        }
+        m_ctx.reset(EVP_CIPHER_CTX_new());
+        if (m_ctx &&
+            EVP_DecryptInit_ex(m_ctx.get(), cipher, NULL, key, NULL) != 1) {
+            m_ctx.reset();
+        }
+        m_opened.resize(recordBytes);
+    }
+
+    // Opens records for about budgetUs, false once one fails
+    bool Run(uint64_t budgetUs) {
+        if (!m_ctx) {
+            return false;
+        }
+        uint64_t begin = hu_time_us();
+        uint64_t elapsed = 0;
+        do {
+            int len = 0;
+            int final_len = 0;
+            // Only the IV changes per record
+            if (EVP_DecryptInit_ex(m_ctx.get(), NULL, NULL, NULL, m_iv) != 1 ||
+                EVP_DecryptUpdate(m_ctx.get(), NULL, &len, m_aad, AAD_BYTES) !=
+                    1 ||
+                EVP_DecryptUpdate(m_ctx.get(), m_opened.data(), &len,
+                                  m_sealed.data(), (int)m_sealed.size()) != 1 ||
+                EVP_CIPHER_CTX_ctrl(m_ctx.get(), EVP_CTRL_AEAD_SET_TAG,
+                                    TAG_BYTES, m_tag) != 1 ||
+                EVP_DecryptFinal_ex(m_ctx.get(), m_opened.data() + len,
+                                    &final_len) != 1 ||
+                m_opened != m_plain) {
+                loge("Couldn't open a %s record", result.name.c_str());
+                m_ctx.reset();
+                return false;
+            }
+            result.records++;
+            elapsed = hu_time_us() - begin;
+        } while (elapsed < budgetUs);
+        us += elapsed;
+        return true;
+    }
+
+   private:
+    CipherCtx m_ctx;
+    byte m_iv[IV_BYTES];
+    byte m_aad[AAD_BYTES];
+    byte m_tag[TAG_BYTES];
+    std::vector<byte> m_plain;
+    std::vector<byte> m_sealed;
+    std::vector<byte> m_opened;
+};
+}
+
+std::vector<HUCipherResult> AndroidAuto::hu_cipher_bench(size_t recordBytes,
+                                                         uint64_t budgetUs) {
+    std::vector<std::unique_ptr<CipherRun>> runs;
+    for (const BenchCipher& bc : bench_ciphers) {
+        runs.emplace_back(new CipherRun(bc, recordBytes));
+    }
+    // Taking turns, so clock ramp-up and other load are shared fairly
+    std::vector<bool> failed(runs.size(), false);
+    const int rounds = 4;
+    for (int round = 0; round < rounds; round++) {
+        for (size_t i = 0; i < runs.size(); i++) {
+            if (!failed[i] && !runs[i]->Run(budgetUs / rounds)) {
+                failed[i] = true;
+            }
+        }
+    }
+
+    std::vector<HUCipherResult> results;
+    for (size_t i = 0; i < runs.size(); i++) {
+        HUCipherResult& result = runs[i]->result;
+        if (!failed[i] && runs[i]->us > 0) {
+            result.mbPerSec = (double)result.records * recordBytes / runs[i]->us;
+        } else {
+            result.records = 0;
+        }
+        results.push_back(result);
+    }
+    std::stable_sort(results.begin(), results.end(),
+                     [](const HUCipherResult& a, const HUCipherResult& b) {
+                         return a.mbPerSec > b.mbPerSec;
+                     });
+    return results;
+}
+
+std::string AndroidAuto::hu_cipher_preference(
+    const std::vector<std::string>& suites,
+    const std::vector<HUCipherResult>& results) {
+    // Rank of the cipher in a suite name, results.size() if not measured
+    auto rank = [&results](const std::string& suite) {
+        for (size_t i = 0; i < results.size(); i++) {
+            if (results[i].mbPerSec > 0 &&
+                suite.find(results[i].suite) != std::string::npos) {
+                return i;
+            }
+        }
+        return results.size();
+    };
+    std::vector<std::string> ordered(suites);
+    std::stable_sort(ordered.begin(), ordered.end(),
+                     [&rank](const std::string& a, const std::string& b) {
+                         return rank(a) < rank(b);
+                     });
+
+    std::string ret;
+    for (const std::string& suite : ordered) {
+        if (!ret.empty()) {
+            ret += ":";
+        }
+        ret += suite;
+    }
+    return ret;
+}
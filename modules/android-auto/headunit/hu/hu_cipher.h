@@ -0,0 +1,30 @@
+#pragma once
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace AndroidAuto {
+
+// How fast this CPU opens TLS records with one of the AEADs a phone may
+// pick for TLS 1.2. Boards without AES instructions are much quicker with
+// ChaCha20-Poly1305, ones with them with AES-GCM. Kept free of the rest of
+// the library so tools can share it.
+struct HUCipherResult {
+    std::string name;     // "AES-128-GCM"
+    std::string suite;    // in TLS 1.2 suite names, "AES128-GCM"
+    size_t recordBytes = 0;
+    uint64_t records = 0;  // opened during the run
+    double mbPerSec = 0;   // decrypt and tag check, 0 if it failed
+};
+
+// Decrypts records of recordBytes with each cipher for about budgetUs,
+// results fastest first
+std::vector<HUCipherResult> hu_cipher_bench(size_t recordBytes = 16384,
+                                            uint64_t budgetUs = 5000);
+
+// suites (OpenSSL names) as an OpenSSL cipher list, reordered so suites
+// using a faster cipher come first. Suites with a cipher that wasn't
+// measured keep their place after those.
+std::string hu_cipher_preference(const std::vector<std::string>& suites,
+                                 const std::vector<HUCipherResult>& results);
+}
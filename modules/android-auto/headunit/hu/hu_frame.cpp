@@ -0,0 +1,92 @@
+#define LOGTAG "hu_frame"
+#include "hu_frame.h"
+
+#include <endian.h>
+#include <string.h>
+#include <algorithm>
+
+using namespace AndroidAuto;
+
+// Whole frame size, header included, once the header is complete. 0 if more
+// header bytes are needed, -1 if the frame is bigger than the protocol allows.
+static int frame_size(const byte* buf, size_t len) {
+    if (len < 4) return 0;
+    int header_size = 4;
+    if ((buf[1] & HU_FRAME_FIRST_FRAME) && !(buf[1] & HU_FRAME_LAST_FRAME)) {
+        header_size += 4;
+        if (len < 8) return 0;
+    }
+    int frame_len = (buf[2] << 8) | buf[3];
+    if (frame_len > MAX_FRAME_PAYLOAD_SIZE) {
+        loge("Frame too big: %d on channel %d", frame_len, buf[0]);
+        return (-1);
+    }
+    return header_size + frame_len;
+}
+
+int HUFrameParser::dispatch(const byte* buf, int size,
+                            const FrameCallback& callback) {
+    HUFrame frame;
+    frame.chan = buf[0];
+    frame.flags = buf[1];
+    frame.len = (buf[2] << 8) | buf[3];
+    int header_size = size - frame.len;
+    if (header_size == 8) {
+        uint32_t total;
+        memcpy(&total, &buf[4], 4);
+        frame.totalLen = be32toh(total);
+    }
+    frame.payload = &buf[header_size];
+    m_stats.frames++;
+    m_stats.bytes += size;
+    return callback(frame);
+}
+
+int HUFrameParser::Feed(const byte* data, size_t len,
+                        const FrameCallback& callback) {
+    int frames = 0;
+
+    // Complete the frame left over from last time. It's copied together,
+    // that only happens to frames crossing a read boundary.
+    while (!m_partial.empty()) {
+        int size = frame_size(m_partial.data(), m_partial.size());
+        if (size < 0) {
+            m_partial.clear();
+            return (-1);
+        }
+        size_t want = size > 0 ? size : (m_partial.size() < 4 ? 4 : 8);
+        size_t count = std::min(want - m_partial.size(), len);
+        m_partial.insert(m_partial.end(), data, data + count);
+        data += count;
+        len -= count;
+        if (m_partial.size() < want) {
+            return frames;
+        }
+        if (size > 0) {
+            m_stats.carried++;
+            int ret = dispatch(m_partial.data(), size, callback);
+            m_partial.clear();
+            if (ret < 0) return (-1);
+            frames++;
+        }
+        // Otherwise the header just got complete, size it again
+    }
+
+    while (len > 0) {
+        int size = frame_size(data, len);
+        if (size < 0) {
+            return (-1);
+        }
+        if (size == 0 || (size_t)size > len) {
+            m_partial.assign(data, data + len);
+            break;
+        }
+        if (dispatch(data, size, callback) < 0) {
+            return (-1);
+        }
+        data += size;
+        len -= size;
+        frames++;
+    }
+    return frames;
+}
@@ -0,0 +1,60 @@
+#pragma once
+#include <stdint.h>
+#include <functional>
+#include <vector>
+#include "hu_uti.h"
+
+namespace AndroidAuto {
+
+enum HU_FRAME_FLAGS {
+    HU_FRAME_FIRST_FRAME = 1 << 0,
+    HU_FRAME_LAST_FRAME = 1 << 1,
+    HU_FRAME_CONTROL_MESSAGE = 1 << 2,
+    HU_FRAME_ENCRYPTED = 1 << 3,
+};
+
+#define MAX_FRAME_PAYLOAD_SIZE 0x4000
+// At 16 bytes for header
+#define MAX_FRAME_SIZE 0x4100
+
+// One frame off the wire: [chan, flags, len16], a len32 total message
+// length on the first of several frames, then len bytes of payload
+struct HUFrame {
+    int chan = 0;
+    int flags = 0;
+    const byte* payload = nullptr;
+    int len = 0;
+    uint32_t totalLen = 0;  // 0 unless first and not last
+};
+
+// Splits the received byte stream into frames. Feed() takes whatever the
+// transport delivered and hands every complete frame in it to the callback,
+// in place where the frame lies within the data. A frame cut off at the end
+// is kept and completed by the next Feed().
+class HUFrameParser {
+   public:
+    // Return < 0 to stop parsing, the rest of the data is dropped then
+    typedef std::function<int(const HUFrame& frame)> FrameCallback;
+
+    HUFrameParser() { m_partial.reserve(MAX_FRAME_SIZE); }
+
+    // Number of frames handed over, -1 on a malformed frame or when the
+    // callback failed. The stream can't be parsed any further after that.
+    int Feed(const byte* data, size_t len, const FrameCallback& callback);
+    void Reset() { m_partial.clear(); }
+    inline bool HasPartial() const { return !m_partial.empty(); }
+
+    struct Stats {
+        uint64_t frames = 0;
+        uint64_t bytes = 0;
+        // Frames that spanned two or more Feed() calls and had to be copied
+        uint64_t carried = 0;
+    };
+    inline const Stats& GetStats() const { return m_stats; }
+
+   private:
+    std::vector<byte> m_partial;
+    Stats m_stats;
+    int dispatch(const byte* buf, int size, const FrameCallback& callback);
+};
+}
@@ -0,0 +1,131 @@
+#define LOGTAG "hu_hotplug"
+#include "hu_hotplug.h"
+
+using namespace AndroidAuto;
+
+HUDeviceWatcher::HUDeviceWatcher(DeviceCallback callback)
+    : m_callback(callback) {}
+
+HUDeviceWatcher::~HUDeviceWatcher() { Stop(); }
+
+int HUDeviceWatcher::Start() {
+    if (m_usbContext) {
+        return 0;
+    }
+    if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+        logw("libusb has no hotplug support");
+        return -1;
+    }
+    if (libusb_init(&m_usbContext) < 0) {
+        loge("Error libusb_init failed");
+        m_usbContext = nullptr;
+        return -1;
+    }
+
+    m_quit = 0;
+    m_switcher.reset(new HUAccessorySwitcher(m_usbContext));
+    int usb_err = libusb_hotplug_register_callback(
+        m_usbContext,
+        (libusb_hotplug_event)(LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED |
+                               LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT),
+        LIBUSB_HOTPLUG_ENUMERATE, LIBUSB_HOTPLUG_MATCH_ANY,
+        LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+        &hotplug_callback_tramp, this, &m_hotplugHandle);
+    if (usb_err != 0) {
+        loge("Error libusb_hotplug_register_callback usb_err: %d (%s)",
+             usb_err, libusb_strerror((libusb_error)usb_err));
+        m_switcher.reset();
+        libusb_exit(m_usbContext);
+        m_usbContext = nullptr;
+        return -1;
+    }
+    m_hotplugRegistered = true;
+
+    m_thread = std::thread([this] { this->event_thread_main(); });
+    logd("Watching for USB devices");
+    return 0;
+}
+
+void HUDeviceWatcher::Stop() {
+    if (!m_usbContext) {
+        return;
+    }
+    m_quit = 1;
+    if (m_hotplugRegistered) {
+        // Also wakes up the event thread
+        libusb_hotplug_deregister_callback(m_usbContext, m_hotplugHandle);
+        m_hotplugRegistered = false;
+    }
+#if LIBUSB_API_VERSION >= 0x01000105
+    libusb_interrupt_event_handler(m_usbContext);
+#endif
+    if (m_thread.joinable()) {
+        m_thread.join();
+    }
+    // Cancels whatever handshakes are still running
+    m_switcher.reset();
+    for (libusb_device* device : m_arrived) {
+        libusb_unref_device(device);
+    }
+    m_arrived.clear();
+    libusb_exit(m_usbContext);
+    m_usbContext = nullptr;
+}
+
+void HUDeviceWatcher::event_thread_main() {
+    pthread_setname_np(pthread_self(), "usb_hotplug");
+    while (!m_quit) {
+        probe_arrived();
+        // Sleeps until libusb has something to report
+        int usb_err = libusb_handle_events_completed(m_usbContext, &m_quit);
+        if (usb_err < 0 && usb_err != LIBUSB_ERROR_INTERRUPTED) {
+            loge("Error libusb_handle_events_completed usb_err: %d (%s)",
+                 usb_err, libusb_strerror((libusb_error)usb_err));
+            break;
+        }
+    }
+    logd("USB hotplug thread exit");
+}
+
+void HUDeviceWatcher::probe_arrived() {
+    std::vector<libusb_device*> arrived;
+    {
+        std::lock_guard<std::mutex> lock(m_arrivedLock);
+        arrived.swap(m_arrived);
+    }
+    for (libusb_device* device : arrived) {
+        m_switcher->Probe(device);
+        libusb_unref_device(device);
+    }
+}
+
+int HUDeviceWatcher::hotplug_callback(libusb_device* device,
+                                      libusb_hotplug_event event) {
+    libusb_device_descriptor desc;
+    if (libusb_get_device_descriptor(device, &desc) < 0) {
+        return 0;
+    }
+    if (desc.bDeviceClass == LIBUSB_CLASS_HUB) {
+        // Never a phone, don't wake anyone up for the root hubs
+        return 0;
+    }
+    bool arrived = event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED;
+    logd("Device 0x%04x : 0x%04x %s", desc.idVendor, desc.idProduct,
+         arrived ? "arrived" : "left");
+    if (arrived && !HUAccessorySwitcher::IsAccessory(desc.idVendor,
+                                                     desc.idProduct)) {
+        // Handled by the event thread once this callback returns
+        std::lock_guard<std::mutex> lock(m_arrivedLock);
+        m_arrived.push_back(libusb_ref_device(device));
+    }
+    m_callback(desc.idVendor, desc.idProduct, arrived);
+    return 0;  // stay registered
+}
+
+int HUDeviceWatcher::hotplug_callback_tramp(libusb_context* /* unused */,
+                                            libusb_device* device,
+                                            libusb_hotplug_event event,
+                                            void* user_data) {
+    return reinterpret_cast<HUDeviceWatcher*>(user_data)
+        ->hotplug_callback(device, event);
+}
@@ -0,0 +1,57 @@
+#pragma once
+#include <libusb.h>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "hu_aoa.h"
+#include "hu_uti.h"
+
+namespace AndroidAuto {
+
+// Watches for USB devices coming and going using libusb hotplug events, so
+// the frontend only tries to connect when something was actually plugged in.
+// Phones that arrive in normal mode are switched to accessory mode on the
+// watcher's event thread and show up again as an accessory. Uses its own
+// libusb context and event thread; the callback runs on that thread and must
+// not block.
+class HUDeviceWatcher {
+   public:
+    typedef std::function<void(uint16_t vendor, uint16_t product,
+                               bool arrived)>
+        DeviceCallback;
+
+    HUDeviceWatcher(DeviceCallback callback);
+    ~HUDeviceWatcher();
+
+    // Fails if libusb can't report hotplug events on this platform, the
+    // caller has to fall back to polling in that case. Devices already
+    // connected are reported as arrived.
+    int Start();
+    void Stop();
+
+   private:
+    DeviceCallback m_callback;
+    libusb_context* m_usbContext = nullptr;
+    libusb_hotplug_callback_handle m_hotplugHandle;
+    bool m_hotplugRegistered = false;
+    int m_quit = 0;
+    std::thread m_thread;
+    std::unique_ptr<HUAccessorySwitcher> m_switcher;
+    // Devices to probe for AOA, libusb_open isn't allowed from the hotplug
+    // callback
+    std::mutex m_arrivedLock;
+    std::vector<libusb_device*> m_arrived;
+
+    void probe_arrived();
+
+    void event_thread_main();
+    int hotplug_callback(libusb_device* device, libusb_hotplug_event event);
+    static int LIBUSB_CALL hotplug_callback_tramp(libusb_context* ctx,
+                                                  libusb_device* device,
+                                                  libusb_hotplug_event event,
+                                                  void* user_data);
+};
+}
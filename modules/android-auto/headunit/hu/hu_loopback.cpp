@@ -0,0 +1,225 @@
+#define LOGTAG "hu_loopback"
+#include "hu_loopback.h"
+#include "hu_uti.h"  // Utilities
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <map>
+
+using namespace AndroidAuto;
+
+HULoopbackPipe::HULoopbackPipe(size_t capacity) : m_ring(capacity) {
+    m_dataFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    m_spaceFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_dataFd < 0 || m_spaceFd < 0) {
+        loge("eventfd failed errno: %d (%s)", errno, strerror(errno));
+        m_closed = true;
+    }
+}
+
+HULoopbackPipe::~HULoopbackPipe() {
+    if (m_dataFd >= 0) close(m_dataFd);
+    if (m_spaceFd >= 0) close(m_spaceFd);
+}
+
+int HULoopbackPipe::Write(const iovec* iov, int iovcnt, int tmo) {
+    const uint64_t deadline = hu_time_us() + (uint64_t)std::max(tmo, 0) * 1000;
+    int total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        const byte* buf = (const byte*)iov[i].iov_base;
+        size_t left = iov[i].iov_len;
+        while (left > 0) {
+            if (m_closed) {
+                return (-1);
+            }
+            bool wasEmpty = false;
+            size_t count = m_ring.write(buf, left, &wasEmpty);
+            if (wasEmpty) {
+                eventfd_write(m_dataFd, 1);
+            }
+            buf += count;
+            left -= count;
+            total += count;
+            if (left == 0) {
+                break;
+            }
+
+            // Full. Announce the wait before looking again, so a reader
+            // that frees space in between is sure to see the flag.
+            m_writerWaiting = true;
+            if (m_ring.writable() == 0) {
+                uint64_t now = hu_time_us();
+                if (now >= deadline) {
+                    m_writerWaiting = false;
+                    loge("Reader stalled for %d ms", tmo);
+                    return (-1);
+                }
+                pollfd pfd = {m_spaceFd, POLLIN, 0};
+                poll(&pfd, 1, (deadline - now + 999) / 1000);
+                eventfd_t value;
+                eventfd_read(m_spaceFd, &value);
+            }
+            m_writerWaiting = false;
+        }
+    }
+    return total;
+}
+
+int HULoopbackPipe::Read(byte* buf, size_t len) {
+    size_t count = m_ring.read(buf, len);
+    if (count > 0) {
+        if (m_writerWaiting) {
+            eventfd_write(m_spaceFd, 1);
+        }
+        return count;
+    }
+    // Closing comes after the last write, look again so nothing is lost
+    if (m_closed) {
+        count = m_ring.read(buf, len);
+        return count > 0 ? (int)count : -1;
+    }
+    return 0;
+}
+
+void HULoopbackPipe::ClearReadable() {
+    eventfd_t value;
+    eventfd_read(m_dataFd, &value);
+}
+
+void HULoopbackPipe::MarkReadable() { eventfd_write(m_dataFd, 1); }
+
+void HULoopbackPipe::Close() {
+    m_closed = true;
+    eventfd_write(m_dataFd, 1);
+    eventfd_write(m_spaceFd, 1);
+}
+
+static std::mutex loopback_links_lock;
+static std::map<std::string, std::shared_ptr<HULoopbackLink>> loopback_links;
+
+std::shared_ptr<HULoopbackLink> HULoopbackLink::Get(const std::string& name,
+                                                    size_t capacity) {
+    std::lock_guard<std::mutex> lock(loopback_links_lock);
+    std::shared_ptr<HULoopbackLink>& link = loopback_links[name];
+    if (!link) {
+        link = std::make_shared<HULoopbackLink>(capacity);
+    }
+    return link;
+}
+
+void HULoopbackLink::Remove(const std::string& name) {
+    std::lock_guard<std::mutex> lock(loopback_links_lock);
+    loopback_links.erase(name);
+}
+
+HUTransportStreamLoopback::HUTransportStreamLoopback(
+    std::map<std::string, std::string> _settings)
+    : HUTransportStream(_settings) {
+    if (_settings.count("loopback_name")) {
+        m_name = _settings["loopback_name"];
+    }
+    if (_settings.count("loopback_ring_size")) {
+        m_ringSize = std::max(atoi(_settings["loopback_ring_size"].c_str()),
+                              m_chunkSize);
+    }
+}
+
+HUTransportStreamLoopback::~HUTransportStreamLoopback() {
+    if (m_link) {
+        Stop();
+    }
+    for (HUTransportChunk* chunk : m_freeChunks) {
+        delete[] chunk->data;
+        delete chunk;
+    }
+}
+
+int HUTransportStreamLoopback::Start() {
+    if (m_link) {
+        return (0);
+    }
+    m_link = HULoopbackLink::Get(m_name, m_ringSize);
+    if (m_link->toHU.IsClosed() || m_link->fromHU.IsClosed()) {
+        // Left over from the last session, the peer makes a new one
+        loge("Loopback link %s is closed", m_name.c_str());
+        m_link.reset();
+        return (-1);
+    }
+    readfd = m_link->toHU.GetReadFD();
+    logd("Loopback link %s started", m_name.c_str());
+    return (0);
+}
+
+int HUTransportStreamLoopback::Stop() {
+    if (m_link) {
+        // The peer sees end of stream
+        m_link->fromHU.Close();
+        m_link.reset();
+    }
+    readfd = -1;
+    return (0);
+}
+
+int HUTransportStreamLoopback::SubmitWrite(const iovec* iov, int iovcnt,
+                                           int tmo, WriteCompletion done) {
+    int ret = -1;
+    {
+        std::lock_guard<std::mutex> lock(m_writeLock);
+        if (m_link) {
+            ret = m_link->fromHU.Write(iov, iovcnt, tmo);
+        }
+    }
+    if (done) done(ret);
+    return ret;
+}
+
+int HUTransportStreamLoopback::Poll(const ReceiveCallback& callback) {
+    if (!m_link) return (-1);
+
+    // Cleared first, everything written after this signals again
+    m_link->toHU.ClearReadable();
+    int count = 0;
+    size_t bytes = 0;
+    while (true) {
+        if (bytes >= m_ringSize) {
+            // A peer writing nonstop could keep the HU thread here, come
+            // back after the rest of the loop had its turn
+            m_link->toHU.MarkReadable();
+            break;
+        }
+        HUTransportChunk* chunk = nullptr;
+        if (m_freeChunks.empty()) {
+            chunk = new HUTransportChunk();
+            chunk->data = new byte[m_chunkSize];
+            chunk->capacity = m_chunkSize;
+            chunk->pool = this;
+        } else {
+            chunk = m_freeChunks.back();
+            m_freeChunks.pop_back();
+        }
+        HUTransportChunkPtr owned(chunk);
+
+        int ret = m_link->toHU.Read(chunk->data, chunk->capacity);
+        if (ret == 0) break;
+        if (ret < 0) {
+            logd("Loopback peer closed");
+            if (count > 0) {
+                // Report the end on the next call
+                m_link->toHU.MarkReadable();
+                return count;
+            }
+            return (-1);
+        }
+        chunk->len = ret;
+        bytes += ret;
+        callback(std::move(owned));
+        count++;
+    }
+    return count;
+}
+
+void HUTransportStreamLoopback::Recycle(HUTransportChunk* chunk) {
+    chunk->len = 0;
+    m_freeChunks.push_back(chunk);
+}
@@ -0,0 +1,92 @@
+#pragma once
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "hu_aap.h"
+#include "hu_ring.h"
+
+namespace AndroidAuto {
+
+// One direction of a loopback link: a byte ring with an eventfd that wakes
+// the reader and one that wakes a writer waiting for space. Same threading
+// rules as HUByteRing, one writer thread and one reader thread.
+class HULoopbackPipe {
+   public:
+    explicit HULoopbackPipe(size_t capacity);
+    ~HULoopbackPipe();
+    HULoopbackPipe(const HULoopbackPipe&) = delete;
+    HULoopbackPipe& operator=(const HULoopbackPipe&) = delete;
+
+    // Writes all of iov, waiting at most tmo ms for the reader to make room.
+    // Returns the byte count, -1 on timeout or once closed. A timeout can
+    // leave part of the data written, the stream is broken after that.
+    int Write(const iovec* iov, int iovcnt, int tmo);
+    // Copies out up to len bytes without waiting, 0 if there is nothing
+    // yet, -1 once closed and drained
+    int Read(byte* buf, size_t len);
+    // Readable when Read() has something. Read() until it returns 0 after
+    // clearing it with ClearReadable(), there is no second wakeup.
+    inline int GetReadFD() const { return m_dataFd; }
+    void ClearReadable();
+    // Makes the reader come back without new data
+    void MarkReadable();
+
+    // Either side, wakes both ends
+    void Close();
+    inline bool IsClosed() const { return m_closed.load(); }
+
+   private:
+    HUByteRing m_ring;
+    int m_dataFd = -1;
+    int m_spaceFd = -1;
+    std::atomic<bool> m_writerWaiting{false};
+    std::atomic<bool> m_closed{false};
+};
+
+// Both directions between HUServer and an in-process peer such as a phone
+// simulator or a benchmark. Links are looked up by name, so the peer and
+// transport_type=loopback (loopback_name) find each other without any
+// plumbing through HUServer. The peer should create the link before the
+// server starts.
+class HULoopbackLink {
+   public:
+    HULoopbackLink(size_t capacity) : toHU(capacity), fromHU(capacity) {}
+
+    HULoopbackPipe toHU;
+    HULoopbackPipe fromHU;
+
+    // Creates the link on first use, capacity only applies then
+    static std::shared_ptr<HULoopbackLink> Get(const std::string& name,
+                                               size_t capacity = 1048576);
+    // Drops the registry's reference, current users keep theirs
+    static void Remove(const std::string& name);
+};
+
+// Transport for transport_type=loopback, the HU end of a HULoopbackLink.
+// Measures framing, TLS and dispatch without USB or network in the way.
+class HUTransportStreamLoopback : public HUTransportStream,
+                                  private HUTransportChunkPool {
+   public:
+    ~HUTransportStreamLoopback();
+    HUTransportStreamLoopback(std::map<std::string, std::string> _settings);
+    virtual int Start() override;
+    virtual int Stop() override;
+    virtual int SubmitWrite(const iovec* iov, int iovcnt, int tmo,
+                            WriteCompletion done = nullptr) override;
+    virtual int Poll(const ReceiveCallback& callback) override;
+
+   private:
+    std::string m_name = "default";
+    size_t m_ringSize = 1048576;
+    std::shared_ptr<HULoopbackLink> m_link;
+    // The pipe takes one writer, HUServer may write from other threads
+    std::mutex m_writeLock;
+
+    // Receive chunks, only touched from the HU thread
+    std::vector<HUTransportChunk*> m_freeChunks;
+    int m_chunkSize = 16384;
+    virtual void Recycle(HUTransportChunk* chunk) override;
+};
+}
@@ -0,0 +1,59 @@
+#include "hu_pool.h"
+
+#include <algorithm>
+
+using namespace AndroidAuto;
+
+// Smallest class holding size, CLASS_COUNT if none does
+static int size_class(size_t size) {
+    int cls = 0;
+    while (cls < HUBufferPool::CLASS_COUNT &&
+           ((size_t)1 << (HUBufferPool::MIN_CLASS_SHIFT + cls)) < size) {
+        cls++;
+    }
+    return cls;
+}
+
+HUBuffer HUBufferPool::Acquire(size_t size) {
+    m_stats.acquired++;
+    m_stats.peakSize = std::max(m_stats.peakSize, size);
+
+    HUBuffer buffer;
+    int cls = size_class(size);
+    if (cls == CLASS_COUNT) {
+        m_stats.unpooled++;
+        buffer.data.reset(new byte[size]);
+        buffer.capacity = size;
+        return buffer;
+    }
+    if (!m_free[cls].empty()) {
+        m_stats.reused++;
+        buffer = std::move(m_free[cls].back());
+        m_free[cls].pop_back();
+        return buffer;
+    }
+    buffer.capacity = (size_t)1 << (MIN_CLASS_SHIFT + cls);
+    buffer.data.reset(new byte[buffer.capacity]);
+    return buffer;
+}
+
+void HUBufferPool::Release(HUBuffer&& buffer) {
+    if (!buffer) {
+        return;
+    }
+    int cls = size_class(buffer.capacity);
+    // Only exact class sizes go back, anything else is freed here
+    if (cls < CLASS_COUNT &&
+        buffer.capacity == (size_t)1 << (MIN_CLASS_SHIFT + cls) &&
+        m_free[cls].size() < FREE_PER_CLASS) {
+        m_free[cls].push_back(std::move(buffer));
+    }
+    buffer.data.reset();
+    buffer.capacity = 0;
+}
+
+void HUBufferPool::Clear() {
+    for (std::vector<HUBuffer>& list : m_free) {
+        list.clear();
+    }
+}
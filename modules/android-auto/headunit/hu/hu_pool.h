@@ -0,0 +1,41 @@
+#pragma once
+#include <stdint.h>
+#include <memory>
+#include <vector>
+#include "hu_uti.h"
+
+namespace AndroidAuto {
+
+// A buffer from HUBufferPool. Frees itself if it's never given back.
+struct HUBuffer {
+    std::unique_ptr<byte[]> data;
+    size_t capacity = 0;
+    explicit operator bool() const { return data != nullptr; }
+};
+
+// Buffers in power of two size classes from 1 KB to 1 MB, kept for reuse
+// once released, a few per class. Bigger ones are allocated to size and
+// freed on release. Not thread safe, one pool per thread.
+class HUBufferPool {
+   public:
+    enum { MIN_CLASS_SHIFT = 10, CLASS_COUNT = 11, FREE_PER_CLASS = 4 };
+
+    // At least size bytes, contents undefined
+    HUBuffer Acquire(size_t size);
+    void Release(HUBuffer&& buffer);
+    // Frees everything kept for reuse
+    void Clear();
+
+    struct Stats {
+        uint64_t acquired = 0;
+        uint64_t reused = 0;    // acquired off a free list
+        uint64_t unpooled = 0;  // bigger than the largest class
+        size_t peakSize = 0;    // largest size asked for
+    };
+    inline const Stats& GetStats() const { return m_stats; }
+
+   private:
+    std::vector<HUBuffer> m_free[CLASS_COUNT];
+    Stats m_stats;
+};
+}
@@ -0,0 +1,129 @@
+#pragma once
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <vector>
+#include "hu_uti.h"
+
+namespace AndroidAuto {
+
+// Lock-free single-producer/single-consumer byte ring. Exactly one thread may
+// call write() and exactly one other thread may call read(); readable() and
+// writable() are safe from either side. reset() is not thread safe.
+class HUByteRing {
+   public:
+    explicit HUByteRing(size_t capacity = 0) { reset(capacity); }
+
+    // Capacity is rounded up to a power of two
+    void reset(size_t capacity) {
+        size_t size = 1;
+        while (size < capacity) size <<= 1;
+        m_data.assign(capacity ? size : 0, 0);
+        m_mask = capacity ? size - 1 : 0;
+        m_head.store(0);
+        m_tail.store(0);
+    }
+
+    inline size_t capacity() const { return m_data.size(); }
+    inline size_t readable() const { return m_head.load() - m_tail.load(); }
+    inline size_t writable() const { return capacity() - readable(); }
+
+    // Producer side. Copies as much as fits and returns the byte count.
+    // wasEmpty is set when the consumer had drained everything before this
+    // write, i.e. when it may be sleeping and needs a wakeup.
+    size_t write(const byte* buf, size_t len, bool* wasEmpty = nullptr) {
+        const size_t head = m_head.load(std::memory_order_relaxed);
+        const size_t count =
+            std::min(len, capacity() - (head - m_tail.load()));
+        if (count > 0) {
+            const size_t offset = head & m_mask;
+            const size_t first = std::min(count, capacity() - offset);
+            memcpy(&m_data[offset], buf, first);
+            memcpy(&m_data[0], buf + first, count - first);
+            m_head.store(head + count);
+        }
+        // Must be loaded after the head store, otherwise a consumer that
+        // catches up in between could go to sleep without being woken
+        if (wasEmpty) *wasEmpty = count > 0 && m_tail.load() == head;
+        return count;
+    }
+
+    // Consumer side. Returns the number of bytes copied, 0 if empty.
+    size_t read(byte* buf, size_t len) {
+        const size_t tail = m_tail.load(std::memory_order_relaxed);
+        const size_t count = std::min(len, m_head.load() - tail);
+        if (count > 0) {
+            const size_t offset = tail & m_mask;
+            const size_t first = std::min(count, capacity() - offset);
+            memcpy(buf, &m_data[offset], first);
+            memcpy(buf + first, &m_data[0], count - first);
+            m_tail.store(tail + count);
+        }
+        return count;
+    }
+
+   private:
+    std::vector<byte> m_data;
+    size_t m_mask = 0;
+    // Free-running positions, padded onto separate cache lines so the two
+    // threads don't bounce each other's line on every access. Padding rather
+    // than alignas, over-aligned new isn't available before C++17.
+    char m_pad0[64];
+    std::atomic<size_t> m_head{0};  // written by the producer
+    char m_pad1[64 - sizeof(std::atomic<size_t>)];
+    std::atomic<size_t> m_tail{0};  // written by the consumer
+};
+
+// Lock-free single-producer/single-consumer queue of small values, typically
+// pointers, with the same threading rules as HUByteRing.
+template <typename T>
+class HUSpscQueue {
+   public:
+    explicit HUSpscQueue(size_t capacity = 0) { reset(capacity); }
+
+    // Capacity is rounded up to a power of two
+    void reset(size_t capacity) {
+        size_t size = 1;
+        while (size < capacity) size <<= 1;
+        m_items.assign(capacity ? size : 0, T());
+        m_mask = capacity ? size - 1 : 0;
+        m_head.store(0);
+        m_tail.store(0);
+    }
+
+    inline size_t capacity() const { return m_items.size(); }
+    inline size_t size() const { return m_head.load() - m_tail.load(); }
+    inline bool empty() const { return size() == 0; }
+
+    // Producer side. wasEmpty has the same meaning as for HUByteRing::write.
+    bool push(const T& item, bool* wasEmpty = nullptr) {
+        const size_t head = m_head.load(std::memory_order_relaxed);
+        if (head - m_tail.load() == capacity()) {
+            return false;
+        }
+        m_items[head & m_mask] = item;
+        m_head.store(head + 1);
+        if (wasEmpty) *wasEmpty = m_tail.load() == head;
+        return true;
+    }
+
+    // Consumer side
+    bool pop(T& item) {
+        const size_t tail = m_tail.load(std::memory_order_relaxed);
+        if (m_head.load() == tail) {
+            return false;
+        }
+        item = m_items[tail & m_mask];
+        m_tail.store(tail + 1);
+        return true;
+    }
+
+   private:
+    std::vector<T> m_items;
+    size_t m_mask = 0;
+    char m_pad0[64];
+    std::atomic<size_t> m_head{0};  // written by the producer
+    char m_pad1[64 - sizeof(std::atomic<size_t>)];
+    std::atomic<size_t> m_tail{0};  // written by the consumer
+};
+}
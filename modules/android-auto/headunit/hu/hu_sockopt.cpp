@@ -0,0 +1,112 @@
+#include "hu_sockopt.h"
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL 46
+#endif
+#ifndef TCP_NOTSENT_LOWAT
+#define TCP_NOTSENT_LOWAT 25
+#endif
+
+using namespace AndroidAuto;
+
+static std::map<std::string, HUSocketProfile> make_profiles() {
+    std::map<std::string, HUSocketProfile> profiles;
+
+    HUSocketProfile& def = profiles["default"];
+    def.name = "default";
+
+    // A 1080p key frame is a few hundred KB arriving in one burst. Make
+    // the receive window big enough to take it without stalling the
+    // phone, and keep the unsent queue short so input and audio going
+    // out don't sit behind a full send buffer.
+    HUSocketProfile& wireless = profiles["wireless"];
+    wireless.name = "wireless";
+    wireless.rcvbuf = 4 * 1024 * 1024;
+    wireless.sndbuf = 1024 * 1024;
+    wireless.notsentLowat = 128 * 1024;
+    wireless.quickack = true;
+
+    // Trades CPU for wakeup latency
+    HUSocketProfile& lowlatency = profiles["lowlatency"];
+    lowlatency.name = "lowlatency";
+    lowlatency.rcvbuf = 1024 * 1024;
+    lowlatency.sndbuf = 256 * 1024;
+    lowlatency.notsentLowat = 16 * 1024;
+    lowlatency.busyPollUs = 50;
+    lowlatency.quickack = true;
+
+    return profiles;
+}
+
+const std::map<std::string, HUSocketProfile>& AndroidAuto::hu_socket_profiles() {
+    static const std::map<std::string, HUSocketProfile> profiles =
+        make_profiles();
+    return profiles;
+}
+
+bool AndroidAuto::hu_socket_profile_from_settings(
+    const std::map<std::string, std::string>& settings,
+    HUSocketProfile& profile) {
+    const auto& profiles = hu_socket_profiles();
+    profile = profiles.at("default");
+    bool known = true;
+
+    auto it = settings.find("tcp_socket_profile");
+    if (it != settings.end() && !it->second.empty()) {
+        auto found = profiles.find(it->second);
+        if (found != profiles.end()) {
+            profile = found->second;
+        } else {
+            known = false;
+        }
+    }
+
+    auto override_int = [&settings](const char* key, int& value) {
+        auto it = settings.find(key);
+        if (it != settings.end() && !it->second.empty()) {
+            value = atoi(it->second.c_str());
+        }
+    };
+    override_int("tcp_rcvbuf", profile.rcvbuf);
+    override_int("tcp_sndbuf", profile.sndbuf);
+    override_int("tcp_notsent_lowat", profile.notsentLowat);
+    override_int("tcp_busy_poll", profile.busyPollUs);
+    it = settings.find("tcp_quickack");
+    if (it != settings.end() && !it->second.empty()) {
+        profile.quickack = it->second == "1";
+    }
+    return known;
+}
+
+int AndroidAuto::hu_socket_profile_apply(int fd,
+                                         const HUSocketProfile& profile) {
+    int refused = 0;
+    auto set = [fd, &refused](int level, int name, int value) {
+        if (setsockopt(fd, level, name, &value, sizeof(value)) != 0) {
+            refused++;
+        }
+    };
+
+    set(SOL_TCP, TCP_NODELAY, 1);
+    if (profile.rcvbuf > 0) set(SOL_SOCKET, SO_RCVBUF, profile.rcvbuf);
+    if (profile.sndbuf > 0) set(SOL_SOCKET, SO_SNDBUF, profile.sndbuf);
+    if (profile.notsentLowat > 0)
+        set(SOL_TCP, TCP_NOTSENT_LOWAT, profile.notsentLowat);
+    // Needs CAP_NET_ADMIN for anything above net.core.busy_poll
+    if (profile.busyPollUs > 0)
+        set(SOL_SOCKET, SO_BUSY_POLL, profile.busyPollUs);
+    if (profile.quickack) set(SOL_TCP, TCP_QUICKACK, 1);
+    return refused;
+}
+
+void AndroidAuto::hu_socket_profile_rearm(int fd,
+                                          const HUSocketProfile& profile) {
+    if (profile.quickack) {
+        int flag = 1;
+        setsockopt(fd, SOL_TCP, TCP_QUICKACK, &flag, sizeof(flag));
+    }
+}
@@ -0,0 +1,38 @@
+#pragma once
+#include <map>
+#include <string>
+
+namespace AndroidAuto {
+
+// Socket options for one kind of link. 0 leaves the kernel default. Kept
+// free of the rest of the library so tools can share it.
+struct HUSocketProfile {
+    std::string name;
+    int rcvbuf = 0;         // SO_RCVBUF bytes
+    int sndbuf = 0;         // SO_SNDBUF bytes
+    int notsentLowat = 0;   // TCP_NOTSENT_LOWAT bytes
+    int busyPollUs = 0;     // SO_BUSY_POLL
+    bool quickack = false;  // TCP_QUICKACK, has to be re-armed after reads
+};
+
+// "default" (kernel defaults, TCP_NODELAY only), "wireless" (big buffers for
+// 1080p bursts over Wi-Fi) and "lowlatency" (busy polling, small unsent
+// queue)
+const std::map<std::string, HUSocketProfile>& hu_socket_profiles();
+
+// Looks up settings["tcp_socket_profile"], then applies the per-option
+// overrides tcp_rcvbuf, tcp_sndbuf, tcp_notsent_lowat, tcp_busy_poll and
+// tcp_quickack. Returns false for an unknown profile name, profile is left
+// at "default" in that case.
+bool hu_socket_profile_from_settings(
+    const std::map<std::string, std::string>& settings,
+    HUSocketProfile& profile);
+
+// Sets TCP_NODELAY and everything in profile on fd. Buffer sizes only fully
+// take effect before connect() or listen(). Returns the number of options the
+// kernel refused.
+int hu_socket_profile_apply(int fd, const HUSocketProfile& profile);
+
+// Re-arms TCP_QUICKACK if the profile wants it, call after each read
+void hu_socket_profile_rearm(int fd, const HUSocketProfile& profile);
+}
@@ -11,6 +11,8 @@
 #include <openssl/x509.h>
 #include <openssl/x509_vfy.h>
 #include <pthread.h>
+#include <mutex>
+#include "hu_cipher.h"
 #include "hu_ssl.h"
 
 using namespace AndroidAuto;
@@ -99,102 +101,171 @@ int HUServer::sendSSLHandshakePacket() {
     return (0);
 }
 
-int HUServer::beginSSLHandshake() {
-    int ret;
-    BIO *cert_bio = NULL;
-    BIO *pkey_bio = NULL;
-
-    ret = SSL_library_init();  // Init
-    logd("SSL_library_init ret: %d", ret);
-    if (ret !=
-        1) {  // Always returns "1", so it is safe to discard the return value.
-        loge("SSL_library_init() error");
-        return (-1);
-    }
-
-    SSL_load_error_strings();  // Before or after init ?
-    ERR_load_BIO_strings();
-    ERR_load_crypto_strings();
-    ERR_load_SSL_strings();
+// Library setup, the certificate and key parsed and a context holding them,
+// once per process. The context isn't changed after this, every session
+// makes its SSL from it. NULL if any of it failed.
+static SSL_CTX *hu_ssl_context() {
+    static SSL_CTX *const context = []() -> SSL_CTX * {
+        uint64_t begin = hu_time_us();
+        int ret = SSL_library_init();  // Init
+        logd("SSL_library_init ret: %d", ret);
+        if (ret != 1) {  // Always returns "1", so it is safe to discard the
+                         // return value.
+            loge("SSL_library_init() error");
+            return NULL;
+        }
+
+        SSL_load_error_strings();  // Before or after init ?
+        ERR_load_BIO_strings();
+        ERR_load_crypto_strings();
+        ERR_load_SSL_strings();
+
+        OPENSSL_add_all_algorithms_noconf();  // Add all algorithms, without
+                                              // using config file
+
+        ret = RAND_status();  // 1 if the PRNG has been seeded with enough
+                              // data, 0 otherwise.
+        logd("RAND_status ret: %d", ret);
+        if (ret != 1) {
+            loge("RAND_status() error");
+            return NULL;
+        }
+
+        BIO *cert_bio = BIO_new_mem_buf(
+            cert_buf, sizeof(cert_buf));  // Read only memory BIO for certificate
+        X509 *x509_cert = PEM_read_bio_X509_AUX(cert_bio, NULL, NULL, NULL);
+        BIO_free(cert_bio);
+        if (x509_cert == NULL) {
+            loge("read_bio_X509_AUX() error");
+            return NULL;
+        }
+
+        BIO *pkey_bio = BIO_new_mem_buf(
+            pkey_buf, sizeof(pkey_buf));  // Read only memory BIO for private key
+        EVP_PKEY *priv_key = PEM_read_bio_PrivateKey(pkey_bio, NULL, NULL, NULL);
+        BIO_free(pkey_bio);
+        if (priv_key == NULL) {
+            loge("PEM_read_bio_PrivateKey() error");
+            X509_free(x509_cert);
+            return NULL;
+        }
+
+        SSL_CTX *ctx = SSL_CTX_new(TLSv1_2_client_method());
+        if (ctx == NULL) {
+            loge("SSL_CTX_new() error");
+            X509_free(x509_cert);
+            EVP_PKEY_free(priv_key);
+            return NULL;
+        }
+
+        // The context takes its own references
+        if (SSL_CTX_use_certificate(ctx, x509_cert) != 1)
+            loge("SSL_CTX_use_certificate() error");
+        if (SSL_CTX_use_PrivateKey(ctx, priv_key) != 1)
+            loge("SSL_CTX_use_PrivateKey() error");
+        X509_free(x509_cert);
+        EVP_PKEY_free(priv_key);
+
+        if (SSL_CTX_check_private_key(ctx) != 1) {
+            loge("SSL_CTX_check_private_key() error");
+            SSL_CTX_free(ctx);
+            return NULL;
+        }
+        SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, NULL);
+
+        logi("SSL context ready in %.2f ms", (hu_time_us() - begin) / 1000.0);
+        return ctx;
+    }();
+    return context;
+}
 
-    OPENSSL_add_all_algorithms_noconf();  // Add all algorithms, without using
-                                          // config file
+// The last session a phone gave us, offered on the next handshake so a
+// reconnect can skip the key exchange. Shared by every HUServer, a phone
+// that doesn't know it just does a full handshake.
+static std::mutex resume_lock;
+static SSL_SESSION *resume_session = NULL;
+static struct {
+    uint64_t full = 0;
+    uint64_t resumed = 0;
+    uint64_t fullUs = 0;
+    uint64_t resumedUs = 0;
+} handshake_stats;
+
+// The context's suites with the ones this CPU decrypts fastest first.
+// Benchmarked once per process, about 15 ms.
+static const std::string &auto_cipher_list(SSL_CTX *context) {
+    static const std::string list = [context]() -> std::string {
+        std::vector<HUCipherResult> results = hu_cipher_bench();
+        for (const HUCipherResult &result : results) {
+            logi("Cipher benchmark: %-18s %8.1f MB/s decrypting %zu byte "
+                 "records",
+                 result.name.c_str(), result.mbPerSec, result.recordBytes);
+        }
+        // What a connection would offer by default
+        std::vector<std::string> suites;
+        SSL *ssl = SSL_new(context);
+        STACK_OF(SSL_CIPHER) *ciphers =
+            ssl ? SSL_get1_supported_ciphers(ssl) : NULL;
+        for (int i = 0; ciphers && i < sk_SSL_CIPHER_num(ciphers); i++) {
+            suites.push_back(
+                SSL_CIPHER_get_name(sk_SSL_CIPHER_value(ciphers, i)));
+        }
+        sk_SSL_CIPHER_free(ciphers);
+        SSL_free(ssl);
+        std::string ret = hu_cipher_preference(suites, results);
+        logi("Cipher preference: %s", ret.c_str());
+        return ret;
+    }();
+    return list;
+}
 
-    ret = RAND_status();  // 1 if the PRNG has been seeded with enough data, 0
-                          // otherwise.
-    logd("RAND_status ret: %d", ret);
-    if (ret != 1) {
-        loge("RAND_status() error");
+int HUServer::prepareSSL() {
+    SSL_CTX *context = hu_ssl_context();
+    if (context == NULL) {
         return (-1);
     }
-
-    cert_bio = BIO_new_mem_buf(
-        cert_buf, sizeof(cert_buf));  // Read only memory BIO for certificate
-    pem_password_cb *ppcb1 = NULL;
-    void *u1 = NULL;
-    X509 *x509 = NULL;
-    X509 *x509_cert = PEM_read_bio_X509_AUX(cert_bio, &x509, ppcb1, u1);
-    if (x509_cert == NULL) {
-        loge("read_bio_X509_AUX() error");
-        return (-1);
+    if (m_cipherList == "auto") {
+        m_cipherList = auto_cipher_list(context);
     }
-    logd("PEM_read_bio_X509_AUX() x509_cert: %p", x509_cert);
-    ret = BIO_free(cert_bio);
-    if (ret != 1)
-        loge("BIO_free(cert_bio) ret: %d", ret);
-    else
-        logd("BIO_free(cert_bio) ret: %d", ret);
-
-    pkey_bio = BIO_new_mem_buf(
-        pkey_buf, sizeof(pkey_buf));  // Read only memory BIO for private key
-    pem_password_cb *ppcb2 = NULL;
-    void *u2 = NULL;
-    // Read a private key from a BIO using a pass phrase callback:    key =
-    // PEM_read_bio_PrivateKey(bp, NULL, pass_cb,  "My Private Key"); Read a
-    // private key from a BIO using the pass phrase "hello":   key =
-    // PEM_read_bio_PrivateKey(bp, NULL, 0,        "hello");
-    EVP_PKEY *priv_key_ret = NULL;
-    EVP_PKEY *priv_key =
-        PEM_read_bio_PrivateKey(pkey_bio, &priv_key_ret, ppcb2, u2);
-    if (priv_key == NULL) {
-        loge("PEM_read_bio_PrivateKey() error");
-        return (-1);
+    if (!m_cipherList.empty()) {
+        // Checked on a spare connection, a failed SSL_set_cipher_list() can
+        // leave one without ciphers
+        SSL *ssl = SSL_new(context);
+        if (!ssl || SSL_set_cipher_list(ssl, m_cipherList.c_str()) != 1) {
+            loge("No usable cipher in ssl_cipher_list \"%s\", using the "
+                 "default list",
+                 m_cipherList.c_str());
+            m_cipherList.clear();
+        }
+        SSL_free(ssl);
     }
-    logd("PEM_read_bio_PrivateKey() priv_key: %p", priv_key);
-    ret = BIO_free(pkey_bio);
-    if (ret != 1)
-        loge("BIO_free(pkey_bio) ret: %d", ret);
-    else
-        logd("BIO_free(pkey_bio) ret: %d", ret);
+    return 0;
+}
 
-    m_sslMethod = (SSL_METHOD *)TLSv1_2_client_method();
-    if (m_sslMethod == NULL) {
-        loge("TLSv1_2_client_method() error");
-        return (-1);
+void HUServer::freeSSL() {
+    if (m_ssl) {
+        // Links just drop, there's no close_notify. Without this OpenSSL
+        // takes the session for a broken one and won't resume it.
+        if (SSL_is_init_finished(m_ssl)) {
+            SSL_set_shutdown(m_ssl, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+        }
+        SSL_free(m_ssl);  // And the BIOs with it
     }
-    logd("TLSv1_2_client_method() hu_ssl_method: %p", m_sslMethod);
+    m_ssl = nullptr;
+    m_sslWriteBio = nullptr;
+    m_sslReadBio = nullptr;
+}
 
-    m_sslContext = SSL_CTX_new(m_sslMethod);
-    if (m_sslContext == NULL) {
-        loge("SSL_CTX_new() error");
+int HUServer::beginSSLHandshake() {
+    int ret;
+    SSL_CTX *context = hu_ssl_context();
+    if (context == NULL) {
         return (-1);
     }
-    logd("SSL_CTX_new() hu_ssl_ctx: %p", m_sslContext);
-
-    ret = SSL_CTX_use_certificate(m_sslContext, x509_cert);
-    if (ret != 1)
-        loge("SSL_CTX_use_certificate() ret: %d", ret);
-    else
-        logd("SSL_CTX_use_certificate() ret: %d", ret);
-
-    ret = SSL_CTX_use_PrivateKey(m_sslContext, priv_key);
-    if (ret != 1)
-        loge("SSL_CTX_use_PrivateKey() ret: %d", ret);
-    else
-        logd("SSL_CTX_use_PrivateKey() ret: %d", ret);
 
-    // Must do all CTX setup before SSL_new() !!
-    m_ssl = SSL_new(m_sslContext);
+    uint64_t begin = hu_time_us();
+    freeSSL();  // The last session's
+    m_ssl = SSL_new(context);
     if (m_ssl == NULL) {
         loge("SSL_new() hu_ssl_ssl: %p", m_ssl);
         return (-1);
@@ -204,13 +275,6 @@ int HUServer::beginSSLHandshake() {
     //	SSL_set_mode (hu_ssl_ssl, SSL_OP_NO_TLSv1|SSL_OP_NO_TLSv1_1
     //|SSL_OP_NO_SSLv2|SSL_OP_NO_SSLv3);
 
-    ret = SSL_check_private_key(m_ssl);
-    if (ret != 1) {
-        loge("SSL_check_private_key() ret: %d", ret);
-        return (-1);
-    }
-    logd("SSL_check_private_key() ret: %d", ret);
-
     m_sslWriteBio = BIO_new(BIO_s_mem());
     if (m_sslWriteBio == NULL) {
         loge("BIO_new() hu_ssl_rm_bio: %p", m_sslWriteBio);
@@ -221,6 +285,8 @@ int HUServer::beginSSLHandshake() {
     m_sslReadBio = BIO_new(BIO_s_mem());
     if (m_sslReadBio == NULL) {
         loge("BIO_new() hu_ssl_wm_bio: %p", m_sslReadBio);
+        BIO_free(m_sslWriteBio);
+        m_sslWriteBio = NULL;
         return (-1);
     }
     logd("BIO_new() hu_ssl_wm_bio: %p", m_sslReadBio);
@@ -235,7 +301,21 @@ int HUServer::beginSSLHandshake() {
 
     SSL_set_connect_state(m_ssl);  // Set ssl to work in client mode
 
-    SSL_set_verify(m_ssl, SSL_VERIFY_NONE, NULL);
+    if (!m_cipherList.empty() &&
+        SSL_set_cipher_list(m_ssl, m_cipherList.c_str()) != 1) {
+        loge("SSL_set_cipher_list() error");  // Was fine in prepareSSL()
+        return (-1);
+    }
+
+    m_sessionOffered = false;
+    if (m_tlsResume) {
+        std::lock_guard<std::mutex> lock(resume_lock);
+        if (resume_session && SSL_set_session(m_ssl, resume_session) == 1) {
+            m_sessionOffered = true;
+        }
+    }
+    m_handshakeBeginUs = hu_time_us();
+    m_sslSetupUs = m_handshakeBeginUs - begin;
 
     ret = SSL_do_handshake(m_ssl);  // Do current handshake step processing
     logd("SSL_do_handshake() ret: %d", ret);
@@ -246,9 +326,141 @@ int HUServer::beginSSLHandshake() {
         return sendSSLHandshakePacket();
     }
 
+    forgetSSLSession();
     return (-1);
 }
 
+void HUServer::forgetSSLSession() {
+    if (!m_sessionOffered) {
+        return;
+    }
+    // Maybe the phone choked on it, the next attempt starts from scratch
+    logw("Handshake failed with a resumed session offered, dropping it");
+    std::lock_guard<std::mutex> lock(resume_lock);
+    if (resume_session) {
+        SSL_SESSION_free(resume_session);
+        resume_session = NULL;
+    }
+    m_sessionOffered = false;
+}
+
+void HUServer::handshakeDone() {
+    uint64_t elapsed = hu_time_us() - m_handshakeBeginUs;
+    bool resumed = SSL_session_reused(m_ssl);
+    const char *cipher = SSL_CIPHER_get_name(SSL_get_current_cipher(m_ssl));
+    m_tlsCounters.cipher.store(cipher, std::memory_order_relaxed);
+    std::lock_guard<std::mutex> lock(resume_lock);
+    if (resumed) {
+        handshake_stats.resumed++;
+        handshake_stats.resumedUs += elapsed;
+    } else {
+        handshake_stats.full++;
+        handshake_stats.fullUs += elapsed;
+    }
+    if (m_tlsResume) {  // The phone may have sent a new ticket
+        SSL_SESSION *session = SSL_get1_session(m_ssl);
+        if (resume_session) {
+            SSL_SESSION_free(resume_session);
+        }
+        resume_session = session;
+    }
+
+    const auto &st = handshake_stats;
+    logi("TLS handshake %s in %.2f ms using %s, %llu of %llu resumed, "
+         "%.2f ms resumed vs %.2f ms full on average",
+         resumed ? "resumed" : (m_sessionOffered ? "full, session refused"
+                                                 : "full"),
+         elapsed / 1000.0, cipher, (unsigned long long)st.resumed,
+         (unsigned long long)(st.resumed + st.full),
+         st.resumed ? st.resumedUs / 1000.0 / st.resumed : 0.0,
+         st.full ? st.fullUs / 1000.0 / st.full : 0.0);
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+// A BIO that copies what the SSL writes to wherever the RecordSink points,
+// the record goes straight to its frame instead of through a memory BIO
+static int record_sink_write(BIO *bio, const char *buf, int len) {
+    auto *sink = static_cast<HURecordSink *>(BIO_get_data(bio));
+    if (sink == NULL || sink->out == NULL || sink->len + len > sink->room) {
+        return (-1);  // Nowhere to put it, SSL_read() has nothing to send
+    }
+    memcpy(&sink->out[sink->len], buf, len);
+    sink->len += len;
+    return len;
+}
+
+static long record_sink_ctrl(BIO *, int cmd, long, void *) {
+    return cmd == BIO_CTRL_FLUSH ? 1 : 0;
+}
+
+static int record_sink_create(BIO *bio) {
+    BIO_set_init(bio, 1);
+    return 1;
+}
+
+static BIO_METHOD *record_sink_method() {
+    static BIO_METHOD *const method = []() -> BIO_METHOD * {
+        BIO_METHOD *m = BIO_meth_new(
+            BIO_get_new_index() | BIO_TYPE_SOURCE_SINK, "hu record sink");
+        if (m == NULL) {
+            return NULL;
+        }
+        BIO_meth_set_write(m, record_sink_write);
+        BIO_meth_set_ctrl(m, record_sink_ctrl);
+        BIO_meth_set_create(m, record_sink_create);
+        return m;
+    }();
+    return method;
+}
+#endif
+
+void HUServer::useRecordSink() {
+    m_recordSink = HURecordSink();
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+    BIO_METHOD *method = record_sink_method();
+    BIO *sink = method ? BIO_new(method) : NULL;
+    if (sink == NULL) {
+        logw("No record sink, records are copied through a memory BIO");
+        return;
+    }
+    BIO_set_data(sink, &m_recordSink);
+    SSL_set0_wbio(m_ssl, sink);  // Frees the memory BIO
+    m_sslReadBio = sink;
+    m_recordSink.active = true;
+#endif
+}
+
+int HUServer::encryptRecord(const byte *buf, int len, byte *out,
+                            size_t room) {
+    m_recordSink.out = out;
+    m_recordSink.room = room;
+    m_recordSink.len = 0;
+    int bytes_written = SSL_write(m_ssl, buf, len);  // Write plaintext to SSL
+    m_recordSink.out = nullptr;
+    if (bytes_written != len) {
+        loge("SSL_write() len: %d  bytes_written: %d", len, bytes_written);
+        logSSLReturnCode(bytes_written);
+        logSSLInfo();
+        return (-1);
+    }
+
+    int record_len = (int)m_recordSink.len;
+    if (!m_recordSink.active) {
+        record_len = BIO_read(m_sslReadBio, out,
+                              room);  // Read encrypted from SSL BIO
+        if (record_len <= 0 || BIO_ctrl_pending(m_sslReadBio) > 0) {
+            loge("BIO_read() bytes_read: %d, %d left over", record_len,
+                 (int)BIO_ctrl_pending(m_sslReadBio));
+            return (-1);
+        }
+    }
+    m_sendBatchStats.copiedBytes +=
+        m_recordSink.active ? record_len : 2 * record_len;
+    if (m_logSends)
+        logd("SSL_write() len: %d  record: %d", len, record_len);
+    return record_len;
+}
+
 int HUServer::handleSSLHandshake(byte *buf, int len) {
     int ret =
         BIO_write(m_sslWriteBio, buf, len);  // Write to the BIO Server response
@@ -273,8 +485,16 @@ int HUServer::handleSSLHandshake(byte *buf, int len) {
         !SSL_is_init_finished(m_ssl)) {
         logSSLReturnCode(ret);
         logSSLInfo();
+        forgetSSLSession();
+        return (-1);
+    }
+
+    // On a resumed session we send the last Finished, not the phone
+    if (BIO_ctrl_pending(m_sslReadBio) > 0 && sendSSLHandshakePacket() < 0) {
         return (-1);
     }
+    handshakeDone();
+    useRecordSink();
 
     HU::AuthCompleteResponse response;
     response.set_status(HU::STATUS_OK);
@@ -289,6 +509,8 @@ int HUServer::handleSSLHandshake(byte *buf, int len) {
 
     iaap_state = hu_STATE_STARTED;
     logd("  SET: iaap_state: %d (%s)", iaap_state, state_get(iaap_state));
+    logi("Connected %.1f ms after start, %.2f ms of it setting up TLS",
+         (hu_time_us() - m_startUs) / 1000.0, m_sslSetupUs / 1000.0);
 
     return 0;
 }
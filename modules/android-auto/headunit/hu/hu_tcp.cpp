@@ -1,19 +1,22 @@
 #define LOGTAG "hu_tcp"
 #include "hu_tcp.h"
+#include "hu_sockopt.h"
 #include "hu_uti.h"  // Utilities
-
-int itcp_state =
-    0;  // 0: Initial    1: Startin    2: Started    3: Stoppin    4: Stopped
-int last_errno = 0;  // store last error printed
+#include <algorithm>
+#include <map>
+#include <memory>
 
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
 #include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/epoll.h>
 #include <sys/select.h>
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include <netdb.h>
@@ -36,182 +39,396 @@ HUTransportStreamTCP::HUTransportStreamTCP(
     } else {
         wifi_direct = 0;
     }
+    if (settings.count("tcp_connect_timeout")) {
+        connect_tmo = std::max(1, atoi(settings["tcp_connect_timeout"].c_str()));
+    }
+    if (!hu_socket_profile_from_settings(settings, profile)) {
+        logw("Unknown tcp_socket_profile \"%s\", using default",
+             settings["tcp_socket_profile"].c_str());
+    }
+}
+
+void HUTransportStreamTCP::itcp_apply_profile(int fd) {
+    int refused = hu_socket_profile_apply(fd, profile);
+    if (refused > 0) {
+        logw("Socket profile %s: %d options refused", profile.name.c_str(),
+             refused);
+    }
+    // The kernel doubles and caps what was asked for, log what we got
+    int rcvbuf = 0, sndbuf = 0;
+    socklen_t opt_len = sizeof(int);
+    getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, &opt_len);
+    opt_len = sizeof(int);
+    getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, &opt_len);
+    logd("Socket profile %s: rcvbuf %d  sndbuf %d", profile.name.c_str(),
+         rcvbuf, sndbuf);
 }
 
-int HUTransportStreamTCP::Write(const byte *buf, int len, int tmo) {
+int HUTransportStreamTCP::SubmitWrite(const iovec *iov, int iovcnt, int tmo,
+                                      WriteCompletion done) {
     // int ret = itcp_bulk_transfer (itcp_ep_out, buf, len, tmo);      //
     // milli-second timeout
+    if (readfd < 0) {
+        if (done) done(-1);
+        return (-1);
+    }
+
+    int len = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        len += iov[i].iov_len;
+    }
+
+    // Short writes continue where they left off, so copy the vector
+    std::vector<iovec> remaining(iov, iov + iovcnt);
+    iovec *cur = remaining.data();
+    int curcnt = iovcnt;
+    int sent = 0;
+    uint64_t deadline = 0;
+    while (sent < len) {
+        errno = 0;
+        int ret = writev(readfd, cur, curcnt);
+        if (ret < 0 && errno == EINTR) continue;
+        if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            // Socket buffer is full, only now is it worth waiting
+            uint64_t now = hu_time_us();
+            if (deadline == 0) deadline = now + (uint64_t)std::max(tmo, 0) * 1000;
+            if (now >= deadline ||
+                itcp_wait(readfd, POLLOUT, (deadline - now + 999) / 1000) <= 0) {
+                loge("Write timeout after %d ms, %d of %d bytes sent", tmo,
+                     sent, len);
+                if (done) done(-1);
+                return (-1);
+            }
+            continue;
+        }
+        if (ret <= 0) {  // Write, if can't write full buffer...
+            loge("Error write  errno: %d (%s)", errno, strerror(errno));
+            if (done) done(-1);
+            return (-1);
+        }
+        sent += ret;
+        while (curcnt > 0 && (size_t)ret >= cur->iov_len) {
+            ret -= cur->iov_len;
+            cur++;
+            curcnt--;
+        }
+        if (curcnt > 0) {
+            cur->iov_base = (byte *)cur->iov_base + ret;
+            cur->iov_len -= ret;
+        }
+    }
+
+    // The kernel has the data, that is as done as it gets
+    if (done) done(len);
+    return (len);
+}
+
+int HUTransportStreamTCP::Poll(const ReceiveCallback &callback) {
     if (readfd < 0) return (-1);
 
-    fd_set sock_set;
-    FD_ZERO(&sock_set);
-    FD_SET(readfd, &sock_set);
+    int count = 0;
+    // Bounded so a fast sender can't keep the HU thread here forever
+    while (count < 64) {
+        HUTransportChunk *chunk = nullptr;
+        if (m_freeChunks.empty()) {
+            chunk = new HUTransportChunk();
+            chunk->data = new byte[m_chunkSize];
+            chunk->capacity = m_chunkSize;
+            chunk->pool = this;
+        } else {
+            chunk = m_freeChunks.back();
+            m_freeChunks.pop_back();
+        }
+        HUTransportChunkPtr owned(chunk);
 
-    timeval tv_timeout;
-    tv_timeout.tv_sec = tmo / 1000;
-    tv_timeout.tv_usec = tmo * 1000;
+        errno = 0;
+        int ret = recv(readfd, chunk->data, chunk->capacity, MSG_DONTWAIT);
+        if (ret < 0 && errno == EINTR) continue;
+        if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (ret <= 0) {
+            if (ret == 0) {
+                loge("Connection closed");
+            } else {
+                loge("Error recv  errno: %d (%s)", errno, strerror(errno));
+            }
+            return (-1);
+        }
+        chunk->len = ret;
 
-    int ret = select(readfd + 1, NULL, &sock_set, NULL, &tv_timeout);
-    if (ret <= 0) return ret;
+        count_received(ret);
+        callback(std::move(owned));
+        count++;
+        if (ret < m_chunkSize) break;  // Drained the socket buffer
+    }
+    if (count > 0) {
+        hu_socket_profile_rearm(readfd, profile);
+    }
+    return (count);
+}
 
-    errno = 0;
-    ret = write(readfd, buf, len);
-    if (ret != len) {  // Write, if can't write full buffer...
-        loge("Error write  errno: %d (%s)", errno, strerror(errno));
-        // ms_sleep (101);                                                 //
-        // Sleep 0.1 second to try to clear errors
+void HUTransportStreamTCP::count_received(int len) {
+    uint64_t now = hu_time_us();
+    if (m_receiveStats.chunks == 0) {
+        m_receiveStats.firstUs = now;
+    } else {
+        uint64_t gap = now - m_receiveStats.lastUs;
+        int bucket = 0;
+        while (bucket < 31 && (1ULL << (bucket + 1)) <= gap) bucket++;
+        m_receiveStats.gapHistogram[bucket]++;
     }
-    // close (readfd);
-    //}
-    // close (tcp_so_fd);
+    m_receiveStats.lastUs = now;
+    m_receiveStats.chunks++;
+    m_receiveStats.bytes += len;
+}
 
-    return (ret);
+void HUTransportStreamTCP::Recycle(HUTransportChunk *chunk) {
+    chunk->len = 0;
+    m_freeChunks.push_back(chunk);
 }
 
 int HUTransportStreamTCP::itcp_deinit() {  // !!!! Need to better reset and wait
                                            // a while to kill transfers in
                                            // progress and auto-restart properly
 
+    // The listening socket stays with HUTCPConnector
     if (readfd >= 0) close(readfd);
     readfd = -1;
 
-    if (tcp_so_fd >= 0) close(tcp_so_fd);
-    tcp_so_fd = -1;
+    for (HUTransportChunk *chunk : m_freeChunks) {
+        delete[] chunk->data;
+        delete chunk;
+    }
+    m_freeChunks.clear();
 
     logd("Done");
 
     return (0);
 }
 
-#define CS_FAM AF_INET
+// Waits up to tmo ms for events on fd. Returns > 0 when ready, 0 on timeout.
+int HUTransportStreamTCP::itcp_wait(int fd, short events, int tmo) {
+    pollfd pfd = {fd, events, 0};
+    int ret;
+    do {
+        ret = poll(&pfd, 1, tmo);
+    } while (ret < 0 && errno == EINTR);
+    return ret;
+}
 
-#define CS_SOCK_TYPE SOCK_STREAM
-#define RES_DATA_MAX 65536
+int HUTransportStreamTCP::itcp_init() {
+    // One attempt that doesn't wait. Retrying is up to the caller.
+    HUTCPConnector& connector =
+        HUTCPConnector::Get(wifi_direct, settings["network_address"]);
+    readfd = connector.Take(connect_tmo, profile);
+    if (readfd < 0) {
+        logd("No TCP connection yet");
+        return (-1);
+    }
+    if (wifi_direct) {
+        // Buffer sizes come from the listener, the rest doesn't carry over
+        itcp_apply_profile(readfd);
+    }
+    return (0);
+}
 
-int HUTransportStreamTCP::itcp_accept() {
-    if (tcp_so_fd < 0) return (-1);
+#define HU_TCP_LISTEN_PORT 30515  // wifi_direct, the phone connects to us
+#define HU_TCP_PHONE_PORT 5277    // otherwise we connect to the phone
+
+HUTCPConnector& HUTCPConnector::Get(bool wifi_direct,
+                                    const std::string& address) {
+    static std::mutex registry_lock;
+    static std::map<std::string, std::unique_ptr<HUTCPConnector>> registry;
+    // Every wifi_direct session listens on the same port
+    const std::string key = wifi_direct ? std::string() : address;
+    std::lock_guard<std::mutex> lock(registry_lock);
+    std::unique_ptr<HUTCPConnector>& connector = registry[key];
+    if (!connector) {
+        connector.reset(new HUTCPConnector(wifi_direct, address));
+    }
+    return *connector;
+}
 
-    memset((char *)&cli_addr, 0, sizeof(cli_addr));  // ?? Don't need this ?
-    // cli_addr.sun_family = CS_FAM;                                     // ""
-    cli_len = sizeof(cli_addr);
+HUTCPConnector::HUTCPConnector(bool wifi_direct, const std::string& address)
+    : m_wifiDirect(wifi_direct), m_address(wifi_direct ? "" : address) {
+    m_epollFD = epoll_create1(EPOLL_CLOEXEC);
+    if (m_epollFD < 0) {
+        loge("epoll_create1 errno: %d (%s)", errno, strerror(errno));
+    }
+}
+
+HUTCPConnector::~HUTCPConnector() {
+    Close();
+    if (m_epollFD >= 0) close(m_epollFD);
+}
+
+void HUTCPConnector::Close() {
+    std::lock_guard<std::mutex> lock(m_lock);
+    close_socket();
+}
+
+bool HUTCPConnector::Ready() {
+    std::lock_guard<std::mutex> lock(m_lock);
+    // One shot, so this takes the readiness away until arm()
+    epoll_event event;
+    return epoll_wait(m_epollFD, &event, 1, 0) > 0;
+}
+
+void HUTCPConnector::arm(uint32_t events) {
+    epoll_event event = {};
+    event.events = events | EPOLLONESHOT;
+    event.data.fd = m_fd;
+    if (epoll_ctl(m_epollFD, EPOLL_CTL_MOD, m_fd, &event) < 0 &&
+        epoll_ctl(m_epollFD, EPOLL_CTL_ADD, m_fd, &event) < 0) {
+        loge("epoll_ctl errno: %d (%s)", errno, strerror(errno));
+    }
+}
+
+void HUTCPConnector::close_socket() {
+    if (m_fd < 0) return;
+    // Closing takes it out of the epoll set
+    close(m_fd);
+    m_fd = -1;
+}
 
+int HUTCPConnector::open_socket(const HUSocketProfile& profile) {
     errno = 0;
-    int ret = 0;
-    if (wifi_direct) {
-        readfd = accept(tcp_so_fd, (struct sockaddr *)&cli_addr, &cli_len);
-        if (readfd < 0) {
-            loge("Error accept errno: %d (%s)", errno, strerror(errno));
+    m_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (m_fd < 0) {
+        loge("Error socket  errno: %d (%s)", errno, strerror(errno));
+        return (-1);
+    }
+    // Before connect() or listen(), the window scale is fixed by then.
+    // Accepted sockets inherit the buffer sizes from the listener.
+    int refused = hu_socket_profile_apply(m_fd, profile);
+    if (refused > 0) {
+        logw("Socket profile %s: %d options refused", profile.name.c_str(),
+             refused);
+    }
+
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    if (m_wifiDirect) {
+        // Will bind to any/all Interfaces/IPs
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_port = htons(HU_TCP_LISTEN_PORT);
+        // Don't trip over TIME_WAIT from the last session
+        int reuse = 1;
+        setsockopt(m_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        if (bind(m_fd, (sockaddr *)&addr, sizeof(addr)) < 0 ||
+            listen(m_fd, 5) < 0) {
+            loge("Error listening on port %d  errno: %d (%s)",
+                 HU_TCP_LISTEN_PORT, errno, strerror(errno));
+            close_socket();
             return (-1);
         }
+        logd("Listening on port %d", HU_TCP_LISTEN_PORT);
     } else {
-        inet_pton(AF_INET, settings["network_address"].c_str(),
-                  &(cli_addr.sin_addr));
-        cli_addr.sin_family = AF_INET;
-        cli_addr.sin_port = htons(5277);
-        // logd ("cli_len: %d  fam: %d  addr: 0x%x  port:
-        // %d",cli_len,cli_addr.sin_family, ntohl (cli_addr.sin_addr.s_addr),
-        // ntohs (cli_addr.sin_port));
-
-        ret = connect(tcp_so_fd, (const struct sockaddr *)&cli_addr, cli_len);
-        if (ret != 0) {
-            if (errno !=
-                last_errno)  // avoid spamming the log with the same error
-            {
+        inet_pton(AF_INET, m_address.c_str(), &addr.sin_addr);
+        addr.sin_port = htons(HU_TCP_PHONE_PORT);
+        // Non-blocking, it finishes while we get on with other things
+        m_connectStartUs = hu_time_us();
+        if (connect(m_fd, (sockaddr *)&addr, sizeof(addr)) != 0 &&
+            errno != EINPROGRESS) {
+            if (errno != m_lastErrno) {
                 loge("Error connect errno: %d (%s)", errno, strerror(errno));
-                last_errno = errno;
+                m_lastErrno = errno;
             }
-            sleep(5);
+            close_socket();
             return (-1);
         }
-        readfd = tcp_so_fd;
     }
-
-    return (tcp_so_fd);
+    return (0);
 }
 
-int HUTransportStreamTCP::itcp_init() {
-    int net_port = 30515;
-
-    int cmd_len = 0, ctr = 0;
-    // struct hostent *hp;
-
-    errno = 0;
-    if ((tcp_so_fd = socket(CS_FAM, CS_SOCK_TYPE, 0)) < 0) {  // Create socket
-        loge("gen_server_loop socket  errno: %d (%s)", errno, strerror(errno));
+// Whether the connect in progress is done, the socket if it worked
+int HUTCPConnector::take_connected() {
+    pollfd pfd = {m_fd, POLLOUT, 0};
+    if (poll(&pfd, 1, 0) <= 0) {
+        return (-1);  // Still going
+    }
+    int err = 0;
+    socklen_t err_len = sizeof(err);
+    getsockopt(m_fd, SOL_SOCKET, SO_ERROR, &err, &err_len);
+    if (err != 0) {
+        if (err != m_lastErrno) {
+            loge("Error connect errno: %d (%s)", err, strerror(err));
+            m_lastErrno = err;
+        }
+        close_socket();
         return (-1);
     }
-    int flag = 1;
-    int ret = setsockopt(
-        tcp_so_fd, SOL_TCP, TCP_NODELAY, &flag,
-        sizeof(flag));  // Only need this for IO socket from accept() ??
-    if (ret != 0)
-        loge("setsockopt TCP_NODELAY errno: %d (%s)", errno, strerror(errno));
-    else
-        logd("setsockopt TCP_NODELAY Success");
+    m_lastErrno = 0;
+    // Handed over, so it's out of the epoll set before the caller has it
+    epoll_ctl(m_epollFD, EPOLL_CTL_DEL, m_fd, nullptr);
+    int fd = m_fd;
+    m_fd = -1;
+    return fd;
+}
 
-    if (wifi_direct) {
-        memset((char *)&srv_addr, 0, sizeof(srv_addr));
-
-        srv_addr.sin_family = AF_INET;
-        srv_addr.sin_addr.s_addr =
-            htonl(INADDR_ANY);  // Will bind to any/all Interfaces/IPs
-
-        // errno = 0;
-        // hp = gethostbyname ("localhost");
-        // if (hp == 0) {
-        //  loge ("Error gethostbyname  errno: %d (%s)", errno, strerror
-        //  (errno)); return (-2);
-        //}
-        // bcopy ((char *) hp->h_addr, (char *) & srv_addr.sin_addr,
-        // hp->h_length);
-        srv_addr.sin_port = htons(net_port);
-        srv_len = sizeof(struct sockaddr_in);
-
-        logd("srv_len: %d  fam: %d  addr: 0x%x  port: %d", srv_len,
-             srv_addr.sin_family, ntohl(srv_addr.sin_addr.s_addr),
-             ntohs(srv_addr.sin_port));
-        errno = 0;
-        if (bind(tcp_so_fd, (struct sockaddr *)&srv_addr, srv_len) <
-            0) {  // Bind socket to server address
-            loge("Error bind  errno: %d (%s)", errno, strerror(errno));
-            loge(
-                "Inet stream continuing despite bind error");  // OK to continue
-                                                               // w/ Internet
-                                                               // Stream
+int HUTCPConnector::Take(int connect_tmo, const HUSocketProfile& profile) {
+    std::lock_guard<std::mutex> lock(m_lock);
+    if (m_wifiDirect) {
+        if (m_fd < 0 && open_socket(profile) < 0) {
+            return (-1);
         }
-
-        // Done after socket() and before bind() so don't repeat it here ?
-        // if (tmo != 0)
-        //  sock_tmo_set (tcp_so_fd, tmo);                                   //
-        //  If polling mode, set socket timeout for polling every tmo
-        //  milliseconds
-
-        // Get command from client
-        errno = 0;
-        if (listen(tcp_so_fd, 5)) {  // Backlog= 5; likely don't need this
-            loge("Error listen  errno: %d (%s)", errno, strerror(errno));
-            return (-4);
+        int fd = accept4(m_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            loge("Error accept errno: %d (%s)", errno, strerror(errno));
         }
-
-        logd("itcp_init Ready");
+        // Keeps listening either way, for the next session
+        arm(EPOLLIN);
+        return fd;
     }
 
-    // readfd = -1;
-    while (readfd < 0) {  // While we don't have an IO socket file descriptor...
-        ret = itcp_accept();  // Try to get one with 100 ms timeout
-        if (ret < 0) {
-            loge("Error while trying to read from TCP stream");
-            return (-1);
+    if (m_fd >= 0 && hu_time_us() - m_connectStartUs > connect_tmo * 1000ULL) {
+        pollfd pfd = {m_fd, POLLOUT, 0};
+        if (poll(&pfd, 1, 0) == 0) {
+            if (m_lastErrno != ETIMEDOUT) {
+                loge("No connection to %s within %d ms", m_address.c_str(),
+                     connect_tmo);
+                m_lastErrno = ETIMEDOUT;
+            }
+            close_socket();  // Start over
         }
     }
-    logd("itcp_accept done");
+    if (m_fd < 0 && open_socket(profile) < 0) {
+        return (-1);
+    }
+    int fd = take_connected();
+    if (fd < 0 && m_fd >= 0) {
+        arm(EPOLLOUT);
+    }
+    return fd;
+}
 
-    return (0);
+void HUTransportStreamTCP::log_receive_stats() {
+    const ReceiveStats &st = m_receiveStats;
+    uint64_t elapsed = st.lastUs - st.firstUs;
+    logi("TCP IN: profile %s  %llu bytes in %llu chunks  %llu ms  %.1f MB/s",
+         profile.name.c_str(), (unsigned long long)st.bytes,
+         (unsigned long long)st.chunks, (unsigned long long)(elapsed / 1000),
+         elapsed ? st.bytes / (double)elapsed : 0.0);
+
+    // Gaps between chunks, as a rough view of arrival jitter. Buckets are
+    // powers of two, so the percentiles are upper bounds.
+    uint64_t gaps = st.chunks > 0 ? st.chunks - 1 : 0;
+    uint64_t seen = 0;
+    uint64_t p50 = 0, p99 = 0;
+    for (int bucket = 0; bucket < 32 && gaps > 0; bucket++) {
+        seen += st.gapHistogram[bucket];
+        if (p50 == 0 && seen * 2 >= gaps) p50 = 2ULL << bucket;
+        if (p99 == 0 && seen * 100 >= gaps * 99) p99 = 2ULL << bucket;
+    }
+    logi("TCP IN: arrival gap p50 < %llu us  p99 < %llu us",
+         (unsigned long long)p50, (unsigned long long)p99);
 }
 
 int HUTransportStreamTCP::Stop() {
     itcp_state = hu_STATE_STOPPIN;
     logd("  SET: itcp_state: %d (%s)", itcp_state, state_get(itcp_state));
+    if (m_receiveStats.chunks > 0) {
+        log_receive_stats();
+    }
     int ret = itcp_deinit();
     itcp_state = hu_STATE_STOPPED;
     logd("  SET: itcp_state: %d (%s)", itcp_state, state_get(itcp_state));
@@ -1,26 +1,90 @@
-
+#pragma once
 #include "hu_aap.h"
+#include "hu_sockopt.h"
 #include <netinet/in.h>
+#include <mutex>
+#include <vector>
 
 namespace AndroidAuto {
-class HUTransportStreamTCP : public HUTransportStream
-{
-    int tcp_so_fd = -1;
-    struct sockaddr_in  cli_addr = {0};
-    socklen_t cli_len = 0;
-    struct sockaddr_in  srv_addr = {0};
-    socklen_t srv_len = 0;
 
+// Gets the phone's connection without blocking. Every connection attempt
+// has a transport of its own, so this outlives them: with wifi_direct one
+// socket keeps listening across attempts, otherwise a non-blocking connect
+// is left in progress between them. The frontend watches GetEventFD() and
+// makes the next attempt when it's readable.
+class HUTCPConnector {
+   public:
+    // One per phone address, or one for listening with wifi_direct. Stays
+    // until the process exits, sessions with other settings get their own.
+    static HUTCPConnector& Get(bool wifi_direct, const std::string& address);
+
+    // epoll fd, readable once the phone connected or a connect finished
+    int GetEventFD() const { return m_epollFD; }
+    // Call when GetEventFD() is readable. Clears it and returns whether an
+    // attempt is worth making. It stays clear until the next Take().
+    bool Ready();
+    // The phone's socket, non-blocking, or -1 if it's not there yet. A
+    // connect that failed is closed and the next call starts another, one
+    // still going after connect_tmo ms is started over.
+    int Take(int connect_tmo, const HUSocketProfile& profile);
+    void Close();
+
+    HUTCPConnector(bool wifi_direct, const std::string& address);
+    ~HUTCPConnector();
+
+   private:
+    std::mutex m_lock;
+    const bool m_wifiDirect;
+    const std::string m_address;
+    int m_epollFD = -1;
+    int m_fd = -1;  // listening or connecting
+    uint64_t m_connectStartUs = 0;
+    int m_lastErrno = 0;  // last connect error logged, to not repeat it
+
+    int open_socket(const HUSocketProfile& profile);
+    int take_connected();
+    void close_socket();
+    void arm(uint32_t events);
+};
+
+class HUTransportStreamTCP : public HUTransportStream, protected HUTransportChunkPool
+{
+    int itcp_state = hu_STATE_INITIAL;
     int wifi_direct = 0;
+    // ms a connect() may stay in progress before it is started over
+    int connect_tmo = 2000;
     int itcp_deinit ();
-    int itcp_accept ();
+    int itcp_wait (int fd, short events, int tmo);
+    void itcp_apply_profile (int fd);
+    void log_receive_stats ();
     int itcp_init();
+
+    // Receive chunks, only touched from the HU thread
+    std::vector<HUTransportChunk*> m_freeChunks;
+    int m_chunkSize = 16384;
+    virtual void Recycle(HUTransportChunk* chunk) override;
+ protected:
     std::map<std::string, std::string> settings;
+    HUSocketProfile profile;
+
+    // Receive side counters, logged at Stop()
+    struct ReceiveStats {
+        uint64_t bytes = 0;
+        uint64_t chunks = 0;
+        uint64_t firstUs = 0;
+        uint64_t lastUs = 0;
+        // Time between chunks, bucket n counts gaps in [2^n, 2^(n+1)) us
+        uint64_t gapHistogram[32] = {0};
+    };
+    ReceiveStats m_receiveStats;
+    void count_received (int len);
  public:
     ~HUTransportStreamTCP();
     HUTransportStreamTCP(std::map<std::string, std::string> _settings);
     virtual int Start() override;
     virtual int Stop() override;
-    virtual int Write(const byte* buf, int len, int tmo) override;
+    virtual int SubmitWrite(const iovec* iov, int iovcnt, int tmo,
+                            WriteCompletion done = nullptr) override;
+    virtual int Poll(const ReceiveCallback& callback) override;
 };
 }
@@ -0,0 +1,452 @@
+#define LOGTAG "hu_tcp_uring"
+#include "hu_tcp_uring.h"
+#include "hu_uti.h"  // Utilities
+
+#ifdef HU_HAVE_IO_URING
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <algorithm>
+#include <chrono>
+
+using namespace AndroidAuto;
+
+enum {
+    URING_TAG_RECV = 1,
+    URING_TAG_SEND = 2,
+};
+#define URING_TAG_SHIFT 32
+#define URING_BUFFER_GROUP 0
+
+HUTransportStreamTCPUring::HUTransportStreamTCPUring(
+    std::map<std::string, std::string> _settings)
+    : HUTransportStreamTCP(_settings) {
+    if (settings.count("tcp_uring_buffers")) {
+        m_receiveBufferCount =
+            std::max(2, atoi(settings["tcp_uring_buffers"].c_str()));
+    }
+    // The buffer ring needs a power of two
+    int count = 1;
+    while (count < m_receiveBufferCount) count <<= 1;
+    m_receiveBufferCount = std::min(count, 32768);
+}
+
+HUTransportStreamTCPUring::~HUTransportStreamTCPUring() {
+    // The base destructor can't reach our Stop()
+    teardown();
+}
+
+int HUTransportStreamTCPUring::Start() {
+    int ret = HUTransportStreamTCP::Start();
+    if (ret < 0 || m_ring.IsOpen()) {
+        return ret;
+    }
+    m_socket = readfd;
+    m_failed = false;
+    m_receiveArmed = false;
+    m_receiveStalled = false;
+
+    int eventfd_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (eventfd_fd < 0 || m_ring.Init(64) < 0 ||
+        m_ring.RegisterEventFd(eventfd_fd) < 0 ||
+        m_ring.SetupBufferRing(URING_BUFFER_GROUP, m_receiveBufferCount) < 0) {
+        loge("io_uring setup failed errno: %d (%s)", errno, strerror(errno));
+        if (eventfd_fd >= 0) close(eventfd_fd);
+        m_ring.Close();
+        Stop();
+        return (-1);
+    }
+    readfd = eventfd_fd;
+
+    const int chunk_size = 16384;
+    m_receiveMemory.resize((size_t)m_receiveBufferCount * chunk_size);
+    m_receiveChunks.resize(m_receiveBufferCount);
+    for (int bid = 0; bid < m_receiveBufferCount; bid++) {
+        HUTransportChunk& chunk = m_receiveChunks[bid];
+        chunk.data = &m_receiveMemory[(size_t)bid * chunk_size];
+        chunk.capacity = chunk_size;
+        chunk.len = 0;
+        chunk.pool = this;
+        m_ring.AddBuffer(chunk.data, chunk.capacity, bid);
+    }
+    m_ring.PublishBuffers();
+
+    m_sendSlots.resize(m_sendSlotCount);
+    for (auto& slot : m_sendSlots) {
+        slot.data.resize(MAX_FRAME_SIZE);
+        m_sendFree.push_back(&slot);
+    }
+
+    std::lock_guard<std::mutex> lock(m_lock);
+    arm_receive();
+    if (submit() < 0) {
+        loge("io_uring_enter failed errno: %d (%s)", errno, strerror(errno));
+        m_failed = true;
+    }
+    logd("io_uring transport started, %d receive buffers",
+         m_receiveBufferCount);
+    return m_failed ? -1 : 0;
+}
+
+int HUTransportStreamTCPUring::Stop() {
+    teardown();
+    return HUTransportStreamTCP::Stop();
+}
+
+void HUTransportStreamTCPUring::teardown() {
+    std::vector<std::pair<WriteCompletion, int>> completions;
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        if (!m_ring.IsOpen()) {
+            return;
+        }
+        // Makes everything in flight complete, the buffers they use are
+        // ours until then. Nothing new gets submitted once failed.
+        m_failed = true;
+        shutdown(m_socket, SHUT_RDWR);
+        uint64_t deadline = hu_time_us() + 200000;
+        while ((m_receiveArmed || !m_sendChain.empty()) &&
+               wait_completion(deadline)) {
+        }
+        if (m_receiveArmed || !m_sendChain.empty()) {
+            logw("io_uring operations still pending at stop");
+        }
+        m_ring.Close();
+
+        for (SendSlot* slot : m_sendChain) {
+            m_writeCompletions.emplace_back(std::move(slot->done), -1);
+        }
+        for (SendSlot* slot : m_sendQueue) {
+            m_writeCompletions.emplace_back(std::move(slot->done), -1);
+        }
+        m_sendQueue.clear();
+        m_sendChain.clear();
+        m_sendFree.clear();
+        m_sendSlots.clear();
+        m_receiveReady.clear();
+        m_receiveChunks.clear();
+        m_receiveMemory.clear();
+        completions.swap(m_writeCompletions);
+        m_sendFreed.notify_all();
+
+        close(readfd);
+        readfd = m_socket;
+        m_socket = -1;
+        log_uring_stats();
+    }
+    for (auto& completion : completions) {
+        if (completion.first) completion.first(completion.second);
+    }
+}
+
+int HUTransportStreamTCPUring::submit(unsigned wait) {
+    if (wait == 0 && m_ring.Unsubmitted() == 0) {
+        return 0;
+    }
+    m_uringStats.enters++;
+    return m_ring.Submit(wait);
+}
+
+void HUTransportStreamTCPUring::arm_receive() {
+    if (m_receiveArmed || m_receiveStalled || m_failed) {
+        return;
+    }
+    io_uring_sqe* sqe = m_ring.GetSqe();
+    if (sqe == nullptr) {
+        return;  // Tried again after the next reap
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = m_socket;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->user_data = (uint64_t)URING_TAG_RECV << URING_TAG_SHIFT;
+    m_receiveArmed = true;
+}
+
+void HUTransportStreamTCPUring::flush_sends() {
+    if (!m_sendChain.empty() || m_failed) {
+        return;
+    }
+    // Keep one entry for re-arming the receive
+    io_uring_sqe* last = nullptr;
+    while (!m_sendQueue.empty() && m_ring.SqSpace() > 1) {
+        SendSlot* slot = m_sendQueue.front();
+        m_sendQueue.pop_front();
+        io_uring_sqe* sqe = m_ring.GetSqe();
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = m_socket;
+        sqe->addr = (uint64_t)(uintptr_t)&slot->data[slot->sent];
+        sqe->len = slot->len - slot->sent;
+        // Retries short sends in the kernel rather than breaking the chain
+        sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+        sqe->user_data =
+            ((uint64_t)URING_TAG_SEND << URING_TAG_SHIFT) | m_sendChain.size();
+        if (last) last->flags |= IOSQE_IO_LINK;
+        last = sqe;
+        m_sendChain.push_back(slot);
+    }
+    if (!m_sendChain.empty()) {
+        m_sendChainCompleted = 0;
+        m_uringStats.sendChains++;
+        m_uringStats.maxChainLength =
+            std::max(m_uringStats.maxChainLength, m_sendChain.size());
+    }
+}
+
+void HUTransportStreamTCPUring::finish_send_chain() {
+    // Whatever didn't go out because a link broke goes first in the next
+    // chain, in the original order
+    std::vector<SendSlot*> resend;
+    for (SendSlot* slot : m_sendChain) {
+        if (slot->failed || slot->sent == slot->len) {
+            m_writeCompletions.emplace_back(std::move(slot->done),
+                                            slot->failed ? -1 : slot->len);
+            slot->done = nullptr;
+            slot->failed = false;
+            m_sendFree.push_back(slot);
+        } else {
+            resend.push_back(slot);
+        }
+    }
+    m_sendQueue.insert(m_sendQueue.begin(), resend.begin(), resend.end());
+    m_sendChain.clear();
+    flush_sends();
+    m_sendFreed.notify_all();
+}
+
+// Handles every completion posted so far, returns how many
+int HUTransportStreamTCPUring::reap() {
+    int count = 0;
+    while (io_uring_cqe* cqe = m_ring.PeekCqe()) {
+        const uint64_t user_data = cqe->user_data;
+        const int res = cqe->res;
+        const unsigned flags = cqe->flags;
+        m_ring.SeenCqe();
+        count++;
+
+        if ((user_data >> URING_TAG_SHIFT) == URING_TAG_RECV) {
+            if (!(flags & IORING_CQE_F_MORE)) {
+                m_receiveArmed = false;
+            }
+            if (res == -ENOBUFS) {
+                // HU thread holds every buffer, Recycle() re-arms
+                m_uringStats.bufferStalls++;
+                m_receiveStalled = true;
+            } else if (res == 0) {
+                loge("Connection closed");
+                m_failed = true;
+            } else if (res < 0) {
+                if (res != -ECANCELED) {
+                    loge("Error recv  errno: %d (%s)", -res, strerror(-res));
+                }
+                m_failed = true;
+            } else {
+                HUTransportChunk& chunk =
+                    m_receiveChunks[flags >> IORING_CQE_BUFFER_SHIFT];
+                chunk.len = res;
+                count_received(res);
+                m_receiveReady.push_back(&chunk);
+            }
+        } else if ((user_data >> URING_TAG_SHIFT) == URING_TAG_SEND) {
+            SendSlot* slot = m_sendChain[user_data & 0xffffffff];
+            if (res >= 0) {
+                slot->sent += res;
+                if (slot->sent < slot->len) m_uringStats.shortSends++;
+            } else if (res != -ECANCELED) {
+                // Cancelled links are resent, anything else is fatal
+                loge("Error send  errno: %d (%s)", -res, strerror(-res));
+                slot->failed = true;
+                m_failed = true;
+            }
+            if (++m_sendChainCompleted == m_sendChain.size()) {
+                finish_send_chain();
+            }
+        }
+    }
+    m_uringStats.completions += count;
+    return count;
+}
+
+// Waits for and handles completions until deadline, false on timeout
+bool HUTransportStreamTCPUring::wait_completion(uint64_t deadline_us) {
+    while (true) {
+        if (reap() > 0) {
+            return true;
+        }
+        uint64_t now = hu_time_us();
+        if (now >= deadline_us) {
+            return false;
+        }
+        pollfd pfd = {readfd, POLLIN, 0};
+        int ret = poll(&pfd, 1, (deadline_us - now + 999) / 1000);
+        if (ret < 0 && errno != EINTR) {
+            return false;
+        }
+        // Callers signal it again if they leave receives behind
+        uint64_t wakeups = 0;
+        if (read(readfd, &wakeups, sizeof(wakeups)) < 0 && errno != EAGAIN) {
+            return false;
+        }
+    }
+}
+
+void HUTransportStreamTCPUring::run_write_completions() {
+    std::vector<std::pair<WriteCompletion, int>> completions;
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        completions.swap(m_writeCompletions);
+    }
+    for (auto& completion : completions) {
+        if (completion.first) completion.first(completion.second);
+    }
+}
+
+int HUTransportStreamTCPUring::SubmitWrite(const iovec* iov, int iovcnt,
+                                           int tmo, WriteCompletion done) {
+    int len = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        len += iov[i].iov_len;
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(m_lock);
+        if (!m_ring.IsOpen() || m_failed) {
+            m_writeCompletions.emplace_back(std::move(done), -1);
+            lock.unlock();
+            run_write_completions();
+            return (-1);
+        }
+        if (m_sendFree.empty()) {
+            uint64_t deadline =
+                hu_time_us() + (uint64_t)std::max(tmo, 0) * 1000;
+            while (m_sendFree.empty() && !m_failed) {
+                if (std::this_thread::get_id() == m_pollThread) {
+                    // Nobody else reaps while the HU thread is in here
+                    if (!wait_completion(deadline)) break;
+                    continue;
+                }
+                // Poll() frees the slot, the lock has to be let go for it.
+                // Short waits in case the HU thread is busy elsewhere.
+                reap();
+                uint64_t now = hu_time_us();
+                if (!m_sendFree.empty() || now >= deadline) break;
+                m_sendFreed.wait_for(
+                    lock, std::chrono::microseconds(
+                              std::min<uint64_t>(deadline - now, 10000)));
+            }
+            if (!m_receiveReady.empty()) {
+                // Picked up receives while waiting, make sure the HU thread
+                // comes back for them
+                eventfd_write(readfd, 1);
+            }
+            if (m_sendFree.empty() || m_failed) {
+                loge("No free send slot after %d ms", tmo);
+                m_writeCompletions.emplace_back(std::move(done), -1);
+                lock.unlock();
+                run_write_completions();
+                return (-1);
+            }
+        }
+
+        SendSlot* slot = m_sendFree.back();
+        m_sendFree.pop_back();
+        if ((size_t)len > slot->data.size()) {
+            slot->data.resize(len);
+        }
+        byte* dest = slot->data.data();
+        for (int i = 0; i < iovcnt; i++) {
+            memcpy(dest, iov[i].iov_base, iov[i].iov_len);
+            dest += iov[i].iov_len;
+        }
+        slot->len = len;
+        slot->sent = 0;
+        slot->done = std::move(done);
+        m_sendQueue.push_back(slot);
+
+        // Only starts a chain if none is in flight, otherwise this goes out
+        // with the next one
+        flush_sends();
+        if (submit() < 0) {
+            loge("io_uring_enter failed errno: %d (%s)", errno,
+                 strerror(errno));
+            m_failed = true;
+        }
+    }
+    run_write_completions();
+    return m_failed ? -1 : len;
+}
+
+int HUTransportStreamTCPUring::Poll(const ReceiveCallback& callback) {
+    std::vector<HUTransportChunk*> ready;
+    bool failed = false;
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        if (!m_ring.IsOpen()) {
+            return (-1);
+        }
+        m_pollThread = std::this_thread::get_id();
+        uint64_t wakeups = 0;
+        if (read(readfd, &wakeups, sizeof(wakeups)) < 0 && errno != EAGAIN) {
+            return (-1);
+        }
+        int count = reap();
+        m_uringStats.wakeups++;
+        m_uringStats.maxCompletionsPerWakeup =
+            std::max(m_uringStats.maxCompletionsPerWakeup, (uint64_t)count);
+
+        arm_receive();
+        flush_sends();
+        if (submit() < 0) {
+            loge("io_uring_enter failed errno: %d (%s)", errno,
+                 strerror(errno));
+            m_failed = true;
+        }
+        ready.swap(m_receiveReady);
+        failed = m_failed;
+    }
+    run_write_completions();
+
+    if (failed) {
+        // Nobody will take these, back into the ring
+        for (HUTransportChunk* chunk : ready) {
+            Recycle(chunk);
+        }
+        return (-1);
+    }
+    for (HUTransportChunk* chunk : ready) {
+        callback(HUTransportChunkPtr(chunk));
+    }
+    return ready.size();
+}
+
+void HUTransportStreamTCPUring::Recycle(HUTransportChunk* chunk) {
+    std::lock_guard<std::mutex> lock(m_lock);
+    if (!m_ring.IsOpen()) {
+        return;
+    }
+    chunk->len = 0;
+    m_ring.AddBuffer(chunk->data, chunk->capacity, chunk - &m_receiveChunks[0]);
+    m_ring.PublishBuffers();
+    if (m_receiveStalled) {
+        m_receiveStalled = false;
+        arm_receive();
+        submit();
+    }
+}
+
+void HUTransportStreamTCPUring::log_uring_stats() {
+    const UringStats& st = m_uringStats;
+    logi("TCP io_uring: %llu completions  %llu wakeups  max %llu per wakeup  "
+         "%llu io_uring_enter",
+         (unsigned long long)st.completions, (unsigned long long)st.wakeups,
+         (unsigned long long)st.maxCompletionsPerWakeup,
+         (unsigned long long)st.enters);
+    logi("TCP io_uring: %llu send chains  longest %zu  %llu short sends  "
+         "%llu buffer stalls",
+         (unsigned long long)st.sendChains, st.maxChainLength,
+         (unsigned long long)st.shortSends,
+         (unsigned long long)st.bufferStalls);
+}
+
+#endif
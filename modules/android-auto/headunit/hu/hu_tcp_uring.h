@@ -0,0 +1,95 @@
+#pragma once
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "hu_tcp.h"
+#include "hu_uring.h"
+
+namespace AndroidAuto {
+
+#ifdef HU_HAVE_IO_URING
+
+// TCP transport doing its socket I/O through io_uring, selected with
+// tcp_io_uring=1. Connecting works as in HUTransportStreamTCP. Received data
+// lands in a provided buffer ring through one multishot receive and writes
+// go out as linked sends, so a wakeup of the HU thread picks up a whole batch
+// of completions with at most one io_uring_enter(). readfd is an eventfd the
+// ring signals on every completion.
+class HUTransportStreamTCPUring : public HUTransportStreamTCP {
+   public:
+    ~HUTransportStreamTCPUring();
+    HUTransportStreamTCPUring(std::map<std::string, std::string> _settings);
+    virtual int Start() override;
+    virtual int Stop() override;
+    virtual int SubmitWrite(const iovec* iov, int iovcnt, int tmo,
+                            WriteCompletion done = nullptr) override;
+    virtual int Poll(const ReceiveCallback& callback) override;
+
+   private:
+    HUUring m_ring;
+    int m_socket = -1;
+    bool m_failed = false;
+    // Serializes the HU thread with writers on other threads
+    std::mutex m_lock;
+    std::thread::id m_pollThread;
+
+    // Receive buffers, registered with the kernel as a provided buffer
+    // ring. The buffer id is the index into m_receiveChunks.
+    std::vector<HUTransportChunk> m_receiveChunks;
+    std::vector<byte> m_receiveMemory;
+    int m_receiveBufferCount = 64;
+    bool m_receiveArmed = false;
+    // Ran out of buffers, waiting for Recycle()
+    bool m_receiveStalled = false;
+    std::vector<HUTransportChunk*> m_receiveReady;
+    virtual void Recycle(HUTransportChunk* chunk) override;
+
+    // Send slots. Separately submitted chains may run in any order, so only
+    // one linked chain is in flight at a time and writes submitted meanwhile
+    // queue up for the next one.
+    struct SendSlot {
+        std::vector<byte> data;
+        int len = 0;
+        int sent = 0;
+        bool failed = false;
+        WriteCompletion done;
+    };
+    std::vector<SendSlot> m_sendSlots;
+    std::vector<SendSlot*> m_sendFree;
+    std::deque<SendSlot*> m_sendQueue;
+    std::vector<SendSlot*> m_sendChain;
+    size_t m_sendChainCompleted = 0;
+    int m_sendSlotCount = 16;
+    std::condition_variable m_sendFreed;
+    // Write completions to run once m_lock is released
+    std::vector<std::pair<WriteCompletion, int>> m_writeCompletions;
+
+    struct UringStats {
+        uint64_t enters = 0;
+        uint64_t completions = 0;
+        uint64_t wakeups = 0;
+        uint64_t maxCompletionsPerWakeup = 0;
+        uint64_t sendChains = 0;
+        size_t maxChainLength = 0;
+        uint64_t shortSends = 0;
+        // Multishot receive ran out of buffers and had to be re-armed
+        uint64_t bufferStalls = 0;
+    };
+    UringStats m_uringStats;
+
+    int submit(unsigned wait = 0);
+    void arm_receive();
+    void flush_sends();
+    int reap();
+    void finish_send_chain();
+    bool wait_completion(uint64_t deadline_us);
+    void run_write_completions();
+    void teardown();
+    void log_uring_stats();
+};
+
+#endif
+}
@@ -0,0 +1,224 @@
+#include "hu_uring.h"
+
+#ifdef HU_HAVE_IO_URING
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+#include <algorithm>
+
+// Same numbers on every architecture that has them
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup 425
+#endif
+#ifndef __NR_io_uring_enter
+#define __NR_io_uring_enter 426
+#endif
+#ifndef __NR_io_uring_register
+#define __NR_io_uring_register 427
+#endif
+
+using namespace AndroidAuto;
+
+static int sys_io_uring_setup(unsigned entries, io_uring_params* params) {
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                              unsigned flags) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                   nullptr, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, const void* arg,
+                                 unsigned nr_args) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+bool HUUring::Supported() {
+    // Probed once, sessions starting on several threads may ask together
+    static const bool supported = [] {
+        utsname name;
+        int major = 0, minor = 0;
+        if (uname(&name) != 0 ||
+            sscanf(name.release, "%d.%d", &major, &minor) != 2 || major < 6) {
+            return false;
+        }
+        // Also fails if io_uring is disabled by sysctl or seccomp
+        HUUring probe;
+        return probe.Init(2) == 0;
+    }();
+    return supported;
+}
+
+int HUUring::Init(unsigned entries) {
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    m_fd = sys_io_uring_setup(entries, &params);
+    if (m_fd < 0) {
+        return -1;
+    }
+
+    m_sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    m_cqRingSize =
+        params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        m_sqRingSize = m_cqRingSize = std::max(m_sqRingSize, m_cqRingSize);
+    }
+
+    m_sqRing = mmap(nullptr, m_sqRingSize, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+    if (m_sqRing == MAP_FAILED) {
+        m_sqRing = nullptr;
+        Close();
+        return -1;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        m_cqRing = m_sqRing;
+    } else {
+        m_cqRing = mmap(nullptr, m_cqRingSize, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+        if (m_cqRing == MAP_FAILED) {
+            m_cqRing = nullptr;
+            Close();
+            return -1;
+        }
+    }
+    m_sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    void* sqes = mmap(nullptr, m_sqesSize, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        Close();
+        return -1;
+    }
+    m_sqes = (io_uring_sqe*)sqes;
+
+    char* sq = (char*)m_sqRing;
+    m_sqEntries = params.sq_entries;
+    m_sqHead = (unsigned*)(sq + params.sq_off.head);
+    m_sqTail = (unsigned*)(sq + params.sq_off.tail);
+    m_sqMask = *(unsigned*)(sq + params.sq_off.ring_mask);
+    m_sqArray = (unsigned*)(sq + params.sq_off.array);
+    m_sqTailLocal = *m_sqTail;
+    m_sqUnsubmitted = 0;
+
+    char* cq = (char*)m_cqRing;
+    m_cqHead = (unsigned*)(cq + params.cq_off.head);
+    m_cqTail = (unsigned*)(cq + params.cq_off.tail);
+    m_cqMask = *(unsigned*)(cq + params.cq_off.ring_mask);
+    m_cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+    return 0;
+}
+
+void HUUring::Close() {
+    // Closing the fd cancels whatever is still in flight
+    if (m_fd >= 0) {
+        close(m_fd);
+        m_fd = -1;
+    }
+    if (m_sqes) {
+        munmap(m_sqes, m_sqesSize);
+        m_sqes = nullptr;
+    }
+    if (m_cqRing && m_cqRing != m_sqRing) {
+        munmap(m_cqRing, m_cqRingSize);
+    }
+    m_cqRing = nullptr;
+    if (m_sqRing) {
+        munmap(m_sqRing, m_sqRingSize);
+        m_sqRing = nullptr;
+    }
+    if (m_bufRing) {
+        munmap(m_bufRing, m_bufRingSize);
+        m_bufRing = nullptr;
+    }
+}
+
+int HUUring::RegisterEventFd(int fd) {
+    return sys_io_uring_register(m_fd, IORING_REGISTER_EVENTFD, &fd, 1);
+}
+
+int HUUring::SetupBufferRing(uint16_t group, unsigned entries) {
+    m_bufRingSize = entries * sizeof(io_uring_buf);
+    void* ring = mmap(nullptr, m_bufRingSize, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring == MAP_FAILED) {
+        return -1;
+    }
+    m_bufRing = (io_uring_buf*)ring;
+
+    io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)m_bufRing;
+    reg.ring_entries = entries;
+    reg.bgid = group;
+    if (sys_io_uring_register(m_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        munmap(m_bufRing, m_bufRingSize);
+        m_bufRing = nullptr;
+        return -1;
+    }
+    m_bufMask = entries - 1;
+    m_bufTailLocal = 0;
+    m_bufGroup = group;
+    return 0;
+}
+
+void HUUring::AddBuffer(void* addr, unsigned len, uint16_t bid) {
+    io_uring_buf& buf = m_bufRing[m_bufTailLocal & m_bufMask];
+    buf.addr = (uint64_t)(uintptr_t)addr;
+    buf.len = len;
+    buf.bid = bid;
+    m_bufTailLocal++;
+}
+
+void HUUring::PublishBuffers() {
+    // The ring tail overlays the resv field of the first entry
+    __atomic_store_n(&m_bufRing[0].resv, m_bufTailLocal, __ATOMIC_RELEASE);
+}
+
+io_uring_sqe* HUUring::GetSqe() {
+    unsigned head = __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE);
+    if (m_sqTailLocal - head >= m_sqEntries) {
+        return nullptr;
+    }
+    unsigned index = m_sqTailLocal & m_sqMask;
+    io_uring_sqe* sqe = &m_sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    m_sqArray[index] = index;
+    m_sqTailLocal++;
+    m_sqUnsubmitted++;
+    return sqe;
+}
+
+int HUUring::Submit(unsigned wait) {
+    __atomic_store_n(m_sqTail, m_sqTailLocal, __ATOMIC_RELEASE);
+    if (m_sqUnsubmitted == 0 && wait == 0) {
+        return 0;
+    }
+    int ret;
+    do {
+        ret = sys_io_uring_enter(m_fd, m_sqUnsubmitted, wait,
+                                 wait ? IORING_ENTER_GETEVENTS : 0);
+    } while (ret < 0 && errno == EINTR);
+    if (ret > 0) {
+        m_sqUnsubmitted -= std::min<unsigned>(ret, m_sqUnsubmitted);
+    }
+    return ret;
+}
+
+io_uring_cqe* HUUring::PeekCqe() {
+    unsigned head = *m_cqHead;
+    if (head == __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE)) {
+        return nullptr;
+    }
+    return &m_cqes[head & m_cqMask];
+}
+
+void HUUring::SeenCqe() {
+    __atomic_store_n(m_cqHead, *m_cqHead + 1, __ATOMIC_RELEASE);
+}
+
+#endif
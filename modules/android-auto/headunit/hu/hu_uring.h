@@ -0,0 +1,93 @@
+#pragma once
+#include <stdint.h>
+#include <sys/uio.h>
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+
+// Multishot receive and provided buffer rings need kernel 6.0 headers
+#ifdef IORING_RECV_MULTISHOT
+#define HU_HAVE_IO_URING 1
+#endif
+
+namespace AndroidAuto {
+
+#ifdef HU_HAVE_IO_URING
+
+// Minimal io_uring on top of the raw syscalls, so there is no liburing
+// dependency. Not thread safe, callers serialize. Also kept free of the rest
+// of the library so tools can share it.
+class HUUring {
+   public:
+    HUUring() {}
+    ~HUUring() { Close(); }
+    HUUring(const HUUring&) = delete;
+    HUUring& operator=(const HUUring&) = delete;
+
+    // True if the running kernel has everything used here (6.0 or later)
+    static bool Supported();
+
+    int Init(unsigned entries);
+    void Close();
+    inline bool IsOpen() const { return m_fd >= 0; }
+
+    // Signals fd for every completion
+    int RegisterEventFd(int fd);
+
+    // Provided buffer ring for IOSQE_BUFFER_SELECT, entries must be a power
+    // of two. Buffers are added with AddBuffer() and become visible to the
+    // kernel on PublishBuffers().
+    int SetupBufferRing(uint16_t group, unsigned entries);
+    void AddBuffer(void* addr, unsigned len, uint16_t bid);
+    void PublishBuffers();
+
+    // Zeroed SQE, nullptr if the submission queue is full. Nothing is
+    // submitted before Submit().
+    io_uring_sqe* GetSqe();
+    inline unsigned SqSpace() const {
+        return m_sqEntries - (m_sqTailLocal - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE));
+    }
+    inline unsigned Unsubmitted() const { return m_sqUnsubmitted; }
+    // Submits queued SQEs, waits for at least wait completions. Returns the
+    // number submitted, -1 with errno on error.
+    int Submit(unsigned wait = 0);
+
+    // Oldest unseen completion or nullptr, release it with SeenCqe()
+    io_uring_cqe* PeekCqe();
+    void SeenCqe();
+
+   private:
+    int m_fd = -1;
+    unsigned m_sqEntries = 0;
+
+    void* m_sqRing = nullptr;
+    size_t m_sqRingSize = 0;
+    void* m_cqRing = nullptr;
+    size_t m_cqRingSize = 0;
+    io_uring_sqe* m_sqes = nullptr;
+    size_t m_sqesSize = 0;
+
+    unsigned* m_sqHead = nullptr;
+    unsigned* m_sqTail = nullptr;
+    unsigned m_sqMask = 0;
+    unsigned* m_sqArray = nullptr;
+    unsigned m_sqTailLocal = 0;
+    unsigned m_sqUnsubmitted = 0;
+
+    unsigned* m_cqHead = nullptr;
+    unsigned* m_cqTail = nullptr;
+    unsigned m_cqMask = 0;
+    io_uring_cqe* m_cqes = nullptr;
+
+    io_uring_buf* m_bufRing = nullptr;
+    size_t m_bufRingSize = 0;
+    unsigned m_bufMask = 0;
+    uint16_t m_bufTailLocal = 0;
+    uint16_t m_bufGroup = 0;
+};
+
+#endif
+}
@@ -2,9 +2,12 @@
 #include "hu_usb.h"
 #include <algorithm>
 #include <vector>
+#include "hu_aoa.h"
 #include "hu_uti.h"  // Utilities
 
 #include <libusb.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
 
 using namespace AndroidAuto;
 
@@ -24,51 +27,127 @@ using namespace AndroidAuto;
 #define LIBUSB_LOG_LEVEL_DEBUG 4
 #endif
 
-static unsigned char AAP_VAL_MAN[] = "Android";
-static unsigned char AAP_VAL_MOD[] = "Android Auto";
-static unsigned char AAP_VAL_DESC[] = "Android Auto";
-static unsigned char AAP_VAL_VER[] = "2.0.1";
-static unsigned char AAP_VAL_URI[] =
-    "https://github.com/viktorgino/libheadunit";
-static unsigned char AAP_VAL_SERIAL[] = "HU-AAAAAA001";
-
-#define ACC_IDX_MAN 0     // Manufacturer
-#define ACC_IDX_MOD 1     // Model
-#define ACC_IDX_DESC 2    // Model
-#define ACC_IDX_VER 3     // Model
-#define ACC_IDX_URI 4     // Model
-#define ACC_IDX_SERIAL 5  // Model
-
-#define ACC_REQ_GET_PROTOCOL 51
-#define ACC_REQ_SEND_STRING 52
-#define ACC_REQ_START 53
-
 #define VEN_ID_GOOGLE 0x18D1
 #define DEV_ID_OAP 0x2D00
 #define DEV_ID_OAP_WITH_ADB 0x2D01
 
-#define USB_DIR_IN 0x80
-#define USB_DIR_OUT 0x00
-#define USB_TYPE_VENDOR 0x40
-
 struct usbvpid {
     uint16_t vendor;
     uint16_t product;
 };
 
-int HUTransportStreamUSB::Write(const byte* buf, int len, int tmo) {
-    byte* copy_buf = (byte*)malloc(len);
-    memcpy(copy_buf, buf, len);
+static uint64_t thread_cpu_us() {
+    timespec tp;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &tp);
+    return (uint64_t)tp.tv_sec * 1000000 + tp.tv_nsec / 1000;
+}
+
+int HUTransportStreamUSB::SubmitWrite(const iovec* iov, int iovcnt, int tmo,
+                                      WriteCompletion done) {
+    int len = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        len += iov[i].iov_len;
+    }
+    if (len <= m_sendTransferSize) {
+        return submit_usb_send(iov, iovcnt, len, tmo, std::move(done));
+    }
+
+    // A multi-frame message. Each entry is a frame and goes out in a pool
+    // transfer of its own, cut to pool buffer size if it has to be, in
+    // order. tmo covers the whole message, done goes with the last one.
+    {
+        std::lock_guard<std::mutex> lock(m_sendLock);
+        m_sendStats.split++;
+    }
+    uint64_t deadline = hu_time_us() + std::max(tmo, 0) * 1000ULL;
+    int sent = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        byte* base = (byte*)iov[i].iov_base;
+        for (size_t offset = 0; offset < iov[i].iov_len;
+             offset += m_sendTransferSize) {
+            iovec part = {base + offset,
+                          std::min(iov[i].iov_len - offset,
+                                   (size_t)m_sendTransferSize)};
+            uint64_t now = hu_time_us();
+            int remaining = now < deadline ? (deadline - now) / 1000 : 0;
+            bool last = sent + (int)part.iov_len == len;
+            if (submit_usb_send(&part, 1, part.iov_len, remaining,
+                                last ? std::move(done) : nullptr) < 0) {
+                // The last part reports it itself
+                if (!last && done) done(-1);
+                return -1;
+            }
+            sent += part.iov_len;
+        }
+    }
+    return len;
+}
+
+int HUTransportStreamUSB::submit_usb_send(const iovec* iov, int iovcnt,
+                                          int len, int tmo,
+                                          WriteCompletion done) {
+    SendTransfer* slot = nullptr;
+    {
+        std::unique_lock<std::mutex> lock(m_sendLock);
+        if (m_sendFree.empty()) {
+            m_sendStats.poolWaits++;
+            uint64_t wait_start = hu_time_us();
+            m_sendAvailable.wait_for(
+                lock, std::chrono::milliseconds(std::max(tmo, 0)), [this] {
+                    return !m_sendFree.empty() || m_state != hu_STATE_STARTED;
+                });
+            uint64_t waited = hu_time_us() - wait_start;
+            m_sendStats.poolWaitTotalUs += waited;
+            m_sendStats.poolWaitMaxUs =
+                std::max(m_sendStats.poolWaitMaxUs, waited);
+        }
+        if (m_state != hu_STATE_STARTED) {
+            // Stopping
+        } else if (m_sendFree.empty()) {
+            m_sendStats.poolTimeouts++;
+            loge("No free OUT transfer after %d ms, %d in flight", tmo,
+                 m_sendInUse);
+        } else {
+            slot = m_sendFree.back();
+            m_sendFree.pop_back();
+            slot->inFlight = true;
+            m_sendInUse++;
+            m_sendStats.maxInUse =
+                std::max(m_sendStats.maxInUse, m_sendInUse);
+            m_sendStats.transfers++;
+            m_sendStats.bytes += len;
+        }
+    }
+    if (slot == nullptr) {
+        if (done) done(-1);
+        return -1;
+    }
+
+    // A bulk transfer needs one contiguous buffer, so gather here
+    uint64_t cpu_start = thread_cpu_us();
+    byte* dest = slot->buffer.data;
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(dest, iov[i].iov_base, iov[i].iov_len);
+        dest += iov[i].iov_len;
+    }
+    slot->done = std::move(done);
 
-    libusb_transfer* transfer = libusb_alloc_transfer(0);
-    libusb_fill_bulk_transfer(transfer, m_usbDeviceHandle, iusb_ep_out, copy_buf,
-                              len, &libusb_callback_send_tramp, this, 0);
+    libusb_fill_bulk_transfer(slot->transfer, m_usbDeviceHandle, iusb_ep_out,
+                              slot->buffer.data, len,
+                              &libusb_callback_send_tramp, slot, 0);
 
-    int iusb_state = libusb_submit_transfer(transfer);
+    int iusb_state = libusb_submit_transfer(slot->transfer);
+    {
+        std::lock_guard<std::mutex> lock(m_sendLock);
+        m_sendStats.submitCpuUs += thread_cpu_us() - cpu_start;
+    }
     if (iusb_state < 0) {
         loge("  Failed: libusb_submit_transfer: %d (%s)", iusb_state,
              libusb_strerror((libusb_error)iusb_state));
-        libusb_free_transfer(transfer);
+        done = std::move(slot->done);
+        slot->done = nullptr;
+        release_usb_send(slot);
+        if (done) done(-1);
         return -1;
     } else {
         logd(" libusb_submit_transfer for %d bytes", len);
@@ -76,32 +155,55 @@ int HUTransportStreamUSB::Write(const byte* buf, int len, int tmo) {
     return len;
 }
 
-static int iusb_control_transfer(libusb_device_handle* usb_hndl,
-                                 uint8_t req_type, uint8_t req_val,
-                                 uint16_t val, uint16_t idx, byte* buf,
-                                 uint16_t len, unsigned int tmo) {
-    if (ena_log_verbo)
-        logd(
-            "Start usb_hndl: %p  req_type: %d  req_val: %d  val: %d  idx: %d  "
-            "buf: %p  len: %d  tmo: %d",
-            usb_hndl, req_type, req_val, val, idx, buf, len, tmo);
-
-    int usb_err = libusb_control_transfer(usb_hndl, req_type, req_val, val, idx,
-                                          buf, len, tmo);
-    if (usb_err < 0) {
-        // this is too spammy while detecting devices
-        // loge ("Error usb_err: %d (%s)  usb_hndl: %p  req_type: %d  req_val:
-        // %d  val: %d  idx: %d  buf: %p  len: %d  tmo: %d", usb_err,
-        // libusb_strerror(usb_err), usb_hndl, req_type, req_val, val, idx, buf,
-        // len, tmo);
-        return (-1);
+void HUTransportStreamUSB::release_usb_send(SendTransfer* slot) {
+    {
+        std::lock_guard<std::mutex> lock(m_sendLock);
+        slot->inFlight = false;
+        m_sendFree.push_back(slot);
+        m_sendInUse--;
     }
-    if (ena_log_verbo)
-        logd(
-            "Done usb_err: %d  usb_hndl: %p  req_type: %d  req_val: %d  val: "
-            "%d  idx: %d  buf: %p  len: %d  tmo: %d",
-            usb_err, usb_hndl, req_type, req_val, val, idx, buf, len, tmo);
-    return (0);
+    m_sendAvailable.notify_one();
+}
+
+bool HUTransportStreamUSB::alloc_transfer_buffer(TransferBuffer& buffer,
+                                                 int size) {
+    buffer.size = size;
+    buffer.devMem = false;
+    buffer.data = nullptr;
+#if LIBUSB_API_VERSION >= 0x01000105
+    if (m_zeroCopy) {
+        buffer.data = libusb_dev_mem_alloc(m_usbDeviceHandle, size);
+        if (buffer.data) {
+            buffer.devMem = true;
+            m_devMemBuffers++;
+            return true;
+        }
+        // Needs usbfs mmap support (Linux 4.6), don't keep trying
+        logw("libusb_dev_mem_alloc failed, using heap buffers");
+        m_zeroCopy = false;
+    }
+#endif
+    buffer.data = (byte*)malloc(size);
+    m_heapBuffers++;
+    return buffer.data != nullptr;
+}
+
+void HUTransportStreamUSB::free_transfer_buffer(TransferBuffer& buffer) {
+#if LIBUSB_API_VERSION >= 0x01000105
+    if (buffer.devMem) {
+        libusb_dev_mem_free(m_usbDeviceHandle, buffer.data, buffer.size);
+    } else
+#endif
+    {
+        free(buffer.data);
+    }
+    buffer.data = nullptr;
+    buffer.size = 0;
+}
+
+HUTransportStreamUSB::SendStats HUTransportStreamUSB::GetSendStats() {
+    std::lock_guard<std::mutex> lock(m_sendLock);
+    return m_sendStats;
 }
 
 // based on http://source.android.com/devices/accessories/aoa.html
@@ -118,7 +220,54 @@ libusb_device_handle* HUTransportStreamUSB::find_oap_device() {
 
 HUTransportStreamUSB::HUTransportStreamUSB(
     std::map<std::string, std::string> _settings)
-    : HUTransportStream(_settings) {}
+    : HUTransportStream(_settings) {
+    if (_settings.count("usb_rx_transfers")) {
+        m_receiveTransferCount =
+            std::max(1, atoi(_settings["usb_rx_transfers"].c_str()));
+    }
+    if (_settings.count("usb_rx_transfer_size")) {
+        m_receiveTransferSize =
+            std::max(512, atoi(_settings["usb_rx_transfer_size"].c_str()));
+    }
+    if (_settings.count("usb_tx_transfers")) {
+        m_sendTransferCount =
+            std::max(1, atoi(_settings["usb_tx_transfers"].c_str()));
+    }
+    if (_settings.count("usb_zero_copy")) {
+        m_zeroCopy = _settings["usb_zero_copy"] == "1";
+    }
+    if (_settings.count("usb_rx_ring_size")) {
+        m_receiveRingSize =
+            std::max(m_receiveTransferSize,
+                     atoi(_settings["usb_rx_ring_size"].c_str()));
+    }
+}
+
+int HUTransportStreamUSB::Poll(const ReceiveCallback& callback) {
+    // Clear the wakeup before looking, so chunks pushed in between are
+    // either seen now or signal the eventfd again
+    uint64_t wakeups = 0;
+    if (read(readfd, &wakeups, sizeof(wakeups)) < 0 && errno != EAGAIN) {
+        return -1;
+    }
+    int count = 0;
+    HUTransportChunk* chunk = nullptr;
+    while (m_receiveReady.pop(chunk)) {
+        callback(HUTransportChunkPtr(chunk));
+        count++;
+    }
+    return count;
+}
+
+void HUTransportStreamUSB::Recycle(HUTransportChunk* chunk) {
+    chunk->len = 0;
+    // Can't fail, the queue holds every chunk
+    m_receiveFree.push(chunk);
+    if (m_receiveStarved.exchange(false) && m_recycleFD >= 0 &&
+        eventfd_write(m_recycleFD, 1) < 0) {
+        loge("Error when writing to the recycle eventfd");
+    }
+}
 
 HUTransportStreamUSB::~HUTransportStreamUSB() {
     if (m_state != hu_STATE_STOPPED) {
@@ -127,13 +276,16 @@ HUTransportStreamUSB::~HUTransportStreamUSB() {
 }
 
 int HUTransportStreamUSB::Stop() {
-    m_state = hu_STATE_STOPPIN;
+    {
+        // Under the lock so a SubmitWrite() about to wait for a slot sees it
+        std::lock_guard<std::mutex> lock(m_sendLock);
+        m_state = hu_STATE_STOPPIN;
+    }
+    m_sendAvailable.notify_all();
     logd("  SET: iusb_state: %d (%s)", m_state, state_get(m_state));
 
     close(readfd);
-    close(m_pipeWriteFD);
     readfd = -1;
-    m_pipeWriteFD = -1;
 
     close(errorfd);
     close(m_errorWriteFD);
@@ -148,6 +300,10 @@ int HUTransportStreamUSB::Stop() {
     if (usb_recv_thread.joinable()) {
         usb_recv_thread.join();
     }
+    if (m_usbContext) {
+        cancel_usb_recv();
+        cancel_usb_send();
+    }
     if (abort_usb_thread_pipe_write_fd >= 0 &&
         close(abort_usb_thread_pipe_write_fd) < 0) {
         loge("Error when closing abort_usb_thread_pipe_write_fd");
@@ -155,6 +311,9 @@ int HUTransportStreamUSB::Stop() {
     close(abort_usb_thread_pipe_read_fd);
     abort_usb_thread_pipe_write_fd = -1;
     abort_usb_thread_pipe_read_fd = -1;
+    close(m_recycleFD);
+    m_recycleFD = -1;
+    usb_thread_event_fds.clear();
 
     iusb_ep_in = -1;
     iusb_ep_out = -1;
@@ -189,7 +348,9 @@ int HUTransportStreamUSB::Stop() {
 }
 
 void HUTransportStreamUSB::usb_recv_thread_main() {
-    pthread_setname_np(pthread_self(), "usb_recv_thread_main");
+    pthread_setname_np(pthread_self(), "usb_recv_thread");
+    rusage usage_start;
+    getrusage(RUSAGE_THREAD, &usage_start);
 
     timeval zero_tv;
     memset(&zero_tv, 0, sizeof(zero_tv));
@@ -201,6 +362,15 @@ void HUTransportStreamUSB::usb_recv_thread_main() {
             logd("Requested to exit");
             break;
         }
+        if (usb_thread_event_fds[1].revents & POLLIN) {
+            // Recycle() gave back a buffer a transfer is waiting for
+            eventfd_t count;
+            eventfd_read(m_recycleFD, &count);
+            if (submit_usb_recv() < 0) {
+                loge("Resubmitting IN transfers failed");
+                break;
+            }
+        }
         int iusb_state =
             libusb_handle_events_timeout_completed(m_usbContext, &zero_tv, nullptr);
         if (iusb_state) {
@@ -212,6 +382,15 @@ void HUTransportStreamUSB::usb_recv_thread_main() {
 
     logd("USB thread exit");
 
+    rusage usage_end;
+    getrusage(RUSAGE_THREAD, &usage_end);
+    m_receiveStats.threadCpuUs =
+        (usage_end.ru_utime.tv_sec - usage_start.ru_utime.tv_sec +
+         usage_end.ru_stime.tv_sec - usage_start.ru_stime.tv_sec) *
+            1000000ULL +
+        usage_end.ru_utime.tv_usec - usage_start.ru_utime.tv_usec +
+        usage_end.ru_stime.tv_usec - usage_start.ru_stime.tv_usec;
+
     // Wake up the reader if required
     int errData = -1;
     if (write(m_errorWriteFD, &errData, sizeof(errData)) < 0) {
@@ -222,90 +401,291 @@ void HUTransportStreamUSB::usb_recv_thread_main() {
 void HUTransportStreamUSB::libusb_callback(libusb_transfer* transfer) {
     logd("libusb_callback %d %d %d", transfer->status,
          LIBUSB_TRANSFER_COMPLETED, LIBUSB_TRANSFER_OVERFLOW);
-    libusb_transfer_status recv_last_status = transfer->status;
-    if (recv_last_status == LIBUSB_TRANSFER_COMPLETED ||
-        recv_last_status == LIBUSB_TRANSFER_OVERFLOW) {
-        if (recv_last_status == LIBUSB_TRANSFER_OVERFLOW) {
-            logw("LIBUSB_TRANSFER_OVERFLOW");
-            m_tempReceiveBuffer.resize(m_tempReceiveBuffer.size() * 2);
-            start_usb_recv();
-        } else {
-            size_t bytesToWrite = transfer->actual_length;
-            unsigned char* buffer = transfer->buffer;
-
-            ssize_t ret = 0;
-            while (bytesToWrite > 0) {
-                ret = write(m_pipeWriteFD, buffer, bytesToWrite);
-                if (ret < 0) break;
-                logd("Wrote %d of %d bytes", ret, transfer->actual_length);
-                buffer += ret;
-                bytesToWrite -= ret;
-            }
+    ReceiveTransfer& slot =
+        *reinterpret_cast<ReceiveTransfer*>(transfer->user_data);
+    slot.inFlight = false;
+    if (--m_receiveInFlight == 0) {
+        m_receiveIdleSince = hu_time_us();
+    }
 
-            if (ret < 0) {
-                loge("libusb_callback: write failed");
-                if (write(abort_usb_thread_pipe_write_fd,
-                          &abort_usb_thread_pipe_write_fd, 1) < 0) {
-                    loge(
-                        "Error when writing to abort_usb_thread_pipe_write_fd");
-                }
-            } else {
-                start_usb_recv();
-            }
-        }
+    if (m_state == hu_STATE_STOPPIN || m_state == hu_STATE_STOPPED) {
+        // Cancelled by Stop(), nothing to hand over
+        return;
+    }
+
+    libusb_transfer_status recv_last_status = transfer->status;
+    if (recv_last_status == LIBUSB_TRANSFER_OVERFLOW) {
+        // The data is lost, resubmit the same buffer
+        logw("LIBUSB_TRANSFER_OVERFLOW");
+        slot.chunk->len = 0;
+    } else if (recv_last_status == LIBUSB_TRANSFER_COMPLETED) {
+        m_receiveStats.transfers++;
+        m_receiveStats.bytes += transfer->actual_length;
+        int fill = transfer->actual_length * 4 / transfer->length;
+        m_receiveStats.fillHistogram[std::min(fill, 4)]++;
+        slot.chunk->len = transfer->actual_length;
     } else {
         loge("libusb_callback: abort");
         if (write(abort_usb_thread_pipe_write_fd,
                   &abort_usb_thread_pipe_write_fd, 1) < 0) {
             loge("Error when writing to abort_usb_thread_pipe_write_fd");
         }
+        return;
+    }
+    slot.completed = true;
+
+    // Hand over in submission order, then requeue the transfers with fresh
+    // buffers
+    while (m_receiveTransfers[m_receiveDeliverIndex].completed) {
+        ReceiveTransfer& next = m_receiveTransfers[m_receiveDeliverIndex];
+        next.completed = false;
+        deliver_usb_recv(next);
+        m_receiveDeliverIndex =
+            (m_receiveDeliverIndex + 1) % m_receiveTransfers.size();
+    }
+    if (submit_usb_recv() < 0) {
+        loge("libusb_callback: resubmit failed");
+        if (write(abort_usb_thread_pipe_write_fd,
+                  &abort_usb_thread_pipe_write_fd, 1) < 0) {
+            loge("Error when writing to abort_usb_thread_pipe_write_fd");
+        }
+    }
+}
+
+void HUTransportStreamUSB::deliver_usb_recv(ReceiveTransfer& slot) {
+    if (slot.chunk->len == 0) {
+        return;  // Nothing received, resubmit the same buffer
+    }
+
+    bool wasEmpty = false;
+    m_receiveReady.push(slot.chunk, &wasEmpty);
+    if (wasEmpty && eventfd_write(readfd, 1) < 0) {
+        loge("Error when writing to the receive eventfd");
+    }
+    logd("Handed over %d bytes", slot.chunk->len);
+    slot.chunk = nullptr;
+}
+
+int HUTransportStreamUSB::submit_usb_recv() {
+    while (true) {
+        ReceiveTransfer& slot = m_receiveTransfers[m_receiveSubmitIndex];
+        if (slot.inFlight || slot.completed) {
+            return 0;  // Every transfer is queued or waiting to be delivered
+        }
+        if (slot.chunk == nullptr && !m_receiveFree.pop(slot.chunk)) {
+            // The HU thread holds every buffer. The transfer waits, which
+            // throttles the phone, until Recycle() wakes us up. Flagged
+            // before looking again so a buffer returned in between isn't
+            // missed.
+            m_receiveStarved = true;
+            if (!m_receiveFree.pop(slot.chunk)) {
+                m_receiveStats.bufferWaits++;
+                return 0;
+            }
+            m_receiveStarved = false;
+        }
+        if (start_usb_recv(slot) < 0) {
+            return -1;
+        }
+        m_receiveSubmitIndex =
+            (m_receiveSubmitIndex + 1) % m_receiveTransfers.size();
     }
-    libusb_free_transfer(transfer);
 }
 
 void HUTransportStreamUSB::libusb_callback_tramp(libusb_transfer* transfer) {
-    reinterpret_cast<HUTransportStreamUSB*>(transfer->user_data)
-        ->libusb_callback(transfer);
+    reinterpret_cast<ReceiveTransfer*>(transfer->user_data)
+        ->owner->libusb_callback(transfer);
 }
 
 void HUTransportStreamUSB::libusb_callback_send(libusb_transfer* transfer) {
     logd("libusb_callback_send %d %d %d", transfer->status,
          LIBUSB_TRANSFER_COMPLETED, LIBUSB_TRANSFER_OVERFLOW);
     libusb_transfer_status recv_last_status = transfer->status;
-    if (recv_last_status != LIBUSB_TRANSFER_COMPLETED) {
+    if (recv_last_status != LIBUSB_TRANSFER_COMPLETED &&
+        m_state == hu_STATE_STARTED) {
         loge("libusb_callback: abort");
         if (write(abort_usb_thread_pipe_write_fd,
                   &abort_usb_thread_pipe_write_fd, 1) < 0) {
             loge("Error when writing to abort_usb_thread_pipe_write_fd");
         }
     }
-    free(transfer->buffer);
-    libusb_free_transfer(transfer);
+    SendTransfer* slot = reinterpret_cast<SendTransfer*>(transfer->user_data);
+    WriteCompletion done = std::move(slot->done);
+    slot->done = nullptr;
+    int result = recv_last_status == LIBUSB_TRANSFER_COMPLETED
+                     ? transfer->actual_length
+                     : -1;
+    release_usb_send(slot);
+    if (done) {
+        done(result);
+    }
 }
 
 void HUTransportStreamUSB::libusb_callback_send_tramp(
     libusb_transfer* transfer) {
-    reinterpret_cast<HUTransportStreamUSB*>(transfer->user_data)
-        ->libusb_callback_send(transfer);
+    reinterpret_cast<SendTransfer*>(transfer->user_data)
+        ->owner->libusb_callback_send(transfer);
 }
 
-int HUTransportStreamUSB::start_usb_recv() {
-    libusb_transfer* transfer = libusb_alloc_transfer(0);
-    libusb_fill_bulk_transfer(transfer, m_usbDeviceHandle, iusb_ep_in,
-                              m_tempReceiveBuffer.data(), m_tempReceiveBuffer.size(),
-                              &libusb_callback_tramp, this, 0);
+int HUTransportStreamUSB::start_usb_recv(ReceiveTransfer& slot) {
+    libusb_fill_bulk_transfer(slot.transfer, m_usbDeviceHandle, iusb_ep_in,
+                              slot.chunk->data, slot.chunk->capacity,
+                              &libusb_callback_tramp, &slot, 0);
 
-    int iusb_state = libusb_submit_transfer(transfer);
+    int iusb_state = libusb_submit_transfer(slot.transfer);
     if (iusb_state < 0) {
         loge("  Failed: libusb_submit_transfer: %d (%s)", iusb_state,
              libusb_strerror((libusb_error)iusb_state));
-        libusb_free_transfer(transfer);
-    } else {
-        logd(" libusb_submit_transfer for %d bytes", m_tempReceiveBuffer.size());
+        return iusb_state;
+    }
+    logd(" libusb_submit_transfer for %d bytes", slot.chunk->capacity);
+
+    slot.inFlight = true;
+    if (m_receiveInFlight++ == 0 && m_receiveIdleSince != 0) {
+        uint64_t gap = hu_time_us() - m_receiveIdleSince;
+        m_receiveStats.idleGaps++;
+        m_receiveStats.idleGapTotalUs += gap;
+        m_receiveStats.idleGapMaxUs =
+            std::max(m_receiveStats.idleGapMaxUs, gap);
+        m_receiveIdleSince = 0;
     }
+    m_receiveStats.maxInFlight =
+        std::max(m_receiveStats.maxInFlight, m_receiveInFlight);
     return iusb_state;
 }
 
+void HUTransportStreamUSB::cancel_usb_recv() {
+    for (auto& slot : m_receiveTransfers) {
+        if (slot.inFlight) {
+            libusb_cancel_transfer(slot.transfer);
+        }
+    }
+
+    // The usb thread is gone, so reap the cancellations on this one
+    timeval tv = {0, 100000};
+    for (int tries = 0; m_receiveInFlight > 0 && tries < 10; tries++) {
+        libusb_handle_events_timeout_completed(m_usbContext, &tv, nullptr);
+    }
+
+    for (auto& slot : m_receiveTransfers) {
+        if (slot.inFlight) {
+            // libusb still owns it and its buffer, leaking is the only safe
+            // option
+            loge("IN transfer still pending after cancel, leaking it");
+            static_cast<ReceiveChunk*>(slot.chunk)->buffer.data = nullptr;
+            continue;
+        }
+        libusb_free_transfer(slot.transfer);
+    }
+    // The HU thread has released everything it held before calling Stop()
+    for (auto& chunk : m_receiveChunkStore) {
+        if (chunk.buffer.data) {
+            free_transfer_buffer(chunk.buffer);
+        }
+    }
+    if (!m_receiveTransfers.empty()) {
+        log_receive_stats();
+    }
+    m_receiveTransfers.clear();
+    m_receiveChunkStore.clear();
+    m_receiveReady.reset(0);
+    m_receiveFree.reset(0);
+    m_receiveDeliverIndex = 0;
+    m_receiveSubmitIndex = 0;
+    m_receiveStarved = false;
+    m_receiveInFlight = 0;
+    m_receiveIdleSince = 0;
+}
+
+void HUTransportStreamUSB::cancel_usb_send() {
+    // SubmitWrite() can't submit anything new once the state has left STARTED
+    std::vector<libusb_transfer*> pending;
+    {
+        std::lock_guard<std::mutex> lock(m_sendLock);
+        for (auto& slot : m_sendTransfers) {
+            if (slot.inFlight) {
+                pending.push_back(slot.transfer);
+            }
+        }
+    }
+    for (libusb_transfer* transfer : pending) {
+        libusb_cancel_transfer(transfer);
+    }
+
+    // Completions return the slots to the free list
+    timeval tv = {0, 100000};
+    for (int tries = 0; tries < 10; tries++) {
+        {
+            std::lock_guard<std::mutex> lock(m_sendLock);
+            if (m_sendInUse == 0) break;
+        }
+        libusb_handle_events_timeout_completed(m_usbContext, &tv, nullptr);
+    }
+
+    std::lock_guard<std::mutex> lock(m_sendLock);
+    for (auto& slot : m_sendTransfers) {
+        if (slot.inFlight) {
+            // libusb still owns it, leaking is the only safe option
+            loge("OUT transfer still pending after cancel, leaking it");
+            continue;
+        }
+        free_transfer_buffer(slot.buffer);
+        libusb_free_transfer(slot.transfer);
+    }
+    if (!m_sendTransfers.empty()) {
+        log_send_stats();
+    }
+    m_sendTransfers.clear();
+    m_sendFree.clear();
+    m_sendInUse = 0;
+}
+
+void HUTransportStreamUSB::log_send_stats() {
+    const SendStats& st = m_sendStats;
+    logi("USB OUT: pool %d x %d bytes, high water %d", m_sendTransferCount,
+         m_sendTransferSize, st.maxInUse);
+    logi("USB OUT: %llu transfers  %llu bytes  %llu split writes",
+         (unsigned long long)st.transfers, (unsigned long long)st.bytes,
+         (unsigned long long)st.split);
+    logi("USB OUT: pool waits %llu  total %llu us  max %llu us  timeouts %llu",
+         (unsigned long long)st.poolWaits,
+         (unsigned long long)st.poolWaitTotalUs,
+         (unsigned long long)st.poolWaitMaxUs,
+         (unsigned long long)st.poolTimeouts);
+    // The submitting threads' side of the usbfs copy, see the IN line
+    logi("USB OUT: %s buffers, %llu us CPU per MB submitting",
+         m_devMemBuffers ? "dev mem" : "heap",
+         (unsigned long long)(st.bytes ? st.submitCpuUs * 1048576 / st.bytes
+                                       : 0));
+}
+
+void HUTransportStreamUSB::log_receive_stats() {
+    const ReceiveStats& st = m_receiveStats;
+    logi("USB IN: %d x %d byte transfers, max in flight %d", m_receiveTransferCount,
+         m_receiveTransferSize, st.maxInFlight);
+    logi("USB IN: %llu transfers  %llu bytes", (unsigned long long)st.transfers,
+         (unsigned long long)st.bytes);
+    logi("USB IN: %zu buffers, waits for a free one %llu",
+         m_receiveChunkStore.size(), (unsigned long long)st.bufferWaits);
+    // Compare usb_zero_copy=1 and 0 on the same stream to see what the
+    // usbfs bounce copy costs, tools/usb_bench does that
+    logi("USB IN: %s buffers (%d dev mem, %d heap), %llu us usb thread CPU "
+         "per MB",
+         m_devMemBuffers ? "dev mem" : "heap", m_devMemBuffers, m_heapBuffers,
+         (unsigned long long)(st.bytes ? st.threadCpuUs * 1048576 / st.bytes
+                                       : 0));
+    logi("USB IN: idle gaps %llu  total %llu us  max %llu us",
+         (unsigned long long)st.idleGaps,
+         (unsigned long long)st.idleGapTotalUs,
+         (unsigned long long)st.idleGapMaxUs);
+    logi("USB IN: fill <25%% %llu  <50%% %llu  <75%% %llu  <100%% %llu  full %llu",
+         (unsigned long long)st.fillHistogram[0],
+         (unsigned long long)st.fillHistogram[1],
+         (unsigned long long)st.fillHistogram[2],
+         (unsigned long long)st.fillHistogram[3],
+         (unsigned long long)st.fillHistogram[4]);
+}
+
 int HUTransportStreamUSB::Start() {
     if (m_state == hu_STATE_STARTED) {
         logd("CHECK: iusb_state: %d (%s)", m_state, state_get(m_state));
@@ -326,121 +706,14 @@ int HUTransportStreamUSB::Start() {
     // See if there is a OAP device already
     m_usbDeviceHandle = find_oap_device();
 
-    //Initiate Android Accessory mode if no device in Accessory mode connected
+    // Normally the device watcher has already switched the phone. If that
+    // didn't happen, the bus is probed in the background without holding up
+    // the caller, and the phone is there as an accessory on a later attempt.
     if (m_usbDeviceHandle == nullptr) {
-        libusb_device** devices = nullptr;
-        ssize_t dev_count = libusb_get_device_list(m_usbContext, &devices);
-        if (dev_count < 0) {
-            loge("Error libusb_get_device_list usb_err: %d (%s)", dev_count,
-                 libusb_strerror((libusb_error)dev_count));
-            Stop();
-            return (-1);
-        }
-
-        for (ssize_t i = 0; i < dev_count; i++) {
-            libusb_device_descriptor desc;
-            int usb_err = libusb_get_device_descriptor(devices[i], &desc);
-            if (usb_err < 0) {
-                loge("Error getting descriptor");
-                continue;
-            }
-            logd("Opening device 0x%04x : 0x%04x", desc.idVendor,
-                 desc.idProduct);
-            libusb_device_handle* handle = nullptr;
-            usb_err = libusb_open(devices[i], &handle);
-            if (usb_err < 0) {
-                loge("Error opening device 0x%04x : 0x%04x", desc.idVendor,
-                     desc.idProduct);
-                continue;
-            }
-
-            uint16_t oap_proto_ver = 0;
-            if (iusb_control_transfer(
-                    handle, USB_DIR_IN | USB_TYPE_VENDOR, ACC_REQ_GET_PROTOCOL,
-                    0, 0, (byte*)&oap_proto_ver, sizeof(uint16_t), 1000) >= 0) {
-                oap_proto_ver = le16toh(oap_proto_ver);
-                if (oap_proto_ver < 1) {
-                    continue;
-                }
-                logd("Device 0x%04x : 0x%04x responded with protocol ver %u",
-                     desc.idVendor, desc.idProduct, oap_proto_ver);
-                usb_err = iusb_control_transfer(
-                    handle, USB_DIR_OUT | USB_TYPE_VENDOR, ACC_REQ_SEND_STRING,
-                    0, ACC_IDX_MAN, AAP_VAL_MAN, sizeof(AAP_VAL_MAN), 1000);
-                if (usb_err < 0) {
-                    loge("Error sending ACC_IDX_MAN to device 0x%04x : 0x%04x",
-                         desc.idVendor, desc.idProduct);
-                    continue;
-                }
-                usb_err = iusb_control_transfer(
-                    handle, USB_DIR_OUT | USB_TYPE_VENDOR, ACC_REQ_SEND_STRING,
-                    0, ACC_IDX_MOD, AAP_VAL_MOD, sizeof(AAP_VAL_MOD), 1000);
-                if (usb_err < 0) {
-                    loge("Error sending ACC_IDX_MOD to device 0x%04x : 0x%04x",
-                         desc.idVendor, desc.idProduct);
-                    continue;
-                }
-                usb_err = iusb_control_transfer(
-                    handle, USB_DIR_OUT | USB_TYPE_VENDOR, ACC_REQ_SEND_STRING,
-                    0, ACC_IDX_DESC, AAP_VAL_DESC, sizeof(AAP_VAL_DESC), 1000);
-                if (usb_err < 0) {
-                    loge("Error sending ACC_IDX_DESC to device 0x%04x : 0x%04x",
-                         desc.idVendor, desc.idProduct);
-                    continue;
-                }
-                usb_err = iusb_control_transfer(
-                    handle, USB_DIR_OUT | USB_TYPE_VENDOR, ACC_REQ_SEND_STRING,
-                    0, ACC_IDX_VER, AAP_VAL_VER, sizeof(AAP_VAL_VER), 1000);
-                if (usb_err < 0) {
-                    loge("Error sending ACC_IDX_VER to device 0x%04x : 0x%04x",
-                         desc.idVendor, desc.idProduct);
-                    continue;
-                }
-                usb_err = iusb_control_transfer(
-                    handle, USB_DIR_OUT | USB_TYPE_VENDOR, ACC_REQ_SEND_STRING,
-                    0, ACC_IDX_URI, AAP_VAL_URI, sizeof(AAP_VAL_URI), 1000);
-                if (usb_err < 0) {
-                    loge("Error sending ACC_IDX_URI to device 0x%04x : 0x%04x",
-                         desc.idVendor, desc.idProduct);
-                    continue;
-                }
-                usb_err = iusb_control_transfer(
-                    handle, USB_DIR_OUT | USB_TYPE_VENDOR, ACC_REQ_SEND_STRING,
-                    0, ACC_IDX_SERIAL, AAP_VAL_SERIAL, sizeof(AAP_VAL_SERIAL),
-                    1000);
-                if (usb_err < 0) {
-                    loge(
-                        "Error sending ACC_IDX_SERIAL to device 0x%04x : "
-                        "0x%04x",
-                        desc.idVendor, desc.idProduct);
-                    continue;
-                }
-                usb_err = iusb_control_transfer(
-                    handle, USB_DIR_OUT | USB_TYPE_VENDOR, ACC_REQ_START, 0, 0,
-                    nullptr, 0, 1000);
-                if (usb_err < 0) {
-                    loge(
-                        "Error sending ACC_REQ_START to device 0x%04x : 0x%04x",
-                        desc.idVendor, desc.idProduct);
-                    continue;
-                }
-                libusb_close(handle);
-                break;
-            }
-
-            libusb_close(handle);
-        }
-
-        // unref the devices
-        libusb_free_device_list(devices, 1);
-
-        // Try right away just incase
-        m_usbDeviceHandle = find_oap_device();
-        if (m_usbDeviceHandle == nullptr) {
-          logd("OAP Device hasn't reconnected yet will try again");
-          Stop();
-          return (-1);
-        }
+        HUAccessorySwitcher::ProbeAllInBackground(2000);
+        logd("No OAP device yet, will try again");
+        Stop();
+        return (-1);
     }
 
     logd("Found OAP Device");
@@ -516,14 +789,13 @@ int HUTransportStreamUSB::Start() {
         return (-1);
     }
 
-    int pipefd[2] = {-1, -1};
-    if (pipe(pipefd) < 0) {
-        loge("Pipe create failed");
+    readfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (readfd < 0) {
+        loge("eventfd create failed");
         return -1;
     }
-    readfd = pipefd[0];
-    m_pipeWriteFD = pipefd[1];
 
+    int pipefd[2] = {-1, -1};
     if (pipe(pipefd) < 0) {
         loge("Error pipe create failed");
         return -1;
@@ -543,6 +815,17 @@ int HUTransportStreamUSB::Start() {
     abort_poll.events = POLLIN;
     abort_poll.revents = 0;
     usb_thread_event_fds.push_back(abort_poll);
+    // And for Recycle() to wake us up when transfers wait for buffers
+    m_recycleFD = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_recycleFD < 0) {
+        loge("eventfd create failed");
+        return -1;
+    }
+    pollfd recycle_poll;
+    recycle_poll.fd = m_recycleFD;
+    recycle_poll.events = POLLIN;
+    recycle_poll.revents = 0;
+    usb_thread_event_fds.push_back(recycle_poll);
 
     const libusb_pollfd** existing_poll_fds = libusb_get_pollfds(m_usbContext);
     for (auto cur_poll_fd_ptr = existing_poll_fds; *cur_poll_fd_ptr;
@@ -562,10 +845,59 @@ int HUTransportStreamUSB::Start() {
     libusb_set_pollfd_notifiers(m_usbContext, &libusb_callback_pollfd_added_tramp,
                                 &libusb_callback_pollfd_removed_tramp, this);
 
-    usb_recv_thread = std::thread([this] { this->usb_recv_thread_main(); });
+    // Enough buffers for usb_rx_ring_size, and at least one spare per
+    // transfer so a resubmit doesn't wait on the HU thread
+    size_t chunk_count =
+        std::max(m_receiveTransferCount * 2,
+                 m_receiveRingSize / m_receiveTransferSize);
+    m_receiveChunkStore.resize(chunk_count);
+    m_receiveReady.reset(chunk_count);
+    m_receiveFree.reset(chunk_count);
+    for (auto& chunk : m_receiveChunkStore) {
+        if (!alloc_transfer_buffer(chunk.buffer, m_receiveTransferSize)) {
+            loge("Error allocating IN buffers");
+            Stop();
+            return (-1);
+        }
+        chunk.data = chunk.buffer.data;
+        chunk.capacity = chunk.buffer.size;
+        chunk.pool = this;
+        m_receiveFree.push(&chunk);
+    }
+
+    // Queue the whole IN ring before the event thread starts so the
+    // counters are only ever touched from one thread at a time
+    m_receiveTransfers.resize(m_receiveTransferCount);
+    for (auto& slot : m_receiveTransfers) {
+        slot.owner = this;
+        slot.transfer = libusb_alloc_transfer(0);
+        if (slot.transfer == nullptr) {
+            loge("Error allocating IN transfers");
+            Stop();
+            return (-1);
+        }
+    }
+    if (submit_usb_recv() < 0 ||
+        m_receiveInFlight != (int)m_receiveTransfers.size()) {
+        loge("Error queueing IN transfers");
+        Stop();
+        return (-1);
+    }
+
+    m_sendTransfers.resize(m_sendTransferCount);
+    for (auto& slot : m_sendTransfers) {
+        slot.owner = this;
+        slot.transfer = libusb_alloc_transfer(0);
+        if (!alloc_transfer_buffer(slot.buffer, m_sendTransferSize) ||
+            slot.transfer == nullptr) {
+            loge("Error allocating OUT transfers");
+            Stop();
+            return (-1);
+        }
+        m_sendFree.push_back(&slot);
+    }
 
-    m_tempReceiveBuffer.resize(16384);
-    start_usb_recv();
+    usb_recv_thread = std::thread([this] { this->usb_recv_thread_main(); });
 
     m_state = hu_STATE_STARTED;
     logd("  SET: iusb_state: %d (%s)", m_state, state_get(m_state));
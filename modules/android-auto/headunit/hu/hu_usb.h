@@ -1,21 +1,70 @@
 #include <libusb.h>
 #include <poll.h>
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
 #include <mutex>
 #include <thread>
 #include <vector>
 #include "hu_aap.h"
+#include "hu_ring.h"
 
 
 namespace AndroidAuto {
 
-class HUTransportStreamUSB : public HUTransportStream {
+class HUTransportStreamUSB : public HUTransportStream,
+                             private HUTransportChunkPool {
    public:
     ~HUTransportStreamUSB();
     HUTransportStreamUSB(std::map<std::string, std::string> _settings);
     virtual int Start() override;
     virtual int Stop() override;
-    virtual int Write(const byte* buf, int len, int tmo) override;
+    virtual int SubmitWrite(const iovec* iov, int iovcnt, int tmo,
+                            WriteCompletion done = nullptr) override;
+    virtual int Poll(const ReceiveCallback& callback) override;
+
+    // Bulk-IN counters, only updated from the usb thread. Read them after
+    // Stop() or from a libusb callback.
+    struct ReceiveStats {
+        uint64_t transfers = 0;
+        uint64_t bytes = 0;
+        // Times every IN transfer had completed and none was queued, i.e. the
+        // endpoint was NAKing the phone until we resubmitted.
+        uint64_t idleGaps = 0;
+        uint64_t idleGapTotalUs = 0;
+        uint64_t idleGapMaxUs = 0;
+        // actual_length / length: <25%, <50%, <75%, <100%, full
+        uint64_t fillHistogram[5] = {0};
+        int maxInFlight = 0;
+        // Times the HU thread held on to every receive buffer and an IN
+        // transfer was held back until Recycle() returned one
+        uint64_t bufferWaits = 0;
+        // CPU time of the usb thread, which is where usbfs copies IN data
+        // out of its bounce buffers when not using device memory
+        uint64_t threadCpuUs = 0;
+    };
+    inline const ReceiveStats& GetReceiveStats() const { return m_receiveStats; }
+
+    // Bulk-OUT pool counters, updated under the send pool lock
+    struct SendStats {
+        uint64_t transfers = 0;
+        uint64_t bytes = 0;
+        // Most pool slots ever in flight at once
+        int maxInUse = 0;
+        // Writes that found the pool empty and had to wait for a completion,
+        // and the ones that gave up after tmo
+        uint64_t poolWaits = 0;
+        uint64_t poolWaitTotalUs = 0;
+        uint64_t poolWaitMaxUs = 0;
+        uint64_t poolTimeouts = 0;
+        // Multi-frame writes, sent as one transfer per frame
+        uint64_t split = 0;
+        // CPU time of the submitting threads gathering and submitting, which
+        // is where usbfs copies OUT data into its bounce buffers when not
+        // using device memory
+        uint64_t submitCpuUs = 0;
+    };
+    SendStats GetSendStats();
 
    private:
     libusb_context* m_usbContext = NULL;
@@ -25,7 +74,6 @@ class HUTransportStreamUSB : public HUTransportStream {
     int iusb_ep_in = -1;
     int iusb_ep_out = -1;
 
-    int m_pipeWriteFD = -1;
     int m_errorWriteFD = -1;
 
     int abort_usb_thread_pipe_read_fd = -1;
@@ -33,12 +81,92 @@ class HUTransportStreamUSB : public HUTransportStream {
     std::mutex usb_thread_event_fds_lock;
     std::vector<pollfd> usb_thread_event_fds;
 
+    // Transfer buffer. Comes from libusb_dev_mem_alloc() when the kernel
+    // supports it, so usbfs can DMA straight into it instead of copying
+    // through its own buffer, from the heap otherwise.
+    struct TransferBuffer {
+        byte* data = nullptr;
+        int size = 0;
+        bool devMem = false;
+    };
+    bool m_zeroCopy = true;
+    int m_devMemBuffers = 0;
+    int m_heapBuffers = 0;
+    bool alloc_transfer_buffer(TransferBuffer& buffer, int size);
+    void free_transfer_buffer(TransferBuffer& buffer);
+
     // usb recv thread state
-    std::vector<byte> m_tempReceiveBuffer;
+    // Receive buffers. A completed IN transfer hands its buffer to the HU
+    // thread as is and is resubmitted with a free one; the HU thread's
+    // Recycle() puts buffers back on the free queue. When there is none the
+    // transfer waits, and Recycle() wakes the usb thread through
+    // m_recycleFD to resubmit it, the libusb callback never blocks.
+    struct ReceiveChunk : public HUTransportChunk {
+        TransferBuffer buffer;
+    };
+    std::vector<ReceiveChunk> m_receiveChunkStore;
+    HUSpscQueue<HUTransportChunk*> m_receiveReady;  // usb -> HU thread
+    HUSpscQueue<HUTransportChunk*> m_receiveFree;   // HU -> usb thread
+    std::atomic<bool> m_receiveStarved{false};
+    int m_recycleFD = -1;  // eventfd, polled by the usb thread
+    virtual void Recycle(HUTransportChunk* chunk) override;
+
+    // Ring of bulk-IN transfers. They are submitted in ring order, so
+    // handing them over in ring order keeps the byte stream ordered even if
+    // a completion were to be reported early. One that is neither in flight
+    // nor completed waits for a buffer, and the ones after it wait behind
+    // it.
+    struct ReceiveTransfer {
+        HUTransportStreamUSB* owner = nullptr;
+        libusb_transfer* transfer = nullptr;
+        HUTransportChunk* chunk = nullptr;
+        bool inFlight = false;
+        bool completed = false;
+    };
+    std::vector<ReceiveTransfer> m_receiveTransfers;
+    size_t m_receiveDeliverIndex = 0;
+    size_t m_receiveSubmitIndex = 0;
+    int m_receiveInFlight = 0;
+    uint64_t m_receiveIdleSince = 0;
+    ReceiveStats m_receiveStats;
+    int m_receiveTransferCount = 4;
+    int m_receiveTransferSize = 16384;
+    // Total receive buffer space. readfd is an eventfd that is only
+    // signalled when the HU thread may have gone to sleep.
+    int m_receiveRingSize = 1024 * 1024;
     std::thread usb_recv_thread;
 
+    // Fixed pool of bulk-OUT transfers, recycled from the send callback.
+    // SubmitWrite() waits up to its timeout for a free one, so a stalled
+    // phone pushes back on the sender instead of growing memory.
+    struct SendTransfer {
+        HUTransportStreamUSB* owner = nullptr;
+        libusb_transfer* transfer = nullptr;
+        TransferBuffer buffer;
+        WriteCompletion done;
+        bool inFlight = false;
+    };
+    std::vector<SendTransfer> m_sendTransfers;
+    std::vector<SendTransfer*> m_sendFree;
+    int m_sendInUse = 0;
+    std::mutex m_sendLock;
+    std::condition_variable m_sendAvailable;
+    SendStats m_sendStats;
+    int m_sendTransferCount = 16;
+    int m_sendTransferSize = MAX_FRAME_SIZE;
+
     void usb_recv_thread_main();
-    int start_usb_recv();
+    int start_usb_recv(ReceiveTransfer& slot);
+    void deliver_usb_recv(ReceiveTransfer& slot);
+    // Resubmits waiting transfers in ring order while there are buffers
+    int submit_usb_recv();
+    void cancel_usb_recv();
+    void log_receive_stats();
+    int submit_usb_send(const iovec* iov, int iovcnt, int len, int tmo,
+                        WriteCompletion done);
+    void cancel_usb_send();
+    void release_usb_send(SendTransfer* slot);
+    void log_send_stats();
 
     void libusb_callback(libusb_transfer* transfer);
     static void libusb_callback_tramp(libusb_transfer* transfer);
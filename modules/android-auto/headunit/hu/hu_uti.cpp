@@ -14,6 +14,7 @@
 
 #include <string.h>
 #include <signal.h>
+#include <time.h>
 
 #include <pthread.h>
 
@@ -34,16 +35,15 @@
 int gen_server_loop_func (unsigned char * cmd_buf, int cmd_len, unsigned char * res_buf, int res_max);
 int gen_server_poll_func (int poll_ms);
 
-  // Log stuff:
+  // Log stuff: process wide, set before any session starts, only read after
 
 int ena_log_extra   = 0;//1;//0;
 int ena_log_verbo   = 0;//1;
 int ena_log_debug   = 0;
+int ena_log_info    = 1;
 int ena_log_warni   = 1;
 int ena_log_error   = 1;
 
-int ena_log_aap_send = 0;
-
 // Enables for hex_dump:
 int ena_hd_hu_aad_dmp = 1;        // Higher level
 int ena_hd_tra_send   = 0;        // Lower  level
@@ -58,6 +58,7 @@ const  char * prio_get (int prio) {
     case hu_LOG_EXT: return ("X");
     case hu_LOG_VER: return ("V");
     case hu_LOG_DEB: return ("D");
+    case hu_LOG_INF: return ("I");
     case hu_LOG_WAR: return ("W");
     case hu_LOG_ERR: return ("E");
   }
@@ -72,6 +73,8 @@ int hu_log (int prio, const char * tag, const char * func, const char * fmt, ...
     return -1;
   if (! ena_log_debug && prio == hu_LOG_DEB)
     return -1;
+  if (! ena_log_info && prio == hu_LOG_INF)
+    return -1;
   if (! ena_log_warni && prio == hu_LOG_WAR)
     return -1;
   if (! ena_log_error && prio == hu_LOG_ERR)
@@ -111,6 +114,12 @@ unsigned long ms_sleep (unsigned long ms) {
   return (ms);
 }
 
+uint64_t hu_time_us () {
+  struct timespec tp;
+  clock_gettime (CLOCK_MONOTONIC, & tp);
+  return ((uint64_t) tp.tv_sec * 1000000 + tp.tv_nsec / 1000);
+}
+
 
 #define HD_MW   256
 void hex_dump (const char * prefix, int width, unsigned char * buf, int len) {
@@ -26,8 +26,6 @@ extern int ena_hd_hu_aad_dmp;
 extern int ena_hd_tra_send;
 extern int ena_hd_tra_recv;
 
-extern int ena_log_aap_send;
-
 extern int ena_log_extra;
 extern int ena_log_verbo;
 
@@ -36,6 +34,7 @@ typedef unsigned char byte;
 #define hu_LOG_EXT   1
 #define hu_LOG_VER   2
 #define hu_LOG_DEB   3
+#define hu_LOG_INF   4
 #define hu_LOG_WAR   5
 #define hu_LOG_ERR   6
 
@@ -44,6 +43,7 @@ typedef unsigned char byte;
 #define  logx(...)
 #define  logv(...)
 #define  logd(...)
+#define  logi(...)
 #define  logw(...)
 #define  loge(...)
 
@@ -55,6 +55,7 @@ typedef unsigned char byte;
 #define  logx(...)  hu_log(hu_LOG_EXT,__FILE__ ":" STR(__LINE__),__FUNCTION__,__VA_ARGS__)
 #define  logv(...)  hu_log(hu_LOG_VER,__FILE__ ":" STR(__LINE__),__FUNCTION__,__VA_ARGS__)
 #define  logd(...)  hu_log(hu_LOG_DEB,__FILE__ ":" STR(__LINE__),__FUNCTION__,__VA_ARGS__)
+#define  logi(...)  hu_log(hu_LOG_INF,__FILE__ ":" STR(__LINE__),__FUNCTION__,__VA_ARGS__)
 #define  logw(...)  hu_log(hu_LOG_WAR,__FILE__ ":" STR(__LINE__),__FUNCTION__,__VA_ARGS__)
 #define  loge(...)  hu_log(hu_LOG_ERR,__FILE__ ":" STR(__LINE__),__FUNCTION__,__VA_ARGS__)
 
@@ -64,6 +65,7 @@ int hu_log (int prio, const char * tag, const char * func, const char * fmt, ...
 
 
 unsigned long ms_sleep        (unsigned long ms);
+uint64_t hu_time_us           ();                                     // CLOCK_MONOTONIC in microseconds, for intervals and stats
 void hex_dump                 (const char * prefix, int width, unsigned char * buf, int len);
 
 void hu_log_library_versions();
@@ -0,0 +1,78 @@
+// Decrypt throughput of the TLS 1.2 AEADs on this CPU, and the cipher list
+// ssl_cipher_list=auto would make of it.
+//
+// Opens records the size of the HU's received frames (16 KB video
+// fragments) and smaller ones like audio and control messages, with
+// AES-128-GCM, AES-256-GCM and ChaCha20-Poly1305, through the same
+// hu_cipher_bench() the HU runs at start. On ARM cores without the AES
+// instructions ChaCha20 usually wins by a wide margin, with them AES-GCM.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <openssl/ssl.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "hu_cipher.h"
+
+using namespace AndroidAuto;
+
+static const size_t record_sizes[] = {16384, 4096, 1024, 128};
+
+// What the HU offers by default
+static std::vector<std::string> default_suites() {
+    std::vector<std::string> suites;
+    SSL_CTX* ctx = SSL_CTX_new(TLSv1_2_client_method());
+    SSL* ssl = ctx ? SSL_new(ctx) : nullptr;
+    STACK_OF(SSL_CIPHER)* ciphers =
+        ssl ? SSL_get1_supported_ciphers(ssl) : nullptr;
+    for (int i = 0; ciphers && i < sk_SSL_CIPHER_num(ciphers); i++) {
+        suites.push_back(SSL_CIPHER_get_name(sk_SSL_CIPHER_value(ciphers, i)));
+    }
+    sk_SSL_CIPHER_free(ciphers);
+    SSL_free(ssl);
+    SSL_CTX_free(ctx);
+    return suites;
+}
+
+int main(int argc, char* argv[]) {
+    int ms = 200;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            ms = std::max(1, atoi(argv[++i]));
+        } else {
+            fprintf(stderr, "usage: %s [-t ms_per_cipher]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    printf("%-8s %-18s %10s %12s\n", "record", "cipher", "MB/s",
+           "us/record");
+    std::vector<HUCipherResult> full;
+    for (size_t size : record_sizes) {
+        std::vector<HUCipherResult> results =
+            hu_cipher_bench(size, (uint64_t)ms * 1000);
+        for (const HUCipherResult& r : results) {
+            printf("%-8zu %-18s %10.1f %12.2f\n", size, r.name.c_str(),
+                   r.mbPerSec, r.mbPerSec > 0 ? size / r.mbPerSec : 0.0);
+        }
+        if (full.empty()) {
+            full = results;  // The biggest records decide, like at HU start
+        }
+    }
+
+    std::vector<std::string> suites = default_suites();
+    printf("\nssl_cipher_list=auto on this CPU:\n");
+    std::string list = hu_cipher_preference(suites, full);
+    size_t begin = 0;
+    while (begin < list.size()) {
+        size_t end = list.find(':', begin);
+        if (end == std::string::npos) {
+            end = list.size();
+        }
+        printf("  %s\n", list.substr(begin, end - begin).c_str());
+        begin = end + 1;
+    }
+    return 0;
+}
@@ -0,0 +1,261 @@
+// Frames/s of the receive path's frame parsing, on captured traffic.
+//
+// Takes what the phone sent in a capture (capture_file, see hu_capture.h),
+// in the chunks the transport handed over at the time, and parses it two
+// ways:
+//  - per frame, as processReceived() did before: one receive call copying
+//    out the 4 byte header, more for the rest of the frame
+//  - with HUFrameParser: every chunk fed once, frames parsed in place and
+//    only those crossing a chunk boundary copied
+// Both then put messages together per channel the way HUServer does. TLS
+// isn't part of it, a capture's payload is parsed still encrypted.
+//
+// Without a capture file a synthetic session is used: 60 KB video messages
+// in 16 KB frames with media acks and input in between, cut into chunks of
+// -c bytes.
+
+#include <endian.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "hu_capture.h"
+#include "hu_frame.h"
+
+using namespace AndroidAuto;
+
+static uint64_t now_us() {
+    timespec tp;
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return (uint64_t)tp.tv_sec * 1000000 + tp.tv_nsec / 1000;
+}
+
+struct Chunk {
+    const byte* data;
+    size_t len;
+};
+
+struct RunStats {
+    uint64_t frames = 0;
+    uint64_t messages = 0;
+    uint64_t bytes = 0;
+    uint64_t receiveCalls = 0;
+    uint64_t carried = 0;
+    uint64_t us = 0;
+};
+
+// Per channel message assembly like HUServer::handleFrame()
+class Assembler {
+   public:
+    uint64_t messages = 0;
+    int Add(const HUFrame& frame) {
+        std::vector<byte>& message = m_messages[frame.chan];
+        if (frame.flags & HU_FRAME_FIRST_FRAME) {
+            message.clear();
+            message.reserve(frame.totalLen ? frame.totalLen : frame.len);
+        }
+        message.insert(message.end(), frame.payload,
+                       frame.payload + frame.len);
+        if (frame.flags & HU_FRAME_LAST_FRAME) {
+            messages++;
+            message.clear();
+        }
+        return 0;
+    }
+
+   private:
+    std::vector<byte> m_messages[256];
+};
+
+// Copies out of the chunks like the old receiveTransportPacket()
+class ChunkReader {
+   public:
+    explicit ChunkReader(const std::vector<Chunk>& chunks) : m_chunks(chunks) {}
+    uint64_t calls = 0;
+
+    int Read(byte* buf, int len) {
+        calls++;
+        int ret = 0;
+        while (ret < len && m_index < m_chunks.size()) {
+            const Chunk& chunk = m_chunks[m_index];
+            int count = std::min((size_t)(len - ret), chunk.len - m_offset);
+            memcpy(&buf[ret], &chunk.data[m_offset], count);
+            ret += count;
+            m_offset += count;
+            if (m_offset == chunk.len) {
+                m_index++;
+                m_offset = 0;
+            }
+        }
+        return ret;
+    }
+
+   private:
+    const std::vector<Chunk>& m_chunks;
+    size_t m_index = 0;
+    size_t m_offset = 0;
+};
+
+static bool parse_per_frame(const std::vector<Chunk>& chunks, RunStats& st) {
+    ChunkReader reader(chunks);
+    Assembler assembler;
+    byte enc_buf[MAX_FRAME_SIZE];
+    while (true) {
+        int have_len = reader.Read(enc_buf, 4);
+        if (have_len == 0) break;
+        if (have_len < 4) return false;
+        int flags = enc_buf[1];
+        int frame_len = be16toh(*(uint16_t*)&enc_buf[2]);
+        if (frame_len > MAX_FRAME_PAYLOAD_SIZE) return false;
+        int header_size = 4;
+        if ((flags & HU_FRAME_FIRST_FRAME) && !(flags & HU_FRAME_LAST_FRAME)) {
+            header_size += 4;
+        }
+        int remaining = frame_len + header_size - have_len;
+        if (reader.Read(&enc_buf[have_len], remaining) != remaining) {
+            return false;
+        }
+        HUFrame frame;
+        frame.chan = enc_buf[0];
+        frame.flags = flags;
+        frame.len = frame_len;
+        if (header_size == 8) {
+            frame.totalLen = be32toh(*(uint32_t*)&enc_buf[4]);
+        }
+        frame.payload = &enc_buf[header_size];
+        assembler.Add(frame);
+        st.frames++;
+        st.bytes += header_size + frame_len;
+    }
+    st.messages += assembler.messages;
+    st.receiveCalls += reader.calls;
+    return true;
+}
+
+static bool parse_streaming(const std::vector<Chunk>& chunks, RunStats& st) {
+    HUFrameParser parser;
+    Assembler assembler;
+    HUFrameParser::FrameCallback callback = [&](const HUFrame& frame) {
+        return assembler.Add(frame);
+    };
+    for (const Chunk& chunk : chunks) {
+        if (parser.Feed(chunk.data, chunk.len, callback) < 0) {
+            return false;
+        }
+    }
+    st.frames += parser.GetStats().frames;
+    st.bytes += parser.GetStats().bytes;
+    st.carried += parser.GetStats().carried;
+    st.messages += assembler.messages;
+    st.receiveCalls += chunks.size();
+    return !parser.HasPartial();
+}
+
+static void add_message(std::vector<byte>& stream, int chan, size_t len) {
+    for (size_t start = 0; start < len; start += MAX_FRAME_PAYLOAD_SIZE) {
+        size_t frame_len =
+            std::min(len - start, (size_t)MAX_FRAME_PAYLOAD_SIZE);
+        byte flags = HU_FRAME_ENCRYPTED;
+        if (start == 0) flags |= HU_FRAME_FIRST_FRAME;
+        if (start + frame_len == len) flags |= HU_FRAME_LAST_FRAME;
+        stream.push_back(chan);
+        stream.push_back(flags);
+        stream.push_back(frame_len >> 8);
+        stream.push_back(frame_len & 0xff);
+        if ((flags & HU_FRAME_FIRST_FRAME) && !(flags & HU_FRAME_LAST_FRAME)) {
+            uint32_t total = htobe32(len);
+            stream.insert(stream.end(), (byte*)&total, (byte*)&total + 4);
+        }
+        stream.insert(stream.end(), frame_len, 0x5a);
+    }
+}
+
+static void synthesize(std::vector<byte>& stream, size_t chunk_size,
+                       std::vector<Chunk>& chunks) {
+    for (int i = 0; i < 500; i++) {
+        add_message(stream, 3, 60000);  // video
+        add_message(stream, 4, 3840);   // 20 ms of audio
+        add_message(stream, 1, 24);     // input binding, ack size
+        add_message(stream, 0, 12);     // ping
+    }
+    for (size_t start = 0; start < stream.size(); start += chunk_size) {
+        chunks.push_back(
+            {&stream[start], std::min(chunk_size, stream.size() - start)});
+    }
+}
+
+static void report(const char* name, const RunStats& st) {
+    double seconds = st.us / 1000000.0;
+    printf("%-10s %10.0f frames/s %8.1f MB/s %6.2f receive calls/frame"
+           " %6.2f%% carried over\n",
+           name, st.frames / seconds, st.bytes / seconds / 1000000.0,
+           (double)st.receiveCalls / std::max<uint64_t>(st.frames, 1),
+           100.0 * st.carried / std::max<uint64_t>(st.frames, 1));
+}
+
+int main(int argc, char* argv[]) {
+    int seconds = 3;
+    size_t chunk_size = 16384;
+    std::string path;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            seconds = std::max(1, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            chunk_size = std::max(1, atoi(argv[++i]));
+        } else if (argv[i][0] == '-') {
+            fprintf(stderr, "usage: %s [-t seconds] [-c chunk_bytes] [capture]\n",
+                    argv[0]);
+            return 1;
+        } else {
+            path = argv[i];
+        }
+    }
+
+    HUCaptureReader reader;
+    std::vector<byte> stream;
+    std::vector<Chunk> chunks;
+    if (!path.empty()) {
+        if (reader.Open(path) < 0) {
+            fprintf(stderr, "Can't read capture %s\n", path.c_str());
+            return 1;
+        }
+        for (const HUCaptureRecord* record = reader.First(); record;
+             record = reader.Next(record)) {
+            if (record->direction == HU_CAPTURE_RECEIVED) {
+                chunks.push_back(
+                    {HUCaptureReader::Payload(record), record->len});
+            }
+        }
+    } else {
+        synthesize(stream, chunk_size, chunks);
+    }
+    size_t total = 0;
+    for (const Chunk& chunk : chunks) total += chunk.len;
+    printf("%zu chunks, %zu bytes, %.0f bytes per chunk\n", chunks.size(),
+           total, (double)total / std::max<size_t>(chunks.size(), 1));
+
+    struct Parser {
+        const char* name;
+        bool (*parse)(const std::vector<Chunk>&, RunStats&);
+    };
+    const Parser parsers[] = {{"per-frame", parse_per_frame},
+                              {"streaming", parse_streaming}};
+    for (const Parser& parser : parsers) {
+        RunStats st;
+        uint64_t start = now_us();
+        uint64_t end = start + (uint64_t)seconds * 1000000;
+        do {
+            if (!parser.parse(chunks, st)) {
+                fprintf(stderr, "%s: malformed stream\n", parser.name);
+                return 1;
+            }
+        } while (now_us() < end);
+        st.us = now_us() - start;
+        report(parser.name, st);
+    }
+    return 0;
+}
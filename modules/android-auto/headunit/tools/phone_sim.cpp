@@ -0,0 +1,1428 @@
+// Phone end of the Android Auto protocol, for end-to-end benchmarks without
+// a phone.
+//
+// Does what a phone does up to the point where media flows: answers the
+// version request, runs the TLS handshake as the server, asks for service
+// discovery, opens every channel the HU offers and sets up video and media
+// audio. Then streams an H.264 elementary stream and a PCM file at the given
+// rates, never more packets in flight than the HU's max_unacked. Input events
+// the HU sends are printed with their latency.
+//
+// The HU runs either in another process over TCP (transport_type=network,
+// wifi_direct=0 and network_address pointing here, or wifi_direct=1 with
+// --connect) or inside this one over transport_type=loopback, which takes
+// USB, the network and the outputs out of the measurement. In loopback mode
+// touch events can be injected into the HU to time the input path.
+//
+// Every second a line with the rates so far, a summary at the end.
+//
+// With --sessions the loopback setup runs as several sessions at once, each
+// with its own HUServer and link, in rounds of 1, 2, 4 ... sessions, and only
+// the aggregate rates of each round are printed.
+
+#define LOGTAG "phone_sim"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "hu_aap.h"
+#include "hu_loopback.h"
+
+using namespace AndroidAuto;
+
+// Our certificate, the HU doesn't check it. From hu_ssl.cpp.
+extern char hu_ssl_cert_mr_buf[];
+extern char hu_ssl_pkey_mr_buf[];
+
+static uint64_t now_us() {
+    timespec tp;
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return (uint64_t)tp.tv_sec * 1000000 + tp.tv_nsec / 1000;
+}
+
+// The HU stamps input events with the wall clock
+static uint64_t realtime_us() {
+    timespec tp;
+    clock_gettime(CLOCK_REALTIME, &tp);
+    return (uint64_t)tp.tv_sec * 1000000 + tp.tv_nsec / 1000;
+}
+
+static std::atomic<bool> interrupted{false};
+
+static void on_signal(int) { interrupted = true; }
+
+struct Options {
+    std::string connect;  // host:port, otherwise listen
+    int port = 5277;
+    bool loopback = false;
+    std::string h264;
+    int fps = 30;
+    int videoBytes = 0;  // synthetic frames without --h264
+    std::string pcm;
+    int pcmRate = 48000;
+    int pcmChannels = 2;
+    int audioMs = 20;
+    bool loop = false;
+    int duration = 0;  // seconds, 0 until the files are done
+    int pingMs = 1000;
+    int touchHz = 0;
+    int sessions = 1;
+    bool verbose = false;
+    bool quiet = false;  // no progress output, for --sessions
+    std::map<std::string, std::string> huSettings;  // loopback HU overrides
+    bool tlsResume = true;  // let the HU resume TLS sessions
+};
+
+// Latency samples in microseconds
+class Samples {
+   public:
+    void Add(uint64_t value) {
+        std::lock_guard<std::mutex> lock(m_lock);
+        m_values.push_back(value);
+    }
+    // "p50/p99/max ms", or "-" without samples
+    std::string Format() {
+        std::vector<uint64_t> values;
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            values = m_values;
+        }
+        if (values.empty()) return "-";
+        std::sort(values.begin(), values.end());
+        char buf[64];
+        snprintf(buf, sizeof(buf), "%.2f/%.2f/%.2f ms",
+                 values[values.size() / 2] / 1000.0,
+                 values[values.size() * 99 / 100] / 1000.0,
+                 values.back() / 1000.0);
+        return buf;
+    }
+    size_t Count() {
+        std::lock_guard<std::mutex> lock(m_lock);
+        return m_values.size();
+    }
+
+   private:
+    std::mutex m_lock;
+    std::vector<uint64_t> m_values;
+};
+
+// Byte stream to the HU
+class PhoneLink {
+   public:
+    virtual ~PhoneLink() {}
+    // All of buf or false
+    virtual bool Write(const byte* buf, size_t len) = 0;
+    // Up to len bytes, 0 after tmo ms without data, -1 once closed
+    virtual int Read(byte* buf, size_t len, int tmo) = 0;
+    virtual void Close() = 0;
+};
+
+class TCPPhoneLink : public PhoneLink {
+   public:
+    explicit TCPPhoneLink(int fd) : m_fd(fd) {}
+    ~TCPPhoneLink() { Close(); }
+
+    virtual bool Write(const byte* buf, size_t len) override {
+        while (len > 0) {
+            ssize_t ret = send(m_fd, buf, len, MSG_NOSIGNAL);
+            if (ret < 0) {
+                if (errno == EINTR) continue;
+                return false;
+            }
+            buf += ret;
+            len -= ret;
+        }
+        return true;
+    }
+
+    virtual int Read(byte* buf, size_t len, int tmo) override {
+        pollfd pfd = {m_fd, POLLIN, 0};
+        int ret = poll(&pfd, 1, tmo);
+        if (ret < 0) return errno == EINTR ? 0 : -1;
+        if (ret == 0) return 0;
+        ssize_t count = recv(m_fd, buf, len, 0);
+        if (count < 0 && (errno == EINTR || errno == EAGAIN)) return 0;
+        return count > 0 ? (int)count : -1;
+    }
+
+    virtual void Close() override {
+        if (m_fd >= 0) {
+            shutdown(m_fd, SHUT_RDWR);
+            close(m_fd);
+            m_fd = -1;
+        }
+    }
+
+   private:
+    int m_fd;
+};
+
+class LoopbackPhoneLink : public PhoneLink {
+   public:
+    explicit LoopbackPhoneLink(std::shared_ptr<HULoopbackLink> link)
+        : m_link(link) {}
+    ~LoopbackPhoneLink() { Close(); }
+
+    virtual bool Write(const byte* buf, size_t len) override {
+        iovec iov = {(void*)buf, len};
+        return m_link->toHU.Write(&iov, 1, 5000) == (int)len;
+    }
+
+    virtual int Read(byte* buf, size_t len, int tmo) override {
+        int ret = m_link->fromHU.Read(buf, len);
+        if (ret != 0) return ret;
+        m_link->fromHU.ClearReadable();
+        ret = m_link->fromHU.Read(buf, len);
+        if (ret != 0) return ret;
+        pollfd pfd = {m_link->fromHU.GetReadFD(), POLLIN, 0};
+        poll(&pfd, 1, tmo);
+        return m_link->fromHU.Read(buf, len);
+    }
+
+    virtual void Close() override { m_link->toHU.Close(); }
+
+   private:
+    std::shared_ptr<HULoopbackLink> m_link;
+};
+
+// Frames of an H.264 Annex B stream. A frame starts at an access unit
+// delimiter, SPS, PPS or SEI following a slice, or at a slice whose
+// first_mb_in_slice is 0.
+class H264Frames {
+   public:
+    bool Load(const std::string& path) {
+        FILE* file = fopen(path.c_str(), "rb");
+        if (!file) {
+            fprintf(stderr, "Can't open %s: %s\n", path.c_str(),
+                    strerror(errno));
+            return false;
+        }
+        byte buf[65536];
+        size_t count;
+        while ((count = fread(buf, 1, sizeof(buf), file)) > 0) {
+            m_data.insert(m_data.end(), buf, buf + count);
+        }
+        fclose(file);
+
+        size_t frameStart = 0;
+        bool frameHasSlice = false;
+        for (size_t pos = 0; pos + 3 < m_data.size(); pos++) {
+            if (m_data[pos] != 0 || m_data[pos + 1] != 0 ||
+                m_data[pos + 2] != 1) {
+                continue;
+            }
+            size_t nalStart = pos > 0 && m_data[pos - 1] == 0 ? pos - 1 : pos;
+            int type = m_data[pos + 3] & 0x1f;
+            bool slice = type == 1 || type == 5;
+            bool newFrame = false;
+            if (frameHasSlice) {
+                if (slice) {
+                    newFrame = pos + 4 < m_data.size() &&
+                               (m_data[pos + 4] & 0x80) != 0;
+                } else {
+                    newFrame = type >= 6 && type <= 9;
+                }
+            }
+            if (newFrame) {
+                m_frames.emplace_back(frameStart, nalStart - frameStart);
+                frameStart = nalStart;
+                frameHasSlice = false;
+            }
+            frameHasSlice |= slice;
+            pos += 3;
+        }
+        if (frameStart < m_data.size()) {
+            m_frames.emplace_back(frameStart, m_data.size() - frameStart);
+        }
+        printf("%s: %zu bytes, %zu frames\n", path.c_str(), m_data.size(),
+               m_frames.size());
+        return !m_frames.empty();
+    }
+
+    size_t Count() const { return m_frames.size(); }
+    const byte* Frame(size_t index, size_t& len) const {
+        len = m_frames[index].second;
+        return &m_data[m_frames[index].first];
+    }
+
+   private:
+    std::vector<byte> m_data;
+    std::vector<std::pair<size_t, size_t>> m_frames;
+};
+
+// A media channel we stream to, video or media audio
+struct MediaStream {
+    int chan = -1;
+    bool video = false;
+    int session = 0;
+    std::thread thread;
+
+    std::mutex lock;
+    std::condition_variable acked;
+    int maxUnacked = 1;
+    bool started = false;
+    std::deque<uint64_t> inFlight;  // send times, oldest first
+
+    std::atomic<uint64_t> packets{0};
+    std::atomic<uint64_t> bytes{0};
+    // Packets that went out later than their slot, mostly waiting for acks
+    std::atomic<uint64_t> late{0};
+    std::atomic<bool> done{false};
+    Samples ackLatency;
+};
+
+class PhoneSimulator {
+   public:
+    PhoneSimulator(const Options& options, std::unique_ptr<PhoneLink> link)
+        : m_options(options), m_link(std::move(link)) {}
+    ~PhoneSimulator() { Stop(); }
+
+    int Start();
+    void Stop();
+    // Until the HU goes away, the duration is up or the files are done
+    void Run();
+    void Report();
+
+    // So far, for --sessions
+    uint64_t VideoPackets() const { return m_video.packets; }
+    uint64_t AudioPackets() const { return m_audio.packets; }
+    uint64_t MediaBytes() const { return m_video.bytes + m_audio.bytes; }
+    double Seconds() const { return (now_us() - m_startUs) / 1000000.0; }
+
+   private:
+    Options m_options;
+    std::unique_ptr<PhoneLink> m_link;
+    std::thread m_readThread;
+    std::atomic<bool> m_running{false};
+    std::atomic<bool> m_connected{false};
+    std::atomic<bool> m_closed{false};
+    uint64_t m_startUs = 0;
+
+    SSL_CTX* m_sslContext = nullptr;
+    SSL* m_ssl = nullptr;
+    BIO* m_sslReadBio = nullptr;   // network to SSL
+    BIO* m_sslWriteBio = nullptr;  // SSL to network
+    bool m_encrypted = false;
+    // SSL and the link are used from the read and the stream threads
+    std::mutex m_sendLock;
+
+    // Receive side, only touched by the read thread
+    std::vector<byte> m_receiveBuffer;
+    size_t m_receiveStart = 0;
+    std::vector<byte> m_assembly[256];
+
+    // Channels from service discovery
+    std::vector<int> m_channels;
+    int m_inputChannel = -1;
+    std::vector<int> m_sensorTypes;
+    int m_sensorChannel = -1;
+    MediaStream m_video;
+    MediaStream m_audio;
+
+    H264Frames m_h264;
+    std::vector<byte> m_pcm;
+
+    std::atomic<uint64_t> m_inputEvents{0};
+    Samples m_inputLatency;
+    Samples m_pingLatency;
+    uint64_t m_setupUs = 0;
+
+    int initSSL();
+    int readThread();
+    int receive(byte* buf, size_t len);
+    int receiveFrame();
+    int handleMessage(int chan, uint16_t type, const byte* buf, int len);
+    int handleHandshake(const byte* buf, int len);
+    int handleServiceDiscovery(const byte* buf, int len);
+    int handleChannelOpen(int chan);
+    int handleMediaSetup(MediaStream& stream, const byte* buf, int len);
+    void handleMediaAck(MediaStream& stream, const byte* buf, int len);
+    void handleInputEvent(const byte* buf, int len);
+
+    int send(int chan, uint16_t type, const byte* buf, size_t len,
+             const byte* data = nullptr, size_t dataLen = 0);
+    int send(int chan, uint16_t type,
+             const google::protobuf::MessageLite& message);
+    template <typename EnumType>
+    inline int send(int chan, EnumType type,
+                    const google::protobuf::MessageLite& message) {
+        return send(chan, static_cast<uint16_t>(type), message);
+    }
+    int flushHandshake();
+
+    void streamThread(MediaStream& stream);
+    bool nextPacket(MediaStream& stream, size_t& index, const byte*& data,
+                    size_t& len, std::vector<byte>& synthetic);
+    bool finished();
+    bool streamDone(MediaStream& stream);
+};
+
+int PhoneSimulator::Start() {
+    if (!m_options.h264.empty() && !m_h264.Load(m_options.h264)) {
+        return (-1);
+    }
+    if (!m_options.pcm.empty()) {
+        FILE* file = fopen(m_options.pcm.c_str(), "rb");
+        if (!file) {
+            fprintf(stderr, "Can't open %s: %s\n", m_options.pcm.c_str(),
+                    strerror(errno));
+            return (-1);
+        }
+        byte buf[65536];
+        size_t count;
+        while ((count = fread(buf, 1, sizeof(buf), file)) > 0) {
+            m_pcm.insert(m_pcm.end(), buf, buf + count);
+        }
+        fclose(file);
+        if (!m_options.quiet) {
+            printf("%s: %zu bytes, %.1f s\n", m_options.pcm.c_str(),
+                   m_pcm.size(),
+                   m_pcm.size() /
+                       (2.0 * m_options.pcmChannels * m_options.pcmRate));
+        }
+    }
+    if (initSSL() < 0) {
+        return (-1);
+    }
+    m_startUs = now_us();
+    m_running = true;
+    m_readThread = std::thread([this] {
+        readThread();
+        m_closed = true;
+        m_video.acked.notify_all();
+        m_audio.acked.notify_all();
+    });
+    return (0);
+}
+
+void PhoneSimulator::Stop() {
+    if (!m_running.exchange(false)) return;
+    m_video.acked.notify_all();
+    m_audio.acked.notify_all();
+    if (m_video.thread.joinable()) m_video.thread.join();
+    if (m_audio.thread.joinable()) m_audio.thread.join();
+    m_link->Close();
+    if (m_readThread.joinable()) m_readThread.join();
+    if (m_ssl) {
+        SSL_free(m_ssl);  // frees the BIOs
+        m_ssl = nullptr;
+    }
+    m_sslContext = nullptr;  // shared, see phone_ssl_context()
+}
+
+// One server context for the process, kept across sessions the way a phone
+// keeps its own, so the HU can resume them
+static SSL_CTX* phone_ssl_context(bool resume) {
+    static SSL_CTX* const context = [resume]() -> SSL_CTX* {
+        SSL_library_init();
+        SSL_load_error_strings();
+
+        SSL_CTX* ctx = SSL_CTX_new(TLSv1_2_server_method());
+        if (!ctx) {
+            fprintf(stderr, "SSL_CTX_new() failed\n");
+            return nullptr;
+        }
+        BIO* certBio = BIO_new_mem_buf(hu_ssl_cert_mr_buf, -1);
+        X509* cert = PEM_read_bio_X509(certBio, nullptr, nullptr, nullptr);
+        BIO_free(certBio);
+        BIO* keyBio = BIO_new_mem_buf(hu_ssl_pkey_mr_buf, -1);
+        EVP_PKEY* key =
+            PEM_read_bio_PrivateKey(keyBio, nullptr, nullptr, nullptr);
+        BIO_free(keyBio);
+        if (!cert || !key || SSL_CTX_use_certificate(ctx, cert) != 1 ||
+            SSL_CTX_use_PrivateKey(ctx, key) != 1) {
+            ERR_print_errors_fp(stderr);
+            X509_free(cert);
+            EVP_PKEY_free(key);
+            SSL_CTX_free(ctx);
+            return nullptr;
+        }
+        X509_free(cert);
+        EVP_PKEY_free(key);
+        if (!resume) {
+            SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+            SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+        }
+        return ctx;
+    }();
+    return context;
+}
+
+int PhoneSimulator::initSSL() {
+    m_sslContext = phone_ssl_context(m_options.tlsResume);
+    if (!m_sslContext) {
+        return (-1);
+    }
+    m_ssl = SSL_new(m_sslContext);
+    m_sslReadBio = BIO_new(BIO_s_mem());
+    m_sslWriteBio = BIO_new(BIO_s_mem());
+    SSL_set_bio(m_ssl, m_sslReadBio, m_sslWriteBio);
+    SSL_set_accept_state(m_ssl);
+    return (0);
+}
+
+// Fragments, encrypts once the handshake is done and writes one message,
+// the two byte type, buf and data back to back. Same framing as
+// HUServer::sendEncoded().
+int PhoneSimulator::send(int chan, uint16_t type, const byte* buf, size_t len,
+                         const byte* data, size_t dataLen) {
+    std::vector<byte> plain(2 + len + dataLen);
+    plain[0] = type >> 8;
+    plain[1] = type & 0xff;
+    if (len) memcpy(&plain[2], buf, len);
+    if (dataLen) memcpy(&plain[2 + len], data, dataLen);
+
+    byte baseFlags = 0;
+    if (chan != ControlChannel && type >= 2 && type < 0x8000) {
+        baseFlags |= HU_FRAME_CONTROL_MESSAGE;
+    }
+
+    std::lock_guard<std::mutex> lock(m_sendLock);
+    const bool encrypted = m_encrypted;
+    if (encrypted) {
+        baseFlags |= HU_FRAME_ENCRYPTED;
+    }
+    // The HU takes frames up to MAX_FRAME_PAYLOAD_SIZE after encryption,
+    // leave room for the TLS record overhead
+    const size_t maxFragment =
+        encrypted ? MAX_FRAME_PAYLOAD_SIZE - 256 : MAX_FRAME_PAYLOAD_SIZE;
+    std::vector<byte> out;
+    out.reserve(plain.size() + plain.size() / 8 + 64);
+    for (size_t start = 0; start < plain.size(); start += maxFragment) {
+        size_t fragLen = std::min(plain.size() - start, maxFragment);
+        byte flags = baseFlags;
+        if (start == 0) flags |= HU_FRAME_FIRST_FRAME;
+        if (start + fragLen == plain.size()) flags |= HU_FRAME_LAST_FRAME;
+
+        size_t header = out.size();
+        out.resize(header + 4);
+        out[header] = (byte)chan;
+        out[header + 1] = flags;
+        if ((flags & HU_FRAME_FIRST_FRAME) && !(flags & HU_FRAME_LAST_FRAME)) {
+            uint32_t total = htobe32(plain.size());
+            out.insert(out.end(), (byte*)&total, (byte*)&total + 4);
+        }
+        size_t payload = out.size();
+        if (encrypted) {
+            if (SSL_write(m_ssl, &plain[start], fragLen) != (int)fragLen) {
+                ERR_print_errors_fp(stderr);
+                return (-1);
+            }
+            out.resize(payload + BIO_ctrl_pending(m_sslWriteBio));
+            int count = BIO_read(m_sslWriteBio, &out[payload],
+                                 out.size() - payload);
+            if (count <= 0) return (-1);
+            out.resize(payload + count);
+        } else {
+            out.insert(out.end(), &plain[start], &plain[start] + fragLen);
+        }
+        uint16_t frameLen = htobe16(out.size() - payload);
+        memcpy(&out[header + 2], &frameLen, 2);
+    }
+    return m_link->Write(out.data(), out.size()) ? 0 : -1;
+}
+
+int PhoneSimulator::send(int chan, uint16_t type,
+                         const google::protobuf::MessageLite& message) {
+    std::string buf = message.SerializeAsString();
+    return send(chan, type, (const byte*)buf.data(), buf.size());
+}
+
+// Whatever the handshake produced goes to the HU as one SSLHandshake message
+int PhoneSimulator::flushHandshake() {
+    std::vector<byte> buf(BIO_ctrl_pending(m_sslWriteBio));
+    if (buf.empty()) return (0);
+    BIO_read(m_sslWriteBio, buf.data(), buf.size());
+    return send(ControlChannel,
+                static_cast<uint16_t>(HU_INIT_MESSAGE::SSLHandshake),
+                buf.data(), buf.size());
+}
+
+// Fills buf completely, -1 once the link is gone
+int PhoneSimulator::receive(byte* buf, size_t len) {
+    while (len > 0) {
+        size_t have = m_receiveBuffer.size() - m_receiveStart;
+        if (have > 0) {
+            size_t count = std::min(have, len);
+            memcpy(buf, &m_receiveBuffer[m_receiveStart], count);
+            m_receiveStart += count;
+            buf += count;
+            len -= count;
+            continue;
+        }
+        m_receiveBuffer.resize(65536);
+        m_receiveStart = 0;
+        int count = 0;
+        while (count == 0) {
+            if (!m_running) return (-1);
+            count = m_link->Read(m_receiveBuffer.data(),
+                                 m_receiveBuffer.size(), 100);
+        }
+        if (count < 0) {
+            m_receiveBuffer.clear();
+            return (-1);
+        }
+        m_receiveBuffer.resize(count);
+    }
+    return (0);
+}
+
+// One frame, and the message if it was the last fragment
+int PhoneSimulator::receiveFrame() {
+    byte header[8];
+    if (receive(header, 4) < 0) return (-1);
+    int chan = header[0];
+    int flags = header[1];
+    int frameLen = be16toh(*(uint16_t*)&header[2]);
+    if ((flags & HU_FRAME_FIRST_FRAME) && !(flags & HU_FRAME_LAST_FRAME)) {
+        if (receive(header + 4, 4) < 0) return (-1);
+    }
+    std::vector<byte> frame(frameLen);
+    if (receive(frame.data(), frameLen) < 0) return (-1);
+
+    std::vector<byte>& message = m_assembly[chan];
+    if (flags & HU_FRAME_FIRST_FRAME) {
+        message.clear();
+    }
+    if (flags & HU_FRAME_ENCRYPTED) {
+        std::lock_guard<std::mutex> lock(m_sendLock);
+        BIO_write(m_sslReadBio, frame.data(), frameLen);
+        size_t start = message.size();
+        message.resize(start + frameLen);
+        int count = SSL_read(m_ssl, &message[start], frameLen);
+        if (count <= 0) {
+            fprintf(stderr, "SSL_read() failed on channel %d\n", chan);
+            ERR_print_errors_fp(stderr);
+            return (-1);
+        }
+        message.resize(start + count);
+    } else {
+        message.insert(message.end(), frame.begin(), frame.end());
+    }
+    if (!(flags & HU_FRAME_LAST_FRAME) || message.size() < 2) {
+        return (0);
+    }
+    uint16_t type = be16toh(*(uint16_t*)message.data());
+    return handleMessage(chan, type, &message[2], message.size() - 2);
+}
+
+int PhoneSimulator::readThread() {
+    while (m_running) {
+        if (receiveFrame() < 0) {
+            if (m_running && !m_options.quiet) printf("HU disconnected\n");
+            return (-1);
+        }
+    }
+    return (0);
+}
+
+int PhoneSimulator::handleMessage(int chan, uint16_t type, const byte* buf,
+                                  int len) {
+    if (m_options.verbose) {
+        printf("< chan %d type 0x%04x len %d\n", chan, type, len);
+    }
+    if (chan == ControlChannel && !m_connected) {
+        switch ((HU_INIT_MESSAGE)type) {
+            case HU_INIT_MESSAGE::VersionRequest: {
+                // Major and minor version, status OK
+                byte version[] = {0, 1, 0, 1, 0, 0};
+                return send(ControlChannel,
+                            static_cast<uint16_t>(
+                                HU_INIT_MESSAGE::VersionResponse),
+                            version, sizeof(version));
+            }
+            case HU_INIT_MESSAGE::SSLHandshake:
+                return handleHandshake(buf, len);
+            case HU_INIT_MESSAGE::AuthComplete: {
+                if (!SSL_is_init_finished(m_ssl)) {
+                    fprintf(stderr, "AuthComplete before the handshake\n");
+                    return (-1);
+                }
+                if (!m_options.quiet) {
+                    printf("Connected, %s %s\n", SSL_get_version(m_ssl),
+                           SSL_CIPHER_get_name(SSL_get_current_cipher(m_ssl)));
+                }
+                {
+                    std::lock_guard<std::mutex> lock(m_sendLock);
+                    m_encrypted = true;
+                }
+                m_connected = true;
+                HU::ServiceDiscoveryRequest request;
+                request.set_phone_name("phone_sim");
+                return send(ControlChannel,
+                            HU_PROTOCOL_MESSAGE::ServiceDiscoveryRequest,
+                            request);
+            }
+            default:
+                fprintf(stderr,
+                        "Unexpected message 0x%04x before AuthComplete\n",
+                        type);
+                return (0);
+        }
+    }
+
+    if (type < 0x8000) {
+        switch ((HU_PROTOCOL_MESSAGE)type) {
+            case HU_PROTOCOL_MESSAGE::ServiceDiscoveryResponse:
+                return handleServiceDiscovery(buf, len);
+            case HU_PROTOCOL_MESSAGE::ChannelOpenResponse: {
+                HU::ChannelOpenResponse response;
+                if (!response.ParseFromArray(buf, len) ||
+                    response.status() != HU::STATUS_OK) {
+                    fprintf(stderr, "Channel %d didn't open\n", chan);
+                    return (0);
+                }
+                return handleChannelOpen(chan);
+            }
+            case HU_PROTOCOL_MESSAGE::PingRequest: {
+                HU::PingRequest request;
+                request.ParseFromArray(buf, len);
+                HU::PingResponse response;
+                response.set_timestamp(request.timestamp());
+                return send(chan, HU_PROTOCOL_MESSAGE::PingResponse,
+                            response);
+            }
+            case HU_PROTOCOL_MESSAGE::PingResponse: {
+                HU::PingResponse response;
+                if (response.ParseFromArray(buf, len)) {
+                    m_pingLatency.Add(now_us() - response.timestamp());
+                }
+                return (0);
+            }
+            case HU_PROTOCOL_MESSAGE::ShutdownRequest: {
+                if (!m_options.quiet) printf("HU is shutting down\n");
+                HU::ShutdownResponse response;
+                send(chan, HU_PROTOCOL_MESSAGE::ShutdownResponse, response);
+                return (-1);
+            }
+            case HU_PROTOCOL_MESSAGE::ShutdownResponse:
+                return (-1);
+            default:
+                return (0);
+        }
+    }
+
+    if (chan == m_video.chan || chan == m_audio.chan) {
+        MediaStream& stream = chan == m_video.chan ? m_video : m_audio;
+        switch ((HU_MEDIA_CHANNEL_MESSAGE)type) {
+            case HU_MEDIA_CHANNEL_MESSAGE::MediaSetupResponse:
+                return handleMediaSetup(stream, buf, len);
+            case HU_MEDIA_CHANNEL_MESSAGE::MediaAck:
+                handleMediaAck(stream, buf, len);
+                return (0);
+            default:
+                return (0);
+        }
+    }
+    if (chan == m_inputChannel &&
+        type == static_cast<uint16_t>(HU_INPUT_CHANNEL_MESSAGE::InputEvent)) {
+        handleInputEvent(buf, len);
+    }
+    return (0);
+}
+
+int PhoneSimulator::handleHandshake(const byte* buf, int len) {
+    BIO_write(m_sslReadBio, buf, len);
+    int ret = SSL_do_handshake(m_ssl);
+    if (ret <= 0 && SSL_get_error(m_ssl, ret) != SSL_ERROR_WANT_READ) {
+        fprintf(stderr, "TLS handshake failed\n");
+        ERR_print_errors_fp(stderr);
+        return (-1);
+    }
+    return flushHandshake();
+}
+
+int PhoneSimulator::handleServiceDiscovery(const byte* buf, int len) {
+    HU::ServiceDiscoveryResponse response;
+    if (!response.ParseFromArray(buf, len)) {
+        fprintf(stderr, "Bad ServiceDiscoveryResponse\n");
+        return (-1);
+    }
+    if (!m_options.quiet) {
+        printf("HU: %s %s, %d channels\n", response.headunit_make().c_str(),
+               response.headunit_model().c_str(), response.channels_size());
+    }
+
+    for (const HU::ChannelDescriptor& channel : response.channels()) {
+        int id = channel.channel_id();
+        if (channel.has_output_stream_channel()) {
+            const auto& output = channel.output_stream_channel();
+            if (output.type() == HU::STREAM_TYPE_VIDEO) {
+                m_video.chan = id;
+                m_video.video = true;
+            } else if (output.type() == HU::STREAM_TYPE_AUDIO &&
+                       output.audio_type() == HU::AUDIO_TYPE_MEDIA) {
+                m_audio.chan = id;
+            }
+        }
+        if (channel.has_input_event_channel()) {
+            m_inputChannel = id;
+        }
+        if (channel.has_sensor_channel()) {
+            m_sensorChannel = id;
+            for (const auto& sensor : channel.sensor_channel().sensor_list()) {
+                m_sensorTypes.push_back(sensor.type());
+            }
+        }
+        m_channels.push_back(id);
+    }
+
+    for (int id : m_channels) {
+        HU::ChannelOpenRequest request;
+        request.set_priority(0);
+        request.set_id(id);
+        if (send(id, HU_PROTOCOL_MESSAGE::ChannelOpenRequest, request) < 0) {
+            return (-1);
+        }
+    }
+    return (0);
+}
+
+int PhoneSimulator::handleChannelOpen(int chan) {
+    bool videoWanted = !m_options.h264.empty() || m_options.videoBytes > 0;
+    if ((chan == m_video.chan && videoWanted) ||
+        (chan == m_audio.chan && !m_pcm.empty())) {
+        HU::MediaSetupRequest request;
+        request.set_type(chan == m_video.chan ? HU::STREAM_TYPE_VIDEO
+                                              : HU::STREAM_TYPE_AUDIO);
+        return send(chan, HU_MEDIA_CHANNEL_MESSAGE::MediaSetupRequest, request);
+    }
+    if (chan == m_inputChannel) {
+        HU::BindingRequest request;
+        return send(chan, HU_INPUT_CHANNEL_MESSAGE::BindingRequest, request);
+    }
+    if (chan == m_sensorChannel) {
+        for (int type : m_sensorTypes) {
+            HU::SensorStartRequest request;
+            request.set_type((HU::SENSOR_TYPE)type);
+            request.set_refresh_interval(0);
+            if (send(chan, HU_SENSOR_CHANNEL_MESSAGE::SensorStartRequest,
+                     request) < 0) {
+                return (-1);
+            }
+        }
+    }
+    return (0);
+}
+
+int PhoneSimulator::handleMediaSetup(MediaStream& stream, const byte* buf,
+                                     int len) {
+    HU::MediaSetupResponse response;
+    if (!response.ParseFromArray(buf, len)) {
+        fprintf(stderr, "Bad MediaSetupResponse on channel %d\n", stream.chan);
+        return (-1);
+    }
+    {
+        std::lock_guard<std::mutex> lock(stream.lock);
+        stream.maxUnacked = std::max(1u, response.max_unacked());
+        if (stream.started) return (0);
+        stream.started = true;
+    }
+    if (!m_options.quiet) {
+        printf("%s channel %d: max_unacked %d\n",
+               stream.video ? "Video" : "Audio", stream.chan,
+               stream.maxUnacked);
+    }
+
+    stream.session = stream.chan;
+    HU::MediaStartRequest request;
+    request.set_session(stream.session);
+    request.set_config(0);
+    if (send(stream.chan, HU_MEDIA_CHANNEL_MESSAGE::MediaStartRequest,
+             request) < 0) {
+        return (-1);
+    }
+    if (stream.video) {
+        HU::VideoFocusRequest focus;
+        focus.set_disp_index(0);
+        focus.set_mode(HU::VIDEO_FOCUS_MODE_FOCUSED);
+        focus.set_reason(HU::VIDEO_FOCUS_REASON_1);
+        if (send(stream.chan, HU_MEDIA_CHANNEL_MESSAGE::VideoFocusRequest,
+                 focus) < 0) {
+            return (-1);
+        }
+    }
+    if (m_setupUs == 0) {
+        m_setupUs = now_us() - m_startUs;
+    }
+    stream.thread = std::thread([this, &stream] { streamThread(stream); });
+    return (0);
+}
+
+void PhoneSimulator::handleMediaAck(MediaStream& stream, const byte* buf,
+                                    int len) {
+    HU::MediaAck ack;
+    if (!ack.ParseFromArray(buf, len)) return;
+    uint64_t now = now_us();
+    {
+        std::lock_guard<std::mutex> lock(stream.lock);
+        for (uint32_t i = 0; i < ack.value() && !stream.inFlight.empty(); i++) {
+            stream.ackLatency.Add(now - stream.inFlight.front());
+            stream.inFlight.pop_front();
+        }
+    }
+    stream.acked.notify_all();
+}
+
+void PhoneSimulator::handleInputEvent(const byte* buf, int len) {
+    HU::InputEvent event;
+    if (!event.ParseFromArray(buf, len)) return;
+    // Only meaningful with both ends on the same clock
+    int64_t latency = (int64_t)(realtime_us() - event.timestamp());
+    if (latency >= 0) {
+        m_inputLatency.Add(latency);
+    }
+    m_inputEvents++;
+    if (m_options.quiet) return;
+
+    double t = (now_us() - m_startUs) / 1000000.0;
+    if (event.has_touch()) {
+        const HU::TouchInfo& touch = event.touch();
+        for (const auto& location : touch.location()) {
+            printf("%.3f touch action %d pointer %u at %u,%u latency %.2f ms\n",
+                   t, touch.action(), location.pointer_id(), location.x(),
+                   location.y(), latency / 1000.0);
+        }
+    }
+    if (event.has_button()) {
+        for (const HU::ButtonInfo& button : event.button().button()) {
+            printf("%.3f button %u %s latency %.2f ms\n", t,
+                   button.scan_code(),
+                   button.is_pressed() ? "pressed" : "released",
+                   latency / 1000.0);
+        }
+    }
+    if (event.has_rel_event() || event.has_abs_event()) {
+        printf("%.3f %s event latency %.2f ms\n", t,
+               event.has_rel_event() ? "relative" : "absolute",
+               latency / 1000.0);
+    }
+}
+
+bool PhoneSimulator::finished() {
+    if (!m_running || m_closed || interrupted) return true;
+    return m_options.duration > 0 &&
+           now_us() - m_startUs >= (uint64_t)m_options.duration * 1000000;
+}
+
+bool PhoneSimulator::streamDone(MediaStream& stream) {
+    std::lock_guard<std::mutex> lock(stream.lock);
+    return !stream.started || (stream.done && stream.inFlight.empty());
+}
+
+// The packet at index, false at the end
+bool PhoneSimulator::nextPacket(MediaStream& stream, size_t& index,
+                                const byte*& data, size_t& len,
+                                std::vector<byte>& synthetic) {
+    if (stream.video) {
+        if (m_h264.Count() == 0) {
+            // Synthetic frames, endless
+            synthetic.resize(m_options.videoBytes);
+            data = synthetic.data();
+            len = synthetic.size();
+            return true;
+        }
+        if (index >= m_h264.Count()) {
+            if (!m_options.loop) return false;
+            index = 0;
+        }
+        data = m_h264.Frame(index, len);
+        return true;
+    }
+    size_t chunk = (size_t)m_options.pcmRate * m_options.pcmChannels * 2 *
+                   m_options.audioMs / 1000;
+    size_t offset = index * chunk;
+    if (offset >= m_pcm.size()) {
+        if (!m_options.loop) return false;
+        index = offset = 0;
+    }
+    data = &m_pcm[offset];
+    len = std::min(chunk, m_pcm.size() - offset);
+    return true;
+}
+
+void PhoneSimulator::streamThread(MediaStream& stream) {
+    const uint64_t period = stream.video
+                                ? 1000000 / std::max(m_options.fps, 1)
+                                : (uint64_t)m_options.audioMs * 1000;
+    std::vector<byte> synthetic;
+    std::vector<byte> timestamp(8);
+    size_t index = 0;
+    uint64_t next = now_us();
+    while (!finished()) {
+        const byte* data;
+        size_t len;
+        if (!nextPacket(stream, index, data, len, synthetic)) {
+            break;
+        }
+
+        // Media flow control, as a phone does it
+        {
+            std::unique_lock<std::mutex> lock(stream.lock);
+            while ((int)stream.inFlight.size() >= stream.maxUnacked &&
+                   !finished()) {
+                stream.acked.wait_for(lock, std::chrono::milliseconds(100));
+            }
+        }
+        if (finished()) break;
+
+        uint64_t now = now_us();
+        if (now < next) {
+            usleep(next - now);
+            now = now_us();
+        } else if (now > next + period / 2) {
+            stream.late++;
+        }
+        // Late packets don't make the next ones come early
+        next = std::max(next + period, now);
+
+        uint64_t ts = htobe64(now);
+        memcpy(timestamp.data(), &ts, 8);
+        {
+            std::lock_guard<std::mutex> lock(stream.lock);
+            stream.inFlight.push_back(now);
+        }
+        if (send(stream.chan,
+                 static_cast<uint16_t>(
+                     HU_PROTOCOL_MESSAGE::MediaDataWithTimestamp),
+                 timestamp.data(), timestamp.size(), data, len) < 0) {
+            fprintf(stderr, "Send failed on channel %d\n", stream.chan);
+            break;
+        }
+        stream.packets++;
+        stream.bytes += len;
+        index++;
+    }
+    stream.done = true;
+}
+
+void PhoneSimulator::Run() {
+    uint64_t nextPing = now_us();
+    uint64_t nextReport = now_us() + 1000000;
+    uint64_t lastVideo = 0, lastAudio = 0, lastVideoBytes = 0;
+    while (!finished()) {
+        usleep(10000);
+        uint64_t now = now_us();
+        if (m_connected && m_options.pingMs > 0 && now >= nextPing) {
+            HU::PingRequest ping;
+            ping.set_timestamp(now);
+            send(ControlChannel, HU_PROTOCOL_MESSAGE::PingRequest, ping);
+            nextPing = now + m_options.pingMs * 1000;
+        }
+        if (now >= nextReport && !m_options.quiet) {
+            uint64_t video = m_video.packets, audio = m_audio.packets;
+            uint64_t videoBytes = m_video.bytes;
+            printf("%4.0f s: video %3llu fps %6.2f Mbit/s, audio %3llu pkt/s, "
+                   "input %llu\n",
+                   (now - m_startUs) / 1000000.0,
+                   (unsigned long long)(video - lastVideo),
+                   (videoBytes - lastVideoBytes) * 8 / 1000000.0,
+                   (unsigned long long)(audio - lastAudio),
+                   (unsigned long long)m_inputEvents.load());
+            lastVideo = video;
+            lastAudio = audio;
+            lastVideoBytes = videoBytes;
+            nextReport += 1000000;
+        }
+        // Files done and acknowledged
+        if (m_options.duration == 0 && !m_options.loop &&
+            (m_video.started || m_audio.started) && streamDone(m_video) &&
+            streamDone(m_audio)) {
+            break;
+        }
+    }
+}
+
+void PhoneSimulator::Report() {
+    double seconds = (now_us() - m_startUs) / 1000000.0;
+    printf("\n%.1f s, channels set up after %.1f ms\n", seconds,
+           m_setupUs / 1000.0);
+    for (MediaStream* stream : {&m_video, &m_audio}) {
+        if (!stream->started) continue;
+        printf("%s: %llu packets, %.2f MB, %.1f/s, %llu late, "
+               "ack p50/p99/max %s\n",
+               stream->video ? "video" : "audio",
+               (unsigned long long)stream->packets.load(),
+               stream->bytes / 1000000.0, stream->packets / seconds,
+               (unsigned long long)stream->late.load(),
+               stream->ackLatency.Format().c_str());
+    }
+    printf("input: %llu events, latency p50/p99/max %s\n",
+           (unsigned long long)m_inputEvents.load(),
+           m_inputLatency.Format().c_str());
+    printf("ping: %zu, round trip p50/p99/max %s\n", m_pingLatency.Count(),
+           m_pingLatency.Format().c_str());
+}
+
+// Stands in for the app with transport_type=loopback
+class LoopbackCallbacks : public IHUConnectionThreadEventCallbacks {
+   public:
+    IHUAnyThreadInterface* hu = nullptr;
+    std::atomic<uint64_t> mediaPackets{0};
+    std::atomic<bool> disconnected{false};
+    // HU thread CPU time at the first and the latest media packet
+    std::atomic<uint64_t> firstCpuUs{0};
+    std::atomic<uint64_t> lastCpuUs{0};
+
+    virtual int MediaPacket(ServiceChannels chan, uint64_t timestamp,
+                            const byte* buf, int len) override {
+        timespec tp;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &tp);
+        uint64_t cpu = (uint64_t)tp.tv_sec * 1000000 + tp.tv_nsec / 1000;
+        if (mediaPackets++ == 0) {
+            firstCpuUs = cpu;
+        }
+        lastCpuUs = cpu;
+        return 0;
+    }
+
+    // Everything the HU thread did while media flowed, per media packet
+    double CpuUsPerPacket() const {
+        uint64_t packets = mediaPackets;
+        if (packets < 2) return 0;
+        return (double)(lastCpuUs - firstCpuUs) / (packets - 1);
+    }
+    virtual int MediaStart(ServiceChannels chan) override { return 0; }
+    virtual int MediaStop(ServiceChannels chan) override { return 0; }
+    virtual void MediaSetupComplete(ServiceChannels chan) override {}
+    virtual void DisconnectionOrError() override { disconnected = true; }
+    virtual void AudioFocusRequest(
+        ServiceChannels chan, const HU::AudioFocusRequest& request) override {}
+    virtual void VideoFocusRequest(
+        ServiceChannels chan, const HU::VideoFocusRequest& request) override {
+        HU::VideoFocus focus;
+        focus.set_mode(request.mode());
+        focus.set_unrequested(false);
+        hu->queueCommand([chan, focus](IHUConnectionThreadInterface& s) {
+            s.sendEncodedMessage(0, chan, HU_MEDIA_CHANNEL_MESSAGE::VideoFocus,
+                                 focus);
+        });
+    }
+};
+
+// Touches in the middle of the screen, press and release in turn
+static void inject_touches(IHUAnyThreadInterface& hu, int hz,
+                           std::atomic<bool>& stop) {
+    bool pressed = false;
+    while (!stop) {
+        usleep(1000000 / hz);
+        HU::InputEvent event;
+        event.set_timestamp(realtime_us());
+        HU::TouchInfo* touch = event.mutable_touch();
+        HU::TouchInfo::Location* location = touch->add_location();
+        location->set_x(400);
+        location->set_y(240);
+        location->set_pointer_id(0);
+        touch->set_action_index(0);
+        pressed = !pressed;
+        touch->set_action(pressed ? HU::TouchInfo::TOUCH_ACTION_PRESS
+                                  : HU::TouchInfo::TOUCH_ACTION_RELEASE);
+        hu.queueCommand([event](IHUConnectionThreadInterface& s) {
+            s.sendEncodedMessage(0, TouchChannel,
+                                 HU_INPUT_CHANNEL_MESSAGE::InputEvent, event);
+        });
+    }
+}
+
+static int wait_for_hu(const Options& options) {
+    if (!options.connect.empty()) {
+        std::string host = options.connect;
+        std::string port = "30515";
+        size_t colon = host.rfind(':');
+        if (colon != std::string::npos) {
+            port = host.substr(colon + 1);
+            host = host.substr(0, colon);
+        }
+        addrinfo hints;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo* addr = nullptr;
+        if (getaddrinfo(host.c_str(), port.c_str(), &hints, &addr) != 0) {
+            fprintf(stderr, "Can't resolve %s\n", options.connect.c_str());
+            return (-1);
+        }
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int ret = connect(fd, addr->ai_addr, addr->ai_addrlen);
+        freeaddrinfo(addr);
+        if (ret < 0) {
+            perror("connect");
+            close(fd);
+            return (-1);
+        }
+        return fd;
+    }
+
+    int listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int flag = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(options.port);
+    if (bind(listener, (sockaddr*)&addr, sizeof(addr)) < 0 ||
+        listen(listener, 1) < 0) {
+        perror("listen");
+        close(listener);
+        return (-1);
+    }
+    printf("Waiting for the HU on port %d\n", options.port);
+    int fd = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+    close(listener);
+    if (fd < 0) {
+        perror("accept");
+    }
+    return fd;
+}
+
+struct SessionResult {
+    uint64_t videoPackets = 0;
+    uint64_t audioPackets = 0;
+    uint64_t bytes = 0;
+    uint64_t huPackets = 0;  // media packets the HU handed to the app
+    double huCpuUs = 0;      // HU thread CPU per media packet
+    double seconds = 0;
+};
+
+// One phone and one HU in this process over a loopback link called name
+static int run_loopback(const Options& options, const std::string& name,
+                        SessionResult& result) {
+    // The link must exist before the HU starts
+    std::shared_ptr<HULoopbackLink> link = HULoopbackLink::Get(name, 4 << 20);
+    PhoneSimulator sim(options, std::unique_ptr<PhoneLink>(
+                                    new LoopbackPhoneLink(link)));
+    if (sim.Start() < 0) {
+        HULoopbackLink::Remove(name);
+        return 1;
+    }
+
+    LoopbackCallbacks callbacks;
+    std::map<std::string, std::string> settings;
+    settings["transport_type"] = "loopback";
+    settings["loopback_name"] = name;
+    settings["loopback_ring_size"] = std::to_string(4 << 20);
+    for (const auto& setting : options.huSettings) {
+        settings[setting.first] = setting.second;
+    }
+    HUServer server(callbacks, settings);
+    callbacks.hu = &server.GetAnyThreadInterface();
+    if (server.start() < 0) {
+        fprintf(stderr, "HU didn't start\n");
+        sim.Stop();
+        HULoopbackLink::Remove(name);
+        return 1;
+    }
+
+    std::atomic<bool> stopTouches{false};
+    std::thread touches;
+    if (options.touchHz > 0) {
+        touches = std::thread([&] {
+            inject_touches(server.GetAnyThreadInterface(), options.touchHz,
+                           stopTouches);
+        });
+    }
+    sim.Run();
+    stopTouches = true;
+    if (touches.joinable()) touches.join();
+    result.videoPackets = sim.VideoPackets();
+    result.audioPackets = sim.AudioPackets();
+    result.bytes = sim.MediaBytes();
+    result.huPackets = callbacks.mediaPackets;
+    result.huCpuUs = callbacks.CpuUsPerPacket();
+    result.seconds = sim.Seconds();
+    if (!options.quiet) {
+        sim.Report();
+        printf("HU: %llu media packets, %.2f us HU thread CPU per packet\n",
+               (unsigned long long)callbacks.mediaPackets.load(),
+               result.huCpuUs);
+        HUServer::TLSStats tls = server.GetTLSStats();
+        printf("HU TLS: %s, %.1f MB/s decrypting %llu records\n",
+               tls.cipher ? tls.cipher : "no handshake",
+               tls.nanoseconds ? tls.bytes * 1e3 / tls.nanoseconds : 0.0,
+               (unsigned long long)tls.records);
+    }
+    server.shutdown();
+    sim.Stop();
+    HULoopbackLink::Remove(name);
+    return 0;
+}
+
+// Rounds of 1, 2, 4 ... sessions running at once, up to options.sessions
+static int run_scaling(Options options) {
+    options.quiet = true;
+    if (options.duration == 0) {
+        options.duration = 5;
+    }
+    printf("%8s %12s %12s %10s %12s %12s %10s\n", "sessions", "video fps",
+           "audio pkt/s", "Mbit/s", "fps/session", "HU pkt/s", "HU us/pkt");
+    int sessions = 1;
+    while (!interrupted) {
+        std::vector<SessionResult> results(sessions);
+        std::vector<int> rets(sessions, 1);
+        std::vector<std::thread> threads;
+        for (int i = 0; i < sessions; i++) {
+            threads.emplace_back([&, i] {
+                rets[i] = run_loopback(
+                    options, "phone_sim." + std::to_string(i), results[i]);
+            });
+        }
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+
+        double video = 0, audio = 0, bits = 0, hu = 0, cpu = 0;
+        int failed = 0;
+        for (int i = 0; i < sessions; i++) {
+            if (rets[i] != 0 || results[i].seconds <= 0) {
+                failed++;
+                continue;
+            }
+            const SessionResult& r = results[i];
+            video += r.videoPackets / r.seconds;
+            audio += r.audioPackets / r.seconds;
+            bits += r.bytes * 8 / r.seconds;
+            hu += r.huPackets / r.seconds;
+            cpu += r.huCpuUs;
+        }
+        printf("%8d %12.1f %12.1f %10.2f %12.1f %12.1f %10.2f", sessions,
+               video, audio, bits / 1000000.0, video / sessions, hu,
+               sessions > failed ? cpu / (sessions - failed) : 0);
+        if (failed > 0) {
+            printf("  %d failed", failed);
+        }
+        printf("\n");
+        fflush(stdout);
+        if (sessions == options.sessions) break;
+        sessions = std::min(sessions * 2, options.sessions);
+    }
+    return 0;
+}
+
+static void usage() {
+    printf(
+        "usage: phone_sim [options]\n"
+        "  --port N           wait for the HU on TCP port N (5277)\n"
+        "  --connect HOST:P   connect to an HU with wifi_direct=1 instead\n"
+        "  --loopback         run the HU in this process, transport_type=loopback\n"
+        "  --h264 FILE        H.264 elementary stream for the video channel\n"
+        "  --fps N            video frame rate (30)\n"
+        "  --video-bytes N    synthetic video frames of N bytes without --h264\n"
+        "  --pcm FILE         16 bit PCM for the media audio channel\n"
+        "  --pcm-rate N       sample rate (48000)\n"
+        "  --pcm-channels N   channels (2)\n"
+        "  --audio-ms N       audio packet length (20)\n"
+        "  --loop             start the files over at the end\n"
+        "  --duration S       stop after S seconds (until the files end or ^C)\n"
+        "  --ping-ms N        ping interval, 0 for none (1000)\n"
+        "  --touch-hz N       loopback only, touches injected into the HU\n"
+        "  --sessions N       loopback only, rounds of 1, 2, 4 .. N sessions at\n"
+        "                     once, aggregate rates per round (--duration 5)\n"
+        "  --hu-setting K=V   loopback only, HU setting, e.g. media_fast_path=0\n"
+        "  --no-tls-resume    refuse to resume TLS sessions, full handshakes\n"
+        "  --verbose          print every message received\n");
+}
+
+int main(int argc, char* argv[]) {
+    static const option long_options[] = {
+        {"port", required_argument, nullptr, 'p'},
+        {"connect", required_argument, nullptr, 'c'},
+        {"loopback", no_argument, nullptr, 'l'},
+        {"h264", required_argument, nullptr, 'v'},
+        {"fps", required_argument, nullptr, 'f'},
+        {"video-bytes", required_argument, nullptr, 'b'},
+        {"pcm", required_argument, nullptr, 'a'},
+        {"pcm-rate", required_argument, nullptr, 'r'},
+        {"pcm-channels", required_argument, nullptr, 'n'},
+        {"audio-ms", required_argument, nullptr, 'm'},
+        {"loop", no_argument, nullptr, 'o'},
+        {"duration", required_argument, nullptr, 'd'},
+        {"ping-ms", required_argument, nullptr, 'i'},
+        {"touch-hz", required_argument, nullptr, 't'},
+        {"sessions", required_argument, nullptr, 's'},
+        {"hu-setting", required_argument, nullptr, 'S'},
+        {"no-tls-resume", no_argument, nullptr, 'R'},
+        {"verbose", no_argument, nullptr, 'V'},
+        {"help", no_argument, nullptr, 'h'},
+        {nullptr, 0, nullptr, 0}};
+
+    Options options;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, nullptr)) != -1) {
+        switch (opt) {
+            case 'p': options.port = atoi(optarg); break;
+            case 'c': options.connect = optarg; break;
+            case 'l': options.loopback = true; break;
+            case 'v': options.h264 = optarg; break;
+            case 'f': options.fps = std::max(1, atoi(optarg)); break;
+            case 'b': options.videoBytes = std::max(0, atoi(optarg)); break;
+            case 'a': options.pcm = optarg; break;
+            case 'r': options.pcmRate = std::max(1, atoi(optarg)); break;
+            case 'n': options.pcmChannels = std::max(1, atoi(optarg)); break;
+            case 'm': options.audioMs = std::max(1, atoi(optarg)); break;
+            case 'o': options.loop = true; break;
+            case 'd': options.duration = std::max(0, atoi(optarg)); break;
+            case 'i': options.pingMs = std::max(0, atoi(optarg)); break;
+            case 't': options.touchHz = std::max(0, atoi(optarg)); break;
+            case 's': options.sessions = std::max(1, atoi(optarg)); break;
+            case 'S': {
+                const char* eq = strchr(optarg, '=');
+                if (!eq) {
+                    usage();
+                    return 1;
+                }
+                options.huSettings[std::string(optarg, eq - optarg)] = eq + 1;
+                break;
+            }
+            case 'R': options.tlsResume = false; break;
+            case 'V': options.verbose = true; break;
+            default:
+                usage();
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    signal(SIGPIPE, SIG_IGN);
+
+    if (!options.loopback) {
+        int fd = wait_for_hu(options);
+        if (fd < 0) return 1;
+        int flag = 1;
+        setsockopt(fd, SOL_TCP, TCP_NODELAY, &flag, sizeof(flag));
+        PhoneSimulator sim(options,
+                           std::unique_ptr<PhoneLink>(new TCPPhoneLink(fd)));
+        if (sim.Start() < 0) return 1;
+        sim.Run();
+        sim.Report();
+        sim.Stop();
+        return 0;
+    }
+
+    if (options.sessions > 1) {
+        return run_scaling(options);
+    }
+    SessionResult result;
+    return run_loopback(options, "phone_sim", result);
+}
@@ -0,0 +1,241 @@
+// Loopback benchmark for the TCP socket profiles in hu_sockopt.h.
+//
+// For every profile (or the ones named on the command line) a sender thread
+// pushes length-prefixed frames to a receiver over 127.0.0.1, both ends
+// using the profile:
+//  - bulk:  as fast as possible, reports throughput
+//  - video: 60 fps bursts shaped like 1080p H.264 (a big key frame every
+//           second, small frames in between), reports p50/p99/max arrival
+//           jitter, i.e. how far each frame's arrival interval is from the
+//           interval it was sent at
+//
+// Loopback has no radio in the way, so absolute numbers are optimistic;
+// compare profiles against each other.
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <vector>
+#include "hu_sockopt.h"
+
+using namespace AndroidAuto;
+
+static uint64_t now_us() {
+    timespec tp;
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return (uint64_t)tp.tv_sec * 1000000 + tp.tv_nsec / 1000;
+}
+
+static bool write_all(int fd, const uint8_t* buf, size_t len) {
+    while (len > 0) {
+        ssize_t ret = write(fd, buf, len);
+        if (ret < 0 && errno == EINTR) continue;
+        if (ret <= 0) return false;
+        buf += ret;
+        len -= ret;
+    }
+    return true;
+}
+
+static bool read_all(int fd, uint8_t* buf, size_t len) {
+    while (len > 0) {
+        ssize_t ret = read(fd, buf, len);
+        if (ret < 0 && errno == EINTR) continue;
+        if (ret <= 0) return false;
+        buf += ret;
+        len -= ret;
+    }
+    return true;
+}
+
+// Frame sizes for one second of video at 60 fps
+static std::vector<uint32_t> video_frame_sizes() {
+    std::vector<uint32_t> sizes(60, 24 * 1024);
+    sizes[0] = 400 * 1024;
+    return sizes;
+}
+
+struct Connection {
+    int sender = -1;
+    int receiver = -1;
+};
+
+static bool connect_pair(const HUSocketProfile& profile, Connection& conn) {
+    int listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addr_len = sizeof(addr);
+
+    int refused = hu_socket_profile_apply(listener, profile);
+    if (bind(listener, (sockaddr*)&addr, addr_len) < 0 ||
+        listen(listener, 1) < 0 ||
+        getsockname(listener, (sockaddr*)&addr, &addr_len) < 0) {
+        perror("listen");
+        close(listener);
+        return false;
+    }
+
+    conn.sender = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    refused += hu_socket_profile_apply(conn.sender, profile);
+    if (connect(conn.sender, (sockaddr*)&addr, addr_len) < 0) {
+        perror("connect");
+        close(listener);
+        return false;
+    }
+    conn.receiver = accept(listener, nullptr, nullptr);
+    close(listener);
+    if (conn.receiver < 0) {
+        perror("accept");
+        return false;
+    }
+    refused += hu_socket_profile_apply(conn.receiver, profile);
+    if (refused > 0) {
+        printf("  (%d socket options refused, try as root)\n", refused);
+    }
+    return true;
+}
+
+static void close_pair(Connection& conn) {
+    close(conn.sender);
+    close(conn.receiver);
+}
+
+// Receives frames until the sender closes, returns the arrival time of each
+static std::vector<uint64_t> receive_frames(int fd,
+                                            const HUSocketProfile& profile,
+                                            uint64_t& bytes) {
+    std::vector<uint64_t> arrivals;
+    std::vector<uint8_t> buf;
+    bytes = 0;
+    uint32_t len = 0;
+    while (read_all(fd, (uint8_t*)&len, sizeof(len))) {
+        buf.resize(len);
+        if (!read_all(fd, buf.data(), len)) break;
+        arrivals.push_back(now_us());
+        bytes += len + sizeof(len);
+        hu_socket_profile_rearm(fd, profile);
+    }
+    return arrivals;
+}
+
+static void run_bulk(const HUSocketProfile& profile, int seconds) {
+    Connection conn;
+    if (!connect_pair(profile, conn)) return;
+
+    // Video fragments are at most 16 KB plus headers
+    std::thread sender([&conn, seconds] {
+        std::vector<uint8_t> frame(4 + 16384, 0x5a);
+        uint32_t len = 16384;
+        memcpy(frame.data(), &len, sizeof(len));
+        uint64_t end = now_us() + seconds * 1000000ULL;
+        while (now_us() < end && write_all(conn.sender, frame.data(), frame.size())) {
+        }
+        shutdown(conn.sender, SHUT_WR);
+    });
+
+    uint64_t bytes = 0;
+    uint64_t start = now_us();
+    receive_frames(conn.receiver, profile, bytes);
+    uint64_t elapsed = now_us() - start;
+    sender.join();
+    close_pair(conn);
+
+    printf("  bulk:  %8.1f MB/s\n", elapsed ? bytes / (double)elapsed : 0.0);
+}
+
+static void run_video(const HUSocketProfile& profile, int seconds) {
+    Connection conn;
+    if (!connect_pair(profile, conn)) return;
+
+    const std::vector<uint32_t> sizes = video_frame_sizes();
+    const uint64_t interval = 1000000 / sizes.size();
+    const size_t frames = sizes.size() * seconds;
+
+    std::thread sender([&conn, &sizes, interval, frames] {
+        std::vector<uint8_t> frame;
+        timespec next;
+        clock_gettime(CLOCK_MONOTONIC, &next);
+        for (size_t i = 0; i < frames; i++) {
+            uint32_t len = sizes[i % sizes.size()];
+            frame.assign(sizeof(len) + len, 0x5a);
+            memcpy(frame.data(), &len, sizeof(len));
+            if (!write_all(conn.sender, frame.data(), frame.size())) break;
+
+            next.tv_nsec += interval * 1000;
+            while (next.tv_nsec >= 1000000000) {
+                next.tv_nsec -= 1000000000;
+                next.tv_sec++;
+            }
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, nullptr);
+        }
+        shutdown(conn.sender, SHUT_WR);
+    });
+
+    uint64_t bytes = 0;
+    std::vector<uint64_t> arrivals =
+        receive_frames(conn.receiver, profile, bytes);
+    sender.join();
+    close_pair(conn);
+
+    std::vector<uint64_t> jitter;
+    for (size_t i = 1; i < arrivals.size(); i++) {
+        uint64_t gap = arrivals[i] - arrivals[i - 1];
+        jitter.push_back(gap > interval ? gap - interval : interval - gap);
+    }
+    if (jitter.empty()) {
+        printf("  video: no frames received\n");
+        return;
+    }
+    std::sort(jitter.begin(), jitter.end());
+    printf("  video: %zu frames  jitter p50 %llu us  p99 %llu us  max %llu us\n",
+           arrivals.size(),
+           (unsigned long long)jitter[jitter.size() / 2],
+           (unsigned long long)jitter[jitter.size() * 99 / 100],
+           (unsigned long long)jitter.back());
+}
+
+int main(int argc, char* argv[]) {
+    int seconds = 3;
+    std::vector<std::string> names;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            seconds = std::max(1, atoi(argv[++i]));
+        } else if (argv[i][0] == '-') {
+            fprintf(stderr, "usage: %s [-t seconds] [profile...]\n", argv[0]);
+            return 1;
+        } else {
+            names.push_back(argv[i]);
+        }
+    }
+    if (names.empty()) {
+        for (const auto& profile : hu_socket_profiles()) {
+            names.push_back(profile.first);
+        }
+    }
+
+    for (const std::string& name : names) {
+        std::map<std::string, std::string> settings;
+        settings["tcp_socket_profile"] = name;
+        HUSocketProfile profile;
+        if (!hu_socket_profile_from_settings(settings, profile)) {
+            fprintf(stderr, "Unknown profile %s\n", name.c_str());
+            return 1;
+        }
+        printf("%s\n", name.c_str());
+        run_bulk(profile, seconds);
+        run_video(profile, seconds);
+    }
+    return 0;
+}
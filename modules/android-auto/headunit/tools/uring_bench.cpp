@@ -0,0 +1,350 @@
+// Loopback benchmark of the select-based TCP I/O against io_uring.
+//
+// A sender thread pushes length-prefixed frames to a receiver over
+// 127.0.0.1. Each side runs either like the select transport (select() and
+// then read()/write() per frame, as receiveTransportPacket and the old
+// Write() did) or like the io_uring transport (multishot receive into a
+// provided buffer ring, sends queued as linked SQEs). The mix is a 16 KB
+// video fragment followed by three small control/input frames. Reports
+// throughput, syscalls per frame and CPU per MB for each side.
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <vector>
+#include "hu_uring.h"
+
+using namespace AndroidAuto;
+
+static uint64_t now_us() {
+    timespec tp;
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return (uint64_t)tp.tv_sec * 1000000 + tp.tv_nsec / 1000;
+}
+
+static uint64_t thread_cpu_us() {
+    rusage usage;
+    getrusage(RUSAGE_THREAD, &usage);
+    return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000ULL +
+           usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+static const uint32_t frame_sizes[] = {16384, 64, 64, 64};
+static const size_t frame_kinds = sizeof(frame_sizes) / sizeof(frame_sizes[0]);
+
+struct SideStats {
+    uint64_t frames = 0;
+    uint64_t bytes = 0;
+    uint64_t syscalls = 0;
+    uint64_t cpuUs = 0;
+};
+
+static bool connect_pair(int& sender, int& receiver) {
+    int listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addr_len = sizeof(addr);
+    if (bind(listener, (sockaddr*)&addr, addr_len) < 0 ||
+        listen(listener, 1) < 0 ||
+        getsockname(listener, (sockaddr*)&addr, &addr_len) < 0) {
+        perror("listen");
+        close(listener);
+        return false;
+    }
+    sender = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (connect(sender, (sockaddr*)&addr, addr_len) < 0) {
+        perror("connect");
+        close(listener);
+        return false;
+    }
+    receiver = accept(listener, nullptr, nullptr);
+    close(listener);
+    int flag = 1;
+    setsockopt(sender, SOL_TCP, TCP_NODELAY, &flag, sizeof(flag));
+    setsockopt(receiver, SOL_TCP, TCP_NODELAY, &flag, sizeof(flag));
+    return receiver >= 0;
+}
+
+static void fill_frame(std::vector<uint8_t>& frame, uint32_t len) {
+    frame.assign(sizeof(len) + len, 0x5a);
+    memcpy(frame.data(), &len, sizeof(len));
+}
+
+// select() + write() per frame
+static void send_select(int fd, uint64_t end_us, SideStats& st) {
+    std::vector<uint8_t> frame;
+    for (uint64_t i = 0; now_us() < end_us; i++) {
+        fill_frame(frame, frame_sizes[i % frame_kinds]);
+        size_t sent = 0;
+        while (sent < frame.size()) {
+            fd_set set;
+            FD_ZERO(&set);
+            FD_SET(fd, &set);
+            timeval tv = {1, 0};
+            select(fd + 1, nullptr, &set, nullptr, &tv);
+            ssize_t ret = write(fd, &frame[sent], frame.size() - sent);
+            st.syscalls += 2;
+            if (ret <= 0) return;
+            sent += ret;
+        }
+        st.frames++;
+        st.bytes += frame.size();
+    }
+}
+
+// select() + read() for the header, then for the body
+static void receive_select(int fd, SideStats& st) {
+    std::vector<uint8_t> buf(65536);
+    while (true) {
+        uint32_t len = 0;
+        size_t want = sizeof(len);
+        uint8_t* dest = (uint8_t*)&len;
+        for (int part = 0; part < 2; part++) {
+            size_t got = 0;
+            while (got < want) {
+                fd_set set;
+                FD_ZERO(&set);
+                FD_SET(fd, &set);
+                timeval tv = {1, 0};
+                select(fd + 1, &set, nullptr, nullptr, &tv);
+                ssize_t ret = read(fd, dest + got, want - got);
+                st.syscalls += 2;
+                if (ret <= 0) return;
+                got += ret;
+            }
+            want = len;
+            dest = buf.data();
+        }
+        st.frames++;
+        st.bytes += sizeof(len) + len;
+    }
+}
+
+#ifdef HU_HAVE_IO_URING
+
+enum { TAG_RECV = 1, TAG_SEND = 2 };
+
+// Linked sends from a fixed pool of frame buffers, one chain in flight
+static void send_uring(int fd, uint64_t end_us, SideStats& st) {
+    HUUring ring;
+    if (ring.Init(64) < 0) {
+        perror("io_uring_setup");
+        return;
+    }
+    const size_t pool_size = 32;
+    std::vector<std::vector<uint8_t>> pool(pool_size);
+    std::vector<size_t> free_slots;
+    for (size_t i = 0; i < pool_size; i++) free_slots.push_back(i);
+
+    uint64_t i = 0;
+    while (true) {
+        // Separately submitted chains may run in any order, so only start
+        // the next one once the previous one is done
+        if (free_slots.size() == pool_size) {
+            if (now_us() >= end_us) break;
+            io_uring_sqe* last = nullptr;
+            while (!free_slots.empty()) {
+                size_t slot = free_slots.back();
+                free_slots.pop_back();
+                fill_frame(pool[slot], frame_sizes[i++ % frame_kinds]);
+                io_uring_sqe* sqe = ring.GetSqe();
+                sqe->opcode = IORING_OP_SEND;
+                sqe->fd = fd;
+                sqe->addr = (uint64_t)(uintptr_t)pool[slot].data();
+                sqe->len = pool[slot].size();
+                sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+                sqe->user_data = (TAG_SEND << 16) | slot;
+                if (last) last->flags |= IOSQE_IO_LINK;
+                last = sqe;
+            }
+        }
+        // Submit and wait in one call
+        if (ring.Submit(1) < 0) {
+            perror("io_uring_enter");
+            return;
+        }
+        st.syscalls++;
+        while (io_uring_cqe* cqe = ring.PeekCqe()) {
+            size_t slot = cqe->user_data & 0xffff;
+            if (cqe->res < 0 || (size_t)cqe->res != pool[slot].size()) {
+                fprintf(stderr, "send failed: %d\n", cqe->res);
+                ring.SeenCqe();
+                return;
+            }
+            st.frames++;
+            st.bytes += cqe->res;
+            free_slots.push_back(slot);
+            ring.SeenCqe();
+        }
+    }
+}
+
+// Multishot receive into a provided buffer ring, frames parsed across
+// buffer boundaries
+static void receive_uring(int fd, SideStats& st) {
+    HUUring ring;
+    const unsigned buffer_count = 64;
+    const unsigned buffer_size = 16384;
+    if (ring.Init(64) < 0 || ring.SetupBufferRing(0, buffer_count) < 0) {
+        perror("io_uring setup");
+        return;
+    }
+    std::vector<uint8_t> buffers(buffer_count * buffer_size);
+    for (unsigned bid = 0; bid < buffer_count; bid++) {
+        ring.AddBuffer(&buffers[bid * buffer_size], buffer_size, bid);
+    }
+    ring.PublishBuffers();
+
+    uint8_t header[4];
+    size_t header_got = 0;
+    uint32_t body_left = 0;
+    bool armed = false;
+    while (true) {
+        if (!armed) {
+            io_uring_sqe* sqe = ring.GetSqe();
+            sqe->opcode = IORING_OP_RECV;
+            sqe->fd = fd;
+            sqe->flags = IOSQE_BUFFER_SELECT;
+            sqe->buf_group = 0;
+            sqe->ioprio = IORING_RECV_MULTISHOT;
+            sqe->user_data = TAG_RECV << 16;
+            armed = true;
+        }
+        if (ring.Submit(1) < 0) {
+            perror("io_uring_enter");
+            return;
+        }
+        st.syscalls++;
+        while (io_uring_cqe* cqe = ring.PeekCqe()) {
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+            ring.SeenCqe();
+            if (!(flags & IORING_CQE_F_MORE)) armed = false;
+            if (res == -ENOBUFS) continue;
+            if (res <= 0) return;
+
+            uint16_t bid = flags >> IORING_CQE_BUFFER_SHIFT;
+            const uint8_t* data = &buffers[bid * buffer_size];
+            size_t left = res;
+            while (left > 0) {
+                if (body_left == 0) {
+                    size_t count = std::min(left, sizeof(header) - header_got);
+                    memcpy(&header[header_got], data, count);
+                    header_got += count;
+                    data += count;
+                    left -= count;
+                    if (header_got == sizeof(header)) {
+                        memcpy(&body_left, header, sizeof(body_left));
+                        header_got = 0;
+                        st.bytes += sizeof(header) + body_left;
+                        if (body_left == 0) st.frames++;
+                    }
+                } else {
+                    size_t count = std::min<size_t>(left, body_left);
+                    data += count;
+                    left -= count;
+                    body_left -= count;
+                    if (body_left == 0) st.frames++;
+                }
+            }
+            ring.AddBuffer(&buffers[bid * buffer_size], buffer_size, bid);
+            ring.PublishBuffers();
+        }
+    }
+}
+
+#endif
+
+static void report(const char* side, const SideStats& st, uint64_t elapsed) {
+    printf("  %-4s %8.1f MB/s  %9.0f frames/s  %5.2f syscalls/frame  %6.0f us CPU/MB\n",
+           side, elapsed ? st.bytes / (double)elapsed : 0.0,
+           elapsed ? st.frames * 1e6 / elapsed : 0.0,
+           st.frames ? st.syscalls / (double)st.frames : 0.0,
+           st.bytes ? st.cpuUs * 1048576.0 / st.bytes : 0.0);
+}
+
+static void run(const std::string& mode, int seconds) {
+    int sender_fd = -1, receiver_fd = -1;
+    if (!connect_pair(sender_fd, receiver_fd)) return;
+
+    SideStats tx, rx;
+    const bool uring = mode == "uring";
+    uint64_t start = now_us();
+    uint64_t end = start + seconds * 1000000ULL;
+    std::thread sender([&] {
+        uint64_t cpu = thread_cpu_us();
+#ifdef HU_HAVE_IO_URING
+        if (uring) {
+            send_uring(sender_fd, end, tx);
+        } else
+#endif
+        {
+            send_select(sender_fd, end, tx);
+        }
+        tx.cpuUs = thread_cpu_us() - cpu;
+        shutdown(sender_fd, SHUT_WR);
+    });
+
+    uint64_t cpu = thread_cpu_us();
+#ifdef HU_HAVE_IO_URING
+    if (uring) {
+        receive_uring(receiver_fd, rx);
+    } else
+#endif
+    {
+        receive_select(receiver_fd, rx);
+    }
+    rx.cpuUs = thread_cpu_us() - cpu;
+    uint64_t elapsed = now_us() - start;
+    sender.join();
+    close(sender_fd);
+    close(receiver_fd);
+
+    printf("%s\n", mode.c_str());
+    report("tx", tx, elapsed);
+    report("rx", rx, elapsed);
+    if (tx.frames != rx.frames || tx.bytes != rx.bytes) {
+        printf("  MISMATCH: sent %llu frames %llu bytes, received %llu frames %llu bytes\n",
+               (unsigned long long)tx.frames, (unsigned long long)tx.bytes,
+               (unsigned long long)rx.frames, (unsigned long long)rx.bytes);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    int seconds = 3;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            seconds = std::max(1, atoi(argv[++i]));
+        } else {
+            fprintf(stderr, "usage: %s [-t seconds]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    run("select", seconds);
+#ifdef HU_HAVE_IO_URING
+    if (HUUring::Supported()) {
+        run("uring", seconds);
+    } else {
+        printf("uring\n  io_uring not available on this kernel\n");
+    }
+#else
+    printf("uring\n  built without io_uring support\n");
+#endif
+    return 0;
+}
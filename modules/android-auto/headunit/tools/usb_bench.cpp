@@ -0,0 +1,283 @@
+// CPU per MB on the USB transport with device memory transfer buffers
+// (usb_zero_copy=1) and with heap buffers (usb_zero_copy=0), against a real
+// phone.
+//
+// Runs the HU in this process with transport_type=usb, asking for 1080p60
+// video, once per buffer mode. The phone is switched to accessory mode by
+// the transport's fallback, so plug it in and unlock it; it is reset and
+// switched again between the runs. Media data is dropped as it arrives,
+// there's no decoding, so what the process spends is the transport, TLS and
+// framing. Only the transport differs between the modes.
+//
+// Counted from the first media packet on: the whole process, which
+// includes the OUT side's usbfs copy on the submitting thread, and the usb
+// thread, where usbfs copies IN data out of its bounce buffers. The HU logs
+// its own split of both sides at the end of each run ("USB IN:", "USB
+// OUT:"). The phone decides the frame rate, keep something moving on its
+// screen.
+
+#define LOGTAG "usb_bench"
+#include <dirent.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <string>
+#include "hu_aap.h"
+
+using namespace AndroidAuto;
+
+static std::atomic<bool> interrupted{false};
+
+static void on_signal(int) { interrupted = true; }
+
+static uint64_t process_cpu_us() {
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000ULL +
+           usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+// User and system time of this process's thread called name, 0 if there is
+// none
+static uint64_t thread_cpu_us(const char* name) {
+    uint64_t ret = 0;
+    DIR* tasks = opendir("/proc/self/task");
+    if (!tasks) {
+        return 0;
+    }
+    while (dirent* task = readdir(tasks)) {
+        if (task->d_name[0] == '.') continue;
+        std::string dir = std::string("/proc/self/task/") + task->d_name;
+        char comm[32] = {0};
+        FILE* f = fopen((dir + "/comm").c_str(), "r");
+        if (!f) continue;
+        bool match = fgets(comm, sizeof(comm), f) &&
+                     strncmp(comm, name, strlen(name)) == 0 &&
+                     comm[strlen(name)] == '\n';
+        fclose(f);
+        if (!match) continue;
+        // Fields 14 and 15, after the name in parentheses
+        char stat[1024] = {0};
+        f = fopen((dir + "/stat").c_str(), "r");
+        if (!f) continue;
+        size_t len = fread(stat, 1, sizeof(stat) - 1, f);
+        fclose(f);
+        stat[len] = 0;
+        const char* p = strrchr(stat, ')');
+        unsigned long long utime = 0, stime = 0;
+        if (p && sscanf(p + 2,
+                        "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu",
+                        &utime, &stime) == 2) {
+            ret = (utime + stime) * 1000000ULL / sysconf(_SC_CLK_TCK);
+        }
+        break;
+    }
+    closedir(tasks);
+    return ret;
+}
+
+// Stands in for the app, drops the media and gives the phone video focus
+class BenchCallbacks : public IHUConnectionThreadEventCallbacks {
+   public:
+    IHUAnyThreadInterface* hu = nullptr;
+    std::atomic<uint64_t> mediaPackets{0};
+    std::atomic<uint64_t> mediaBytes{0};
+    std::atomic<bool> disconnected{false};
+
+    virtual int MediaPacket(ServiceChannels chan, uint64_t timestamp,
+                            const byte* buf, int len) override {
+        mediaBytes += len;
+        mediaPackets++;
+        return 0;
+    }
+    virtual int MediaStart(ServiceChannels chan) override { return 0; }
+    virtual int MediaStop(ServiceChannels chan) override { return 0; }
+    virtual void MediaSetupComplete(ServiceChannels chan) override {
+        if (chan == VideoChannel) {
+            sendVideoFocus(chan, true);
+        }
+    }
+    virtual void DisconnectionOrError() override { disconnected = true; }
+    virtual void AudioFocusRequest(
+        ServiceChannels chan, const HU::AudioFocusRequest& request) override {
+        HU::AudioFocusResponse response;
+        response.set_focus_type(
+            request.focus_type() == HU::AudioFocusRequest::AUDIO_FOCUS_RELEASE
+                ? HU::AudioFocusResponse::AUDIO_FOCUS_STATE_LOSS
+                : HU::AudioFocusResponse::AUDIO_FOCUS_STATE_GAIN);
+        hu->queueCommand([chan, response](IHUConnectionThreadInterface& s) {
+            s.sendEncodedMessage(0, chan,
+                                 HU_PROTOCOL_MESSAGE::AudioFocusResponse,
+                                 response);
+        });
+    }
+    virtual void VideoFocusRequest(
+        ServiceChannels chan, const HU::VideoFocusRequest& request) override {
+        sendVideoFocus(chan, request.mode() == HU::VIDEO_FOCUS_MODE_FOCUSED);
+    }
+
+   private:
+    void sendVideoFocus(ServiceChannels chan, bool focused) {
+        HU::VideoFocus focus;
+        focus.set_mode(focused ? HU::VIDEO_FOCUS_MODE_FOCUSED
+                               : HU::VIDEO_FOCUS_MODE_UNFOCUSED);
+        focus.set_unrequested(false);
+        hu->queueCommand([chan, focus](IHUConnectionThreadInterface& s) {
+            s.sendEncodedMessage(0, chan, HU_MEDIA_CHANNEL_MESSAGE::VideoFocus,
+                                 focus);
+        });
+    }
+};
+
+struct Options {
+    int duration = 20;  // s of media per mode
+    int wait = 30;      // s for the phone to show up
+    std::string resolution = "3";  // 1920x1080
+    std::string frameRate = "2";   // 60 FPS
+    std::map<std::string, std::string> huSettings;
+};
+
+struct ModeResult {
+    bool ok = false;
+    std::string buffers;
+    double seconds = 0;
+    uint64_t bytes = 0;
+    uint64_t packets = 0;
+    uint64_t processCpuUs = 0;
+    uint64_t usbThreadCpuUs = 0;
+};
+
+static int run_mode(const Options& options, bool zeroCopy,
+                    ModeResult& result) {
+    result.buffers = zeroCopy ? "dev mem" : "heap";
+    BenchCallbacks callbacks;
+    std::map<std::string, std::string> settings;
+    settings["transport_type"] = "usb";
+    settings["usb_zero_copy"] = zeroCopy ? "1" : "0";
+    settings["resolution"] = options.resolution;
+    settings["frame_rate"] = options.frameRate;
+    settings["log_packets"] = "0";
+    for (const auto& setting : options.huSettings) {
+        settings[setting.first] = setting.second;
+    }
+    HUServer server(callbacks, settings);
+    callbacks.hu = &server.GetAnyThreadInterface();
+
+    printf("%s buffers: waiting for the phone\n", result.buffers.c_str());
+    fflush(stdout);
+    // Each failed start probes the bus in the background, the phone comes
+    // back as an accessory
+    uint64_t deadline = hu_time_us() + options.wait * 1000000ULL;
+    while (server.start() < 0) {
+        if (interrupted || hu_time_us() > deadline) {
+            fprintf(stderr, "No phone in accessory mode\n");
+            return -1;
+        }
+        usleep(500000);
+    }
+
+    deadline = hu_time_us() + options.wait * 1000000ULL;
+    while (callbacks.mediaPackets == 0 && !callbacks.disconnected &&
+           !interrupted && hu_time_us() < deadline) {
+        usleep(10000);
+    }
+    if (callbacks.mediaPackets == 0) {
+        fprintf(stderr, "No media from the phone\n");
+        server.shutdown();
+        return -1;
+    }
+
+    uint64_t begin = hu_time_us();
+    uint64_t bytes_start = callbacks.mediaBytes;
+    uint64_t packets_start = callbacks.mediaPackets;
+    uint64_t process_start = process_cpu_us();
+    uint64_t usb_start = thread_cpu_us("usb_recv_thread");
+    uint64_t end = begin + options.duration * 1000000ULL;
+    while (!callbacks.disconnected && !interrupted && hu_time_us() < end) {
+        usleep(100000);
+    }
+    result.seconds = (hu_time_us() - begin) / 1e6;
+    result.bytes = callbacks.mediaBytes - bytes_start;
+    result.packets = callbacks.mediaPackets - packets_start;
+    result.processCpuUs = process_cpu_us() - process_start;
+    result.usbThreadCpuUs = thread_cpu_us("usb_recv_thread") - usb_start;
+    result.ok = !callbacks.disconnected && result.bytes > 0;
+    if (callbacks.disconnected) {
+        fprintf(stderr, "The phone disconnected\n");
+    }
+    server.shutdown();
+    return result.ok ? 0 : -1;
+}
+
+static void usage() {
+    printf(
+        "usage: usb_bench [options]\n"
+        "  --duration S       seconds of media per buffer mode (20)\n"
+        "  --wait S           for the phone and its first media (30)\n"
+        "  --resolution N     1 800x480, 2 1280x720, 3 1920x1080 (3)\n"
+        "  --frame-rate N     1 30 FPS, 2 60 FPS (2)\n"
+        "  --hu-setting K=V   any other HU setting\n");
+}
+
+int main(int argc, char* argv[]) {
+    static const option long_options[] = {
+        {"duration", required_argument, nullptr, 'd'},
+        {"wait", required_argument, nullptr, 'w'},
+        {"resolution", required_argument, nullptr, 'r'},
+        {"frame-rate", required_argument, nullptr, 'f'},
+        {"hu-setting", required_argument, nullptr, 'S'},
+        {"help", no_argument, nullptr, 'h'},
+        {nullptr, 0, nullptr, 0}};
+
+    Options options;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, nullptr)) != -1) {
+        switch (opt) {
+            case 'd': options.duration = std::max(1, atoi(optarg)); break;
+            case 'w': options.wait = std::max(1, atoi(optarg)); break;
+            case 'r': options.resolution = optarg; break;
+            case 'f': options.frameRate = optarg; break;
+            case 'S': {
+                const char* eq = strchr(optarg, '=');
+                if (!eq) {
+                    usage();
+                    return 1;
+                }
+                options.huSettings[std::string(optarg, eq - optarg)] = eq + 1;
+                break;
+            }
+            default:
+                usage();
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    ModeResult results[2];
+    const bool modes[2] = {true, false};
+    for (int i = 0; i < 2 && !interrupted; i++) {
+        run_mode(options, modes[i], results[i]);
+    }
+
+    printf("\n%-8s %8s %8s %10s %14s %14s\n", "buffers", "s", "MB/s",
+           "packets/s", "process us/MB", "usb thr us/MB");
+    for (const ModeResult& r : results) {
+        if (!r.ok) {
+            printf("%-8s no result\n", r.buffers.c_str());
+            continue;
+        }
+        double mb = r.bytes / 1048576.0;
+        printf("%-8s %8.1f %8.2f %10.1f %14.0f %14.0f\n", r.buffers.c_str(),
+               r.seconds, mb / r.seconds, r.packets / r.seconds,
+               r.processCpuUs / mb, r.usbThreadCpuUs / mb);
+    }
+    return results[0].ok && results[1].ok ? 0 : 1;
+}
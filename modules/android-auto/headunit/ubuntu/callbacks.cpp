@@ -3,7 +3,30 @@
 #include "glib_utils.h"
 #include "bt/ub_bluetooth.h"
 
+// Queue depths in packets, see MediaQueue for the overflow policies
+#define VIDEO_QUEUE_PACKETS 8
+#define AUDIO_QUEUE_PACKETS 16
+#define AUDIO_QUEUE_BLOCK_MS 20
+
 DesktopEventCallbacks::DesktopEventCallbacks() :
+    videoQueue("hu_video", VIDEO_QUEUE_PACKETS, MediaQueue::DROP_OLDEST, 0,
+        [this](uint64_t timestamp, const byte *buf, int len) {
+            if (videoOutput) {
+                videoOutput->MediaPacket(timestamp, buf, len);
+            }
+        }),
+    mediaAudioQueue("hu_audio", AUDIO_QUEUE_PACKETS, MediaQueue::BLOCK_BRIEFLY, AUDIO_QUEUE_BLOCK_MS,
+        [this](uint64_t timestamp, const byte *buf, int len) {
+            if (audioOutput) {
+                audioOutput->MediaPacketAUD(timestamp, buf, len);
+            }
+        }),
+    voiceAudioQueue("hu_voice", AUDIO_QUEUE_PACKETS, MediaQueue::BLOCK_BRIEFLY, AUDIO_QUEUE_BLOCK_MS,
+        [this](uint64_t timestamp, const byte *buf, int len) {
+            if (audioOutput) {
+                audioOutput->MediaPacketAU1(timestamp, buf, len);
+            }
+        }),
     connected(false),
     videoFocus(false),
     audioFocus(false)
@@ -11,17 +34,20 @@ DesktopEventCallbacks::DesktopEventCallbacks() :
 }
 
 DesktopEventCallbacks::~DesktopEventCallbacks() {
-
+    for (MediaQueue* queue : {&videoQueue, &mediaAudioQueue, &voiceAudioQueue}) {
+        queue->Stop();
+        printf("%s\n", queue->Describe().c_str());
+    }
 }
 
 int DesktopEventCallbacks::MediaPacket(int chan, uint64_t timestamp, const byte *buf, int len) {
-
+    // snd_pcm_writei and the video appsrc can block, keep that off the HU thread
     if (chan == AA_CH_VID && videoOutput) {
-        videoOutput->MediaPacket(timestamp, buf, len);
+        videoQueue.Push(timestamp, buf, len);
     } else if (chan == AA_CH_AUD && audioOutput) {
-        audioOutput->MediaPacketAUD(timestamp, buf, len);
+        mediaAudioQueue.Push(timestamp, buf, len);
     } else if (chan == AA_CH_AU1 && audioOutput) {
-        audioOutput->MediaPacketAU1(timestamp, buf, len);
+        voiceAudioQueue.Push(timestamp, buf, len);
     }
     return 0;
 }
@@ -29,13 +55,19 @@ int DesktopEventCallbacks::MediaPacket(int chan, uint64_t timestamp, const byte
 int DesktopEventCallbacks::MediaStart(int chan) {
     if (chan == AA_CH_MIC) {
         printf("SHAI1 : Mic Started\n");
-        micInput.Start(g_hu);
+        micInput.Start(hu);
     }
     return 0;
 }
 
 int DesktopEventCallbacks::MediaStop(int chan) {
-    if (chan == AA_CH_MIC) {
+    if (chan == AA_CH_VID) {
+        printf("%s\n", videoQueue.Describe().c_str());
+    } else if (chan == AA_CH_AUD) {
+        printf("%s\n", mediaAudioQueue.Describe().c_str());
+    } else if (chan == AA_CH_AU1) {
+        printf("%s\n", voiceAudioQueue.Describe().c_str());
+    } else if (chan == AA_CH_MIC) {
         micInput.Stop();
         printf("SHAI1 : Mic Stopped\n");
     }
@@ -77,7 +109,7 @@ void DesktopEventCallbacks::AudioFocusRequest(int chan, const HU::AudioFocusRequ
             audioFocus = true;
         }
 
-        g_hu->hu_queue_command([chan, response](IHUConnectionThreadInterface & s) {
+        hu->hu_queue_command([chan, response](IHUConnectionThreadInterface & s) {
             s.hu_aap_enc_send_message(0, chan, HU_PROTOCOL_MESSAGE::AudioFocusResponse, response);
         });
         return false;
@@ -110,7 +142,7 @@ void DesktopEventCallbacks::VideoFocusHappened(bool hasFocus, VIDEO_FOCUS_REQUES
         }
         videoFocus = hasFocus;
         bool unrequested = videoFocusRequestor != VIDEO_FOCUS_REQUESTOR::ANDROID_AUTO;
-        g_hu->hu_queue_command([hasFocus, unrequested](IHUConnectionThreadInterface & s) {
+        hu->hu_queue_command([hasFocus, unrequested](IHUConnectionThreadInterface & s) {
             HU::VideoFocus videoFocusGained;
             videoFocusGained.set_mode(hasFocus ? HU::VIDEO_FOCUS_MODE_FOCUSED : HU::VIDEO_FOCUS_MODE_UNFOCUSED);
             videoFocusGained.set_unrequested(unrequested);
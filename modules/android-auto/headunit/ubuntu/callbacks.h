@@ -5,6 +5,7 @@
 #include "main.h"
 #include "audio.h"
 #include "command_server.h"
+#include "media_queue.h"
 
 #include <asoundlib.h>
 
@@ -21,6 +22,11 @@ class DesktopEventCallbacks : public IHUConnectionThreadEventCallbacks {
         std::unique_ptr<AudioOutput> audioOutput;
 
         MicInput micInput;
+
+        // Declared after the outputs so the workers feeding them stop first
+        MediaQueue videoQueue;
+        MediaQueue mediaAudioQueue;
+        MediaQueue voiceAudioQueue;
 public:
         DesktopEventCallbacks();
         ~DesktopEventCallbacks();
@@ -42,6 +48,8 @@ public:
 
         void VideoFocusHappened(bool hasFocus, VIDEO_FOCUS_REQUESTOR videoFocusRequestor);
 
+        // The session these callbacks belong to, set while connected
+        IHUAnyThreadInterface* hu = nullptr;
         std::atomic<bool> connected;
         std::atomic<bool> videoFocus;
         std::atomic<bool> audioFocus;
@@ -18,8 +18,6 @@ gst_app_t gst_app;
 
 float g_dpi_scalefactor = 1.0f;
 
-IHUAnyThreadInterface* g_hu = nullptr;
-
 uint64_t
 get_cur_timestamp() {
         struct timespec tp;
@@ -99,7 +97,7 @@ main(int argc, char *argv[]) {
 
             callbacks.connected = true;
 
-            g_hu = &headunit.GetAnyThreadInterface();
+            callbacks.hu = &headunit.GetAnyThreadInterface();
             commandCallbacks.eventCallbacks = &callbacks;
 
               /* Start gstreamer pipeline and main loop */
@@ -119,7 +117,7 @@ main(int argc, char *argv[]) {
                     return (ret);
             }
 
-            g_hu = nullptr;
+            callbacks.hu = nullptr;
         }
 
         SDL_Quit();
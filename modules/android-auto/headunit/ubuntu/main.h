@@ -11,6 +11,5 @@ struct gst_app_t {
 
 extern gst_app_t gst_app;
 extern float g_dpi_scalefactor;
-extern IHUAnyThreadInterface* g_hu;
 
 uint64_t get_cur_timestamp();
@@ -98,7 +98,7 @@ void VideoOutput::aa_touch_event(SDL_Window *window, HU::TouchInfo::TOUCH_ACTION
     y = (unsigned int) (normy * 480);
 #endif
 
-    g_hu->hu_queue_command([action, x, y](IHUConnectionThreadInterface & s) {
+    callbacks->hu->hu_queue_command([action, x, y](IHUConnectionThreadInterface & s) {
         HU::InputEvent inputEvent;
         inputEvent.set_timestamp(get_cur_timestamp());
         HU::TouchInfo* touchEvent = inputEvent.mutable_touch();
@@ -181,7 +181,7 @@ gboolean VideoOutput::sdl_poll_event() {
                         rel->set_delta(key->keysym.sym == SDLK_LEFT ? -1 : 1);
                         rel->set_scan_code(HUIB_SCROLLWHEEL);
 
-                        g_hu->hu_queue_command([inputEvent2](IHUConnectionThreadInterface & s) {
+                        callbacks->hu->hu_queue_command([inputEvent2](IHUConnectionThreadInterface & s) {
                             s.hu_aap_enc_send_message(0, AA_CH_TOU, HU_INPUT_CHANNEL_MESSAGE::InputEvent, inputEvent2);
                         });
                     }
@@ -215,7 +215,7 @@ gboolean VideoOutput::sdl_poll_event() {
                                             | HU::SensorEvent::DrivingStatus::DRIVE_STATUS_NO_CONFIG
                                             | HU::SensorEvent::DrivingStatus::DRIVE_STATUS_LIMIT_MESSAGE_LEN);
 
-                        g_hu->hu_queue_command([sensorEvent](IHUConnectionThreadInterface& s)
+                        callbacks->hu->hu_queue_command([sensorEvent](IHUConnectionThreadInterface& s)
                         {
                             s.hu_aap_enc_send_message(0, AA_CH_SEN, HU_SENSOR_CHANNEL_MESSAGE::SensorEvent, sensorEvent);
                         });
@@ -228,7 +228,7 @@ gboolean VideoOutput::sdl_poll_event() {
                         notificationReq.set_id("test");
                         notificationReq.set_text("This is a test");
 
-                        g_hu->hu_queue_command([notificationReq](IHUConnectionThreadInterface& s)
+                        callbacks->hu->hu_queue_command([notificationReq](IHUConnectionThreadInterface& s)
                         {
                             s.hu_aap_enc_send_message(0, AA_CH_NOT, HU_GENERIC_NOTIFICATIONS_CHANNEL_MESSAGE::GenericNotificationRequest, notificationReq);
                         });
@@ -238,7 +238,7 @@ gboolean VideoOutput::sdl_poll_event() {
                 }
 
                 if (buttonInfo->has_scan_code()) {
-                    g_hu->hu_queue_command([inputEvent](IHUConnectionThreadInterface & s) {
+                    callbacks->hu->hu_queue_command([inputEvent](IHUConnectionThreadInterface & s) {
                         s.hu_aap_enc_send_message(0, AA_CH_TOU, HU_INPUT_CHANNEL_MESSAGE::InputEvent, inputEvent);
                     });
                 }
@@ -352,7 +352,7 @@ void VideoOutput::MediaPacket(uint64_t timestamp, const byte *buf, int len) {
 void VideoOutput::SendNightMode()
 {
     bool nm = nightmode;
-    g_hu->hu_queue_command([nm](IHUConnectionThreadInterface & s) {
+    callbacks->hu->hu_queue_command([nm](IHUConnectionThreadInterface & s) {
         HU::SensorEvent sensorEvent;
         sensorEvent.add_night_mode()->set_is_night(nm);
 
@@ -34,7 +34,7 @@ class VideoOutput {
     DesktopEventCallbacks* callbacks;
 
     static gboolean bus_callback(GstBus *bus, GstMessage *message, gpointer *ptr);
-    static void aa_touch_event(SDL_Window* window, HU::TouchInfo::TOUCH_ACTION action, unsigned int x, unsigned int y);
+    void aa_touch_event(SDL_Window* window, HU::TouchInfo::TOUCH_ACTION action, unsigned int x, unsigned int y);
     static gboolean sdl_poll_event_wrapper(gpointer data);
 
     gboolean sdl_poll_event();
@@ -1,11 +1,16 @@
 #include "aaservice.h"
 #include "headunit.h"
 #include "aasettings.h"
+#include "hu_hotplug.h"
+#include "hu_tcp.h"
 #include <QFile>
 #include <QDir>
 #include <QTextStream>
+#include <algorithm>
+#include <chrono>
 
-AAService::AAService(QObject *parent) : QObject(parent)
+AAService::AAService(QObject *parent) : QObject(parent),
+    m_reconnectRandom(std::chrono::steady_clock::now().time_since_epoch().count())
 {
     // Initialize settings first
     AASettings::instance()->initialize();
@@ -17,23 +22,110 @@ AAService::AAService(QObject *parent) : QObject(parent)
     connect(m_headunit, &Headunit::playbackStarted, this, &AAService::playbackStarted);
     connect(m_headunit, &Headunit::btConnectionRequest, this, &AAService::btConnectionRequest);
     
-    // Create a timer to periodically check for devices
+    const bool network =
+        AASettings::instance()->getSetting("transport_type", "usb") == "network";
+
+    // Sleep until a USB device is plugged in instead of scanning the bus.
+    // The watcher switches phones into accessory mode by itself, so only
+    // accessories are worth a connection attempt. Events arrive on the
+    // watcher thread, only queue one check at a time.
+    if (AASettings::instance()->getSetting("transport_type", "usb") == "usb") {
+        m_deviceWatcher.reset(new AndroidAuto::HUDeviceWatcher(
+            [this](uint16_t vendor, uint16_t product, bool arrived) {
+                if (!arrived ||
+                    !AndroidAuto::HUAccessorySwitcher::IsAccessory(vendor, product) ||
+                    m_deviceCheckQueued.exchange(true)) {
+                    return;
+                }
+                qDebug("USB device 0x%04x:0x%04x arrived", vendor, product);
+                QMetaObject::invokeMethod(this, "deviceArrived", Qt::QueuedConnection);
+            }));
+        if (m_deviceWatcher->Start() < 0) {
+            qWarning() << "USB hotplug not available, polling for devices instead";
+            m_deviceWatcher.reset();
+        }
+    }
+
     m_deviceCheckTimer = new QTimer(this);
     connect(m_deviceCheckTimer, &QTimer::timeout, this, &AAService::checkForDevice);
-    m_deviceCheckTimer->start(1000); // Check every second
+    if (network || m_deviceWatcher) {
+        // The timer retries with backoff after a failed attempt, and right
+        // away when a session drops.
+        m_deviceCheckTimer->setSingleShot(true);
+        connect(m_headunit, &Headunit::statusChanged, this, [this]() {
+            if (m_headunit->status() == Headunit::NO_CONNECTION &&
+                !m_deviceCheckTimer->isActive()) {
+                m_reconnectAttempts = 0;
+                scheduleReconnect();
+            }
+        });
+    }
+    if (network) {
+        // Attempts don't wait for the phone, the connector keeps its
+        // socket between them and wakes us up when the phone is there.
+        // Sessions look theirs up from the same settings
+        AASettings* settings = AASettings::instance();
+        AndroidAuto::HUTCPConnector* connector = &AndroidAuto::HUTCPConnector::Get(
+            settings->getSetting("wifi_direct", "0") == "1",
+            settings->getSetting("network_address", "127.0.0.1").toStdString());
+        m_connectNotifier = new QSocketNotifier(connector->GetEventFD(),
+                                                QSocketNotifier::Read, this);
+        connect(m_connectNotifier, &QSocketNotifier::activated, this, [this, connector]() {
+            if (connector->Ready()) {
+                checkForDevice();
+            }
+        });
+        scheduleReconnect();
+    } else if (!m_deviceWatcher) {
+        m_deviceCheckTimer->start(1000); // Check every second
+    }
+}
+
+void AAService::deviceArrived()
+{
+    // A new device earns a fresh round of retries
+    m_reconnectAttempts = 0;
+    checkForDevice();
 }
 
 void AAService::checkForDevice()
 {
+    m_deviceCheckQueued = false;
     // Only attempt reconnection if we're not already connected
     if (m_headunit->status() == Headunit::NO_CONNECTION) {
         qDebug() << "Checking for Android Auto devices...";
         start(); // Attempt to start connection
     }
+    if (m_deviceCheckTimer->isSingleShot()) {
+        if (m_headunit->status() == Headunit::NO_CONNECTION) {
+            scheduleReconnect();
+        } else {
+            m_reconnectAttempts = 0;
+        }
+    }
+}
+
+void AAService::scheduleReconnect()
+{
+    // The device is gone or unusable, the next arrival starts over
+    if (m_deviceWatcher && m_reconnectAttempts >= MAX_USB_RECONNECT_ATTEMPTS) {
+        qDebug() << "Giving up on the USB device until it is plugged in again";
+        return;
+    }
+    // Exponential backoff from 50 ms up to 5 s, with the delay picked at
+    // random from the upper half so retries don't fall into lockstep with
+    // the phone's own
+    int delay = std::min(5000, 50 << std::min(m_reconnectAttempts, 7));
+    delay = delay / 2 + m_reconnectRandom() % (delay / 2 + 1);
+    m_reconnectAttempts++;
+    qDebug() << "Next connection attempt in" << delay << "ms";
+    m_deviceCheckTimer->start(delay);
 }
 
 AAService::~AAService()
 {
+    // Stop the watcher thread before anything it calls into goes away
+    m_deviceWatcher.reset();
     // The m_headunit pointer will be deleted by Qt's parent-child mechanism
 }
 
@@ -124,7 +216,9 @@ void AAService::init()
     
     // Apply custom settings before initializing
     applyCustomSettings();
-    m_headunit->init();
+    if (m_headunit->init() >= 0) {
+        m_initialized = true;
+    }
 }
 
 void AAService::applyCustomSettings() {
@@ -160,8 +254,10 @@ void AAService::start()
     }
     
     qDebug() << "Attempting to start Android Auto";
-    // First ensure initialization is done
-    init();
+    // First ensure initialization is done, once is enough
+    if (!m_initialized) {
+        init();
+    }
     
     // Try to start the connection
     int result = m_headunit->startHU();
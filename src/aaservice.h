@@ -5,11 +5,15 @@
 #include <QAbstractVideoSurface>
 #include <QVideoSurfaceFormat>
 #include <QTimer>
+#include <QSocketNotifier>
 #include <memory>
+#include <atomic>
+#include <random>
 
 // We need to define the InputMode enum here to avoid including headunit.h
 // which would create circular dependencies
 class Headunit; // Forward declaration still needed
+namespace AndroidAuto { class HUDeviceWatcher; }
 
 class AAService : public QObject
 {
@@ -69,9 +73,11 @@ public slots:
 
 private slots:
     void checkForDevice();
+    void deviceArrived();
     
 private:
     void applyCustomSettings();
+    void scheduleReconnect();
 
 signals:
     void videoSurfaceChanged();
@@ -84,7 +90,18 @@ signals:
     void btConnectionRequest(QString address);
 
 private:
+    // Polls every second without USB hotplug events. Single shot with
+    // backoff for the network transport and after a hotplug arrival.
     QTimer* m_deviceCheckTimer = nullptr;
+    // With hotplug events, retries for one arrival before waiting for the next
+    static const int MAX_USB_RECONNECT_ATTEMPTS = 10;
+    // Network transport, readable when the phone connected
+    QSocketNotifier* m_connectNotifier = nullptr;
+    int m_reconnectAttempts = 0;
+    std::minstd_rand m_reconnectRandom;
+    std::unique_ptr<AndroidAuto::HUDeviceWatcher> m_deviceWatcher;
+    std::atomic<bool> m_deviceCheckQueued{false};
+    bool m_initialized = false;
     Headunit* m_headunit;
     int m_outputWidth = 1280;
     int m_outputHeight = 720;